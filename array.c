@@ -45,6 +45,45 @@ memfill(mem, size, val)
 
 #define ARY_TMPLOCK  FL_USER1
 
+/*
+ * Arrays of up to ARY_EMBED_LEN_MAX elements keep them in the aux union
+ * of the object slot; such an array is never the source of a shared one.
+ */
+#define ARY_EMBED    ELTS_EMBED
+#define ARY_EMBED_P(ary) FL_TEST(ary, ARY_EMBED)
+#define ARY_EMBED_PTR(ary) ((VALUE *)&RARRAY(ary)->aux)
+#define ARY_EMBED_LEN_MAX ((long)(sizeof(((struct RArray *)0)->aux) / sizeof(VALUE)))
+#define ARY_CAPA(ary) (ARY_EMBED_P(ary) ? ARY_EMBED_LEN_MAX : RARRAY(ary)->aux.capa)
+
+static void
+ary_unembed(ary, capa)
+    VALUE ary;
+    long capa;
+{
+    VALUE *ptr = ALLOC_N(VALUE, capa);
+
+    MEMCPY(ptr, RARRAY(ary)->ptr, VALUE, RARRAY(ary)->len);
+    FL_UNSET(ary, ARY_EMBED);
+    RARRAY(ary)->ptr = ptr;
+    RARRAY(ary)->aux.capa = capa;
+}
+
+static void
+ary_resize_capa(ary, capa)
+    VALUE ary;
+    long capa;
+{
+    if (ARY_EMBED_P(ary)) {
+	if (capa > ARY_EMBED_LEN_MAX) {
+	    ary_unembed(ary, capa);
+	}
+    }
+    else {
+	REALLOC_N(RARRAY(ary)->ptr, VALUE, capa);
+	RARRAY(ary)->aux.capa = capa;
+    }
+}
+
 static inline void
 rb_ary_modify_check(ary)
     VALUE ary;
@@ -124,9 +163,14 @@ ary_new(klass, len)
     if (len > ARY_MAX_SIZE) {
 	rb_raise(rb_eArgError, "array size too big");
     }
-    if (len == 0) len++;
-    RARRAY(ary)->ptr = ALLOC_N(VALUE, len);
-    RARRAY(ary)->aux.capa = len;
+    if (len <= ARY_EMBED_LEN_MAX) {
+	FL_SET(ary, ARY_EMBED);
+	RARRAY(ary)->ptr = ARY_EMBED_PTR(ary);
+    }
+    else {
+	RARRAY(ary)->ptr = ALLOC_N(VALUE, len);
+	RARRAY(ary)->aux.capa = len;
+    }
 
     return ary;
 }
@@ -297,9 +341,8 @@ rb_ary_initialize(argc, argv, ary)
     if (len > ARY_MAX_SIZE) {
 	rb_raise(rb_eArgError, "array size too big");
     }
-    if (len > RARRAY(ary)->aux.capa) {
-	REALLOC_N(RARRAY(ary)->ptr, VALUE, len);
-	RARRAY(ary)->aux.capa = len;
+    if (len > ARY_CAPA(ary)) {
+	ary_resize_capa(ary, len);
     }
     if (rb_block_given_p()) {
 	long i;
@@ -364,8 +407,8 @@ rb_ary_store(ary, idx, val)
     }
 
     rb_ary_modify(ary);
-    if (idx >= RARRAY(ary)->aux.capa) {
-	long new_capa = RARRAY(ary)->aux.capa / 2;
+    if (idx >= ARY_CAPA(ary)) {
+	long new_capa = ARY_CAPA(ary) / 2;
 
 	if (new_capa < ARY_DEFAULT_SIZE) {
 	    new_capa = ARY_DEFAULT_SIZE;
@@ -374,8 +417,7 @@ rb_ary_store(ary, idx, val)
 	    new_capa = (ARY_MAX_SIZE - idx) / 2;
 	}
 	new_capa += idx;
-	REALLOC_N(RARRAY(ary)->ptr, VALUE, new_capa);
-	RARRAY(ary)->aux.capa = new_capa;
+	ary_resize_capa(ary, new_capa);
     }
     if (idx > RARRAY(ary)->len) {
 	rb_mem_clear(RARRAY(ary)->ptr + RARRAY(ary)->len,
@@ -454,10 +496,9 @@ rb_ary_pop(ary)
     rb_ary_modify_check(ary);
     if (RARRAY(ary)->len == 0) return Qnil;
     if (!FL_TEST(ary, ELTS_SHARED) &&
-	    RARRAY(ary)->len * 2 < RARRAY(ary)->aux.capa &&
-	    RARRAY(ary)->aux.capa > ARY_DEFAULT_SIZE) {
-	RARRAY(ary)->aux.capa = RARRAY(ary)->len * 2;
-	REALLOC_N(RARRAY(ary)->ptr, VALUE, RARRAY(ary)->aux.capa);
+	    RARRAY(ary)->len * 2 < ARY_CAPA(ary) &&
+	    ARY_CAPA(ary) > ARY_DEFAULT_SIZE) {
+	ary_resize_capa(ary, RARRAY(ary)->len * 2);
     }
     return RARRAY(ary)->ptr[--RARRAY(ary)->len];
 }
@@ -470,6 +511,9 @@ ary_make_shared(ary)
 	NEWOBJ(shared, struct RArray);
 	OBJSETUP(shared, rb_cArray, T_ARRAY);
 
+	if (ARY_EMBED_P(ary)) {
+	    ary_unembed(ary, ARY_EMBED_LEN_MAX);
+	}
 	shared->len = RARRAY(ary)->len;
 	shared->ptr = RARRAY(ary)->ptr;
 	shared->aux.capa = RARRAY(ary)->aux.capa;
@@ -525,13 +569,12 @@ rb_ary_unshift(ary, item)
     VALUE ary, item;
 {
     rb_ary_modify(ary);
-    if (RARRAY(ary)->len == RARRAY(ary)->aux.capa) {
-	long capa_inc = RARRAY(ary)->aux.capa / 2;
+    if (RARRAY(ary)->len == ARY_CAPA(ary)) {
+	long capa_inc = ARY_CAPA(ary) / 2;
 	if (capa_inc < ARY_DEFAULT_SIZE) {
 	    capa_inc = ARY_DEFAULT_SIZE;
 	}
-	RARRAY(ary)->aux.capa += capa_inc;
-	REALLOC_N(RARRAY(ary)->ptr, VALUE, RARRAY(ary)->aux.capa);
+	ary_resize_capa(ary, ARY_CAPA(ary) + capa_inc);
     }
 
     /* sliding items */
@@ -616,7 +659,12 @@ rb_ary_subseq(ary, beg, len)
 	    len = 0;
     }
     klass = rb_obj_class(ary);
-    if (len == 0) return ary_new(klass, 0);
+    if (len <= ARY_EMBED_LEN_MAX) {
+	ary2 = ary_new(klass, len);
+	MEMCPY(RARRAY(ary2)->ptr, RARRAY(ary)->ptr + beg, VALUE, len);
+	RARRAY(ary2)->len = len;
+	return ary2;
+    }
 
     shared = ary_make_shared(ary);
     ptr = RARRAY(ary)->ptr;
@@ -983,9 +1031,8 @@ rb_ary_splice(ary, beg, len, rpl)
 	    rb_raise(rb_eIndexError, "index %ld too big", beg);
 	}
 	len = beg + rlen;
-	if (len >= RARRAY(ary)->aux.capa) {
-	    REALLOC_N(RARRAY(ary)->ptr, VALUE, len);
-	    RARRAY(ary)->aux.capa = len;
+	if (len >= ARY_CAPA(ary)) {
+	    ary_resize_capa(ary, len);
 	}
 	rb_mem_clear(RARRAY(ary)->ptr + RARRAY(ary)->len, beg - RARRAY(ary)->len);
 	if (rlen > 0) {
@@ -1001,9 +1048,8 @@ rb_ary_splice(ary, beg, len, rpl)
 	}
 
 	alen = RARRAY(ary)->len + rlen - len;
-	if (alen >= RARRAY(ary)->aux.capa) {
-	    REALLOC_N(RARRAY(ary)->ptr, VALUE, alen);
-	    RARRAY(ary)->aux.capa = alen;
+	if (alen >= ARY_CAPA(ary)) {
+	    ary_resize_capa(ary, alen);
 	}
 
 	if (len != rlen) {
@@ -1245,6 +1291,9 @@ rb_ary_dup(ary)
     VALUE dup = rb_ary_new2(RARRAY(ary)->len);
 
     DUPSETUP(dup, ary);
+    if (RARRAY(dup)->ptr == ARY_EMBED_PTR(dup)) {
+	FL_SET(dup, ARY_EMBED);	/* DUPSETUP resets the flags */
+    }
     MEMCPY(RARRAY(dup)->ptr, RARRAY(ary)->ptr, VALUE, RARRAY(ary)->len);
     RARRAY(dup)->len = RARRAY(ary)->len;
     return dup;
@@ -1877,10 +1926,9 @@ rb_ary_delete(ary, item)
     rb_ary_modify(ary);
     if (RARRAY(ary)->len > i2) {
 	RARRAY(ary)->len = i2;
-	if (i2 * 2 < RARRAY(ary)->aux.capa &&
-	    RARRAY(ary)->aux.capa > ARY_DEFAULT_SIZE) {
-	    REALLOC_N(RARRAY(ary)->ptr, VALUE, i2 * 2);
-	    RARRAY(ary)->aux.capa = i2 * 2;
+	if (i2 * 2 < ARY_CAPA(ary) &&
+	    ARY_CAPA(ary) > ARY_DEFAULT_SIZE) {
+	    ary_resize_capa(ary, i2 * 2);
 	}
     }
 
@@ -2175,9 +2223,20 @@ rb_ary_replace(copy, orig)
     rb_ary_modify(copy);
     orig = to_ary(orig);
     if (copy == orig) return copy;
+    if (RARRAY(orig)->len <= ARY_EMBED_LEN_MAX) {
+	if (RARRAY(copy)->ptr && !FL_TEST(copy, ELTS_SHARED|ARY_EMBED))
+	    free(RARRAY(copy)->ptr);
+	FL_UNSET(copy, ELTS_SHARED);
+	FL_SET(copy, ARY_EMBED);
+	RARRAY(copy)->ptr = ARY_EMBED_PTR(copy);
+	MEMCPY(RARRAY(copy)->ptr, RARRAY(orig)->ptr, VALUE, RARRAY(orig)->len);
+	RARRAY(copy)->len = RARRAY(orig)->len;
+	return copy;
+    }
     shared = ary_make_shared(orig);
-    if (RARRAY(copy)->ptr && !FL_TEST(copy, ELTS_SHARED))
+    if (RARRAY(copy)->ptr && !FL_TEST(copy, ELTS_SHARED|ARY_EMBED))
 	free(RARRAY(copy)->ptr);
+    FL_UNSET(copy, ARY_EMBED);
     RARRAY(copy)->ptr = RARRAY(orig)->ptr;
     RARRAY(copy)->len = RARRAY(orig)->len;
     RARRAY(copy)->aux.shared = shared;
@@ -2202,9 +2261,8 @@ rb_ary_clear(ary)
 {
     rb_ary_modify(ary);
     RARRAY(ary)->len = 0;
-    if (ARY_DEFAULT_SIZE * 2 < RARRAY(ary)->aux.capa) {
-	REALLOC_N(RARRAY(ary)->ptr, VALUE, ARY_DEFAULT_SIZE * 2);
-	RARRAY(ary)->aux.capa = ARY_DEFAULT_SIZE * 2;
+    if (ARY_DEFAULT_SIZE * 2 < ARY_CAPA(ary)) {
+	ary_resize_capa(ary, ARY_DEFAULT_SIZE * 2);
     }
     return ary;
 }
@@ -2280,9 +2338,8 @@ rb_ary_fill(argc, argv, ary)
     }
     end = beg + len;
     if (end > RARRAY(ary)->len) {
-	if (end >= RARRAY(ary)->aux.capa) {
-	    REALLOC_N(RARRAY(ary)->ptr, VALUE, end);
-	    RARRAY(ary)->aux.capa = end;
+	if (end >= ARY_CAPA(ary)) {
+	    ary_resize_capa(ary, end);
 	}
 	rb_mem_clear(RARRAY(ary)->ptr + RARRAY(ary)->len, end - RARRAY(ary)->len);
 	RARRAY(ary)->len = end;
@@ -2871,8 +2928,8 @@ rb_ary_compact_bang(ary)
     if (RARRAY(ary)->len == (p - RARRAY(ary)->ptr)) {
 	return Qnil;
     }
-    RARRAY(ary)->len = RARRAY(ary)->aux.capa = (p - RARRAY(ary)->ptr);
-    REALLOC_N(RARRAY(ary)->ptr, VALUE, RARRAY(ary)->len);
+    RARRAY(ary)->len = p - RARRAY(ary)->ptr;
+    ary_resize_capa(ary, RARRAY(ary)->len);
 
     return ary;
 }
@@ -74,11 +74,13 @@ rb_mod_init_copy(clone, orig)
     VALUE clone, orig;
 {
     rb_obj_init_copy(clone, orig);
+    CLASS_SERIAL_RESET(clone);
     if (!FL_TEST(CLASS_OF(clone), FL_SINGLETON)) {
 	RBASIC(clone)->klass = RBASIC(orig)->klass;
 	RBASIC(clone)->klass = rb_singleton_class_clone(clone);
     }
     RCLASS(clone)->super = RCLASS(orig)->super;
+    ruby_const_serial++;
     if (RCLASS(orig)->iv_tbl) {
 	ID id;
 
@@ -126,6 +128,7 @@ rb_singleton_class_clone(obj)
 	/* copy singleton(unnamed) class */
 	NEWOBJ(clone, struct RClass);
 	OBJSETUP(clone, 0, RBASIC(klass)->flags);
+	CLASS_SERIAL_RESET(clone);
 
 	if (BUILTIN_TYPE(obj) == T_CLASS) {
 	    RBASIC(clone)->klass = (VALUE)clone;
@@ -434,11 +437,15 @@ rb_include_module(klass, module)
 	    }
 	}
 	c = RCLASS(c)->super = include_class_new(module, RCLASS(c)->super);
+	rb_check_redefined_ops(klass, module);
 	changed = 1;
       skip:
 	module = RCLASS(module)->super;
     }
-    if (changed) rb_clear_cache();
+    if (changed) {
+	rb_clear_cache_by_class(klass);
+	ruby_const_serial++;
+    }
 }
 
 /*
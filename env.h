@@ -44,6 +44,7 @@ extern struct SCOPE {
 #define SCOPE_NOSTACK 2
 #define SCOPE_DONT_RECYCLE 4
 #define SCOPE_CLONE   8
+#define SCOPE_STACK   16
 
 extern int ruby_in_eval;
 
@@ -12,6 +12,13 @@
 
 **********************************************************************/
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+/* switching to a thread on a stack of its own is a longjmp() to a
+   lower address, which the checking longjmp() of _FORTIFY_SOURCE
+   takes for a jump into a dead frame */
+#undef _FORTIFY_SOURCE
+#endif
+
 #include "ruby.h"
 #include "node.h"
 #include "env.h"
@@ -321,89 +328,407 @@ print_undef(klass, id)
 
 static ID removed, singleton_removed, undefined, singleton_undefined;
 
-#define CACHE_SIZE 0x800
-#define CACHE_MASK 0x7ff
-#define EXPR1(c,m) ((((c)>>3)^(m))&CACHE_MASK)
+/*
+ * The global method cache is set associative: a class and a method id
+ * hash to a set of CACHE_WAYS entries, kept most recently filled first.
+ * The number of entries can be set with RUBY_METHOD_CACHE_SIZE.
+ */
+#define CACHE_SIZE 0x2000
+#define CACHE_SIZE_MAX 0x1000000
+#define CACHE_WAYS 4
+/* the low bits of an id are its scope, the same for most method names */
+#define EXPR1(c,m) ((((c)>>3)^((m)>>3))&cache_mask)
+#define CACHE_SET(c,m) (cache + EXPR1(c,m) * CACHE_WAYS)
 
 struct cache_entry {		/* method hash table. */
     ID mid;			/* method's id */
     ID mid0;			/* method's original id */
     VALUE klass;		/* receiver's class */
+    unsigned long serial;	/* method_serial when filled */
+    unsigned long class_serial;	/* serial of klass when filled */
     VALUE origin;		/* where method defined  */
     NODE *method;
     int noex;
 };
 
-static struct cache_entry cache[CACHE_SIZE];
+static struct cache_entry *cache;
+static unsigned long cache_size;	/* entries */
+static unsigned long cache_mask;	/* sets - 1 */
+static unsigned long cache_inline_hits, cache_hits, cache_misses;
+static unsigned long cache_invalidations, cache_global_invalidations;
 static int ruby_running = 0;
 
-void
-rb_clear_cache()
-{
-   struct cache_entry *ent, *end;
+/*
+ * Cached methods are checked against the serial of the receiver's
+ * class (see node.h) and the global method_serial.  Changing the
+ * methods of a class gives it a new serial, which invalidates the
+ * entries of that class alone.  Once a method lookup for another
+ * class has searched it, entries of other classes may depend on it
+ * too, and method_serial is bumped instead, invalidating every entry.
+ */
 
-    if (!ruby_running) return;
-    ent = cache; end = ent + CACHE_SIZE;
-    while (ent < end) {
-	ent->mid = 0;
-	ent++;
+static unsigned long method_serial = 1;
+static unsigned long class_serial = 0;	/* the last one given out */
+
+static unsigned long
+new_class_serial(klass)
+    VALUE klass;
+{
+    if (++class_serial > CLASS_SERIAL_MAX) {
+	/* the serials given out before may come round again */
+	class_serial = 1;
+	method_serial++;
     }
+    RBASIC(klass)->flags &= ~(CLASS_SERIAL_MAX << CLASS_SERIAL_SHIFT);
+    RBASIC(klass)->flags |= class_serial << CLASS_SERIAL_SHIFT;
+    return class_serial;
 }
 
+/*
+ * A class has no serial until something is cached for it, so that a
+ * new class in the slot of a freed one never matches its old entries.
+ */
+#define CLASS_SERIAL_OF(k) (CLASS_SERIAL(k) ? CLASS_SERIAL(k) : new_class_serial(k))
+
 static void
-rb_clear_cache_for_undef(klass, id)
+init_method_cache()
+{
+    char *ptr = getenv("RUBY_METHOD_CACHE_SIZE"), *end;
+    long size = CACHE_SIZE;
+
+    if (ptr) {
+	size = strtol(ptr, &end, 10);
+	if (end == ptr || *end || size <= 0) size = CACHE_SIZE;
+    }
+    if (size > CACHE_SIZE_MAX) size = CACHE_SIZE_MAX;
+    cache_size = CACHE_WAYS;
+    while (cache_size < size) cache_size <<= 1;
+    cache_mask = cache_size / CACHE_WAYS - 1;
+    cache = ALLOC_N(struct cache_entry, cache_size);
+    MEMZERO(cache, struct cache_entry, cache_size);
+}
+
+static struct cache_entry *
+cache_lookup(klass, id)
     VALUE klass;
     ID id;
 {
-    struct cache_entry *ent, *end;
+    struct cache_entry *ent = CACHE_SET(klass, id);
+    struct cache_entry *end = ent + CACHE_WAYS;
 
-    if (!ruby_running) return;
-    ent = cache; end = ent + CACHE_SIZE;
-    while (ent < end) {
-	if (ent->mid == id &&
-	    RCLASS(ent->origin)->m_tbl == RCLASS(klass)->m_tbl) {
-	    ent->mid = 0;
+    for (; ent < end; ent++) {
+	if (ent->mid == id && ent->klass == klass &&
+	    ent->serial == method_serial &&
+	    ent->class_serial == CLASS_SERIAL(klass)) {
+	    cache_hits++;
+	    return ent;
 	}
-	ent++;
     }
+    return 0;
 }
 
-static void
-rb_clear_cache_by_id(id)
+/* returns the first entry of the set, making room for it there */
+static struct cache_entry *
+cache_fill(klass, id)
+    VALUE klass;
     ID id;
 {
-    struct cache_entry *ent, *end;
+    struct cache_entry *set = CACHE_SET(klass, id);
+    int i;
 
-    if (!ruby_running) return;
-    ent = cache; end = ent + CACHE_SIZE;
-    while (ent < end) {
-	if (ent->mid == id) {
-	    ent->mid = 0;
-	}
-	ent++;
+    /* an outdated entry makes room, or else the oldest one */
+    for (i = 0; i < CACHE_WAYS - 1; i++) {
+	if (set[i].serial != method_serial) break;
     }
+    if (i > 0) MEMMOVE(set + 1, set, struct cache_entry, i);
+    set->klass = klass;
+    set->class_serial = CLASS_SERIAL_OF(klass);
+    set->serial = method_serial;
+    return set;
+}
+
+void
+rb_clear_cache()
+{
+    method_serial++;
+    cache_invalidations++;
+    cache_global_invalidations++;
 }
 
 void
 rb_clear_cache_by_class(klass)
     VALUE klass;
 {
-    struct cache_entry *ent, *end;
-
-    if (!ruby_running) return;
-    ent = cache; end = ent + CACHE_SIZE;
-    while (ent < end) {
-	if (ent->klass == klass || ent->origin == klass) {
-	    ent->mid = 0;
-	}
-	ent++;
+    if (FL_TEST(klass, CLASS_SEARCHED)) {
+	rb_clear_cache();
     }
+    else {
+	if (CLASS_SERIAL(klass)) new_class_serial(klass);
+	cache_invalidations++;
+    }
+}
+
+#define SET_STAT(hash, name, val) \
+    rb_hash_aset(hash, ID2SYM(rb_intern(name)), val)
+
+/*
+ *  call-seq:
+ *     ObjectSpace.method_cache_stat    => hash
+ *
+ *  Returns a hash of method cache statistics.
+ *  <code>:inline_hits</code> counts the calls found in the cache of
+ *  their call site, <code>:hits</code> and <code>:misses</code> the
+ *  lookups in the global method cache, which holds <code>:size</code>
+ *  entries in sets of <code>:ways</code>.  <code>:invalidations</code>
+ *  counts the times cached methods were invalidated because a method
+ *  was defined, removed or made private, or a module was included.
+ *  Most of these affect the entries of a single class;
+ *  <code>:global_invalidations</code> counts those that invalidated
+ *  every entry, because the class was a superclass or a module whose
+ *  methods had been looked up for another class.
+ *
+ *     ObjectSpace.method_cache_stat
+ *        #=> {:size=>8192, :ways=>4, :inline_hits=>1873215,
+ *        #    :hits=>20544, :misses=>3731, :invalidations=>2630,
+ *        #    :global_invalidations=>112}
+ *
+ */
+
+static VALUE
+method_cache_stat()
+{
+    VALUE hash = rb_hash_new();
+
+    SET_STAT(hash, "size", ULONG2NUM(cache_size));
+    SET_STAT(hash, "ways", INT2FIX(CACHE_WAYS));
+    SET_STAT(hash, "inline_hits", ULONG2NUM(cache_inline_hits));
+    SET_STAT(hash, "hits", ULONG2NUM(cache_hits));
+    SET_STAT(hash, "misses", ULONG2NUM(cache_misses));
+    SET_STAT(hash, "invalidations", ULONG2NUM(cache_invalidations));
+    SET_STAT(hash, "global_invalidations",
+	     ULONG2NUM(cache_global_invalidations));
+    return hash;
+}
+
+/*
+ *  call-seq:
+ *     ObjectSpace.clear_method_cache_stats    => nil
+ *
+ *  Resets the counters reported by
+ *  <code>ObjectSpace.method_cache_stat</code> to zero.
+ *
+ */
+
+static VALUE
+method_cache_clear_stats()
+{
+    cache_inline_hits = cache_hits = cache_misses = 0;
+    cache_invalidations = cache_global_invalidations = 0;
+    return Qnil;
 }
 
 static ID init, eqq, each, aref, aset, match, missing;
 static ID added, singleton_added;
 static ID __id__, __send__, respond_to;
 
+/*
+ * Basic operations, done without a method call on instances of the
+ * builtin classes below, as long as no method of the same name has been
+ * defined in the class or one of its ancestors since the interpreter
+ * started.  Nor while an event hook is set, since the calls would go
+ * unreported.
+ */
+enum {
+    BOP_UNKNOWN,		/* not looked up yet */
+    BOP_NONE,			/* not a basic operation */
+    BOP_PLUS, BOP_MINUS, BOP_MULT, BOP_LT, BOP_LE, BOP_GT, BOP_GE,
+    BOP_EQ, BOP_AREF, BOP_NIL_P,
+    BOP_LAST
+};
+#define BOP_FIXNUM 1		/* classes in bop_redefined[] */
+#define BOP_FLOAT  2
+#define BOP_NIL    4
+#define BOP_ARRAY  8
+#define BOP_HASH   16
+#define BOP_CLASSES 5
+#define BOP_HOOKS  32		/* an event hook is set */
+#define BOP_BIT(op) (1L << (op))
+#define BOP_HOOKED BOP_BIT(BOP_LAST)
+
+#define CALL_BOP(cc, mid) ((cc)->bop ? (cc)->bop : ((cc)->bop = basic_op(mid)))
+
+/* a call node made with NEW_NODE() has no cache, nor a receiver */
+#define CALL_RECV(node) \
+    ((node)->nd_cache ? (node)->nd_cache->recv : call_no_cache(node))
+
+static NODE *
+call_no_cache(node)
+    NODE *node;
+{
+    rb_raise(rb_eRuntimeError, "call node (type %d) without a call cache",
+	     nd_type(node));
+    return 0;			/* not reached */
+}
+
+static ID basic_ops[BOP_LAST];
+static int bop_redefined[BOP_LAST];
+static long bop_redefined_ops;	/* BOP_BIT()s of the above, and BOP_HOOKED */
+
+static void
+bop_redefine(klass, mid)
+    VALUE klass;
+    ID mid;
+{
+    static VALUE *const classes[BOP_CLASSES] = {
+	&rb_cFixnum, &rb_cFloat, &rb_cNilClass, &rb_cArray, &rb_cHash
+    };
+    int op, i;
+
+    if (!ruby_running) return;
+    for (op = BOP_PLUS; op < BOP_LAST; op++) {
+	if (basic_ops[op] != mid) continue;
+	for (i = 0; i < BOP_CLASSES; i++) {
+	    if (rb_class_inherited_p(*classes[i], klass) == Qtrue) {
+		bop_redefined[op] |= 1 << i;
+		bop_redefined_ops |= BOP_BIT(op);
+	    }
+	}
+    }
+}
+
+/* called by rb_include_module() for every module it inserts */
+void
+rb_check_redefined_ops(klass, module)
+    VALUE klass, module;
+{
+    int op;
+
+    for (op = BOP_PLUS; op < BOP_LAST; op++) {
+	if (st_lookup(RCLASS(module)->m_tbl, basic_ops[op], 0)) {
+	    bop_redefine(klass, basic_ops[op]);
+	}
+    }
+}
+
+static void
+bop_hooks(set)
+    int set;
+{
+    int op;
+
+    for (op = BOP_PLUS; op < BOP_LAST; op++) {
+	if (set) bop_redefined[op] |= BOP_HOOKS;
+	else bop_redefined[op] &= ~BOP_HOOKS;
+    }
+    if (set) bop_redefined_ops |= BOP_HOOKED;
+    else bop_redefined_ops &= ~BOP_HOOKED;
+}
+
+static int
+basic_op(mid)
+    ID mid;
+{
+    int op;
+
+    for (op = BOP_PLUS; op < BOP_LAST; op++) {
+	if (basic_ops[op] == mid) return op;
+    }
+    return BOP_NONE;
+}
+
+/* x op y for Fixnums, or Qundef if the result is not a Fixnum */
+static VALUE
+fix_bop(op, x, y)
+    int op;
+    VALUE x, y;
+{
+    long a = FIX2LONG(x), b = FIX2LONG(y), c;
+
+    switch (op) {
+      case BOP_PLUS:
+	c = a + b;
+	break;
+      case BOP_MINUS:
+	c = a - b;
+	break;
+      case BOP_MULT:
+#ifdef HAVE_BUILTIN_MUL_OVERFLOW
+	if (__builtin_mul_overflow(a, b, &c)) return Qundef;
+#else
+	/* a signed overflow is undefined, so it must not happen */
+	if (a != 0 && b != 0 &&
+	    (a < 0 ? -a : a) > FIXNUM_MAX / (b < 0 ? -b : b)) return Qundef;
+	c = a * b;
+#endif
+	break;
+      case BOP_LT:
+	return a < b ? Qtrue : Qfalse;
+      case BOP_LE:
+	return a <= b ? Qtrue : Qfalse;
+      case BOP_GT:
+	return a > b ? Qtrue : Qfalse;
+      case BOP_GE:
+	return a >= b ? Qtrue : Qfalse;
+      case BOP_EQ:
+	return x == y ? Qtrue : Qfalse;
+      default:
+	return Qundef;
+    }
+    return FIXABLE(c) ? LONG2FIX(c) : Qundef;
+}
+
+/* recv.op(arg) without calling the method, or Qundef if it must be */
+static VALUE
+call_bop(op, recv, arg)
+    int op;
+    VALUE recv, arg;
+{
+    double a, b;
+
+    if (FIXNUM_P(recv)) {
+	if (bop_redefined[op] & (BOP_FIXNUM|BOP_HOOKS)) return Qundef;
+	if (FIXNUM_P(arg)) return fix_bop(op, recv, arg);
+	if (TYPE(arg) != T_FLOAT) return Qundef;
+	a = (double)FIX2LONG(recv);
+	b = RFLOAT(arg)->value;
+	switch (op) {
+	  case BOP_PLUS:  return rb_float_new(a + b);
+	  case BOP_MINUS: return rb_float_new(a - b);
+	  case BOP_MULT:  return rb_float_new(a * b);
+	}
+	return Qundef;
+    }
+    if (SPECIAL_CONST_P(recv)) return Qundef;
+    if (RBASIC(recv)->klass == rb_cFloat) {
+	if (bop_redefined[op] & (BOP_FLOAT|BOP_HOOKS)) return Qundef;
+	a = RFLOAT(recv)->value;
+	if (FIXNUM_P(arg)) b = (double)FIX2LONG(arg);
+	else if (TYPE(arg) == T_FLOAT) b = RFLOAT(arg)->value;
+	else return Qundef;
+	switch (op) {
+	  case BOP_PLUS:  return rb_float_new(a + b);
+	  case BOP_MINUS: return rb_float_new(a - b);
+	  case BOP_MULT:  return rb_float_new(a * b);
+	  case BOP_LT:    return a < b ? Qtrue : Qfalse;
+	  case BOP_LE:    return a <= b ? Qtrue : Qfalse;
+	  case BOP_GT:    return a > b ? Qtrue : Qfalse;
+	  case BOP_GE:    return a >= b ? Qtrue : Qfalse;
+	  case BOP_EQ:    return a == b ? Qtrue : Qfalse;
+	}
+	return Qundef;
+    }
+    if (op != BOP_AREF) return Qundef;
+    if (RBASIC(recv)->klass == rb_cArray && FIXNUM_P(arg)) {
+	if (bop_redefined[op] & (BOP_ARRAY|BOP_HOOKS)) return Qundef;
+	return rb_ary_entry(recv, FIX2LONG(arg));
+    }
+    if (RBASIC(recv)->klass == rb_cHash) {
+	if (bop_redefined[op] & (BOP_HASH|BOP_HOOKS)) return Qundef;
+	return rb_hash_aref(recv, arg);
+    }
+    return Qundef;
+}
+
 #define NOEX_TAINTED 8
 #define NOEX_SAFE(n) ((n) >> 4)
 #define NOEX_WITH(n, v) ((n) | (v) << 4)
@@ -434,7 +759,8 @@ rb_add_method(klass, mid, node, noex)
 	mid = ID_ALLOCATOR;
     }
     if (OBJ_FROZEN(klass)) rb_error_frozen("class/module");
-    rb_clear_cache_by_id(mid);
+    rb_clear_cache_by_class(klass);
+    bop_redefine(klass, mid);
     body = NEW_METHOD(node, NOEX_WITH_SAFE(noex));
     st_insert(RCLASS(klass)->m_tbl, mid, (st_data_t)body);
     if (node && mid != ID_ALLOCATOR && ruby_running) {
@@ -473,9 +799,16 @@ search_method(klass, id, origin)
     st_data_t body;
 
     if (!klass) return 0;
+    if (BUILTIN_TYPE(klass) == T_ICLASS) {
+	FL_SET(RBASIC(klass)->klass, CLASS_SEARCHED);
+    }
     while (!st_lookup(RCLASS(klass)->m_tbl, id, &body)) {
 	klass = RCLASS(klass)->super;
 	if (!klass) return 0;
+	FL_SET(klass, CLASS_SEARCHED);
+	if (BUILTIN_TYPE(klass) == T_ICLASS) {
+	    FL_SET(RBASIC(klass)->klass, CLASS_SEARCHED);
+	}
     }
 
     if (origin) *origin = klass;
@@ -494,10 +827,10 @@ rb_get_method_body(klassp, idp, noexp)
     NODE * volatile body;
     struct cache_entry *ent;
 
+    cache_misses++;
     if ((body = search_method(klass, id, &origin)) == 0 || !body->nd_body) {
 	/* store empty info in cache */
-	ent = cache + EXPR1(klass, id);
-	ent->klass  = klass;
+	ent = cache_fill(klass, id);
 	ent->origin = klass;
 	ent->mid = ent->mid0 = id;
 	ent->noex   = 0;
@@ -508,8 +841,7 @@ rb_get_method_body(klassp, idp, noexp)
 
     if (ruby_running) {
 	/* store in cache */
-	ent = cache + EXPR1(klass, id);
-	ent->klass  = klass;
+	ent = cache_fill(klass, id);
 	ent->noex   = body->nd_noex;
 	if (noexp) *noexp = body->nd_noex;
 	body = body->nd_body;
@@ -582,7 +914,8 @@ remove_method(klass, mid)
 	rb_name_error(mid, "method `%s' not defined in %s",
 		      rb_id2name(mid), rb_class2name(klass));
     }
-    rb_clear_cache_for_undef(klass, mid);
+    rb_clear_cache_by_class(klass);
+    bop_redefine(klass, mid);
     if (FL_TEST(klass, FL_SINGLETON)) {
 	rb_funcall(rb_iv_get(klass, "__attached__"), singleton_removed, 1, ID2SYM(mid));
     }
@@ -662,6 +995,8 @@ rb_export_method(klass, name, noex)
     if (body->nd_noex != noex) {
 	if (klass == origin) {
 	    body->nd_noex = noex;
+	    /* the fast paths would not check it */
+	    bop_redefine(klass, name);
 	}
 	else {
 	    rb_add_method(klass, name, NEW_ZSUPER(), noex);
@@ -679,8 +1014,7 @@ rb_method_boundp(klass, id, ex)
     int noex;
 
     /* is it in the method cache? */
-    ent = cache + EXPR1(klass, id);
-    if (ent->mid == id && ent->klass == klass) {
+    if ((ent = cache_lookup(klass, id)) != 0) {
 	if (ex && (ent->noex & NOEX_PRIVATE))
 	    return Qfalse;
 	if (!ent->method) return Qfalse;
@@ -789,6 +1123,7 @@ struct BLOCK {
     int flags;
     int uniq;
     struct RVarmap *dyna_vars;
+    struct RVarmap *spare_vars;	/* kept by rb_yield_0() for the next yield */
     VALUE orig_thread;
     VALUE wrapper;
     VALUE block_obj;
@@ -798,6 +1133,7 @@ struct BLOCK {
 
 #define BLOCK_D_SCOPE 1
 #define BLOCK_LAMBDA  2
+#define BLOCK_STACK   4
 
 static struct BLOCK *ruby_block;
 static unsigned long block_unique = 1;
@@ -816,8 +1152,9 @@ static unsigned long block_unique = 1;
     _block.outer = ruby_block;		\
     _block.iter = ruby_iter->iter;	\
     _block.vmode = scope_vmode;		\
-    _block.flags = BLOCK_D_SCOPE;	\
+    _block.flags = BLOCK_D_SCOPE|BLOCK_STACK;\
     _block.dyna_vars = ruby_dyna_vars;	\
+    _block.spare_vars = 0;		\
     _block.wrapper = ruby_wrapper;	\
     _block.block_obj = 0;		\
     _block.uniq = (b)?block_unique++:0; \
@@ -1081,18 +1418,40 @@ NODE *ruby_top_cref;
     ruby_scope = _scope;		\
     scope_vmode = SCOPE_PUBLIC
 
+/* method calls keep their scope on the C stack; scope_promote() moves
+   it to the heap when something outlives the call or grows its local
+   variables, leaving the address of the copy in super.klass.
+   super.flags stays 0 so the garbage collector never takes it for an
+   object. */
+#define PUSH_STACK_SCOPE() do {		\
+    volatile int _vmode = scope_vmode;	\
+    struct SCOPE * volatile _old;	\
+    struct SCOPE _sscope;		\
+    _sscope.super.flags = 0;		\
+    _sscope.super.klass = 0;		\
+    _sscope.local_tbl = 0;		\
+    _sscope.local_vars = 0;		\
+    _sscope.flags = SCOPE_STACK;	\
+    _old = ruby_scope;			\
+    ruby_scope = &_sscope;		\
+    scope_vmode = SCOPE_PUBLIC
+
+#define SCOPE_FORWARD(s) (((s) && ((s)->flags & SCOPE_STACK) && (s)->super.klass) ?\
+			  (struct SCOPE*)(s)->super.klass : (s))
+
 rb_thread_t rb_curr_thread;
 rb_thread_t rb_main_thread;
 #define main_thread rb_main_thread
 #define curr_thread rb_curr_thread
 
-static void scope_dup _((struct SCOPE *));
+static struct SCOPE *scope_promote _((struct SCOPE *));
+static struct SCOPE *scope_dup _((struct SCOPE *));
 
 #define POP_SCOPE() 			\
     if (ruby_scope->flags & SCOPE_DONT_RECYCLE) {\
 	if (_old) scope_dup(_old);	\
     }					\
-    if (!(ruby_scope->flags & SCOPE_MALLOC)) {\
+    if (!(ruby_scope->flags & (SCOPE_MALLOC|SCOPE_STACK))) {\
 	ruby_scope->local_vars = 0;	\
 	ruby_scope->local_tbl  = 0;	\
 	if (!(ruby_scope->flags & SCOPE_DONT_RECYCLE) && \
@@ -1101,11 +1460,12 @@ static void scope_dup _((struct SCOPE *));
 	}				\
     }					\
     ruby_scope->flags |= SCOPE_NOSTACK;	\
-    ruby_scope = _old;			\
+    ruby_scope = SCOPE_FORWARD(_old);	\
     scope_vmode = _vmode;		\
 } while (0)
 
 static VALUE rb_eval _((VALUE,NODE*));
+static void init_tcode _((void));
 static VALUE eval _((VALUE,VALUE,VALUE,char*,int));
 static NODE *compile _((VALUE, char*, int));
 
@@ -1118,6 +1478,7 @@ static VALUE rb_yield_0 _((VALUE, VALUE, VALUE, int, int));
 #define YIELD_FUNC_SVALUE 2
 
 static VALUE rb_call _((VALUE,VALUE,ID,int,const VALUE*,int,VALUE));
+static VALUE rb_call_cached _((struct call_cache*,VALUE,VALUE,ID,int,const VALUE*,int,VALUE));
 static VALUE module_setup _((VALUE,NODE*));
 
 static VALUE massign _((VALUE,NODE*,VALUE,int));
@@ -1387,6 +1748,8 @@ ruby_init()
 
     Init_stack((void*)&state);
     Init_heap();
+    init_method_cache();
+    init_tcode();
     PUSH_SCOPE();
     ruby_scope->local_vars = 0;
     ruby_scope->local_tbl  = 0;
@@ -1884,7 +2247,7 @@ rb_eval_cmd(cmd, arg, level)
     }
     if (ruby_scope->flags & SCOPE_DONT_RECYCLE)
 	scope_dup(saved_scope);
-    ruby_scope = saved_scope;
+    ruby_scope = SCOPE_FORWARD(saved_scope);
     ruby_safe_level = safe;
     POP_TAG();
     POP_FRAME();
@@ -1947,6 +2310,115 @@ ev_const_get(cref, id, self)
     return rb_const_get(NIL_P(cref->nd_clss) ? CLASS_OF(self): cref->nd_clss, id);
 }
 
+/* ev_const_get() for a NODE_CONST, through its cache (see node.h) */
+static VALUE
+ev_const_get_cached(node, cref, self)
+    NODE *node, *cref;
+    VALUE self;
+{
+    struct const_cache *cc = node->nd_ccache;
+    NODE *cbase = cref;
+    ID id = node->nd_vid;
+    VALUE result;
+
+    if (cc->serial == ruby_const_serial && cc->key == (VALUE)cref) {
+	return cc->value;
+    }
+    while (cbase && cbase->nd_next) {
+	VALUE klass = cbase->nd_clss;
+
+	if (!NIL_P(klass) && RCLASS(klass)->iv_tbl &&
+	    st_lookup(RCLASS(klass)->iv_tbl, id, &result)) {
+	    if (result == Qundef) goto uncached;
+	    goto found;
+	}
+	cbase = cbase->nd_next;
+    }
+    if (NIL_P(cref->nd_clss)) goto uncached;
+    result = rb_const_lookup(cref->nd_clss, id, Qfalse);
+    if (result == Qundef) goto uncached;
+  found:
+    cc->key = (VALUE)cref;
+    cc->value = result;
+    cc->serial = ruby_const_serial;
+    return result;
+
+  uncached:
+    return ev_const_get(cref, id, self);
+}
+
+/* rb_const_get_from() for a NODE_COLON2 or NODE_COLON3 */
+static VALUE
+const_get_from_cached(node, klass)
+    NODE *node;
+    VALUE klass;
+{
+    struct const_cache *cc = node->nd_ccache;
+    VALUE result;
+
+    if (cc->serial == ruby_const_serial && cc->key == klass) {
+	return cc->value;
+    }
+    result = rb_const_lookup(klass, node->nd_mid, Qtrue);
+    if (result == Qundef) {
+	return rb_const_get_from(klass, node->nd_mid);
+    }
+    cc->key = klass;
+    cc->value = result;
+    cc->serial = ruby_const_serial;
+    return result;
+}
+
+/* rb_ivar_get() for a NODE_IVAR, through its cache (see node.h) */
+static VALUE
+ivar_get_cached(node, obj, warn)
+    NODE *node;
+    VALUE obj;
+    int warn;
+{
+    struct ivar_cache *ic = node->nd_icache;
+    VALUE val;
+
+    if (SPECIAL_CONST_P(obj) || BUILTIN_TYPE(obj) != T_OBJECT) goto uncached;
+    if (!ic->index || ic->index != ROBJECT(obj)->iv_index) {
+	long slot = rb_ivar_slot(obj, node->nd_vid);
+
+	if (slot < 0) goto uncached;
+	ic->index = ROBJECT(obj)->iv_index;
+	ic->slot = slot;
+    }
+    if (ic->slot < ROBJECT(obj)->iv_len &&
+	(val = ROBJECT(obj)->iv_ptr[ic->slot]) != Qundef) {
+	return val;
+    }
+  uncached:
+    if (warn) return rb_ivar_get(obj, node->nd_vid);
+    return rb_attr_get(obj, node->nd_vid);
+}
+
+/* rb_ivar_set() for a NODE_IASGN or NODE_ATTRSET */
+static VALUE
+ivar_set_cached(node, obj, val)
+    NODE *node;
+    VALUE obj, val;
+{
+    struct ivar_cache *ic = node->nd_icache;
+
+    if (SPECIAL_CONST_P(obj) || BUILTIN_TYPE(obj) != T_OBJECT) {
+	return rb_ivar_set(obj, node->nd_vid, val);
+    }
+    if (ic->index && ic->index == ROBJECT(obj)->iv_index &&
+	ic->slot < ROBJECT(obj)->iv_len && !OBJ_FROZEN(obj) &&
+	(ruby_safe_level < 4 || OBJ_TAINTED(obj))) {
+	ROBJECT(obj)->iv_ptr[ic->slot] = val;
+	return val;
+    }
+    rb_ivar_set(obj, node->nd_vid, val);
+    ic->index = ROBJECT(obj)->iv_index;
+    ic->slot = rb_ivar_slot(obj, node->nd_vid);
+    return val;
+}
+
 static VALUE
 cvar_cbase()
 {
@@ -2191,7 +2663,8 @@ rb_alias(klass, name, def)
 	body = body->nd_head;
     }
 
-    rb_clear_cache_by_id(name);
+    rb_clear_cache_by_class(klass);
+    bop_redefine(klass, name);
     if (RTEST(ruby_verbose) && st_lookup(RCLASS(klass)->m_tbl, name, &data)) {
 	node = (NODE *)data;
 	if (node->nd_cnt == 0 && node->nd_body) {
@@ -2247,7 +2720,10 @@ rb_copy_node_scope(node, rval)
     NODE *node;
     NODE *rval;
 {
-    NODE *copy = NEW_NODE(NODE_SCOPE,0,rval,node->nd_next);
+    NODE *body = node->nd_next;
+    NODE *copy;
+
+    copy = NEW_NODE(NODE_SCOPE,0,rval,body);
 
     if (node->nd_tbl) {
 	copy->nd_tbl = ALLOC_N(ID, node->nd_tbl[0]+1);
@@ -2383,11 +2859,11 @@ is_defined(self, node, buf)
 
       case NODE_ATTRASGN:
 	val = self;
-	if (node->nd_recv == (NODE *)1) goto check_bound;
+	if (CALL_RECV(node) == (NODE *)1) goto check_bound;
       case NODE_CALL:
 	PUSH_TAG(PROT_NONE);
 	if ((state = EXEC_TAG()) == 0) {
-	    val = rb_eval(self, node->nd_recv);
+	    val = rb_eval(self, CALL_RECV(node));
 	}
 	POP_TAG();
 	if (state) {
@@ -2576,6 +3052,7 @@ rb_add_event_hook(func, events)
     hook->events = events;
     hook->next = event_hooks;
     event_hooks = hook;
+    bop_hooks(1);
 }
 
 int
@@ -2595,6 +3072,7 @@ rb_remove_event_hook(func)
 		event_hooks = hook->next;
 	    }
 	    xfree(hook);
+	    if (!event_hooks) bop_hooks(0);
 	    return 0;
 	}
 	prev = hook;
@@ -2985,7 +3463,7 @@ rb_eval(self, n)
 	/* nodes for speed-up(literal match) */
       case NODE_MATCH2:
 	{
-	    VALUE l = rb_eval(self,node->nd_recv);
+	    VALUE l = rb_eval(self,node->nd_obj);
 	    VALUE r = rb_eval(self,node->nd_value);
 	    result = rb_reg_match(l, r);
 	}
@@ -2994,7 +3472,7 @@ rb_eval(self, n)
 	/* nodes for speed-up(literal match) */
       case NODE_MATCH3:
 	{
-	    VALUE r = rb_eval(self,node->nd_recv);
+	    VALUE r = rb_eval(self,node->nd_obj);
 	    VALUE l = rb_eval(self,node->nd_value);
 	    if (TYPE(l) == T_STRING) {
 		result = rb_reg_match(r, l);
@@ -3456,12 +3934,12 @@ rb_eval(self, n)
 	    TMP_PROTECT;
 
 	    BEGIN_CALLARGS;
-	    if (node->nd_recv == (NODE *)1) {
+	    if (CALL_RECV(node) == (NODE *)1) {
 		recv = self;
 		scope = 1;
 	    }
 	    else {
-		recv = rb_eval(self, node->nd_recv);
+		recv = rb_eval(self, CALL_RECV(node));
 		scope = 0;
 	    }
 	    SETUP_ARGS(node->nd_args);
@@ -3469,7 +3947,8 @@ rb_eval(self, n)
 
 	    ruby_current_node = node;
 	    SET_CURRENT_SOURCE();
-	    rb_call(CLASS_OF(recv),recv,node->nd_mid,argc,argv,scope,self);
+	    rb_call_cached(node->nd_cache,CLASS_OF(recv),recv,node->nd_mid,
+			   argc,argv,scope,self);
 	    result = argv[argc-1];
 	}
 	break;
@@ -3481,13 +3960,19 @@ rb_eval(self, n)
 	    TMP_PROTECT;
 
 	    BEGIN_CALLARGS;
-	    recv = rb_eval(self, node->nd_recv);
+	    recv = rb_eval(self, CALL_RECV(node));
 	    SETUP_ARGS(node->nd_args);
 	    END_CALLARGS;
 
 	    ruby_current_node = node;
 	    SET_CURRENT_SOURCE();
-	    result = rb_call(CLASS_OF(recv),recv,node->nd_mid,argc,argv,0,self);
+	    if (argc == 1 &&
+		CALL_BOP(node->nd_cache, node->nd_mid) != BOP_NONE &&
+		(result = call_bop(node->nd_cache->bop, recv, argv[0])) != Qundef) {
+		break;
+	    }
+	    result = rb_call_cached(node->nd_cache,CLASS_OF(recv),recv,node->nd_mid,
+				    argc,argv,0,self);
 	}
 	break;
 
@@ -3502,13 +3987,15 @@ rb_eval(self, n)
 
 	    ruby_current_node = node;
 	    SET_CURRENT_SOURCE();
-	    result = rb_call(CLASS_OF(self),self,node->nd_mid,argc,argv,1,self);
+	    result = rb_call_cached(node->nd_cache,CLASS_OF(self),self,node->nd_mid,
+				    argc,argv,1,self);
 	}
 	break;
 
       case NODE_VCALL:
 	SET_CURRENT_SOURCE();
-	result = rb_call(CLASS_OF(self),self,node->nd_mid,0,0,2,self);
+	result = rb_call_cached(node->nd_cache,CLASS_OF(self),self,node->nd_mid,
+				0,0,2,self);
 	break;
 
       case NODE_SUPER:
@@ -3602,7 +4089,7 @@ rb_eval(self, n)
 	    NODE *rval;
 	    TMP_PROTECT;
 
-	    recv = rb_eval(self, node->nd_recv);
+	    recv = rb_eval(self, node->nd_obj);
 	    rval = node->nd_args->nd_head;
 	    SETUP_ARGS0(node->nd_args->nd_body, 1);
 	    val = rb_funcall3(recv, aref, argc, argv);
@@ -3630,7 +4117,7 @@ rb_eval(self, n)
 	    ID id = node->nd_next->nd_vid;
 	    VALUE recv, val, tmp;
 
-	    recv = rb_eval(self, node->nd_recv);
+	    recv = rb_eval(self, node->nd_obj);
 	    val = rb_funcall3(recv, id, 0, 0);
 	    switch (node->nd_next->nd_mid) {
 	    case 0: /* OR */
@@ -3693,7 +4180,7 @@ rb_eval(self, n)
 
       case NODE_IASGN:
 	result = rb_eval(self, node->nd_value);
-	rb_ivar_set(self, node->nd_vid, result);
+	ivar_set_cached(node, self, result);
 	break;
 
       case NODE_CDECL:
@@ -3735,11 +4222,11 @@ rb_eval(self, n)
 	break;
 
       case NODE_IVAR:
-	result = rb_ivar_get(self, node->nd_vid);
+	result = ivar_get_cached(node, self, Qtrue);
 	break;
 
       case NODE_CONST:
-	result = ev_const_get(ruby_cref, node->nd_vid, self);
+	result = ev_const_get_cached(node, ruby_cref, self);
 	break;
 
       case NODE_CVAR:
@@ -3767,7 +4254,7 @@ rb_eval(self, n)
 		switch (TYPE(klass)) {
 		  case T_CLASS:
 		  case T_MODULE:
-		    result = rb_const_get_from(klass, node->nd_mid);
+		    result = const_get_from_cached(node, klass);
 		    break;
 		  default:
 		    rb_raise(rb_eTypeError, "%s is not a class/module",
@@ -3782,7 +4269,7 @@ rb_eval(self, n)
 	break;
 
       case NODE_COLON3:
-	result = rb_const_get_from(rb_cObject, node->nd_mid);
+	result = const_get_from_cached(node, rb_cObject);
 	break;
 
       case NODE_NTH_REF:
@@ -3965,7 +4452,7 @@ rb_eval(self, n)
 
       case NODE_DEFS:
 	if (node->nd_defn) {
-	    VALUE recv = rb_eval(self, node->nd_recv);
+	    VALUE recv = rb_eval(self, node->nd_obj);
 	    VALUE klass;
 	    NODE *body = 0, *defn;
 
@@ -4113,7 +4600,7 @@ rb_eval(self, n)
 	{
 	    VALUE klass;
 
-	    result = rb_eval(self, node->nd_recv);
+	    result = rb_eval(self, node->nd_obj);
 	    if (FIXNUM_P(result) || SYMBOL_P(result)) {
 		rb_raise(rb_eTypeError, "no virtual class for %s",
 			 rb_obj_classname(result));
@@ -4161,791 +4648,2005 @@ rb_eval(self, n)
     return result;
 }
 
-static VALUE
-module_setup(module, n)
-    VALUE module;
-    NODE *n;
-{
-    NODE * volatile node = n->nd_body;
-    int state;
-    struct FRAME frame;
-    VALUE result = Qnil;	/* OK */
-    TMP_PROTECT;
+/*
+ * Threaded code.
+ *
+ * A method body called often enough is compiled into a flat array of
+ * instructions for a small stack machine, which runs it without the
+ * recursion and node type dispatch of rb_eval().  Built with GCC,
+ * every instruction begins with the address of the code that runs it
+ * (direct threading); otherwise with its number, for a switch.
+ *
+ * Nodes the compiler does not handle are left to rb_eval(), and the
+ * frame, scope and arguments are still set up by rb_call0(), so the
+ * semantics do not change.  A loop still runs under a PROT_LOOP tag,
+ * which catches the break, next and redo jumped from code left to
+ * rb_eval(); those in compiled code jump directly.  Line events are
+ * reported as before.
+ *
+ * The compiler also folds constant expressions, does Fixnum arithmetic
+ * and comparisons inline, and reports consecutive line events with a
+ * single instruction, which only records the last place when no event
+ * hook is set.
+ */
 
-    frame = *ruby_frame;
-    frame.tmp = ruby_frame;
-    ruby_frame = &frame;
+#define TCODE_THRESHOLD 8	/* calls before a method is compiled */
 
-    PUSH_CLASS(module);
-    PUSH_SCOPE();
-    PUSH_VARS();
+static long tcode_threshold = TCODE_THRESHOLD;
 
-    if (node->nd_tbl) {
-	VALUE *vars = TMP_ALLOC(node->nd_tbl[0]+1);
-	*vars++ = (VALUE)node;
-	ruby_scope->local_vars = vars;
-	rb_mem_clear(ruby_scope->local_vars, node->nd_tbl[0]);
-	ruby_scope->local_tbl = node->nd_tbl;
-    }
-    else {
-	ruby_scope->local_vars = 0;
-	ruby_scope->local_tbl  = 0;
-    }
+#if defined(__GNUC__) && !defined(TCODE_SWITCH)
+#define TCODE_THREADED 1
+#endif
 
-    PUSH_CREF(module);
-    PUSH_TAG(PROT_NONE);
-    if ((state = EXEC_TAG()) == 0) {
-	EXEC_EVENT_HOOK(RUBY_EVENT_CLASS, n, ruby_cbase,
-			ruby_frame->last_func, ruby_frame->last_class);
-	result = rb_eval(ruby_cbase, node->nd_next);
-    }
-    POP_TAG();
-    POP_CREF();
-    POP_VARS();
-    POP_SCOPE();
-    POP_CLASS();
+#define TCODE_INSNS(insn) \
+    insn(leave) insn(pop) insn(putnil) insn(putself) insn(puttrue) \
+    insn(putfalse) insn(putundef) insn(putobject) insn(putstring) \
+    insn(getlocal) insn(setlocal) insn(getivar) insn(setivar) \
+    insn(getgvar) insn(setgvar) insn(getconst) insn(line) insn(lines) \
+    insn(checkints) insn(jump) insn(jumpbp) insn(branchif) \
+    insn(branchunless) insn(andjump) insn(orjump) insn(not) \
+    insn(loop) insn(breakjump) insn(nextjump) insn(redojump) \
+    insn(returnjump) insn(call) insn(fcall) insn(vcall) \
+    insn(attrasgn) insn(yield) insn(array) insn(hash) insn(range) \
+    insn(dstr) insn(evstr) insn(eval) insn(putfolded) insn(opt_plus) \
+    insn(opt_minus) insn(opt_lt) insn(opt_le) insn(opt_gt) insn(opt_ge) \
+    insn(opt_eq) insn(opt_bop)
+
+#define TCODE_ENUM(name) TC_##name,
+enum tcode_insn { TCODE_INSNS(TCODE_ENUM) TC_LAST };
+#undef TCODE_ENUM
+
+union tcode_word {
+    const void *label;		/* instruction, threaded */
+    long op;			/* instruction, switched */
+    long num;			/* operands */
+    VALUE value;
+    NODE *node;
+};
 
-    ruby_frame = frame.tmp;
-    EXEC_EVENT_HOOK(RUBY_EVENT_END, n, 0,
-		    ruby_frame->last_func, ruby_frame->last_class);
-    if (state) JUMP_TAG(state);
+struct tcode {
+    long stack;			/* depth of the value stack */
+    long len;
+    union tcode_word insns[1];
+};
 
-    return result;
-}
+#ifdef TCODE_THREADED
+static const void *const *tcode_labels;
+#endif
 
-static NODE *basic_respond_to = 0;
+static VALUE tcode_run _((VALUE, struct tcode*, union tcode_word*, VALUE*));
 
-int
-rb_obj_respond_to(obj, id, priv)
-    VALUE obj;
-    ID id;
-    int priv;
+static VALUE
+tcode_loop(self, tc, ops, sp)
+    VALUE self;
+    struct tcode *tc;
+    union tcode_word *ops;	/* start, redo, next, exit */
+    VALUE *sp;
 {
-    VALUE klass = CLASS_OF(obj);
-
-    if (rb_method_node(klass, respond_to) == basic_respond_to) {
-	return rb_method_boundp(klass, id, !priv);
+    volatile VALUE result = Qnil;
+    long start = ops[0].num;
+    int state;
+
+    PUSH_TAG(PROT_LOOP);
+    switch (state = EXEC_TAG()) {
+      case TAG_REDO:
+	state = 0;
+	start = ops[1].num;
+	goto run;
+      case TAG_NEXT:
+	state = 0;
+	start = ops[2].num;
+	/* fall through */
+      case 0:
+      run:
+	result = tcode_run(self, tc, tc->insns + start, sp);
+	break;
+      case TAG_BREAK:
+	if (TAG_DST()) {
+	    state = 0;
+	    result = prot_tag->retval;
+	}
+	break;
     }
-    else {
-	VALUE args[2];
-	int n = 0;
-	args[n++] = ID2SYM(id);
-	if (priv) args[n++] = Qtrue;
-	return RTEST(rb_funcall2(obj, respond_to, n, args));
+    POP_TAG();
+    if (state) JUMP_TAG(state);
+    return result;
+}
+
+#ifdef TCODE_THREADED
+#define INSN(name) tc_##name:
+#define NEXT_INSN goto *(pc++)->label
+#else
+#define INSN(name) case TC_##name:
+#define NEXT_INSN goto dispatch
+#endif
+#define JUMP_TO(off) (pc = insns + (off))
+
+/* runs from pc to a leave instruction, with the value stack at sp */
+static VALUE
+tcode_run(self, tc, pc, sp)
+    VALUE self;
+    struct tcode *tc;
+    union tcode_word *pc;
+    VALUE *sp;
+{
+#ifdef TCODE_THREADED
+#define TCODE_LABEL(name) &&tc_##name,
+    static const void *const labels[] = { TCODE_INSNS(TCODE_LABEL) };
+#undef TCODE_LABEL
+#endif
+    union tcode_word *insns;
+    VALUE *bp = sp;
+    VALUE recv, val;
+    NODE *node;
+    long n, i;
+
+#ifdef TCODE_THREADED
+    if (!tc) {
+	tcode_labels = labels;
+	return Qnil;
+    }
+    insns = tc->insns;
+    NEXT_INSN;
+#else
+    insns = tc->insns;
+  dispatch:
+    switch ((pc++)->op) {
+#endif
+
+    INSN(leave)
+	return sp[-1];
+
+    INSN(pop)
+	sp--;
+	NEXT_INSN;
+
+    INSN(putnil)
+	*sp++ = Qnil;
+	NEXT_INSN;
+
+    INSN(putself)
+	*sp++ = self;
+	NEXT_INSN;
+
+    INSN(puttrue)
+	*sp++ = Qtrue;
+	NEXT_INSN;
+
+    INSN(putfalse)
+	*sp++ = Qfalse;
+	NEXT_INSN;
+
+    INSN(putundef)
+	*sp++ = Qundef;
+	NEXT_INSN;
+
+    INSN(putobject)
+	*sp++ = (pc++)->value;
+	NEXT_INSN;
+
+    INSN(putstring)
+	*sp++ = rb_str_new3((pc++)->value);
+	NEXT_INSN;
+
+    INSN(getlocal)
+	*sp++ = ruby_scope->local_vars[(pc++)->num];
+	NEXT_INSN;
+
+    INSN(setlocal)
+	ruby_scope->local_vars[(pc++)->num] = sp[-1];
+	NEXT_INSN;
+
+    INSN(getivar)
+	node = (pc++)->node;
+	ruby_current_node = node;
+	*sp++ = ivar_get_cached(node, self, Qtrue);
+	NEXT_INSN;
+
+    INSN(setivar)
+	node = (pc++)->node;
+	ruby_current_node = node;
+	ivar_set_cached(node, self, sp[-1]);
+	NEXT_INSN;
+
+    INSN(getgvar)
+	node = (pc++)->node;
+	ruby_current_node = node;
+	*sp++ = rb_gvar_get(node->nd_entry);
+	NEXT_INSN;
+
+    INSN(setgvar)
+	node = (pc++)->node;
+	ruby_current_node = node;
+	rb_gvar_set(node->nd_entry, sp[-1]);
+	NEXT_INSN;
+
+    INSN(getconst)
+	node = (pc++)->node;
+	ruby_current_node = node;
+	*sp++ = ev_const_get_cached(node, ruby_cref, self);
+	NEXT_INSN;
+
+    INSN(line)
+	node = (pc++)->node;
+	CHECK_INTS;
+	ruby_current_node = node;
+	EXEC_EVENT_HOOK(RUBY_EVENT_LINE, node, self,
+			ruby_frame->last_func,
+			ruby_frame->last_class);
+	NEXT_INSN;
+
+    INSN(lines)			/* count, nodes */
+	n = (pc++)->num;
+	CHECK_INTS;
+	if (event_hooks) {
+	    for (i=0; i<n; i++) {
+		ruby_current_node = pc[i].node;
+		EXEC_EVENT_HOOK(RUBY_EVENT_LINE, pc[i].node, self,
+				ruby_frame->last_func,
+				ruby_frame->last_class);
+	    }
+	}
+	ruby_current_node = pc[n-1].node;
+	pc += n;
+	NEXT_INSN;
+
+    INSN(checkints)
+	CHECK_INTS;
+	NEXT_INSN;
+
+    INSN(jump)
+	JUMP_TO(pc->num);
+	NEXT_INSN;
+
+    INSN(jumpbp)
+	sp = bp;
+	JUMP_TO(pc->num);
+	NEXT_INSN;
+
+    INSN(branchif)
+	if (RTEST(*--sp)) JUMP_TO(pc->num);
+	else pc++;
+	NEXT_INSN;
+
+    INSN(branchunless)
+	if (!RTEST(*--sp)) JUMP_TO(pc->num);
+	else pc++;
+	NEXT_INSN;
+
+    INSN(andjump)
+	if (!RTEST(sp[-1])) JUMP_TO(pc->num);
+	else {
+	    sp--;
+	    pc++;
+	}
+	NEXT_INSN;
+
+    INSN(orjump)
+	if (RTEST(sp[-1])) JUMP_TO(pc->num);
+	else {
+	    sp--;
+	    pc++;
+	}
+	NEXT_INSN;
+
+    INSN(not)
+	sp[-1] = RTEST(sp[-1]) ? Qfalse : Qtrue;
+	NEXT_INSN;
+
+    INSN(loop)
+	val = tcode_loop(self, tc, pc, sp);
+	*sp++ = val;
+	JUMP_TO(pc[3].num);
+	NEXT_INSN;
+
+    INSN(breakjump)
+	break_jump(*--sp);
+	NEXT_INSN;
+
+    INSN(nextjump)
+	CHECK_INTS;
+	next_jump(*--sp);
+	NEXT_INSN;
+
+    INSN(redojump)
+	CHECK_INTS;
+	JUMP_TAG(TAG_REDO);
+	NEXT_INSN;
+
+    INSN(returnjump)
+	return_jump(*--sp);
+	NEXT_INSN;
+
+    INSN(call)
+	node = pc[0].node;
+	n = pc[1].num;
+	pc += 2;
+	sp -= n;
+	recv = sp[-1];
+	ruby_current_node = node;
+	sp[-1] = rb_call_cached(node->nd_cache,CLASS_OF(recv),recv,
+				node->nd_mid,n,sp,0,self);
+	NEXT_INSN;
+
+    INSN(fcall)
+	node = pc[0].node;
+	n = pc[1].num;
+	pc += 2;
+	sp -= n;
+	ruby_current_node = node;
+	val = rb_call_cached(node->nd_cache,CLASS_OF(self),self,
+			     node->nd_mid,n,sp,1,self);
+	*sp++ = val;
+	NEXT_INSN;
+
+    INSN(vcall)
+	node = (pc++)->node;
+	ruby_current_node = node;
+	val = rb_call_cached(node->nd_cache,CLASS_OF(self),self,
+			     node->nd_mid,0,0,2,self);
+	*sp++ = val;
+	NEXT_INSN;
+
+    INSN(attrasgn)
+	node = pc[0].node;
+	n = pc[1].num;
+	pc += 2;
+	sp -= n;
+	recv = sp[-1];
+	ruby_current_node = node;
+	rb_call_cached(node->nd_cache,CLASS_OF(recv),recv,node->nd_mid,n,sp,
+		       CALL_RECV(node) == (NODE *)1 ? 1 : 0,self);
+	sp[-1] = sp[n-1];
+	NEXT_INSN;
+
+    INSN(yield)
+	node = (pc++)->node;
+	ruby_current_node = node;
+	sp[-1] = rb_yield_0(sp[-1], 0, 0, 0, node->nd_state);
+	NEXT_INSN;
+
+    INSN(array)
+	n = (pc++)->num;
+	sp -= n;
+	val = rb_ary_new4(n, sp);
+	*sp++ = val;
+	NEXT_INSN;
+
+    INSN(hash)
+	n = (pc++)->num;
+	sp -= n;
+	val = rb_hash_new();
+	for (i=0; i<n; i+=2) {
+	    rb_hash_aset(val, sp[i], sp[i+1]);
+	}
+	*sp++ = val;
+	NEXT_INSN;
+
+    INSN(range)
+	node = (pc++)->node;
+	sp--;
+	sp[-1] = rb_range_new(sp[-1], sp[0], nd_type(node) == NODE_DOT3);
+	NEXT_INSN;
+
+    INSN(dstr)
+	node = pc[0].node;
+	n = pc[1].num;
+	pc += 2;
+	sp -= n;
+	val = rb_str_new3(node->nd_lit);
+	for (i = 0, node = node->nd_next; node; node = node->nd_next) {
+	    VALUE str2;
+
+	    if (!node->nd_head) continue;
+	    if (nd_type(node->nd_head) == NODE_STR) {
+		str2 = node->nd_head->nd_lit;
+	    }
+	    else {
+		str2 = sp[i++];
+	    }
+	    rb_str_append(val, str2);
+	    OBJ_INFECT(val, str2);
+	}
+	*sp++ = val;
+	NEXT_INSN;
+
+    INSN(evstr)
+	sp[-1] = rb_obj_as_string(sp[-1]);
+	NEXT_INSN;
+
+    INSN(eval)
+	val = rb_eval(self, (pc++)->node);
+	*sp++ = val;
+	NEXT_INSN;
+
+    INSN(putfolded)		/* value, operations it depends on, node */
+	if (bop_redefined_ops & pc[1].num) {
+	    val = rb_eval(self, pc[2].node);
+	}
+	else {
+	    val = pc[0].value;
+	}
+	pc += 3;
+	*sp++ = val;
+	NEXT_INSN;
+
+#define FIXNUM_OPERANDS(op) \
+    (FIXNUM_P(sp[-2]) && FIXNUM_P(sp[-1]) && \
+     !(bop_redefined[op] & (BOP_FIXNUM|BOP_HOOKS)))
+#define FIXNUM_ARITH(op, expr) \
+    if (FIXNUM_OPERANDS(op)) { \
+	n = FIX2LONG(sp[-2]) expr FIX2LONG(sp[-1]); \
+	if (FIXABLE(n)) { \
+	    sp--; \
+	    sp[-1] = LONG2FIX(n); \
+	    pc++; \
+	    NEXT_INSN; \
+	} \
+    } \
+    goto opt_bop;
+#define FIXNUM_COMPARE(op, expr) \
+    if (FIXNUM_OPERANDS(op)) { \
+	sp--; \
+	sp[-1] = (long)sp[-1] expr (long)sp[0] ? Qtrue : Qfalse; \
+	pc++; \
+	NEXT_INSN; \
+    } \
+    goto opt_bop;
+
+    INSN(opt_plus)
+	FIXNUM_ARITH(BOP_PLUS, +);
+
+    INSN(opt_minus)
+	FIXNUM_ARITH(BOP_MINUS, -);
+
+    INSN(opt_lt)
+	FIXNUM_COMPARE(BOP_LT, <);
+
+    INSN(opt_le)
+	FIXNUM_COMPARE(BOP_LE, <=);
+
+    INSN(opt_gt)
+	FIXNUM_COMPARE(BOP_GT, >);
+
+    INSN(opt_ge)
+	FIXNUM_COMPARE(BOP_GE, >=);
+
+    INSN(opt_eq)
+	FIXNUM_COMPARE(BOP_EQ, ==);
+
+    INSN(opt_bop)		/* recv.op(arg), other basic operations */
+      opt_bop:
+	node = (pc++)->node;
+	sp--;
+	recv = sp[-1];
+	val = call_bop(node->nd_cache->bop, recv, sp[0]);
+	if (val == Qundef) {
+	    ruby_current_node = node;
+	    val = rb_call_cached(node->nd_cache,CLASS_OF(recv),recv,
+				 node->nd_mid,1,sp,0,self);
+	}
+	sp[-1] = val;
+	NEXT_INSN;
+
+#undef FIXNUM_OPERANDS
+#undef FIXNUM_ARITH
+#undef FIXNUM_COMPARE
+
+#ifndef TCODE_THREADED
+      default:
+	rb_bug("unknown instruction %ld", pc[-1].op);
     }
+#endif
+    return Qnil;		/* not reached */
 }
 
-int
-rb_respond_to(obj, id)
-    VALUE obj;
-    ID id;
+#undef INSN
+#undef NEXT_INSN
+#undef JUMP_TO
+
+struct tcode_loop {		/* innermost loop being compiled */
+    long redo;			/* where the body starts */
+    long next, brk;		/* jumps to be patched */
+    struct tcode_loop *prev;
+};
+
+struct tcode_compiler {
+    union tcode_word *buf;
+    long len, capa;
+    long depth, max;		/* of the value stack */
+    struct tcode_loop *loop;
+    int last_op, prev_op;	/* the last two instructions, or -1 */
+    long last, prev;		/* and where they are */
+    long target;		/* the last place jumped to */
+};
+
+static long tcode_word _((struct tcode_compiler*));
+static void tcode_op _((struct tcode_compiler*, int, long));
+static void tcode_num _((struct tcode_compiler*, long));
+static void tcode_value _((struct tcode_compiler*, VALUE));
+static void tcode_node _((struct tcode_compiler*, NODE*));
+static long tcode_jump _((struct tcode_compiler*, int, long, long));
+static void tcode_patch _((struct tcode_compiler*, long));
+static long tcode_argc _((NODE*));
+static long tcode_label _((struct tcode_compiler*));
+static void tcode_pop _((struct tcode_compiler*));
+static void tcode_line _((struct tcode_compiler*, NODE*));
+static void tcode_compile_node _((struct tcode_compiler*, NODE*));
+
+static long
+tcode_word(c)
+    struct tcode_compiler *c;
 {
-    return rb_obj_respond_to(obj, id, Qfalse);
+    if (c->len == c->capa) {
+	c->capa *= 2;
+	REALLOC_N(c->buf, union tcode_word, c->capa);
+    }
+    return c->len++;
 }
 
-/*
- *  call-seq:
- *     obj.respond_to?(symbol, include_private=false) => true or false
- *  
- *  Returns +true+> if _obj_ responds to the given
- *  method. Private methods are included in the search only if the
- *  optional second parameter evaluates to +true+.
- */
+static void
+tcode_op(c, op, push)
+    struct tcode_compiler *c;
+    int op;
+    long push;			/* values pushed, or popped if negative */
+{
+    long i = tcode_word(c);
 
-static VALUE
-obj_respond_to(argc, argv, obj)
-    int argc;
-    VALUE *argv;
-    VALUE obj;
+#ifdef TCODE_THREADED
+    c->buf[i].label = tcode_labels[op];
+#else
+    c->buf[i].op = op;
+#endif
+    c->prev_op = c->last_op;
+    c->prev = c->last;
+    c->last_op = op;
+    c->last = i;
+    c->depth += push;
+    if (c->depth > c->max) c->max = c->depth;
+}
+
+static void
+tcode_num(c, num)
+    struct tcode_compiler *c;
+    long num;
 {
-    VALUE mid, priv;
-    ID id;
+    long i = tcode_word(c);
 
-    rb_scan_args(argc, argv, "11", &mid, &priv);
-    id = rb_to_id(mid);
-    if (rb_method_boundp(CLASS_OF(obj), id, !RTEST(priv))) {
-	return Qtrue;
-    }
-    return Qfalse;
+    c->buf[i].num = num;
+}
+
+static void
+tcode_value(c, val)
+    struct tcode_compiler *c;
+    VALUE val;
+{
+    long i = tcode_word(c);
+
+    c->buf[i].value = val;
+}
+
+static void
+tcode_node(c, node)
+    struct tcode_compiler *c;
+    NODE *node;
+{
+    long i = tcode_word(c);
+
+    c->buf[i].node = node;
 }
 
 /*
- *  call-seq:
- *     mod.method_defined?(symbol)    => true or false
- *  
- *  Returns +true+ if the named method is defined by
- *  _mod_ (or its included modules and, if _mod_ is a class,
- *  its ancestors). Public and protected methods are matched.
- *     
- *     module A
- *       def method1()  end
- *     end
- *     class B
- *       def method2()  end
- *     end
- *     class C < B
- *       include A
- *       def method3()  end
- *     end
- *     
- *     A.method_defined? :method1    #=> true
- *     C.method_defined? "method1"   #=> true
- *     C.method_defined? "method2"   #=> true
- *     C.method_defined? "method3"   #=> true
- *     C.method_defined? "method4"   #=> false
+ * Jumps forward are chained through their operands until the target
+ * is known; 0 ends a chain, since no operand is at offset 0.
  */
+static long
+tcode_jump(c, op, push, chain)
+    struct tcode_compiler *c;
+    int op;
+    long push, chain;
+{
+    tcode_op(c, op, push);
+    tcode_num(c, chain);
+    return c->len - 1;
+}
 
-static VALUE
-rb_mod_method_defined(mod, mid)
-    VALUE mod, mid;
+static void
+tcode_patch(c, chain)
+    struct tcode_compiler *c;
+    long chain;
 {
-    return rb_method_boundp(mod, rb_to_id(mid), 1);
+    long next;
+
+    if (chain) c->target = c->len;
+    while (chain) {
+	next = c->buf[chain].num;
+	c->buf[chain].num = c->len;
+	chain = next;
+    }
 }
 
-#define VISI_CHECK(x,f) (((x)&NOEX_MASK) == (f))
+/* the current place, which something will jump to */
+static long
+tcode_label(c)
+    struct tcode_compiler *c;
+{
+    return c->target = c->len;
+}
 
 /*
- *  call-seq:
- *     mod.public_method_defined?(symbol)   => true or false
- *  
- *  Returns +true+ if the named public method is defined by
- *  _mod_ (or its included modules and, if _mod_ is a class,
- *  its ancestors).
- *     
- *     module A
- *       def method1()  end
- *     end
- *     class B
- *       protected
- *       def method2()  end
- *     end
- *     class C < B
- *       include A
- *       def method3()  end
- *     end
- *     
- *     A.method_defined? :method1           #=> true
- *     C.public_method_defined? "method1"   #=> true
- *     C.public_method_defined? "method2"   #=> false
- *     C.method_defined? "method2"          #=> true
+ * Pops a value, or drops the instruction that pushed it when that has
+ * no other effect and nothing jumps in between.
  */
+static void
+tcode_pop(c)
+    struct tcode_compiler *c;
+{
+    if (c->target != c->len) {
+	switch (c->last_op) {
+	  case TC_putnil: case TC_putself: case TC_puttrue: case TC_putfalse:
+	  case TC_putundef: case TC_putobject: case TC_putstring:
+	  case TC_getlocal:
+	    c->len = c->last;
+	    c->depth--;
+	    c->last_op = c->prev_op;
+	    c->last = c->prev;
+	    c->prev_op = -1;
+	    return;
+	}
+    }
+    tcode_op(c, TC_pop, -1);
+}
 
-static VALUE
-rb_mod_public_method_defined(mod, mid)
-    VALUE mod, mid;
+/* reports a line event for node, with the line just before if any */
+static void
+tcode_line(c, node)
+    struct tcode_compiler *c;
+    NODE *node;
 {
-    ID id = rb_to_id(mid);
-    int noex;
-
-    if (rb_get_method_body(&mod, &id, &noex)) {
-	if (VISI_CHECK(noex, NOEX_PUBLIC))
-	    return Qtrue;
+    NODE *prev;
+
+    if (c->target != c->len) {
+	switch (c->last_op) {
+	  case TC_line:
+	    prev = c->buf[c->last+1].node;
+	    c->len = c->last;
+	    c->last_op = c->prev_op;
+	    c->last = c->prev;
+	    tcode_op(c, TC_lines, 0);
+	    tcode_num(c, 2);
+	    tcode_node(c, prev);
+	    tcode_node(c, node);
+	    return;
+	  case TC_lines:
+	    c->buf[c->last+1].num++;
+	    tcode_node(c, node);
+	    return;
+	}
     }
-    return Qfalse;
+    tcode_op(c, TC_line, 0);
+    tcode_node(c, node);
 }
 
 /*
- *  call-seq:
- *     mod.private_method_defined?(symbol)    => true or false
- *  
- *  Returns +true+ if the named private method is defined by
- *  _ mod_ (or its included modules and, if _mod_ is a class,
- *  its ancestors).
- *     
- *     module A
- *       def method1()  end
- *     end
- *     class B
- *       private
- *       def method2()  end
- *     end
- *     class C < B
- *       include A
- *       def method3()  end
- *     end
- *     
- *     A.method_defined? :method1            #=> true
- *     C.private_method_defined? "method1"   #=> false
- *     C.private_method_defined? "method2"   #=> true
- *     C.method_defined? "method2"           #=> false
+ * The value of node if it is a constant expression, or Qundef.  The
+ * basic operations it depends on are added to *bops.
  */
-
 static VALUE
-rb_mod_private_method_defined(mod, mid)
-    VALUE mod, mid;
+tcode_fold(node, bops)
+    NODE *node;
+    long *bops;
 {
-    ID id = rb_to_id(mid);
-    int noex;
-
-    if (rb_get_method_body(&mod, &id, &noex)) {
-	if (VISI_CHECK(noex, NOEX_PRIVATE))
-	    return Qtrue;
-    }
-    return Qfalse;
-}
+    VALUE recv, arg;
+    int op;
 
-/*
- *  call-seq:
- *     mod.protected_method_defined?(symbol)   => true or false
- *  
- *  Returns +true+ if the named protected method is defined
- *  by _mod_ (or its included modules and, if _mod_ is a
- *  class, its ancestors).
- *     
- *     module A
- *       def method1()  end
- *     end
- *     class B
- *       protected
- *       def method2()  end
- *     end
- *     class C < B
- *       include A
- *       def method3()  end
- *     end
- *     
- *     A.method_defined? :method1              #=> true
- *     C.protected_method_defined? "method1"   #=> false
- *     C.protected_method_defined? "method2"   #=> true
- *     C.method_defined? "method2"             #=> true
- */
+    if (!node) return Qnil;
+    switch (nd_type(node)) {
+      case NODE_NIL:
+	return Qnil;
 
-static VALUE
-rb_mod_protected_method_defined(mod, mid)
-    VALUE mod, mid;
-{
-    ID id = rb_to_id(mid);
-    int noex;
+      case NODE_TRUE:
+	return Qtrue;
 
-    if (rb_get_method_body(&mod, &id, &noex)) {
-	if (VISI_CHECK(noex, NOEX_PROTECTED))
-	    return Qtrue;
-    }
-    return Qfalse;
-}
+      case NODE_FALSE:
+	return Qfalse;
 
-NORETURN(static VALUE terminate_process _((int, VALUE)));
-static VALUE
-terminate_process(status, mesg)
-    int status;
-    VALUE mesg;
-{
-    VALUE args[2];
-    args[0] = INT2NUM(status);
-    args[1] = mesg;
+      case NODE_LIT:
+	return node->nd_lit;
 
-    rb_exc_raise(rb_class_new_instance(2, args, rb_eSystemExit));
-}
+      case NODE_NOT:
+	recv = tcode_fold(node->nd_body, bops);
+	if (recv == Qundef) break;
+	return RTEST(recv) ? Qfalse : Qtrue;
 
-void
-rb_exit(status)
-    int status;
-{
-    if (prot_tag) {
-	terminate_process(status, rb_str_new("exit", 4));
+      case NODE_CALL:
+	if (!node->nd_cache) break;
+	op = CALL_BOP(node->nd_cache, node->nd_mid);
+	if (op == BOP_NONE) break;
+	recv = tcode_fold(CALL_RECV(node), bops);
+	if (recv == Qundef) break;
+	*bops |= BOP_BIT(op);
+	if (op == BOP_NIL_P) {
+	    if (node->nd_args) break;
+	    if (NIL_P(recv)) return Qtrue;
+	    if (FIXNUM_P(recv)) return Qfalse;
+	    break;
+	}
+	if (!FIXNUM_P(recv) || tcode_argc(node->nd_args) != 1) break;
+	arg = tcode_fold(node->nd_args->nd_head, bops);
+	if (!FIXNUM_P(arg)) break;
+	return fix_bop(op, recv, arg);
     }
-    ruby_finalize();
-    exit(status);
+    return Qundef;
 }
 
-
-/*
- *  call-seq:
- *     exit(integer=0)
- *     Kernel::exit(integer=0)
- *     Process::exit(integer=0)
- *  
- *  Initiates the termination of the Ruby script by raising the
- *  <code>SystemExit</code> exception. This exception may be caught. The
- *  optional parameter is used to return a status code to the invoking
- *  environment.
- *     
- *     begin
- *       exit
- *       puts "never get here"
- *     rescue SystemExit
- *       puts "rescued a SystemExit exception"
- *     end
- *     puts "after begin block"
- *     
- *  <em>produces:</em>
- *     
- *     rescued a SystemExit exception
- *     after begin block
- *     
- *  Just prior to termination, Ruby executes any <code>at_exit</code> functions
- *  (see Kernel::at_exit) and runs any object finalizers (see
- *  ObjectSpace::define_finalizer).
- *     
- *     at_exit { puts "at_exit function" }
- *     ObjectSpace.define_finalizer("string",  proc { puts "in finalizer" })
- *     exit
- *     
- *  <em>produces:</em>
- *     
- *     at_exit function
- *     in finalizer
- */
-
-VALUE
-rb_f_exit(argc, argv)
-    int argc;
-    VALUE *argv;
+/* compiles node as its value, if it is a constant expression */
+static int
+tcode_folded(c, node)
+    struct tcode_compiler *c;
+    NODE *node;
 {
-    VALUE status;
-    int istatus;
-
-    rb_secure(4);
-    if (rb_scan_args(argc, argv, "01", &status) == 1) {
-	switch (status) {
-	  case Qtrue:
-	    istatus = EXIT_SUCCESS;
-	    break;
-	  case Qfalse:
-	    istatus = EXIT_FAILURE;
-	    break;
-	  default:
-	    istatus = NUM2INT(status);
-#if EXIT_SUCCESS != 0
-	    if (istatus == 0) istatus = EXIT_SUCCESS;
-#endif
-	    break;
-	}
+    VALUE val;
+    long bops = 0;
+
+    val = tcode_fold(node, &bops);
+    if (val == Qundef || !SPECIAL_CONST_P(val)) return 0;
+    if (bops & bop_redefined_ops) return 0;
+    if (bops) {
+	bops |= BOP_HOOKED;
+	tcode_op(c, TC_putfolded, 1);
+	tcode_value(c, val);
+	tcode_num(c, bops);
+	tcode_node(c, node);
     }
     else {
-	istatus = EXIT_SUCCESS;
+	tcode_op(c, TC_putobject, 1);
+	tcode_value(c, val);
     }
-    rb_exit(istatus);
-    return Qnil;		/* not reached */
+    return 1;
 }
 
-
-/*
- *  call-seq:
- *     abort
- *     Kernel::abort
- *     Process::abort
- *  
- *  Terminate execution immediately, effectively by calling
- *  <code>Kernel.exit(1)</code>. If _msg_ is given, it is written
- *  to STDERR prior to terminating.
- */
-
-VALUE
-rb_f_abort(argc, argv)
-    int argc;
-    VALUE *argv;
+/* the number of arguments, or -1 if they are left to rb_eval() */
+static long
+tcode_argc(args)
+    NODE *args;
 {
-    rb_secure(4);
-    if (argc == 0) {
-	if (!NIL_P(ruby_errinfo)) {
-	    error_print();
-	}
-	rb_exit(EXIT_FAILURE);
-    }
-    else {
-	VALUE mesg;
+    long argc = 0;
 
-	rb_scan_args(argc, argv, "1", &mesg);
-	StringValue(mesg);
-	rb_io_puts(1, &mesg, rb_stderr);
-	terminate_process(EXIT_FAILURE, mesg);
-    }
-    return Qnil;		/* not reached */
+    if (!args) return 0;
+    if (nd_type(args) != NODE_ARRAY) return -1;
+    for (; args; args = args->nd_next) argc++;
+    return argc;
 }
 
-void
-rb_iter_break()
+static void
+tcode_list(c, list)
+    struct tcode_compiler *c;
+    NODE *list;
 {
-    break_jump(Qnil);
+    for (; list; list = list->nd_next) {
+	tcode_compile_node(c, list->nd_head);
+    }
 }
 
-NORETURN(static void rb_longjmp _((int, VALUE)));
-static VALUE make_backtrace _((void));
-
+/* compiles code leaving the value of node on the stack */
 static void
-rb_longjmp(tag, mesg)
-    int tag;
-    VALUE mesg;
+tcode_compile_node(c, node)
+    struct tcode_compiler *c;
+    NODE *node;
 {
-    VALUE at;
-    rb_thread_t th = curr_thread;
+    struct tcode_loop loop;
+    NODE *list;
+    long argc, l1, l2, ops;
+    int op;
 
-    if (rb_thread_set_raised(th)) {
-	ruby_errinfo = exception_error;
-	JUMP_TAG(TAG_FATAL);
-    }
-    if (NIL_P(mesg)) mesg = ruby_errinfo;
-    if (NIL_P(mesg)) {
-	mesg = rb_exc_new(rb_eRuntimeError, 0, 0);
+  again:
+    if (!node) {
+	tcode_op(c, TC_putnil, 1);
+	return;
     }
+    switch (nd_type(node)) {
+      case NODE_NEWLINE:
+	tcode_line(c, node);
+	node = node->nd_next;
+	goto again;
 
-    ruby_set_current_source();
-    if (ruby_sourcefile && !NIL_P(mesg)) {
-	at = get_backtrace(mesg);
-	if (NIL_P(at)) {
-	    at = make_backtrace();
-	    if (OBJ_FROZEN(mesg)) {
-		mesg = rb_obj_dup(mesg);
-	    }
-	    set_backtrace(mesg, at);
+      case NODE_BLOCK:
+	for (; node->nd_next; node = node->nd_next) {
+	    tcode_compile_node(c, node->nd_head);
+	    tcode_pop(c);
 	}
-    }
-    if (!NIL_P(mesg)) {
-	ruby_errinfo = mesg;
-    }
+	node = node->nd_head;
+	goto again;
 
-    if (RTEST(ruby_debug) && !NIL_P(ruby_errinfo)
-	&& !rb_obj_is_kind_of(ruby_errinfo, rb_eSystemExit)) {
-	VALUE e = ruby_errinfo;
-	int status;
+      case NODE_BEGIN:
+	node = node->nd_body;
+	goto again;
 
-	PUSH_TAG(PROT_NONE);
-	if ((status = EXEC_TAG()) == 0) {
-	    StringValue(e);
-	    warn_printf("Exception `%s' at %s:%d - %s\n",
-			rb_obj_classname(ruby_errinfo),
-			ruby_sourcefile, ruby_sourceline,
-			RSTRING(e)->ptr);
+      case NODE_SELF:
+	tcode_op(c, TC_putself, 1);
+	break;
+
+      case NODE_NIL:
+	tcode_op(c, TC_putnil, 1);
+	break;
+
+      case NODE_TRUE:
+	tcode_op(c, TC_puttrue, 1);
+	break;
+
+      case NODE_FALSE:
+	tcode_op(c, TC_putfalse, 1);
+	break;
+
+      case NODE_LIT:
+	tcode_op(c, TC_putobject, 1);
+	tcode_value(c, node->nd_lit);
+	break;
+
+      case NODE_STR:
+	tcode_op(c, TC_putstring, 1);
+	tcode_value(c, node->nd_lit);
+	break;
+
+      case NODE_LVAR:
+	tcode_op(c, TC_getlocal, 1);
+	tcode_num(c, node->nd_cnt);
+	break;
+
+      case NODE_LASGN:
+	tcode_compile_node(c, node->nd_value);
+	tcode_op(c, TC_setlocal, 0);
+	tcode_num(c, node->nd_cnt);
+	break;
+
+      case NODE_IVAR:
+	tcode_op(c, TC_getivar, 1);
+	tcode_node(c, node);
+	break;
+
+      case NODE_IASGN:
+	tcode_compile_node(c, node->nd_value);
+	tcode_op(c, TC_setivar, 0);
+	tcode_node(c, node);
+	break;
+
+      case NODE_GVAR:
+	tcode_op(c, TC_getgvar, 1);
+	tcode_node(c, node);
+	break;
+
+      case NODE_GASGN:
+	tcode_compile_node(c, node->nd_value);
+	tcode_op(c, TC_setgvar, 0);
+	tcode_node(c, node);
+	break;
+
+      case NODE_CONST:
+	tcode_op(c, TC_getconst, 1);
+	tcode_node(c, node);
+	break;
+
+      case NODE_IF:
+	tcode_line(c, node);
+	tcode_compile_node(c, node->nd_cond);
+	l1 = tcode_jump(c, TC_branchunless, -1, 0);
+	tcode_compile_node(c, node->nd_body);
+	l2 = tcode_jump(c, TC_jump, -1, 0);
+	tcode_patch(c, l1);
+	tcode_compile_node(c, node->nd_else);
+	tcode_patch(c, l2);
+	break;
+
+      case NODE_AND:
+      case NODE_OR:
+	tcode_compile_node(c, node->nd_1st);
+	l1 = tcode_jump(c, nd_type(node) == NODE_AND ? TC_andjump : TC_orjump,
+			-1, 0);
+	tcode_compile_node(c, node->nd_2nd);
+	tcode_patch(c, l1);
+	break;
+
+      case NODE_NOT:
+	if (tcode_folded(c, node)) break;
+	tcode_compile_node(c, node->nd_body);
+	tcode_op(c, TC_not, 0);
+	break;
+
+      case NODE_WHILE:
+      case NODE_UNTIL:
+	/*
+	 * The loop runs in its own call of tcode_run(), from the stack
+	 * depth of the loop instruction:
+	 *
+	 *   redo: body; pop
+	 *   next: checkints; cond; branch to redo
+	 *         putnil
+	 *   brk:  leave
+	 */
+	tcode_op(c, TC_loop, 0);
+	ops = c->len;
+	tcode_num(c, 0);
+	tcode_num(c, 0);
+	tcode_num(c, 0);
+	tcode_num(c, 0);
+	loop.redo = tcode_label(c);
+	loop.next = loop.brk = 0;
+	loop.prev = c->loop;
+	c->loop = &loop;
+	tcode_compile_node(c, node->nd_body);
+	tcode_pop(c);
+	tcode_patch(c, loop.next);
+	l1 = tcode_label(c);
+	tcode_op(c, TC_checkints, 0);
+	tcode_compile_node(c, node->nd_cond);
+	tcode_op(c, nd_type(node) == NODE_WHILE ? TC_branchif : TC_branchunless,
+		 -1);
+	tcode_num(c, loop.redo);
+	tcode_op(c, TC_putnil, 1);
+	tcode_patch(c, loop.brk);
+	tcode_op(c, TC_leave, 0);
+	c->loop = loop.prev;
+	c->buf[ops].num = node->nd_state ? l1 : loop.redo;
+	c->buf[ops+1].num = loop.redo;
+	c->buf[ops+2].num = l1;
+	c->buf[ops+3].num = tcode_label(c);
+	break;
+
+      case NODE_BREAK:
+	tcode_compile_node(c, node->nd_stts);
+	if (c->loop) {
+	    c->loop->brk = tcode_jump(c, TC_jump, 0, c->loop->brk);
 	}
-	POP_TAG();
-	if (status == TAG_FATAL && ruby_errinfo == exception_error) {
-	    ruby_errinfo = mesg;
+	else {
+	    tcode_op(c, TC_breakjump, 0);
 	}
-	else if (status) {
-	    rb_thread_reset_raised(th);
-	    JUMP_TAG(status);
+	break;
+
+      case NODE_NEXT:
+	tcode_compile_node(c, node->nd_stts);
+	if (c->loop) {
+	    tcode_pop(c);
+	    tcode_op(c, TC_checkints, 0);
+	    c->loop->next = tcode_jump(c, TC_jumpbp, 1, c->loop->next);
 	}
-    }
+	else {
+	    tcode_op(c, TC_nextjump, 0);
+	}
+	break;
 
-    rb_trap_restore_mask();
-    if (tag != TAG_FATAL) {
-	EXEC_EVENT_HOOK(RUBY_EVENT_RAISE, ruby_current_node,
-			ruby_frame->self,
-			ruby_frame->last_func,
-			ruby_frame->last_class);
-    }
-    if (!prot_tag) {
-	error_print();
-    }
-    rb_thread_raised_clear(th);
-    JUMP_TAG(tag);
-}
+      case NODE_REDO:
+	if (c->loop) {
+	    tcode_op(c, TC_checkints, 0);
+	    tcode_op(c, TC_jumpbp, 1);
+	    tcode_num(c, c->loop->redo);
+	}
+	else {
+	    tcode_op(c, TC_redojump, 1);
+	}
+	break;
 
-void
-rb_exc_jump(mesg)
-    VALUE mesg;
-{
-    rb_thread_raised_clear(rb_curr_thread);
-    ruby_errinfo = mesg;
-    JUMP_TAG(TAG_RAISE);
-}
+      case NODE_RETURN:
+	tcode_compile_node(c, node->nd_stts);
+	tcode_op(c, c->loop ? TC_returnjump : TC_leave, 0);
+	break;
 
-void
-rb_exc_raise(mesg)
-    VALUE mesg;
-{
-    rb_longjmp(TAG_RAISE, mesg);
-}
+      case NODE_CALL:
+	if (!node->nd_cache) goto fallback;
+	if ((argc = tcode_argc(node->nd_args)) < 0) goto fallback;
+	if (tcode_folded(c, node)) break;
+	tcode_compile_node(c, CALL_RECV(node));
+	tcode_list(c, node->nd_args);
+	if (argc == 1) {
+	    switch (CALL_BOP(node->nd_cache, node->nd_mid)) {
+	      case BOP_PLUS:  op = TC_opt_plus;  break;
+	      case BOP_MINUS: op = TC_opt_minus; break;
+	      case BOP_LT:    op = TC_opt_lt;    break;
+	      case BOP_LE:    op = TC_opt_le;    break;
+	      case BOP_GT:    op = TC_opt_gt;    break;
+	      case BOP_GE:    op = TC_opt_ge;    break;
+	      case BOP_EQ:    op = TC_opt_eq;    break;
+	      case BOP_MULT:
+	      case BOP_AREF:  op = TC_opt_bop;   break;
+	      default:        op = -1;           break;
+	    }
+	    if (op >= 0) {
+		tcode_op(c, op, -1);
+		tcode_node(c, node);
+		break;
+	    }
+	}
+	tcode_op(c, TC_call, -argc);
+	tcode_node(c, node);
+	tcode_num(c, argc);
+	break;
 
-void
-rb_exc_fatal(mesg)
-    VALUE mesg;
-{
-    rb_longjmp(TAG_FATAL, mesg);
-}
+      case NODE_FCALL:
+	if ((argc = tcode_argc(node->nd_args)) < 0) goto fallback;
+	tcode_list(c, node->nd_args);
+	tcode_op(c, TC_fcall, 1-argc);
+	tcode_node(c, node);
+	tcode_num(c, argc);
+	break;
 
-void
-rb_interrupt()
-{
-    rb_raise(rb_eInterrupt, "");
-}
+      case NODE_VCALL:
+	tcode_op(c, TC_vcall, 1);
+	tcode_node(c, node);
+	break;
 
-/*
- *  call-seq:
- *     raise
- *     raise(string)
- *     raise(exception [, string [, array]])
- *     fail
- *     fail(string)
- *     fail(exception [, string [, array]])
- *  
- *  With no arguments, raises the exception in <code>$!</code> or raises
- *  a <code>RuntimeError</code> if <code>$!</code> is +nil+.
- *  With a single +String+ argument, raises a
- *  +RuntimeError+ with the string as a message. Otherwise,
- *  the first parameter should be the name of an +Exception+
- *  class (or an object that returns an +Exception+ object when sent
- *  an +exception+ message). The optional second parameter sets the
- *  message associated with the exception, and the third parameter is an
- *  array of callback information. Exceptions are caught by the
- *  +rescue+ clause of <code>begin...end</code> blocks.
- *     
- *     raise "Failed to create socket"
- *     raise ArgumentError, "No parameters", caller
- */
+      case NODE_ATTRASGN:
+	if (!node->nd_cache) goto fallback;
+	if ((argc = tcode_argc(node->nd_args)) <= 0) goto fallback;
+	if (CALL_RECV(node) == (NODE *)1) {
+	    tcode_op(c, TC_putself, 1);
+	}
+	else {
+	    tcode_compile_node(c, CALL_RECV(node));
+	}
+	tcode_list(c, node->nd_args);
+	tcode_op(c, TC_attrasgn, -argc);
+	tcode_node(c, node);
+	tcode_num(c, argc);
+	break;
 
-static VALUE
-rb_f_raise(argc, argv)
-    int argc;
-    VALUE *argv;
-{
-    rb_raise_jump(rb_make_exception(argc, argv));
-    return Qnil;		/* not reached */
-}
+      case NODE_YIELD:
+	if (node->nd_head) {
+	    tcode_compile_node(c, node->nd_head);
+	}
+	else {
+	    tcode_op(c, TC_putundef, 1);	/* no arg */
+	}
+	tcode_op(c, TC_yield, 0);
+	tcode_node(c, node);
+	break;
 
-static VALUE
-rb_make_exception(argc, argv)
-    int argc;
-    VALUE *argv;
-{
-    VALUE mesg;
-    ID exception;
-    int n;
+      case NODE_ZARRAY:
+      case NODE_ARRAY:
+	argc = nd_type(node) == NODE_ARRAY ? tcode_argc(node) : 0;
+	tcode_list(c, nd_type(node) == NODE_ARRAY ? node : 0);
+	tcode_op(c, TC_array, 1-argc);
+	tcode_num(c, argc);
+	break;
 
-    mesg = Qnil;
-    switch (argc) {
-      case 0:
-	mesg = Qnil;
+      case NODE_HASH:
+	if ((argc = tcode_argc(node->nd_head)) % 2) goto fallback;
+	tcode_list(c, node->nd_head);
+	tcode_op(c, TC_hash, 1-argc);
+	tcode_num(c, argc);
 	break;
-      case 1:
-	if (NIL_P(argv[0])) break;
-	if (TYPE(argv[0]) == T_STRING) {
-	    mesg = rb_exc_new3(rb_eRuntimeError, argv[0]);
-	    break;
-	}
-	n = 0;
-	goto exception_call;
 
-      case 2:
-      case 3:
-	n = 1;
-      exception_call:
-	exception = rb_intern("exception");
-	if (!rb_respond_to(argv[0], exception)) {
-	    rb_raise(rb_eTypeError, "exception class/object expected");
+      case NODE_DOT2:
+      case NODE_DOT3:
+	tcode_compile_node(c, node->nd_beg);
+	tcode_compile_node(c, node->nd_end);
+	tcode_op(c, TC_range, -1);
+	tcode_node(c, node);
+	break;
+
+      case NODE_DSTR:
+	argc = 0;
+	for (list = node->nd_next; list; list = list->nd_next) {
+	    if (list->nd_head && nd_type(list->nd_head) != NODE_STR) {
+		tcode_compile_node(c, list->nd_head);
+		argc++;
+	    }
 	}
-	mesg = rb_funcall(argv[0], exception, n, argv[1]);
+	tcode_op(c, TC_dstr, 1-argc);
+	tcode_node(c, node);
+	tcode_num(c, argc);
+	break;
+
+      case NODE_EVSTR:
+	tcode_compile_node(c, node->nd_body);
+	tcode_op(c, TC_evstr, 0);
 	break;
+
       default:
-	rb_raise(rb_eArgError, "wrong number of arguments");
+      fallback:
+	tcode_op(c, TC_eval, 1);
+	tcode_node(c, node);
 	break;
     }
-    if (argc > 0) {
-	if (!rb_obj_is_kind_of(mesg, rb_eException))
-	    rb_raise(rb_eTypeError, "exception object expected");
-	if (argc>2)
-	    set_backtrace(mesg, argv[2]);
-    }
-
-    return mesg;
 }
 
-static void
-rb_raise_jump(mesg)
-    VALUE mesg;
+static struct tcode*
+tcode_compile(node)
+    NODE *node;
 {
-    if (ruby_frame != top_frame) {
-	PUSH_FRAME();		/* fake frame */
-	*ruby_frame = *_frame.prev->prev;
-	rb_longjmp(TAG_RAISE, mesg);
-	POP_FRAME();
+    struct tcode_compiler c;
+    struct tcode *tc;
+
+#ifdef TCODE_THREADED
+    if (!tcode_labels) tcode_run(Qnil, 0, 0, 0);
+#endif
+    c.capa = 64;
+    c.buf = ALLOC_N(union tcode_word, c.capa);
+    c.len = c.depth = c.max = 0;
+    c.loop = 0;
+    c.last_op = c.prev_op = -1;
+    c.last = c.prev = 0;
+    c.target = -1;
+    tcode_compile_node(&c, node);
+    tcode_op(&c, TC_leave, 0);
+
+    tc = (struct tcode*)xmalloc(sizeof(struct tcode) +
+				sizeof(union tcode_word) * (c.len - 1));
+    tc->stack = c.max;
+    tc->len = c.len;
+    MEMCPY(tc->insns, c.buf, union tcode_word, c.len);
+    xfree(c.buf);
+    return tc;
+}
+
+/* the NODE_SCOPEs of called methods: their code once compiled, and
+   until then the number of calls, as (calls << 1 | 1) */
+static st_table *tcode_scopes;
+
+/* the compiled ones last run, so most calls need no table lookup */
+#define TCODE_RECENT 256
+#define TCODE_RECENT_IDX(scope) (((VALUE)(scope) >> 3) & (TCODE_RECENT - 1))
+static struct {
+    NODE *scope;
+    struct tcode *tc;
+} tcode_recent[TCODE_RECENT];
+
+/* counts a call of the method scope, compiling body, what is left of
+   it past the arguments, when hot; returns the code, or 0 */
+static struct tcode*
+tcode_hot(scope, body)
+    NODE *scope, *body;
+{
+    int i = TCODE_RECENT_IDX(scope);
+    st_data_t val;
+    long calls = 0;
+    struct tcode *tc;
+
+    if (tcode_recent[i].scope == scope) return tcode_recent[i].tc;
+    if (!tcode_scopes) tcode_scopes = st_init_numtable();
+    if (st_lookup(tcode_scopes, (st_data_t)scope, &val)) {
+	if (!(val & 1)) {
+	    tc = (struct tcode*)val;
+	    goto recent;
+	}
+	calls = (long)(val >> 1);
+    }
+    if (++calls < tcode_threshold) {
+	st_insert(tcode_scopes, (st_data_t)scope, (st_data_t)calls << 1 | 1);
+	return 0;
     }
-    rb_longjmp(TAG_RAISE, mesg);
+    tc = tcode_compile(body);
+    st_insert(tcode_scopes, (st_data_t)scope, (st_data_t)tc);
+  recent:
+    tcode_recent[i].scope = scope;
+    tcode_recent[i].tc = tc;
+    return tc;
 }
 
+/* called by the collector when a NODE_SCOPE is freed */
 void
-rb_jump_tag(tag)
-    int tag;
+rb_tcode_free(scope)
+    NODE *scope;
 {
-    JUMP_TAG(tag);
+    int i = TCODE_RECENT_IDX(scope);
+    st_data_t key = (st_data_t)scope, val;
+
+    if (tcode_recent[i].scope == scope) {
+	tcode_recent[i].scope = 0;
+    }
+    if (tcode_scopes && st_delete(tcode_scopes, &key, &val) && !(val & 1)) {
+	xfree((struct tcode*)val);
+    }
 }
 
-int
-rb_block_given_p()
+static VALUE
+tcode_eval(self, tc)
+    VALUE self;
+    struct tcode *tc;
 {
-    if (ruby_frame->iter == ITER_CUR && ruby_block)
-	return Qtrue;
-    return Qfalse;
+    VALUE *stack;
+    TMP_PROTECT;
+
+    stack = TMP_ALLOC(tc->stack + 1);
+    return tcode_run(self, tc, tc->insns, stack);
 }
 
-int
-rb_iterator_p()
+static void
+init_tcode()
 {
-    return rb_block_given_p();
+    char *ptr = getenv("RUBY_COMPILE_THRESHOLD"), *end;
+    long n;
+
+    if (ptr) {
+	n = strtol(ptr, &end, 10);
+	if (end != ptr && !*end && n >= 0) tcode_threshold = n;
+    }
 }
 
-/*
- *  call-seq:
- *     block_given?   => true or false
- *     iterator?      => true or false
- *  
- *  Returns <code>true</code> if <code>yield</code> would execute a
- *  block in the current context. The <code>iterator?</code> form
- *  is mildly deprecated.
- *     
- *     def try
- *       if block_given?
- *         yield
- *       else
- *         "no block"
- *       end
- *     end
- *     try                  #=> "no block"
- *     try { "hello" }      #=> "hello"
- *     try do "hello" end   #=> "hello"
- */
-
-
 static VALUE
-rb_f_block_given_p()
+module_setup(module, n)
+    VALUE module;
+    NODE *n;
 {
-    if (ruby_frame->prev && ruby_frame->prev->iter == ITER_CUR && ruby_block)
-	return Qtrue;
-    return Qfalse;
-}
+    NODE * volatile node = n->nd_body;
+    int state;
+    struct FRAME frame;
+    VALUE result = Qnil;	/* OK */
+    TMP_PROTECT;
 
-VALUE rb_eThreadError;
+    frame = *ruby_frame;
+    frame.tmp = ruby_frame;
+    ruby_frame = &frame;
 
-NORETURN(static void proc_jump_error(int, VALUE));
-static void
-proc_jump_error(state, result)
-    int state;
-    VALUE result;
-{
-    char mesg[32];
-    char *statement;
+    PUSH_CLASS(module);
+    PUSH_SCOPE();
+    PUSH_VARS();
 
-    switch (state) {
-      case TAG_BREAK:
-	statement = "break"; break;
-      case TAG_RETURN:
-	statement = "return"; break;
-      case TAG_RETRY:
-	statement = "retry"; break;
-      default:
-	statement = "local-jump"; break; /* should not happen */
+    if (node->nd_tbl) {
+	VALUE *vars = TMP_ALLOC(node->nd_tbl[0]+1);
+	*vars++ = (VALUE)node;
+	ruby_scope->local_vars = vars;
+	rb_mem_clear(ruby_scope->local_vars, node->nd_tbl[0]);
+	ruby_scope->local_tbl = node->nd_tbl;
+    }
+    else {
+	ruby_scope->local_vars = 0;
+	ruby_scope->local_tbl  = 0;
     }
-    snprintf(mesg, sizeof mesg, "%s from proc-closure", statement);
-    localjump_error(mesg, result, state);
-}
-
-static void
-return_jump(retval)
-    VALUE retval;
-{
-    struct tag *tt = prot_tag;
-    int yield = Qfalse;
 
-    if (retval == Qundef) retval = Qnil;
-    while (tt) {
-	if (tt->tag == PROT_YIELD) {
-	    yield = Qtrue;
-	    tt = tt->prev;
-	}
-	if (tt->tag == PROT_FUNC && tt->frame->uniq == ruby_frame->uniq) {
-	    tt->dst = (VALUE)ruby_frame->uniq;
-	    tt->retval = retval;
-	    JUMP_TAG(TAG_RETURN);
-	}
-	if (tt->tag == PROT_LAMBDA && !yield) {
-	    tt->dst = (VALUE)tt->frame->uniq;
-	    tt->retval = retval;
-	    JUMP_TAG(TAG_RETURN);
-	}
-	if (tt->tag == PROT_THREAD) {
-	    rb_raise(rb_eThreadError, "return can't jump across threads");
-	}
-	tt = tt->prev;
+    PUSH_CREF(module);
+    PUSH_TAG(PROT_NONE);
+    if ((state = EXEC_TAG()) == 0) {
+	EXEC_EVENT_HOOK(RUBY_EVENT_CLASS, n, ruby_cbase,
+			ruby_frame->last_func, ruby_frame->last_class);
+	result = rb_eval(ruby_cbase, node->nd_next);
     }
-    localjump_error("unexpected return", retval, TAG_RETURN);
+    POP_TAG();
+    POP_CREF();
+    POP_VARS();
+    POP_SCOPE();
+    POP_CLASS();
+
+    ruby_frame = frame.tmp;
+    EXEC_EVENT_HOOK(RUBY_EVENT_END, n, 0,
+		    ruby_frame->last_func, ruby_frame->last_class);
+    if (state) JUMP_TAG(state);
+
+    return result;
 }
 
-static void
-break_jump(retval)
-    VALUE retval;
+static NODE *basic_respond_to = 0;
+
+int
+rb_obj_respond_to(obj, id, priv)
+    VALUE obj;
+    ID id;
+    int priv;
 {
-    struct tag *tt = prot_tag;
+    VALUE klass = CLASS_OF(obj);
 
-    if (retval == Qundef) retval = Qnil;
-    while (tt) {
-	switch (tt->tag) {
-	  case PROT_THREAD:
-	  case PROT_YIELD:
-	  case PROT_LOOP:
-	  case PROT_LAMBDA:
-	    tt->dst = (VALUE)tt->frame->uniq;
-	    tt->retval = retval;
-	    JUMP_TAG(TAG_BREAK);
-	    break;
-	  case PROT_FUNC:
-	    tt = 0;
-	    continue;
-	  default:
-	    break;
-	}
-	tt = tt->prev;
+    if (rb_method_node(klass, respond_to) == basic_respond_to) {
+	return rb_method_boundp(klass, id, !priv);
+    }
+    else {
+	VALUE args[2];
+	int n = 0;
+	args[n++] = ID2SYM(id);
+	if (priv) args[n++] = Qtrue;
+	return RTEST(rb_funcall2(obj, respond_to, n, args));
     }
-    localjump_error("unexpected break", retval, TAG_BREAK);
 }
 
-static void
-next_jump(retval)
-    VALUE retval;
+int
+rb_respond_to(obj, id)
+    VALUE obj;
+    ID id;
 {
-    struct tag *tt = prot_tag;
-
-    if (retval == Qundef) retval = Qnil;
-    while (tt) {
-	switch (tt->tag) {
-	  case PROT_THREAD:
-	  case PROT_YIELD:
-	  case PROT_LOOP:
-	  case PROT_LAMBDA:
-	  case PROT_FUNC:
-	    tt->dst = (VALUE)tt->frame->uniq;
-	    tt->retval = retval;
-	    JUMP_TAG(TAG_NEXT);
-	    break;
-	  default:
-	    break;
-	}
-	tt = tt->prev;
-    }
-    localjump_error("unexpected next", retval, TAG_NEXT);
+    return rb_obj_respond_to(obj, id, Qfalse);
 }
 
-void
-rb_need_block()
+/*
+ *  call-seq:
+ *     obj.respond_to?(symbol, include_private=false) => true or false
+ *  
+ *  Returns +true+> if _obj_ responds to the given
+ *  method. Private methods are included in the search only if the
+ *  optional second parameter evaluates to +true+.
+ */
+
+static VALUE
+obj_respond_to(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
 {
-    if (!rb_block_given_p()) {
-	localjump_error("no block given", Qnil, 0);
+    VALUE mid, priv;
+    ID id;
+
+    rb_scan_args(argc, argv, "11", &mid, &priv);
+    id = rb_to_id(mid);
+    if (rb_method_boundp(CLASS_OF(obj), id, !RTEST(priv))) {
+	return Qtrue;
     }
+    return Qfalse;
 }
 
+/*
+ *  call-seq:
+ *     mod.method_defined?(symbol)    => true or false
+ *  
+ *  Returns +true+ if the named method is defined by
+ *  _mod_ (or its included modules and, if _mod_ is a class,
+ *  its ancestors). Public and protected methods are matched.
+ *     
+ *     module A
+ *       def method1()  end
+ *     end
+ *     class B
+ *       def method2()  end
+ *     end
+ *     class C < B
+ *       include A
+ *       def method3()  end
+ *     end
+ *     
+ *     A.method_defined? :method1    #=> true
+ *     C.method_defined? "method1"   #=> true
+ *     C.method_defined? "method2"   #=> true
+ *     C.method_defined? "method3"   #=> true
+ *     C.method_defined? "method4"   #=> false
+ */
+
 static VALUE
-rb_yield_0(val, self, klass, flags, avalue)
-    VALUE val, self, klass;	/* OK */
-    int flags, avalue;
+rb_mod_method_defined(mod, mid)
+    VALUE mod, mid;
 {
-    NODE *node;
-    volatile VALUE result = Qnil;
-    volatile VALUE old_cref;
-    volatile VALUE old_wrapper;
-    struct BLOCK * volatile block;
-    struct SCOPE * volatile old_scope;
-    int old_vmode;
-    struct FRAME frame;
-    NODE *cnode = ruby_current_node;
-    int lambda = flags & YIELD_LAMBDA_CALL;
-    int state;
+    return rb_method_boundp(mod, rb_to_id(mid), 1);
+}
 
-    rb_need_block();
+#define VISI_CHECK(x,f) (((x)&NOEX_MASK) == (f))
 
-    PUSH_VARS();
-    block = ruby_block;
-    frame = block->frame;
-    frame.prev = ruby_frame;
+/*
+ *  call-seq:
+ *     mod.public_method_defined?(symbol)   => true or false
+ *  
+ *  Returns +true+ if the named public method is defined by
+ *  _mod_ (or its included modules and, if _mod_ is a class,
+ *  its ancestors).
+ *     
+ *     module A
+ *       def method1()  end
+ *     end
+ *     class B
+ *       protected
+ *       def method2()  end
+ *     end
+ *     class C < B
+ *       include A
+ *       def method3()  end
+ *     end
+ *     
+ *     A.method_defined? :method1           #=> true
+ *     C.public_method_defined? "method1"   #=> true
+ *     C.public_method_defined? "method2"   #=> false
+ *     C.method_defined? "method2"          #=> true
+ */
+
+static VALUE
+rb_mod_public_method_defined(mod, mid)
+    VALUE mod, mid;
+{
+    ID id = rb_to_id(mid);
+    int noex;
+
+    if (rb_get_method_body(&mod, &id, &noex)) {
+	if (VISI_CHECK(noex, NOEX_PUBLIC))
+	    return Qtrue;
+    }
+    return Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     mod.private_method_defined?(symbol)    => true or false
+ *  
+ *  Returns +true+ if the named private method is defined by
+ *  _ mod_ (or its included modules and, if _mod_ is a class,
+ *  its ancestors).
+ *     
+ *     module A
+ *       def method1()  end
+ *     end
+ *     class B
+ *       private
+ *       def method2()  end
+ *     end
+ *     class C < B
+ *       include A
+ *       def method3()  end
+ *     end
+ *     
+ *     A.method_defined? :method1            #=> true
+ *     C.private_method_defined? "method1"   #=> false
+ *     C.private_method_defined? "method2"   #=> true
+ *     C.method_defined? "method2"           #=> false
+ */
+
+static VALUE
+rb_mod_private_method_defined(mod, mid)
+    VALUE mod, mid;
+{
+    ID id = rb_to_id(mid);
+    int noex;
+
+    if (rb_get_method_body(&mod, &id, &noex)) {
+	if (VISI_CHECK(noex, NOEX_PRIVATE))
+	    return Qtrue;
+    }
+    return Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     mod.protected_method_defined?(symbol)   => true or false
+ *  
+ *  Returns +true+ if the named protected method is defined
+ *  by _mod_ (or its included modules and, if _mod_ is a
+ *  class, its ancestors).
+ *     
+ *     module A
+ *       def method1()  end
+ *     end
+ *     class B
+ *       protected
+ *       def method2()  end
+ *     end
+ *     class C < B
+ *       include A
+ *       def method3()  end
+ *     end
+ *     
+ *     A.method_defined? :method1              #=> true
+ *     C.protected_method_defined? "method1"   #=> false
+ *     C.protected_method_defined? "method2"   #=> true
+ *     C.method_defined? "method2"             #=> true
+ */
+
+static VALUE
+rb_mod_protected_method_defined(mod, mid)
+    VALUE mod, mid;
+{
+    ID id = rb_to_id(mid);
+    int noex;
+
+    if (rb_get_method_body(&mod, &id, &noex)) {
+	if (VISI_CHECK(noex, NOEX_PROTECTED))
+	    return Qtrue;
+    }
+    return Qfalse;
+}
+
+NORETURN(static VALUE terminate_process _((int, VALUE)));
+static VALUE
+terminate_process(status, mesg)
+    int status;
+    VALUE mesg;
+{
+    VALUE args[2];
+    args[0] = INT2NUM(status);
+    args[1] = mesg;
+
+    rb_exc_raise(rb_class_new_instance(2, args, rb_eSystemExit));
+}
+
+void
+rb_exit(status)
+    int status;
+{
+    if (prot_tag) {
+	terminate_process(status, rb_str_new("exit", 4));
+    }
+    ruby_finalize();
+    exit(status);
+}
+
+
+/*
+ *  call-seq:
+ *     exit(integer=0)
+ *     Kernel::exit(integer=0)
+ *     Process::exit(integer=0)
+ *  
+ *  Initiates the termination of the Ruby script by raising the
+ *  <code>SystemExit</code> exception. This exception may be caught. The
+ *  optional parameter is used to return a status code to the invoking
+ *  environment.
+ *     
+ *     begin
+ *       exit
+ *       puts "never get here"
+ *     rescue SystemExit
+ *       puts "rescued a SystemExit exception"
+ *     end
+ *     puts "after begin block"
+ *     
+ *  <em>produces:</em>
+ *     
+ *     rescued a SystemExit exception
+ *     after begin block
+ *     
+ *  Just prior to termination, Ruby executes any <code>at_exit</code> functions
+ *  (see Kernel::at_exit) and runs any object finalizers (see
+ *  ObjectSpace::define_finalizer).
+ *     
+ *     at_exit { puts "at_exit function" }
+ *     ObjectSpace.define_finalizer("string",  proc { puts "in finalizer" })
+ *     exit
+ *     
+ *  <em>produces:</em>
+ *     
+ *     at_exit function
+ *     in finalizer
+ */
+
+VALUE
+rb_f_exit(argc, argv)
+    int argc;
+    VALUE *argv;
+{
+    VALUE status;
+    int istatus;
+
+    rb_secure(4);
+    if (rb_scan_args(argc, argv, "01", &status) == 1) {
+	switch (status) {
+	  case Qtrue:
+	    istatus = EXIT_SUCCESS;
+	    break;
+	  case Qfalse:
+	    istatus = EXIT_FAILURE;
+	    break;
+	  default:
+	    istatus = NUM2INT(status);
+#if EXIT_SUCCESS != 0
+	    if (istatus == 0) istatus = EXIT_SUCCESS;
+#endif
+	    break;
+	}
+    }
+    else {
+	istatus = EXIT_SUCCESS;
+    }
+    rb_exit(istatus);
+    return Qnil;		/* not reached */
+}
+
+
+/*
+ *  call-seq:
+ *     abort
+ *     Kernel::abort
+ *     Process::abort
+ *  
+ *  Terminate execution immediately, effectively by calling
+ *  <code>Kernel.exit(1)</code>. If _msg_ is given, it is written
+ *  to STDERR prior to terminating.
+ */
+
+VALUE
+rb_f_abort(argc, argv)
+    int argc;
+    VALUE *argv;
+{
+    rb_secure(4);
+    if (argc == 0) {
+	if (!NIL_P(ruby_errinfo)) {
+	    error_print();
+	}
+	rb_exit(EXIT_FAILURE);
+    }
+    else {
+	VALUE mesg;
+
+	rb_scan_args(argc, argv, "1", &mesg);
+	StringValue(mesg);
+	rb_io_puts(1, &mesg, rb_stderr);
+	terminate_process(EXIT_FAILURE, mesg);
+    }
+    return Qnil;		/* not reached */
+}
+
+void
+rb_iter_break()
+{
+    break_jump(Qnil);
+}
+
+NORETURN(static void rb_longjmp _((int, VALUE)));
+static VALUE make_backtrace _((void));
+
+static void
+rb_longjmp(tag, mesg)
+    int tag;
+    VALUE mesg;
+{
+    VALUE at;
+    rb_thread_t th = curr_thread;
+
+    if (rb_thread_set_raised(th)) {
+	ruby_errinfo = exception_error;
+	JUMP_TAG(TAG_FATAL);
+    }
+    if (NIL_P(mesg)) mesg = ruby_errinfo;
+    if (NIL_P(mesg)) {
+	mesg = rb_exc_new(rb_eRuntimeError, 0, 0);
+    }
+
+    ruby_set_current_source();
+    if (ruby_sourcefile && !NIL_P(mesg)) {
+	at = get_backtrace(mesg);
+	if (NIL_P(at)) {
+	    at = make_backtrace();
+	    if (OBJ_FROZEN(mesg)) {
+		mesg = rb_obj_dup(mesg);
+	    }
+	    set_backtrace(mesg, at);
+	}
+    }
+    if (!NIL_P(mesg)) {
+	ruby_errinfo = mesg;
+    }
+
+    if (RTEST(ruby_debug) && !NIL_P(ruby_errinfo)
+	&& !rb_obj_is_kind_of(ruby_errinfo, rb_eSystemExit)) {
+	VALUE e = ruby_errinfo;
+	int status;
+
+	PUSH_TAG(PROT_NONE);
+	if ((status = EXEC_TAG()) == 0) {
+	    StringValue(e);
+	    warn_printf("Exception `%s' at %s:%d - %s\n",
+			rb_obj_classname(ruby_errinfo),
+			ruby_sourcefile, ruby_sourceline,
+			RSTRING(e)->ptr);
+	}
+	POP_TAG();
+	if (status == TAG_FATAL && ruby_errinfo == exception_error) {
+	    ruby_errinfo = mesg;
+	}
+	else if (status) {
+	    rb_thread_reset_raised(th);
+	    JUMP_TAG(status);
+	}
+    }
+
+    rb_trap_restore_mask();
+    if (tag != TAG_FATAL) {
+	EXEC_EVENT_HOOK(RUBY_EVENT_RAISE, ruby_current_node,
+			ruby_frame->self,
+			ruby_frame->last_func,
+			ruby_frame->last_class);
+    }
+    if (!prot_tag) {
+	error_print();
+    }
+    rb_thread_raised_clear(th);
+    JUMP_TAG(tag);
+}
+
+void
+rb_exc_jump(mesg)
+    VALUE mesg;
+{
+    rb_thread_raised_clear(rb_curr_thread);
+    ruby_errinfo = mesg;
+    JUMP_TAG(TAG_RAISE);
+}
+
+void
+rb_exc_raise(mesg)
+    VALUE mesg;
+{
+    rb_longjmp(TAG_RAISE, mesg);
+}
+
+void
+rb_exc_fatal(mesg)
+    VALUE mesg;
+{
+    rb_longjmp(TAG_FATAL, mesg);
+}
+
+void
+rb_interrupt()
+{
+    rb_raise(rb_eInterrupt, "");
+}
+
+/*
+ *  call-seq:
+ *     raise
+ *     raise(string)
+ *     raise(exception [, string [, array]])
+ *     fail
+ *     fail(string)
+ *     fail(exception [, string [, array]])
+ *  
+ *  With no arguments, raises the exception in <code>$!</code> or raises
+ *  a <code>RuntimeError</code> if <code>$!</code> is +nil+.
+ *  With a single +String+ argument, raises a
+ *  +RuntimeError+ with the string as a message. Otherwise,
+ *  the first parameter should be the name of an +Exception+
+ *  class (or an object that returns an +Exception+ object when sent
+ *  an +exception+ message). The optional second parameter sets the
+ *  message associated with the exception, and the third parameter is an
+ *  array of callback information. Exceptions are caught by the
+ *  +rescue+ clause of <code>begin...end</code> blocks.
+ *     
+ *     raise "Failed to create socket"
+ *     raise ArgumentError, "No parameters", caller
+ */
+
+static VALUE
+rb_f_raise(argc, argv)
+    int argc;
+    VALUE *argv;
+{
+    rb_raise_jump(rb_make_exception(argc, argv));
+    return Qnil;		/* not reached */
+}
+
+static VALUE
+rb_make_exception(argc, argv)
+    int argc;
+    VALUE *argv;
+{
+    VALUE mesg;
+    ID exception;
+    int n;
+
+    mesg = Qnil;
+    switch (argc) {
+      case 0:
+	mesg = Qnil;
+	break;
+      case 1:
+	if (NIL_P(argv[0])) break;
+	if (TYPE(argv[0]) == T_STRING) {
+	    mesg = rb_exc_new3(rb_eRuntimeError, argv[0]);
+	    break;
+	}
+	n = 0;
+	goto exception_call;
+
+      case 2:
+      case 3:
+	n = 1;
+      exception_call:
+	exception = rb_intern("exception");
+	if (!rb_respond_to(argv[0], exception)) {
+	    rb_raise(rb_eTypeError, "exception class/object expected");
+	}
+	mesg = rb_funcall(argv[0], exception, n, argv[1]);
+	break;
+      default:
+	rb_raise(rb_eArgError, "wrong number of arguments");
+	break;
+    }
+    if (argc > 0) {
+	if (!rb_obj_is_kind_of(mesg, rb_eException))
+	    rb_raise(rb_eTypeError, "exception object expected");
+	if (argc>2)
+	    set_backtrace(mesg, argv[2]);
+    }
+
+    return mesg;
+}
+
+static void
+rb_raise_jump(mesg)
+    VALUE mesg;
+{
+    if (ruby_frame != top_frame) {
+	PUSH_FRAME();		/* fake frame */
+	*ruby_frame = *_frame.prev->prev;
+	rb_longjmp(TAG_RAISE, mesg);
+	POP_FRAME();
+    }
+    rb_longjmp(TAG_RAISE, mesg);
+}
+
+void
+rb_jump_tag(tag)
+    int tag;
+{
+    JUMP_TAG(tag);
+}
+
+int
+rb_block_given_p()
+{
+    if (ruby_frame->iter == ITER_CUR && ruby_block)
+	return Qtrue;
+    return Qfalse;
+}
+
+int
+rb_iterator_p()
+{
+    return rb_block_given_p();
+}
+
+/*
+ *  call-seq:
+ *     block_given?   => true or false
+ *     iterator?      => true or false
+ *  
+ *  Returns <code>true</code> if <code>yield</code> would execute a
+ *  block in the current context. The <code>iterator?</code> form
+ *  is mildly deprecated.
+ *     
+ *     def try
+ *       if block_given?
+ *         yield
+ *       else
+ *         "no block"
+ *       end
+ *     end
+ *     try                  #=> "no block"
+ *     try { "hello" }      #=> "hello"
+ *     try do "hello" end   #=> "hello"
+ */
+
+
+static VALUE
+rb_f_block_given_p()
+{
+    if (ruby_frame->prev && ruby_frame->prev->iter == ITER_CUR && ruby_block)
+	return Qtrue;
+    return Qfalse;
+}
+
+VALUE rb_eThreadError;
+
+NORETURN(static void proc_jump_error(int, VALUE));
+static void
+proc_jump_error(state, result)
+    int state;
+    VALUE result;
+{
+    char mesg[32];
+    char *statement;
+
+    switch (state) {
+      case TAG_BREAK:
+	statement = "break"; break;
+      case TAG_RETURN:
+	statement = "return"; break;
+      case TAG_RETRY:
+	statement = "retry"; break;
+      default:
+	statement = "local-jump"; break; /* should not happen */
+    }
+    snprintf(mesg, sizeof mesg, "%s from proc-closure", statement);
+    localjump_error(mesg, result, state);
+}
+
+static void
+return_jump(retval)
+    VALUE retval;
+{
+    struct tag *tt = prot_tag;
+    int yield = Qfalse;
+
+    if (retval == Qundef) retval = Qnil;
+    while (tt) {
+	if (tt->tag == PROT_YIELD) {
+	    yield = Qtrue;
+	    tt = tt->prev;
+	}
+	if (tt->tag == PROT_FUNC && tt->frame->uniq == ruby_frame->uniq) {
+	    tt->dst = (VALUE)ruby_frame->uniq;
+	    tt->retval = retval;
+	    JUMP_TAG(TAG_RETURN);
+	}
+	if (tt->tag == PROT_LAMBDA && !yield) {
+	    tt->dst = (VALUE)tt->frame->uniq;
+	    tt->retval = retval;
+	    JUMP_TAG(TAG_RETURN);
+	}
+	if (tt->tag == PROT_THREAD) {
+	    rb_raise(rb_eThreadError, "return can't jump across threads");
+	}
+	tt = tt->prev;
+    }
+    localjump_error("unexpected return", retval, TAG_RETURN);
+}
+
+static void
+break_jump(retval)
+    VALUE retval;
+{
+    struct tag *tt = prot_tag;
+
+    if (retval == Qundef) retval = Qnil;
+    while (tt) {
+	switch (tt->tag) {
+	  case PROT_THREAD:
+	  case PROT_YIELD:
+	  case PROT_LOOP:
+	  case PROT_LAMBDA:
+	    tt->dst = (VALUE)tt->frame->uniq;
+	    tt->retval = retval;
+	    JUMP_TAG(TAG_BREAK);
+	    break;
+	  case PROT_FUNC:
+	    tt = 0;
+	    continue;
+	  default:
+	    break;
+	}
+	tt = tt->prev;
+    }
+    localjump_error("unexpected break", retval, TAG_BREAK);
+}
+
+static void
+next_jump(retval)
+    VALUE retval;
+{
+    struct tag *tt = prot_tag;
+
+    if (retval == Qundef) retval = Qnil;
+    while (tt) {
+	switch (tt->tag) {
+	  case PROT_THREAD:
+	  case PROT_YIELD:
+	  case PROT_LOOP:
+	  case PROT_LAMBDA:
+	  case PROT_FUNC:
+	    tt->dst = (VALUE)tt->frame->uniq;
+	    tt->retval = retval;
+	    JUMP_TAG(TAG_NEXT);
+	    break;
+	  default:
+	    break;
+	}
+	tt = tt->prev;
+    }
+    localjump_error("unexpected next", retval, TAG_NEXT);
+}
+
+void
+rb_need_block()
+{
+    if (!rb_block_given_p()) {
+	localjump_error("no block given", Qnil, 0);
+    }
+}
+
+static VALUE
+rb_yield_0(val, self, klass, flags, avalue)
+    VALUE val, self, klass;	/* OK */
+    int flags, avalue;
+{
+    NODE *node;
+    volatile VALUE result = Qnil;
+    volatile VALUE old_cref;
+    volatile VALUE old_wrapper;
+    struct BLOCK * volatile block;
+    struct SCOPE * volatile old_scope;
+    int old_vmode;
+    struct FRAME frame;
+    NODE *cnode = ruby_current_node;
+    int lambda = flags & YIELD_LAMBDA_CALL;
+    int state;
+
+    rb_need_block();
+
+    PUSH_VARS();
+    block = ruby_block;
+    frame = block->frame;
+    frame.prev = ruby_frame;
     frame.node = cnode;
     ruby_frame = &(frame);
     old_cref = (VALUE)ruby_cref;
@@ -4953,4959 +6654,5696 @@ rb_yield_0(val, self, klass, flags, avalue)
     old_wrapper = ruby_wrapper;
     ruby_wrapper = block->wrapper;
     old_scope = ruby_scope;
-    ruby_scope = block->scope;
+    ruby_scope = SCOPE_FORWARD(block->scope);
     old_vmode = scope_vmode;
     scope_vmode = (flags & YIELD_PUBLIC_DEF) ? SCOPE_PUBLIC : block->vmode;
     ruby_block = block->prev;
     if (block->flags & BLOCK_D_SCOPE) {
 	/* put place holder for dynamic (in-block) local variables */
-	ruby_dyna_vars = new_dvar(0, 0, block->dyna_vars);
+	struct RVarmap *vars = block->spare_vars;
+
+	block->spare_vars = 0;
+	if (vars && !FL_TEST(vars, DVAR_DONT_RECYCLE)) {
+	    /* left by the last yield, with its parameter if any */
+	    ruby_dyna_vars = vars;
+	}
+	else {
+	    ruby_dyna_vars = new_dvar(0, 0, block->dyna_vars);
+	}
+    }
+    else {
+	/* FOR does not introduce new scope */
+	ruby_dyna_vars = block->dyna_vars;
+    }
+    PUSH_CLASS(klass ? klass : block->klass);
+    if (!klass) {
+	self = block->self;
+    }
+    node = block->body;
+
+    if (block->var == (NODE*)1 && !lambda) {
+	/* no parameter || */
+    }
+    else if (block->var > (NODE*)2 && nd_type(block->var) == NODE_DASGN_CURR &&
+	     (avalue ? RARRAY(val)->len == 1 : val != Qundef)) {
+	/* nothing to check or warn about, so no tag either */
+	dvar_asgn_curr(block->var->nd_vid, avalue ? RARRAY(val)->ptr[0] : val);
+    }
+    else if (block->var) {
+	PUSH_TAG(PROT_NONE);
+	if ((state = EXEC_TAG()) == 0) {
+	    if (block->var == (NODE*)1) { /* no parameter || */
+		if (lambda && RARRAY(val)->len != 0) {
+		    rb_raise(rb_eArgError, "wrong number of arguments (%ld for 0)",
+			     RARRAY(val)->len);
+		}
+	    }
+	    else if (block->var == (NODE*)2) {
+		if (TYPE(val) == T_ARRAY && RARRAY(val)->len != 0) {
+		    rb_raise(rb_eArgError, "wrong number of arguments (%ld for 0)",
+			     RARRAY(val)->len);
+		}
+	    }
+	    else if (nd_type(block->var) == NODE_MASGN) {
+		if (!avalue) {
+		    val = svalue_to_mrhs(val, block->var->nd_head);
+		}
+		massign(self, block->var, val, lambda);
+	    }
+	    else {
+		int len = 0;
+		if (avalue) {
+		    len = RARRAY(val)->len;
+		    if (len == 0) {
+			goto zero_arg;
+		    }
+		    if (len == 1) {
+			val = RARRAY(val)->ptr[0];
+		    }
+		    else {
+			goto multi_values;
+		    }
+		}
+		else if (val == Qundef) {
+		  zero_arg:
+		    val = Qnil;
+		  multi_values:
+		    {
+			ruby_current_node = block->var;
+			rb_warn("multiple values for a block parameter (%d for 1)\n\tfrom %s:%d",
+				len, cnode->nd_file, nd_line(cnode));
+			ruby_current_node = cnode;
+		    }
+		}
+		assign(self, block->var, val, lambda);
+	    }
+	}
+	POP_TAG();
+	if (state) goto pop_state;
+    }
+    if (!node) {
+	state = 0;
+	goto pop_state;
+    }
+    ruby_current_node = node;
+
+    PUSH_ITER(block->iter);
+    PUSH_TAG(lambda ? PROT_NONE : PROT_YIELD);
+    if ((state = EXEC_TAG()) == 0) {
+      redo:
+	if (nd_type(node) == NODE_CFUNC || nd_type(node) == NODE_IFUNC) {
+	    if (node->nd_state == YIELD_FUNC_AVALUE) {
+		if (!avalue) {
+		    val = svalue_to_avalue(val);
+		}
+	    }
+	    else {
+		if (avalue) {
+		    val = avalue_to_svalue(val);
+		}
+		if (val == Qundef && node->nd_state != YIELD_FUNC_SVALUE)
+		    val = Qnil;
+	    }
+	    result = (*node->nd_cfnc)(val, node->nd_tval, self);
+	}
+	else {
+	    result = rb_eval(self, node);
+	}
+    }
+    else {
+	switch (state) {
+	  case TAG_REDO:
+	    state = 0;
+	    CHECK_INTS;
+	    goto redo;
+	  case TAG_NEXT:
+	    if (!lambda) {
+		state = 0;
+		result = prot_tag->retval;
+	    }
+	    break;
+	  case TAG_BREAK:
+	    if (TAG_DST()) {
+		result = prot_tag->retval;
+	    }
+	    else {
+		lambda = Qtrue;	/* just pass TAG_BREAK */
+	    }
+	    break;
+	  default:
+	    break;
+	}
+    }
+    POP_TAG();
+    POP_ITER();
+  pop_state:
+    POP_CLASS();
+    if (ruby_dyna_vars && (block->flags & BLOCK_D_SCOPE) &&
+	!FL_TEST(ruby_dyna_vars, DVAR_DONT_RECYCLE)) {
+	struct RVarmap *vars = ruby_dyna_vars;
+
+	if (ruby_dyna_vars->id == 0) {
+	    struct RVarmap *param = 0;
+
+	    vars = ruby_dyna_vars->next;
+	    while (vars && vars->id != 0 && vars != block->dyna_vars) {
+		struct RVarmap *tmp = vars->next;
+		if (tmp == block->dyna_vars && block->var > (NODE*)2 &&
+		    nd_type(block->var) == NODE_DASGN_CURR &&
+		    vars->id == block->var->nd_vid) {
+		    /* assigned first, so it is the last one */
+		    param = vars;
+		}
+		else {
+		    rb_gc_force_recycle((VALUE)vars);
+		}
+		vars = tmp;
+	    }
+	    if (block->flags & BLOCK_STACK) {
+		/* keep the place holder and parameter for the next yield */
+		if (param) {
+		    param->val = Qnil;
+		    ruby_dyna_vars->next = param;
+		}
+		else {
+		    ruby_dyna_vars->next = block->dyna_vars;
+		}
+		block->spare_vars = ruby_dyna_vars;
+	    }
+	    else {
+		if (param) rb_gc_force_recycle((VALUE)param);
+		rb_gc_force_recycle((VALUE)ruby_dyna_vars);
+	    }
+	}
+    }
+    POP_VARS();
+    ruby_block = block;
+    ruby_frame = ruby_frame->prev;
+    ruby_cref = (NODE*)old_cref;
+    ruby_wrapper = old_wrapper;
+    if (ruby_scope->flags & SCOPE_DONT_RECYCLE)
+	scope_dup(old_scope);
+    ruby_scope = SCOPE_FORWARD(old_scope);
+    scope_vmode = old_vmode;
+    switch (state) {
+      case 0:
+	break;
+      case TAG_BREAK:
+	if (!lambda) {
+	    struct tag *tt = prot_tag;
+
+	    while (tt) {
+		if (tt->tag == PROT_LOOP && tt->blkid == ruby_block->uniq) {
+		    tt->dst = (VALUE)tt->frame->uniq;
+		    tt->retval = result;
+		    JUMP_TAG(TAG_BREAK);
+		}
+		tt = tt->prev;
+	    }
+	    proc_jump_error(TAG_BREAK, result);
+	}
+	/* fall through */
+      default:
+	JUMP_TAG(state);
+	break;
+    }
+    ruby_current_node = cnode;
+    return result;
+}
+
+VALUE
+rb_yield(val)
+    VALUE val;
+{
+    return rb_yield_0(val, 0, 0, 0, Qfalse);
+}
+
+VALUE
+#ifdef HAVE_STDARG_PROTOTYPES
+rb_yield_values(int n, ...)
+#else
+rb_yield_values(n, va_alist)
+    int n;
+    va_dcl
+#endif
+{
+    va_list args;
+    VALUE ary;
+
+    if (n == 0) {
+	return rb_yield_0(Qundef, 0, 0, 0, Qfalse);
+    }
+    ary = rb_ary_new2(n);
+    va_init_list(args, n);
+    while (n--) {
+	rb_ary_push(ary, va_arg(args, VALUE));
+    }
+    va_end(args);
+    return rb_yield_0(ary, 0, 0, 0, Qtrue);
+}
+
+VALUE
+rb_yield_splat(values)
+    VALUE values;
+{
+    int avalue = Qfalse;
+
+    if (TYPE(values) == T_ARRAY) {
+	if (RARRAY(values)->len == 0) {
+	    values = Qundef;
+	}
+	else {
+	    avalue = Qtrue;
+	}
+    }
+    return rb_yield_0(values, 0, 0, 0, avalue);
+}
+
+/*
+ *  call-seq:
+ *     loop {|| block } 
+ *  
+ *  Repeatedly executes the block.
+ *     
+ *     loop do
+ *       print "Input: "
+ *       line = gets
+ *       break if !line or line =~ /^qQ/
+ *       # ...
+ *     end
+ */
+
+static VALUE
+rb_f_loop()
+{
+    for (;;) {
+	rb_yield_0(Qundef, 0, 0, 0, Qfalse);
+	CHECK_INTS;
+    }
+    return Qnil;		/* dummy */
+}
+
+static VALUE
+massign(self, node, val, pcall)
+    VALUE self;
+    NODE *node;
+    VALUE val;
+    int pcall;
+{
+    NODE *list;
+    long i = 0, len;
+
+    len = RARRAY(val)->len;
+    list = node->nd_head;
+    for (; list && i<len; i++) {
+	assign(self, list->nd_head, RARRAY(val)->ptr[i], pcall);
+	list = list->nd_next;
+    }
+    if (pcall && list) goto arg_error;
+    if (node->nd_args) {
+	if ((long)(node->nd_args) == -1) {
+	    /* no check for mere `*' */
+	}
+	else if (!list && i<len) {
+	    assign(self, node->nd_args, rb_ary_new4(len-i, RARRAY(val)->ptr+i), pcall);
+	}
+	else {
+	    assign(self, node->nd_args, rb_ary_new2(0), pcall);
+	}
+    }
+    else if (pcall && i < len) {
+	goto arg_error;
+    }
+
+    while (list) {
+	i++;
+	assign(self, list->nd_head, Qnil, pcall);
+	list = list->nd_next;
+    }
+    return val;
+
+  arg_error:
+    while (list) {
+	i++;
+	list = list->nd_next;
+    }
+    rb_raise(rb_eArgError, "wrong number of arguments (%ld for %ld)", len, i);
+}
+
+static void
+assign(self, lhs, val, pcall)
+    VALUE self;
+    NODE *lhs;
+    VALUE val;
+    int pcall;
+{
+    ruby_current_node = lhs;
+    if (val == Qundef) {
+	rb_warning("assigning void value");
+	val = Qnil;
+    }
+    switch (nd_type(lhs)) {
+      case NODE_GASGN:
+	rb_gvar_set(lhs->nd_entry, val);
+	break;
+
+      case NODE_IASGN:
+	ivar_set_cached(lhs, self, val);
+	break;
+
+      case NODE_LASGN:
+	if (ruby_scope->local_vars == 0)
+	    rb_bug("unexpected local variable assignment");
+	ruby_scope->local_vars[lhs->nd_cnt] = val;
+	break;
+
+      case NODE_DASGN:
+	dvar_asgn(lhs->nd_vid, val);
+	break;
+
+      case NODE_DASGN_CURR:
+	dvar_asgn_curr(lhs->nd_vid, val);
+	break;
+
+      case NODE_CDECL:
+	if (lhs->nd_vid == 0) {
+	    rb_const_set(class_prefix(self, lhs->nd_else), lhs->nd_else->nd_mid, val);
+	}
+	else {
+	    rb_const_set(ruby_cbase, lhs->nd_vid, val);
+	}
+	break;
+
+      case NODE_CVDECL:
+	if (RTEST(ruby_verbose) && FL_TEST(ruby_cbase, FL_SINGLETON)) {
+	    rb_warn("declaring singleton class variable");
+	}
+	rb_cvar_set(cvar_cbase(), lhs->nd_vid, val, Qtrue);
+	break;
+
+      case NODE_CVASGN:
+	rb_cvar_set(cvar_cbase(), lhs->nd_vid, val, Qfalse);
+	break;
+
+      case NODE_MASGN:
+	massign(self, lhs, svalue_to_mrhs(val, lhs->nd_head), pcall);
+	break;
+
+      case NODE_CALL:
+      case NODE_ATTRASGN:
+	{
+	    VALUE recv;
+	    int scope;
+	    if (CALL_RECV(lhs) == (NODE *)1) {
+		recv = self;
+		scope = 1;
+	    }
+	    else {
+		recv = rb_eval(self, CALL_RECV(lhs));
+		scope = 0;
+	    }
+	    if (!lhs->nd_args) {
+		/* attr set */
+		ruby_current_node = lhs;
+		SET_CURRENT_SOURCE();
+		rb_call_cached(lhs->nd_cache, CLASS_OF(recv), recv, lhs->nd_mid,
+			       1, &val, scope, self);
+	    }
+	    else {
+		/* array set */
+		VALUE args;
+
+		args = rb_eval(self, lhs->nd_args);
+		rb_ary_push(args, val);
+		ruby_current_node = lhs;
+		SET_CURRENT_SOURCE();
+		rb_call_cached(lhs->nd_cache, CLASS_OF(recv), recv, lhs->nd_mid,
+			       RARRAY(args)->len, RARRAY(args)->ptr, scope, self);
+	    }
+	}
+	break;
+
+      default:
+	rb_bug("bug in variable assignment");
+	break;
+    }
+}
+
+VALUE
+rb_iterate(it_proc, data1, bl_proc, data2)
+    VALUE (*it_proc) _((VALUE)), (*bl_proc)(ANYARGS);
+    VALUE data1, data2;
+{
+    int state;
+    volatile VALUE retval = Qnil;
+    NODE *node = NEW_IFUNC(bl_proc, data2);
+    VALUE self = ruby_top_self;
+
+    PUSH_TAG(PROT_LOOP);
+    PUSH_BLOCK(0, node);
+    PUSH_ITER(ITER_PRE);
+    state = EXEC_TAG();
+    if (state == 0) {
+  iter_retry:
+	retval = (*it_proc)(data1);
+    }
+    else if (state == TAG_BREAK && TAG_DST()) {
+	retval = prot_tag->retval;
+	state = 0;
+    }
+    else if (state == TAG_RETRY) {
+	state = 0;
+	goto iter_retry;
+    }
+    POP_ITER();
+    POP_BLOCK();
+    POP_TAG();
+
+    switch (state) {
+      case 0:
+	break;
+      default:
+	JUMP_TAG(state);
+    }
+    return retval;
+}
+
+static int
+handle_rescue(self, node)
+    VALUE self;
+    NODE *node;
+{
+    int argc; VALUE *argv; /* used in SETUP_ARGS */
+    TMP_PROTECT;
+
+    if (!node->nd_args) {
+	return rb_obj_is_kind_of(ruby_errinfo, rb_eStandardError);
+    }
+
+    BEGIN_CALLARGS;
+    SETUP_ARGS(node->nd_args);
+    END_CALLARGS;
+
+    while (argc--) {
+	if (!rb_obj_is_kind_of(argv[0], rb_cModule)) {
+	    rb_raise(rb_eTypeError, "class or module required for rescue clause");
+	}
+	if (RTEST(rb_funcall(*argv, eqq, 1, ruby_errinfo))) return 1;
+	argv++;
+    }
+    return 0;
+}
+
+VALUE
+#ifdef HAVE_STDARG_PROTOTYPES
+rb_rescue2(VALUE (*b_proc)(ANYARGS), VALUE data1, VALUE (*r_proc)(ANYARGS), VALUE data2, ...)
+#else
+rb_rescue2(b_proc, data1, r_proc, data2, va_alist)
+    VALUE (*b_proc)(ANYARGS), (*r_proc)(ANYARGS);
+    VALUE data1, data2;
+    va_dcl
+#endif
+{
+    int state;
+    volatile VALUE result;
+    volatile VALUE e_info = ruby_errinfo;
+    volatile int handle = Qfalse;
+    VALUE eclass;
+    va_list args;
+
+    PUSH_TAG(PROT_NONE);
+    switch (state = EXEC_TAG()) {
+      case TAG_RETRY:
+	if (!handle) break;
+	handle = Qfalse;
+	state = 0;
+	ruby_errinfo = Qnil;
+      case 0:
+	result = (*b_proc)(data1);
+	break;
+      case TAG_RAISE:
+	if (handle) break;
+	handle = Qfalse;
+	va_init_list(args, data2);
+	while ((eclass = va_arg(args, VALUE)) != 0) {
+	    if (rb_obj_is_kind_of(ruby_errinfo, eclass)) {
+		handle = Qtrue;
+		break;
+	    }
+	}
+	va_end(args);
+
+	if (handle) {
+	    state = 0;
+	    if (r_proc) {
+		result = (*r_proc)(data2, ruby_errinfo);
+	    }
+	    else {
+		result = Qnil;
+	    }
+	    ruby_errinfo = e_info;
+	}
+    }
+    POP_TAG();
+    if (state) JUMP_TAG(state);
+
+    return result;
+}
+
+VALUE
+rb_rescue(b_proc, data1, r_proc, data2)
+    VALUE (*b_proc)(), (*r_proc)();
+    VALUE data1, data2;
+{
+    return rb_rescue2(b_proc, data1, r_proc, data2, rb_eStandardError, (VALUE)0);
+}
+
+static VALUE cont_protect;
+
+VALUE
+rb_protect(proc, data, state)
+    VALUE (*proc) _((VALUE));
+    VALUE data;
+    int *state;
+{
+    VALUE result = Qnil;	/* OK */
+    int status;
+
+    PUSH_TAG(PROT_NONE);
+    cont_protect = (VALUE)rb_node_newnode(NODE_MEMO, cont_protect, 0, 0);
+    if ((status = EXEC_TAG()) == 0) {
+	result = (*proc)(data);
+    }
+    cont_protect = ((NODE *)cont_protect)->u1.value;
+    POP_TAG();
+    if (state) {
+	*state = status;
+    }
+    if (status != 0) {
+	return Qnil;
+    }
+
+    return result;
+}
+
+VALUE
+rb_ensure(b_proc, data1, e_proc, data2)
+    VALUE (*b_proc)();
+    VALUE data1;
+    VALUE (*e_proc)();
+    VALUE data2;
+{
+    int state;
+    volatile VALUE result = Qnil;
+    VALUE retval;
+
+    PUSH_TAG(PROT_NONE);
+    if ((state = EXEC_TAG()) == 0) {
+	result = (*b_proc)(data1);
+    }
+    POP_TAG();
+    retval = prot_tag ? prot_tag->retval : Qnil;	/* save retval */
+    if (!thread_no_ensure()) {
+	(*e_proc)(data2);
+    }
+    if (prot_tag) return_value(retval);
+    if (state) JUMP_TAG(state);
+    return result;
+}
+
+VALUE
+rb_with_disable_interrupt(proc, data)
+    VALUE (*proc)();
+    VALUE data;
+{
+    VALUE result = Qnil;	/* OK */
+    int status;
+
+    DEFER_INTS;
+    {
+	int thr_critical = rb_thread_critical;
+
+	rb_thread_critical = Qtrue;
+	PUSH_TAG(PROT_NONE);
+	if ((status = EXEC_TAG()) == 0) {
+	    result = (*proc)(data);
+	}
+	POP_TAG();
+	rb_thread_critical = thr_critical;
+    }
+    ENABLE_INTS;
+    if (status) JUMP_TAG(status);
+
+    return result;
+}
+
+static void
+stack_check()
+{
+    rb_thread_t th = rb_curr_thread;
+
+    if (!th) return;		/* threads not initialized yet */
+    if (!rb_thread_raised_p(th, RAISED_STACKOVERFLOW) && ruby_stack_check()) {
+	rb_thread_raised_set(th, RAISED_STACKOVERFLOW);
+	rb_exc_raise(sysstack_error);
+    }
+}
+
+static int last_call_status;
+
+#define CSTAT_PRIV  1
+#define CSTAT_PROT  2
+#define CSTAT_VCALL 4
+#define CSTAT_SUPER 8
+
+/*
+ *  call-seq:
+ *     obj.method_missing(symbol [, *args] )   => result
+ *  
+ *  Invoked by Ruby when <i>obj</i> is sent a message it cannot handle.
+ *  <i>symbol</i> is the symbol for the method called, and <i>args</i>
+ *  are any arguments that were passed to it. By default, the interpreter
+ *  raises an error when this method is called. However, it is possible
+ *  to override the method to provide more dynamic behavior.
+ *  The example below creates
+ *  a class <code>Roman</code>, which responds to methods with names
+ *  consisting of roman numerals, returning the corresponding integer
+ *  values.
+ *     
+ *     class Roman
+ *       def romanToInt(str)
+ *         # ...
+ *       end
+ *       def method_missing(methId)
+ *         str = methId.id2name
+ *         romanToInt(str)
+ *       end
+ *     end
+ *     
+ *     r = Roman.new
+ *     r.iv      #=> 4
+ *     r.xxiii   #=> 23
+ *     r.mm      #=> 2000
+ */
+
+static VALUE
+rb_method_missing(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    ID id;
+    VALUE exc = rb_eNoMethodError;
+    char *format = 0;
+    NODE *cnode = ruby_current_node;
+
+    if (argc == 0 || !SYMBOL_P(argv[0])) {
+	rb_raise(rb_eArgError, "no id given");
+    }
+
+    stack_check();
+
+    id = SYM2ID(argv[0]);
+
+    if (last_call_status & CSTAT_PRIV) {
+	format = "private method `%s' called for %s";
+    }
+    else if (last_call_status & CSTAT_PROT) {
+	format = "protected method `%s' called for %s";
+    }
+    else if (last_call_status & CSTAT_VCALL) {
+	format = "undefined local variable or method `%s' for %s";
+	exc = rb_eNameError;
+    }
+    else if (last_call_status & CSTAT_SUPER) {
+	format = "super: no superclass method `%s'";
+    }
+    if (!format) {
+	format = "undefined method `%s' for %s";
+    }
+
+    ruby_current_node = cnode;
+    {
+	int n = 0;
+	VALUE args[3];
+
+	args[n++] = rb_funcall(rb_const_get(exc, rb_intern("message")), '!',
+			       3, rb_str_new2(format), obj, argv[0]);
+	args[n++] = argv[0];
+	if (exc == rb_eNoMethodError) {
+	    args[n++] = rb_ary_new4(argc-1, argv+1);
+	}
+	exc = rb_class_new_instance(n, args, exc);
+	ruby_frame = ruby_frame->prev; /* pop frame for "method_missing" */
+	rb_exc_raise(exc);
+    }
+
+    return Qnil;		/* not reached */
+}
+
+static VALUE
+method_missing(obj, id, argc, argv, call_status)
+    VALUE obj;
+    ID    id;
+    int   argc;
+    const VALUE *argv;
+    int   call_status;
+{
+    VALUE *nargv;
+
+    last_call_status = call_status;
+
+    if (id == missing) {
+	PUSH_FRAME();
+	rb_method_missing(argc, argv, obj);
+	POP_FRAME();
+    }
+    else if (id == ID_ALLOCATOR) {
+	rb_raise(rb_eTypeError, "allocator undefined for %s", rb_class2name(obj));
+    }
+    if (argc < 0) {
+	VALUE tmp;
+
+	argc = -argc-1;
+	tmp = splat_value(argv[argc]);
+	nargv = ALLOCA_N(VALUE, argc + RARRAY(tmp)->len + 1);
+	MEMCPY(nargv+1, argv, VALUE, argc);
+	MEMCPY(nargv+1+argc, RARRAY(tmp)->ptr, VALUE, RARRAY(tmp)->len);
+	argc += RARRAY(tmp)->len;
+    }
+    else {
+	nargv = ALLOCA_N(VALUE, argc+1);
+	MEMCPY(nargv+1, argv, VALUE, argc);
     }
-    else {
-	/* FOR does not introduce new scope */
-	ruby_dyna_vars = block->dyna_vars;
+    nargv[0] = ID2SYM(id);
+    return rb_funcall2(obj, missing, argc+1, nargv);
+}
+
+static inline VALUE
+call_cfunc(func, recv, len, argc, argv)
+    VALUE (*func)();
+    VALUE recv;
+    int len, argc;
+    VALUE *argv;
+{
+    if (len >= 0 && argc != len) {
+	rb_raise(rb_eArgError, "wrong number of arguments (%d for %d)",
+		 argc, len);
     }
-    PUSH_CLASS(klass ? klass : block->klass);
-    if (!klass) {
-	self = block->self;
+
+    switch (len) {
+      case -2:
+	return (*func)(recv, rb_ary_new4(argc, argv));
+	break;
+      case -1:
+	return (*func)(argc, argv, recv);
+	break;
+      case 0:
+	return (*func)(recv);
+	break;
+      case 1:
+	return (*func)(recv, argv[0]);
+	break;
+      case 2:
+	return (*func)(recv, argv[0], argv[1]);
+	break;
+      case 3:
+	return (*func)(recv, argv[0], argv[1], argv[2]);
+	break;
+      case 4:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3]);
+	break;
+      case 5:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4]);
+	break;
+      case 6:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
+		       argv[5]);
+	break;
+      case 7:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
+		       argv[5], argv[6]);
+	break;
+      case 8:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
+		       argv[5], argv[6], argv[7]);
+	break;
+      case 9:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
+		       argv[5], argv[6], argv[7], argv[8]);
+	break;
+      case 10:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
+		       argv[5], argv[6], argv[7], argv[8], argv[9]);
+	break;
+      case 11:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
+		       argv[5], argv[6], argv[7], argv[8], argv[9], argv[10]);
+	break;
+      case 12:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
+		       argv[5], argv[6], argv[7], argv[8], argv[9],
+		       argv[10], argv[11]);
+	break;
+      case 13:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
+		       argv[5], argv[6], argv[7], argv[8], argv[9], argv[10],
+		       argv[11], argv[12]);
+	break;
+      case 14:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
+		       argv[5], argv[6], argv[7], argv[8], argv[9], argv[10],
+		       argv[11], argv[12], argv[13]);
+	break;
+      case 15:
+	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
+		       argv[5], argv[6], argv[7], argv[8], argv[9], argv[10],
+		       argv[11], argv[12], argv[13], argv[14]);
+	break;
+      default:
+	rb_raise(rb_eArgError, "too many arguments (%d)", len);
+	break;
     }
-    node = block->body;
+    return Qnil;		/* not reached */
+}
 
-    if (block->var) {
-	PUSH_TAG(PROT_NONE);
-	if ((state = EXEC_TAG()) == 0) {
-	    if (block->var == (NODE*)1) { /* no parameter || */
-		if (lambda && RARRAY(val)->len != 0) {
-		    rb_raise(rb_eArgError, "wrong number of arguments (%ld for 0)",
-			     RARRAY(val)->len);
-		}
-	    }
-	    else if (block->var == (NODE*)2) {
-		if (TYPE(val) == T_ARRAY && RARRAY(val)->len != 0) {
-		    rb_raise(rb_eArgError, "wrong number of arguments (%ld for 0)",
-			     RARRAY(val)->len);
-		}
-	    }
-	    else if (nd_type(block->var) == NODE_MASGN) {
-		if (!avalue) {
-		    val = svalue_to_mrhs(val, block->var->nd_head);
-		}
-		massign(self, block->var, val, lambda);
-	    }
-	    else {
-		int len = 0;
-		if (avalue) {
-		    len = RARRAY(val)->len;
-		    if (len == 0) {
-			goto zero_arg;
-		    }
-		    if (len == 1) {
-			val = RARRAY(val)->ptr[0];
-		    }
-		    else {
-			goto multi_values;
-		    }
-		}
-		else if (val == Qundef) {
-		  zero_arg:
-		    val = Qnil;
-		  multi_values:
-		    {
-			ruby_current_node = block->var;
-			rb_warn("multiple values for a block parameter (%d for 1)\n\tfrom %s:%d",
-				len, cnode->nd_file, nd_line(cnode));
-			ruby_current_node = cnode;
-		    }
-		}
-		assign(self, block->var, val, lambda);
-	    }
-	}
-	POP_TAG();
-	if (state) goto pop_state;
+static VALUE
+rb_call0(klass, recv, id, oid, argc, argv, body, flags)
+    VALUE klass, recv;
+    ID    id;
+    ID    oid;
+    int argc;			/* OK */
+    VALUE *argv;		/* OK */
+    NODE * volatile body;
+    int flags;
+{
+    NODE *b2;		/* OK */
+    volatile VALUE result = Qnil;
+    int itr;
+    static int tick;
+    TMP_PROTECT;
+    volatile int safe = -1;
+
+    if (NOEX_SAFE(flags) > ruby_safe_level && NOEX_SAFE(flags) > 2) {
+	rb_raise(rb_eSecurityError, "calling insecure method: %s",
+		 rb_id2name(id));
     }
-    if (!node) {
-	state = 0;
-	goto pop_state;
+    switch (ruby_iter->iter) {
+      case ITER_PRE:
+      case ITER_PAS:
+	itr = ITER_CUR;
+	break;
+      case ITER_CUR:
+      default:
+	itr = ITER_NOT;
+	break;
     }
-    ruby_current_node = node;
 
-    PUSH_ITER(block->iter);
-    PUSH_TAG(lambda ? PROT_NONE : PROT_YIELD);
-    if ((state = EXEC_TAG()) == 0) {
-      redo:
-	if (nd_type(node) == NODE_CFUNC || nd_type(node) == NODE_IFUNC) {
-	    if (node->nd_state == YIELD_FUNC_AVALUE) {
-		if (!avalue) {
-		    val = svalue_to_avalue(val);
-		}
-	    }
-	    else {
-		if (avalue) {
-		    val = avalue_to_svalue(val);
-		}
-		if (val == Qundef && node->nd_state != YIELD_FUNC_SVALUE)
-		    val = Qnil;
-	    }
-	    result = (*node->nd_cfnc)(val, node->nd_tval, self);
-	}
-	else {
-	    result = rb_eval(self, node);
+    if ((++tick & 0x1f) == 0) {
+	/* a level of recursion may take only one call here, since basic
+	   operators need none, so look at the stack more often */
+	if ((tick & 0xff) == 0) {
+	    CHECK_INTS;		/* better than nothing */
+	    rb_gc_finalize_deferred();
 	}
+	stack_check();
     }
-    else {
-	switch (state) {
-	  case TAG_REDO:
-	    state = 0;
-	    CHECK_INTS;
-	    goto redo;
-	  case TAG_NEXT:
-	    if (!lambda) {
-		state = 0;
-		result = prot_tag->retval;
+    if (argc < 0) {
+	VALUE tmp;
+	VALUE *nargv;
+
+	argc = -argc-1;
+	tmp = splat_value(argv[argc]);
+	nargv = TMP_ALLOC(argc + RARRAY(tmp)->len);
+	MEMCPY(nargv, argv, VALUE, argc);
+	MEMCPY(nargv+argc, RARRAY(tmp)->ptr, VALUE, RARRAY(tmp)->len);
+	argc += RARRAY(tmp)->len;
+	argv = nargv;
+    }
+    PUSH_ITER(itr);
+    PUSH_FRAME();
+
+    ruby_frame->last_func = id;
+    ruby_frame->orig_func = oid;
+    ruby_frame->last_class = (flags & NOEX_NOSUPER)?0:klass;
+    ruby_frame->self = recv;
+    ruby_frame->argc = argc;
+    ruby_frame->flags = 0;
+
+    switch (nd_type(body)) {
+      case NODE_CFUNC:
+	{
+	    int len = body->nd_argc;
+
+	    if (len < -2) {
+		rb_bug("bad argc (%d) specified for `%s(%s)'",
+		       len, rb_class2name(klass), rb_id2name(id));
 	    }
-	    break;
-	  case TAG_BREAK:
-	    if (TAG_DST()) {
-		result = prot_tag->retval;
+	    if (event_hooks) {
+		int state;
+
+		EXEC_EVENT_HOOK(RUBY_EVENT_C_CALL, ruby_current_node,
+				recv, id, klass);
+		PUSH_TAG(PROT_FUNC);
+		if ((state = EXEC_TAG()) == 0) {
+		    result = call_cfunc(body->nd_cfnc, recv, len, argc, argv);
+		}
+		POP_TAG();
+		ruby_current_node = ruby_frame->node;
+		EXEC_EVENT_HOOK(RUBY_EVENT_C_RETURN, ruby_current_node,
+				recv, id, klass);
+		if (state) JUMP_TAG(state);
 	    }
 	    else {
-		lambda = Qtrue;	/* just pass TAG_BREAK */
+		result = call_cfunc(body->nd_cfnc, recv, len, argc, argv);
 	    }
-	    break;
-	  default:
-	    break;
 	}
-    }
-    POP_TAG();
-    POP_ITER();
-  pop_state:
-    POP_CLASS();
-    if (ruby_dyna_vars && (block->flags & BLOCK_D_SCOPE) &&
-	!FL_TEST(ruby_dyna_vars, DVAR_DONT_RECYCLE)) {
-	struct RVarmap *vars = ruby_dyna_vars;
+	break;
 
-	if (ruby_dyna_vars->id == 0) {
-	    vars = ruby_dyna_vars->next;
-	    rb_gc_force_recycle((VALUE)ruby_dyna_vars);
-	    while (vars && vars->id != 0 && vars != block->dyna_vars) {
-		struct RVarmap *tmp = vars->next;
-		rb_gc_force_recycle((VALUE)vars);
-		vars = tmp;
-	    }
+	/* for attr get/set */
+      case NODE_IVAR:
+	if (argc != 0) {
+	    rb_raise(rb_eArgError, "wrong number of arguments (%d for 0)", argc);
 	}
-    }
-    POP_VARS();
-    ruby_block = block;
-    ruby_frame = ruby_frame->prev;
-    ruby_cref = (NODE*)old_cref;
-    ruby_wrapper = old_wrapper;
-    if (ruby_scope->flags & SCOPE_DONT_RECYCLE)
-	scope_dup(old_scope);
-    ruby_scope = old_scope;
-    scope_vmode = old_vmode;
-    switch (state) {
-      case 0:
+	result = ivar_get_cached(body, recv, Qfalse);
 	break;
-      case TAG_BREAK:
-	if (!lambda) {
-	    struct tag *tt = prot_tag;
 
-	    while (tt) {
-		if (tt->tag == PROT_LOOP && tt->blkid == ruby_block->uniq) {
-		    tt->dst = (VALUE)tt->frame->uniq;
-		    tt->retval = result;
-		    JUMP_TAG(TAG_BREAK);
-		}
-		tt = tt->prev;
-	    }
-	    proc_jump_error(TAG_BREAK, result);
+      case NODE_ATTRSET:
+	if (argc != 1)
+	    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+	result = ivar_set_cached(body, recv, argv[0]);
+	break;
+
+      case NODE_ZSUPER:
+	result = rb_call_super(argc, argv);
+	break;
+
+      case NODE_DMETHOD:
+	result = method_call(argc, argv, umethod_bind(body->nd_cval, recv));
+	break;
+
+      case NODE_BMETHOD:
+	ruby_frame->flags |= FRAME_DMETH;
+	if (event_hooks) {
+	    struct BLOCK *data;
+	    Data_Get_Struct(body->nd_cval, struct BLOCK, data);
+	    EXEC_EVENT_HOOK(RUBY_EVENT_CALL, data->body, recv, id, klass);
+	}
+	result = proc_invoke(body->nd_cval, rb_ary_new4(argc, argv), recv, klass);
+	if (event_hooks) {
+	    EXEC_EVENT_HOOK(RUBY_EVENT_RETURN, body, recv, id, klass);
 	}
-	/* fall through */
-      default:
-	JUMP_TAG(state);
 	break;
-    }
-    ruby_current_node = cnode;
-    return result;
-}
 
-VALUE
-rb_yield(val)
-    VALUE val;
-{
-    return rb_yield_0(val, 0, 0, 0, Qfalse);
-}
+      case NODE_SCOPE:
+	{
+	    int state;
+	    VALUE *local_vars;	/* OK */
+	    NODE *saved_cref = 0;
+	    NODE *scope = body;
+	    struct tcode *tc;
 
-VALUE
-#ifdef HAVE_STDARG_PROTOTYPES
-rb_yield_values(int n, ...)
-#else
-rb_yield_values(n, va_alist)
-    int n;
-    va_dcl
-#endif
-{
-    va_list args;
-    VALUE ary;
+	    PUSH_STACK_SCOPE();
+	    if (body->nd_rval) {
+		saved_cref = ruby_cref;
+		ruby_cref = (NODE*)body->nd_rval;
+	    }
+	    PUSH_CLASS(ruby_cbase);
+	    if (body->nd_tbl) {
+		local_vars = TMP_ALLOC(body->nd_tbl[0]+1);
+		*local_vars++ = (VALUE)body;
+		rb_mem_clear(local_vars, body->nd_tbl[0]);
+		ruby_scope->local_tbl = body->nd_tbl;
+		ruby_scope->local_vars = local_vars;
+	    }
+	    else {
+		local_vars = ruby_scope->local_vars = 0;
+		ruby_scope->local_tbl  = 0;
+	    }
+	    b2 = body = body->nd_next;
 
-    if (n == 0) {
-	return rb_yield_0(Qundef, 0, 0, 0, Qfalse);
-    }
-    ary = rb_ary_new2(n);
-    va_init_list(args, n);
-    while (n--) {
-	rb_ary_push(ary, va_arg(args, VALUE));
-    }
-    va_end(args);
-    return rb_yield_0(ary, 0, 0, 0, Qtrue);
-}
+	    if (NOEX_SAFE(flags) > ruby_safe_level) {
+		safe = ruby_safe_level;
+		ruby_safe_level = NOEX_SAFE(flags);
+	    }
+	    PUSH_VARS();
+	    PUSH_TAG(PROT_FUNC);
+	    if ((state = EXEC_TAG()) == 0) {
+		NODE *node = 0;
+		int i, nopt = 0;
 
-VALUE
-rb_yield_splat(values)
-    VALUE values;
-{
-    int avalue = Qfalse;
+		if (nd_type(body) == NODE_ARGS) {
+		    node = body;
+		    body = 0;
+		}
+		else if (nd_type(body) == NODE_BLOCK) {
+		    node = body->nd_head;
+		    body = body->nd_next;
+		}
+		if (node) {
+		    if (nd_type(node) != NODE_ARGS) {
+			rb_bug("no argument-node");
+		    }
 
-    if (TYPE(values) == T_ARRAY) {
-	if (RARRAY(values)->len == 0) {
-	    values = Qundef;
-	}
-	else {
-	    avalue = Qtrue;
+		    i = node->nd_cnt;
+		    if (i > argc) {
+			rb_raise(rb_eArgError, "wrong number of arguments (%d for %d)",
+				 argc, i);
+		    }
+		    if (!node->nd_rest) {
+			NODE *optnode = node->nd_opt;
+
+			nopt = i;
+			while (optnode) {
+			    nopt++;
+			    optnode = optnode->nd_next;
+			}
+			if (nopt < argc) {
+			    rb_raise(rb_eArgError,
+				     "wrong number of arguments (%d for %d)",
+				     argc, nopt);
+			}
+		    }
+		    if (local_vars) {
+			if (i > 0) {
+			    /* +2 for $_ and $~ */
+			    MEMCPY(local_vars+2, argv, VALUE, i);
+			}
+		    }
+		    argv += i; argc -= i;
+		    if (node->nd_opt) {
+			NODE *opt = node->nd_opt;
+
+			while (opt && argc) {
+			    assign(recv, opt->nd_head, *argv, 1);
+			    argv++; argc--;
+			    ++i;
+			    opt = opt->nd_next;
+			}
+			if (opt) {
+			    rb_eval(recv, opt);
+			    while (opt) {
+				opt = opt->nd_next;
+				++i;
+			    }
+			}
+		    }
+		    if (!node->nd_rest) {
+			i = nopt;
+		    }
+		    else {
+			VALUE v;
+			
+			if (argc > 0) {
+			    v = rb_ary_new4(argc,argv);
+			    i = -i - 1;
+			}
+			else {
+			    v = rb_ary_new2(0);
+			}
+			assign(recv, node->nd_rest, v, 1);
+		    }
+		    ruby_frame->argc = i;
+		}
+		if (event_hooks) {
+		    EXEC_EVENT_HOOK(RUBY_EVENT_CALL, b2, recv, id, klass);
+		}
+		if (tcode_threshold > 0 && (tc = tcode_hot(scope, body)) != 0) {
+		    result = tcode_eval(recv, tc);
+		}
+		else {
+		    result = rb_eval(recv, body);
+		}
+	    }
+	    else if (state == TAG_RETURN && TAG_DST()) {
+		result = prot_tag->retval;
+		state = 0;
+	    }
+	    POP_TAG();
+	    if (event_hooks) {
+		EXEC_EVENT_HOOK(RUBY_EVENT_RETURN, body, recv, id, klass);
+	    }
+	    POP_VARS();
+	    POP_CLASS();
+	    POP_SCOPE();
+	    ruby_cref = saved_cref;
+	    if (safe >= 0) ruby_safe_level = safe;
+	    switch (state) {
+	      case 0:
+		break;
+
+	      case TAG_BREAK:
+	      case TAG_RETURN:
+		JUMP_TAG(state);
+		break;
+
+	      case TAG_RETRY:
+		if (rb_block_given_p()) JUMP_TAG(state);
+		/* fall through */
+	      default:
+		jump_tag_but_local_jump(state, result);
+		break;
+	    }
 	}
-    }
-    return rb_yield_0(values, 0, 0, 0, avalue);
-}
-
-/*
- *  call-seq:
- *     loop {|| block } 
- *  
- *  Repeatedly executes the block.
- *     
- *     loop do
- *       print "Input: "
- *       line = gets
- *       break if !line or line =~ /^qQ/
- *       # ...
- *     end
- */
+	break;
 
-static VALUE
-rb_f_loop()
-{
-    for (;;) {
-	rb_yield_0(Qundef, 0, 0, 0, Qfalse);
-	CHECK_INTS;
+      default:
+	unknown_node(body);
+	break;
     }
-    return Qnil;		/* dummy */
+    POP_FRAME();
+    POP_ITER();
+    return result;
 }
 
 static VALUE
-massign(self, node, val, pcall)
+rb_call_cached(cc, klass, recv, mid, argc, argv, scope, self)
+    struct call_cache *cc;
+    VALUE klass, recv;
+    ID    mid;
+    int argc;			/* OK */
+    const VALUE *argv;		/* OK */
+    int scope;
     VALUE self;
-    NODE *node;
-    VALUE val;
-    int pcall;
 {
-    NODE *list;
-    long i = 0, len;
-
-    len = RARRAY(val)->len;
-    list = node->nd_head;
-    for (; list && i<len; i++) {
-	assign(self, list->nd_head, RARRAY(val)->ptr[i], pcall);
-	list = list->nd_next;
-    }
-    if (pcall && list) goto arg_error;
-    if (node->nd_args) {
-	if ((long)(node->nd_args) == -1) {
-	    /* no check for mere `*' */
-	}
-	else if (!list && i<len) {
-	    assign(self, node->nd_args, rb_ary_new4(len-i, RARRAY(val)->ptr+i), pcall);
-	}
-	else {
-	    assign(self, node->nd_args, rb_ary_new2(0), pcall);
-	}
-    }
-    else if (pcall && i < len) {
-	goto arg_error;
-    }
-
-    while (list) {
-	i++;
-	assign(self, list->nd_head, Qnil, pcall);
-	list = list->nd_next;
-    }
-    return val;
+    NODE  *body;		/* OK */
+    int    noex;
+    ID     id = mid;
+    struct cache_entry *ent;
 
-  arg_error:
-    while (list) {
-	i++;
-	list = list->nd_next;
+    if (!klass) {
+	rb_raise(rb_eNotImpError, "method `%s' called on terminated object (0x%lx)",
+		 rb_id2name(mid), recv);
     }
-    rb_raise(rb_eArgError, "wrong number of arguments (%ld for %ld)", len, i);
-}
-
-static void
-assign(self, lhs, val, pcall)
-    VALUE self;
-    NODE *lhs;
-    VALUE val;
-    int pcall;
-{
-    ruby_current_node = lhs;
-    if (val == Qundef) {
-	rb_warning("assigning void value");
-	val = Qnil;
+    /* is it in the call site's cache? */
+    if (cc && cc->klass == klass && cc->serial == method_serial &&
+	cc->class_serial == CLASS_SERIAL(klass)) {
+	cache_inline_hits++;
+	if (!cc->method)
+	    return method_missing(recv, mid, argc, argv, scope==2?CSTAT_VCALL:0);
+	klass = cc->origin;
+	id    = cc->mid0;
+	noex  = cc->noex;
+	body  = cc->method;
     }
-    switch (nd_type(lhs)) {
-      case NODE_GASGN:
-	rb_gvar_set(lhs->nd_entry, val);
-	break;
-
-      case NODE_IASGN:
-	rb_ivar_set(self, lhs->nd_vid, val);
-	break;
-
-      case NODE_LASGN:
-	if (ruby_scope->local_vars == 0)
-	    rb_bug("unexpected local variable assignment");
-	ruby_scope->local_vars[lhs->nd_cnt] = val;
-	break;
-
-      case NODE_DASGN:
-	dvar_asgn(lhs->nd_vid, val);
-	break;
-
-      case NODE_DASGN_CURR:
-	dvar_asgn_curr(lhs->nd_vid, val);
-	break;
+    else {
+	VALUE rklass = klass;
 
-      case NODE_CDECL:
-	if (lhs->nd_vid == 0) {
-	    rb_const_set(class_prefix(self, lhs->nd_else), lhs->nd_else->nd_mid, val);
+	/* is it in the method cache? */
+	if ((ent = cache_lookup(klass, mid)) != 0) {
+	    klass = ent->origin;
+	    id    = ent->mid0;
+	    noex  = ent->noex;
+	    body  = ent->method;
 	}
-	else {
-	    rb_const_set(ruby_cbase, lhs->nd_vid, val);
-	}
-	break;
-
-      case NODE_CVDECL:
-	if (RTEST(ruby_verbose) && FL_TEST(ruby_cbase, FL_SINGLETON)) {
-	    rb_warn("declaring singleton class variable");
+	else if ((body = rb_get_method_body(&klass, &id, &noex)) == 0 &&
+		 scope == 3) {
+	    return method_missing(recv, mid, argc, argv, CSTAT_SUPER);
 	}
-	rb_cvar_set(cvar_cbase(), lhs->nd_vid, val, Qtrue);
-	break;
-
-      case NODE_CVASGN:
-	rb_cvar_set(cvar_cbase(), lhs->nd_vid, val, Qfalse);
-	break;
+	if (cc) {
+	    /* missing methods are cached too, for method_missing proxies */
+	    cc->klass  = rklass;
+	    cc->class_serial = CLASS_SERIAL_OF(rklass);
+	    cc->serial = method_serial;
+	    cc->origin = klass;
+	    cc->mid0   = id;
+	    cc->noex   = body ? noex : 0;
+	    cc->method = body;
+	}
+	if (!body)
+	    return method_missing(recv, mid, argc, argv, scope==2?CSTAT_VCALL:0);
+    }
 
-      case NODE_MASGN:
-	massign(self, lhs, svalue_to_mrhs(val, lhs->nd_head), pcall);
-	break;
+    if (mid != missing && scope == 0) {
+	/* receiver specified form for private method */
+	if (noex & NOEX_PRIVATE)
+	    return method_missing(recv, mid, argc, argv, CSTAT_PRIV);
 
-      case NODE_CALL:
-      case NODE_ATTRASGN:
-	{
-	    VALUE recv;
-	    int scope;
-	    if (lhs->nd_recv == (NODE *)1) {
-		recv = self;
-		scope = 1;
-	    }
-	    else {
-		recv = rb_eval(self, lhs->nd_recv);
-		scope = 0;
-	    }
-	    if (!lhs->nd_args) {
-		/* attr set */
-		ruby_current_node = lhs;
-		SET_CURRENT_SOURCE();
-		rb_call(CLASS_OF(recv), recv, lhs->nd_mid, 1, &val, scope, self);
-	    }
-	    else {
-		/* array set */
-		VALUE args;
+	/* self must be kind of a specified form for protected method */
+	if (noex & NOEX_PROTECTED) {
+	    VALUE defined_class = klass;
 
-		args = rb_eval(self, lhs->nd_args);
-		rb_ary_push(args, val);
-		ruby_current_node = lhs;
-		SET_CURRENT_SOURCE();
-		rb_call(CLASS_OF(recv), recv, lhs->nd_mid,
-			RARRAY(args)->len, RARRAY(args)->ptr, scope, self);
+	    if (self == Qundef) self = ruby_frame->self;
+	    if (TYPE(defined_class) == T_ICLASS) {
+		defined_class = RBASIC(defined_class)->klass;
 	    }
+	    if (!rb_obj_is_kind_of(self, rb_class_real(defined_class)))
+		return method_missing(recv, mid, argc, argv, CSTAT_PROT);
 	}
-	break;
-
-      default:
-	rb_bug("bug in variable assignment");
-	break;
     }
+
+    return rb_call0(klass, recv, mid, id, argc, argv, body, noex);
+}
+
+static VALUE
+rb_call(klass, recv, mid, argc, argv, scope, self)
+    VALUE klass, recv;
+    ID    mid;
+    int argc;			/* OK */
+    const VALUE *argv;		/* OK */
+    int scope;
+    VALUE self;
+{
+    return rb_call_cached(0, klass, recv, mid, argc, argv, scope, self);
 }
 
 VALUE
-rb_iterate(it_proc, data1, bl_proc, data2)
-    VALUE (*it_proc) _((VALUE)), (*bl_proc)(ANYARGS);
-    VALUE data1, data2;
+rb_apply(recv, mid, args)
+    VALUE recv;
+    ID mid;
+    VALUE args;
 {
-    int state;
-    volatile VALUE retval = Qnil;
-    NODE *node = NEW_IFUNC(bl_proc, data2);
-    VALUE self = ruby_top_self;
+    int argc;
+    VALUE *argv;
 
-    PUSH_TAG(PROT_LOOP);
-    PUSH_BLOCK(0, node);
-    PUSH_ITER(ITER_PRE);
-    state = EXEC_TAG();
-    if (state == 0) {
-  iter_retry:
-	retval = (*it_proc)(data1);
-    }
-    else if (state == TAG_BREAK && TAG_DST()) {
-	retval = prot_tag->retval;
-	state = 0;
-    }
-    else if (state == TAG_RETRY) {
-	state = 0;
-	goto iter_retry;
-    }
+    argc = RARRAY(args)->len; /* Assigns LONG, but argc is INT */
+    argv = ALLOCA_N(VALUE, argc);
+    MEMCPY(argv, RARRAY(args)->ptr, VALUE, argc);
+    return rb_call(CLASS_OF(recv), recv, mid, argc, argv, 1, Qundef);
+}
+
+/*
+ *  call-seq:
+ *     obj.send(symbol [, args...])        => obj
+ *     obj.__send__(symbol [, args...])    => obj
+ *  
+ *  Invokes the method identified by _symbol_, passing it any
+ *  arguments specified. You can use <code>\_\_send__</code> if the name
+ *  +send+ clashes with an existing method in _obj_.
+ *     
+ *     class Klass
+ *       def hello(*args)
+ *         "Hello " + args.join(' ')
+ *       end
+ *     end
+ *     k = Klass.new
+ *     k.send :hello, "gentle", "readers"   #=> "Hello gentle readers"
+ */
+
+static VALUE
+rb_f_send(argc, argv, recv)
+    int argc;
+    VALUE *argv;
+    VALUE recv;
+{
+    VALUE vid;
+
+    if (argc == 0) rb_raise(rb_eArgError, "no method name given");
+
+    vid = *argv++; argc--;
+    PUSH_ITER(rb_block_given_p()?ITER_PRE:ITER_NOT);
+    vid = rb_call(CLASS_OF(recv), recv, rb_to_id(vid), argc, argv, 1, Qundef);
     POP_ITER();
-    POP_BLOCK();
-    POP_TAG();
 
-    switch (state) {
-      case 0:
-	break;
-      default:
-	JUMP_TAG(state);
-    }
-    return retval;
+    return vid;
 }
 
-static int
-handle_rescue(self, node)
-    VALUE self;
-    NODE *node;
+static VALUE
+vafuncall(recv, mid, n, ar)
+    VALUE recv;
+    ID mid;
+    int n;
+    va_list *ar;
 {
-    int argc; VALUE *argv; /* used in SETUP_ARGS */
-    TMP_PROTECT;
+    VALUE *argv;
 
-    if (!node->nd_args) {
-	return rb_obj_is_kind_of(ruby_errinfo, rb_eStandardError);
-    }
+    if (n > 0) {
+	long i;
 
-    BEGIN_CALLARGS;
-    SETUP_ARGS(node->nd_args);
-    END_CALLARGS;
+	argv = ALLOCA_N(VALUE, n);
 
-    while (argc--) {
-	if (!rb_obj_is_kind_of(argv[0], rb_cModule)) {
-	    rb_raise(rb_eTypeError, "class or module required for rescue clause");
+	for (i=0;i<n;i++) {
+	    argv[i] = va_arg(*ar, VALUE);
 	}
-	if (RTEST(rb_funcall(*argv, eqq, 1, ruby_errinfo))) return 1;
-	argv++;
+	va_end(*ar);
     }
-    return 0;
+    else {
+	argv = 0;
+    }
+
+    return rb_call(CLASS_OF(recv), recv, mid, n, argv, 1, Qundef);
 }
 
 VALUE
 #ifdef HAVE_STDARG_PROTOTYPES
-rb_rescue2(VALUE (*b_proc)(ANYARGS), VALUE data1, VALUE (*r_proc)(ANYARGS), VALUE data2, ...)
+rb_funcall(VALUE recv, ID mid, int n, ...)
 #else
-rb_rescue2(b_proc, data1, r_proc, data2, va_alist)
-    VALUE (*b_proc)(ANYARGS), (*r_proc)(ANYARGS);
-    VALUE data1, data2;
+rb_funcall(recv, mid, n, va_alist)
+    VALUE recv;
+    ID mid;
+    int n;
     va_dcl
 #endif
 {
-    int state;
-    volatile VALUE result;
-    volatile VALUE e_info = ruby_errinfo;
-    volatile int handle = Qfalse;
-    VALUE eclass;
-    va_list args;
-
-    PUSH_TAG(PROT_NONE);
-    switch (state = EXEC_TAG()) {
-      case TAG_RETRY:
-	if (!handle) break;
-	handle = Qfalse;
-	state = 0;
-	ruby_errinfo = Qnil;
-      case 0:
-	result = (*b_proc)(data1);
-	break;
-      case TAG_RAISE:
-	if (handle) break;
-	handle = Qfalse;
-	va_init_list(args, data2);
-	while ((eclass = va_arg(args, VALUE)) != 0) {
-	    if (rb_obj_is_kind_of(ruby_errinfo, eclass)) {
-		handle = Qtrue;
-		break;
-	    }
-	}
-	va_end(args);
-
-	if (handle) {
-	    state = 0;
-	    if (r_proc) {
-		result = (*r_proc)(data2, ruby_errinfo);
-	    }
-	    else {
-		result = Qnil;
-	    }
-	    ruby_errinfo = e_info;
-	}
-    }
-    POP_TAG();
-    if (state) JUMP_TAG(state);
-
-    return result;
-}
+    va_list ar;
+    va_init_list(ar, n);
 
-VALUE
-rb_rescue(b_proc, data1, r_proc, data2)
-    VALUE (*b_proc)(), (*r_proc)();
-    VALUE data1, data2;
-{
-    return rb_rescue2(b_proc, data1, r_proc, data2, rb_eStandardError, (VALUE)0);
+    return vafuncall(recv, mid, n, &ar);
 }
 
-static VALUE cont_protect;
-
 VALUE
-rb_protect(proc, data, state)
-    VALUE (*proc) _((VALUE));
-    VALUE data;
-    int *state;
+#ifdef HAVE_STDARG_PROTOTYPES
+rb_funcall_rescue(VALUE recv, ID mid, int n, ...)
+#else
+rb_funcall_rescue(recv, mid, n, va_alist)
+    VALUE recv;
+    ID mid;
+    int n;
+    va_dcl
+#endif
 {
     VALUE result = Qnil;	/* OK */
     int status;
+    va_list ar;
+
+    va_init_list(ar, n);
 
     PUSH_TAG(PROT_NONE);
-    cont_protect = (VALUE)rb_node_newnode(NODE_MEMO, cont_protect, 0, 0);
     if ((status = EXEC_TAG()) == 0) {
-	result = (*proc)(data);
+	result = vafuncall(recv, mid, n, &ar);
     }
-    cont_protect = ((NODE *)cont_protect)->u1.value;
     POP_TAG();
-    if (state) {
-	*state = status;
-    }
-    if (status != 0) {
-	return Qnil;
+    switch (status) {
+      case 0:
+	return result;
+      case TAG_RAISE:
+	return Qundef;
+      default:
+	JUMP_TAG(status);
     }
-
-    return result;
 }
 
 VALUE
-rb_ensure(b_proc, data1, e_proc, data2)
-    VALUE (*b_proc)();
-    VALUE data1;
-    VALUE (*e_proc)();
-    VALUE data2;
+rb_funcall2(recv, mid, argc, argv)
+    VALUE recv;
+    ID mid;
+    int argc;
+    const VALUE *argv;
 {
-    int state;
-    volatile VALUE result = Qnil;
-    VALUE retval;
-
-    PUSH_TAG(PROT_NONE);
-    if ((state = EXEC_TAG()) == 0) {
-	result = (*b_proc)(data1);
-    }
-    POP_TAG();
-    retval = prot_tag ? prot_tag->retval : Qnil;	/* save retval */
-    if (!thread_no_ensure()) {
-	(*e_proc)(data2);
-    }
-    if (prot_tag) return_value(retval);
-    if (state) JUMP_TAG(state);
-    return result;
+    return rb_call(CLASS_OF(recv), recv, mid, argc, argv, 1, Qundef);
 }
 
 VALUE
-rb_with_disable_interrupt(proc, data)
-    VALUE (*proc)();
-    VALUE data;
-{
-    VALUE result = Qnil;	/* OK */
-    int status;
-
-    DEFER_INTS;
-    {
-	int thr_critical = rb_thread_critical;
-
-	rb_thread_critical = Qtrue;
-	PUSH_TAG(PROT_NONE);
-	if ((status = EXEC_TAG()) == 0) {
-	    result = (*proc)(data);
-	}
-	POP_TAG();
-	rb_thread_critical = thr_critical;
-    }
-    ENABLE_INTS;
-    if (status) JUMP_TAG(status);
-
-    return result;
-}
-
-static void
-stack_check()
-{
-    rb_thread_t th = rb_curr_thread;
-
-    if (!rb_thread_raised_p(th, RAISED_STACKOVERFLOW) && ruby_stack_check()) {
-	rb_thread_raised_set(th, RAISED_STACKOVERFLOW);
-	rb_exc_raise(sysstack_error);
-    }
-}
-
-static int last_call_status;
-
-#define CSTAT_PRIV  1
-#define CSTAT_PROT  2
-#define CSTAT_VCALL 4
-#define CSTAT_SUPER 8
-
-/*
- *  call-seq:
- *     obj.method_missing(symbol [, *args] )   => result
- *  
- *  Invoked by Ruby when <i>obj</i> is sent a message it cannot handle.
- *  <i>symbol</i> is the symbol for the method called, and <i>args</i>
- *  are any arguments that were passed to it. By default, the interpreter
- *  raises an error when this method is called. However, it is possible
- *  to override the method to provide more dynamic behavior.
- *  The example below creates
- *  a class <code>Roman</code>, which responds to methods with names
- *  consisting of roman numerals, returning the corresponding integer
- *  values.
- *     
- *     class Roman
- *       def romanToInt(str)
- *         # ...
- *       end
- *       def method_missing(methId)
- *         str = methId.id2name
- *         romanToInt(str)
- *       end
- *     end
- *     
- *     r = Roman.new
- *     r.iv      #=> 4
- *     r.xxiii   #=> 23
- *     r.mm      #=> 2000
- */
+rb_funcall3(recv, mid, argc, argv)
+    VALUE recv;
+    ID mid;
+    int argc;
+    const VALUE *argv;
+{
+    return rb_call(CLASS_OF(recv), recv, mid, argc, argv, 0, Qundef);
+}
 
-static VALUE
-rb_method_missing(argc, argv, obj)
+VALUE
+rb_call_super(argc, argv)
     int argc;
-    VALUE *argv;
-    VALUE obj;
+    const VALUE *argv;
 {
-    ID id;
-    VALUE exc = rb_eNoMethodError;
-    char *format = 0;
-    NODE *cnode = ruby_current_node;
+    VALUE result, self, klass;
 
-    if (argc == 0 || !SYMBOL_P(argv[0])) {
-	rb_raise(rb_eArgError, "no id given");
+    if (ruby_frame->last_class == 0) {
+	rb_name_error(ruby_frame->last_func, "calling `super' from `%s' is prohibited",
+		      rb_id2name(ruby_frame->orig_func));
     }
 
-    stack_check();
-
-    id = SYM2ID(argv[0]);
-
-    if (last_call_status & CSTAT_PRIV) {
-	format = "private method `%s' called for %s";
-    }
-    else if (last_call_status & CSTAT_PROT) {
-	format = "protected method `%s' called for %s";
-    }
-    else if (last_call_status & CSTAT_VCALL) {
-	format = "undefined local variable or method `%s' for %s";
-	exc = rb_eNameError;
-    }
-    else if (last_call_status & CSTAT_SUPER) {
-	format = "super: no superclass method `%s'";
-    }
-    if (!format) {
-	format = "undefined method `%s' for %s";
+    self = ruby_frame->self;
+    klass = ruby_frame->last_class;
+    if (RCLASS(klass)->super == 0) {
+	return method_missing(self, ruby_frame->orig_func, argc, argv, CSTAT_SUPER);
     }
 
-    ruby_current_node = cnode;
-    {
-	int n = 0;
-	VALUE args[3];
-
-	args[n++] = rb_funcall(rb_const_get(exc, rb_intern("message")), '!',
-			       3, rb_str_new2(format), obj, argv[0]);
-	args[n++] = argv[0];
-	if (exc == rb_eNoMethodError) {
-	    args[n++] = rb_ary_new4(argc-1, argv+1);
-	}
-	exc = rb_class_new_instance(n, args, exc);
-	ruby_frame = ruby_frame->prev; /* pop frame for "method_missing" */
-	rb_exc_raise(exc);
-    }
+    PUSH_ITER(ruby_iter->iter ? ITER_PRE : ITER_NOT);
+    result = rb_call(RCLASS(klass)->super, self, ruby_frame->orig_func, argc, argv, 3, Qundef);
+    POP_ITER();
 
-    return Qnil;		/* not reached */
+    return result;
 }
 
 static VALUE
-method_missing(obj, id, argc, argv, call_status)
-    VALUE obj;
-    ID    id;
-    int   argc;
-    const VALUE *argv;
-    int   call_status;
+backtrace(lev)
+    int lev;
 {
-    VALUE *nargv;
-
-    last_call_status = call_status;
+    struct FRAME *frame = ruby_frame;
+    char buf[BUFSIZ];
+    VALUE ary;
+    NODE *n;
 
-    if (id == missing) {
-	PUSH_FRAME();
-	rb_method_missing(argc, argv, obj);
-	POP_FRAME();
-    }
-    else if (id == ID_ALLOCATOR) {
-	rb_raise(rb_eTypeError, "allocator undefined for %s", rb_class2name(obj));
+    ary = rb_ary_new();
+    if (frame->last_func == ID_ALLOCATOR) {
+	frame = frame->prev;
     }
-    if (argc < 0) {
-	VALUE tmp;
-
-	argc = -argc-1;
-	tmp = splat_value(argv[argc]);
-	nargv = ALLOCA_N(VALUE, argc + RARRAY(tmp)->len + 1);
-	MEMCPY(nargv+1, argv, VALUE, argc);
-	MEMCPY(nargv+1+argc, RARRAY(tmp)->ptr, VALUE, RARRAY(tmp)->len);
-	argc += RARRAY(tmp)->len;
+    if (lev < 0) {
+	ruby_set_current_source();
+	if (frame->last_func) {
+	    snprintf(buf, BUFSIZ, "%s:%d:in `%s'",
+		     ruby_sourcefile, ruby_sourceline,
+		     rb_id2name(frame->last_func));
+	}
+	else if (ruby_sourceline == 0) {
+	    snprintf(buf, BUFSIZ, "%s", ruby_sourcefile);
+	}
+	else {
+	    snprintf(buf, BUFSIZ, "%s:%d", ruby_sourcefile, ruby_sourceline);
+	}
+	rb_ary_push(ary, rb_str_new2(buf));
+	if (lev < -1) return ary;
     }
     else {
-	nargv = ALLOCA_N(VALUE, argc+1);
-	MEMCPY(nargv+1, argv, VALUE, argc);
+	while (lev-- > 0) {
+	    frame = frame->prev;
+	    if (!frame) {
+		ary = Qnil;
+		break;
+	    }
+	}
     }
-    nargv[0] = ID2SYM(id);
-    return rb_funcall2(obj, missing, argc+1, nargv);
+    for (; frame && (n = frame->node); frame = frame->prev) {
+	if (frame->prev && frame->prev->last_func) {
+	    if (frame->prev->node == n) {
+		if (frame->prev->last_func == frame->last_func) continue;
+	    }
+	    snprintf(buf, BUFSIZ, "%s:%d:in `%s'",
+		     n->nd_file, nd_line(n),
+		     rb_id2name(frame->prev->last_func));
+	}
+	else {
+	    snprintf(buf, BUFSIZ, "%s:%d", n->nd_file, nd_line(n));
+	}
+	rb_ary_push(ary, rb_str_new2(buf));
+    }
+
+    return ary;
 }
 
-static inline VALUE
-call_cfunc(func, recv, len, argc, argv)
-    VALUE (*func)();
-    VALUE recv;
-    int len, argc;
+/*
+ *  call-seq:
+ *     caller(start=1)    => array
+ *  
+ *  Returns the current execution stack---an array containing strings in
+ *  the form ``<em>file:line</em>'' or ``<em>file:line: in
+ *  `method'</em>''. The optional _start_ parameter
+ *  determines the number of initial stack entries to omit from the
+ *  result.
+ *     
+ *     def a(skip)
+ *       caller(skip)
+ *     end
+ *     def b(skip)
+ *       a(skip)
+ *     end
+ *     def c(skip)
+ *       b(skip)
+ *     end
+ *     c(0)   #=> ["prog:2:in `a'", "prog:5:in `b'", "prog:8:in `c'", "prog:10"]
+ *     c(1)   #=> ["prog:5:in `b'", "prog:8:in `c'", "prog:11"]
+ *     c(2)   #=> ["prog:8:in `c'", "prog:12"]
+ *     c(3)   #=> ["prog:13"]
+ */
+
+static VALUE
+rb_f_caller(argc, argv)
+    int argc;
     VALUE *argv;
 {
-    if (len >= 0 && argc != len) {
-	rb_raise(rb_eArgError, "wrong number of arguments (%d for %d)",
-		 argc, len);
-    }
+    VALUE level;
+    int lev;
 
-    switch (len) {
-      case -2:
-	return (*func)(recv, rb_ary_new4(argc, argv));
-	break;
-      case -1:
-	return (*func)(argc, argv, recv);
-	break;
-      case 0:
-	return (*func)(recv);
-	break;
-      case 1:
-	return (*func)(recv, argv[0]);
-	break;
-      case 2:
-	return (*func)(recv, argv[0], argv[1]);
-	break;
-      case 3:
-	return (*func)(recv, argv[0], argv[1], argv[2]);
-	break;
-      case 4:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3]);
-	break;
-      case 5:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4]);
-	break;
-      case 6:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
-		       argv[5]);
-	break;
-      case 7:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
-		       argv[5], argv[6]);
-	break;
-      case 8:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
-		       argv[5], argv[6], argv[7]);
-	break;
-      case 9:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
-		       argv[5], argv[6], argv[7], argv[8]);
-	break;
-      case 10:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
-		       argv[5], argv[6], argv[7], argv[8], argv[9]);
-	break;
-      case 11:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
-		       argv[5], argv[6], argv[7], argv[8], argv[9], argv[10]);
-	break;
-      case 12:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
-		       argv[5], argv[6], argv[7], argv[8], argv[9],
-		       argv[10], argv[11]);
-	break;
-      case 13:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
-		       argv[5], argv[6], argv[7], argv[8], argv[9], argv[10],
-		       argv[11], argv[12]);
-	break;
-      case 14:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
-		       argv[5], argv[6], argv[7], argv[8], argv[9], argv[10],
-		       argv[11], argv[12], argv[13]);
-	break;
-      case 15:
-	return (*func)(recv, argv[0], argv[1], argv[2], argv[3], argv[4],
-		       argv[5], argv[6], argv[7], argv[8], argv[9], argv[10],
-		       argv[11], argv[12], argv[13], argv[14]);
-	break;
-      default:
-	rb_raise(rb_eArgError, "too many arguments (%d)", len);
-	break;
+    rb_scan_args(argc, argv, "01", &level);
+
+    if (NIL_P(level)) lev = 1;
+    else lev = NUM2INT(level);
+    if (lev < 0) rb_raise(rb_eArgError, "negative level (%d)", lev);
+
+    return backtrace(lev);
+}
+
+void
+rb_backtrace()
+{
+    long i;
+    VALUE ary;
+
+    ary = backtrace(-1);
+    for (i=0; i<RARRAY(ary)->len; i++) {
+	printf("\tfrom %s\n", RSTRING(RARRAY(ary)->ptr[i])->ptr);
     }
-    return Qnil;		/* not reached */
 }
 
 static VALUE
-rb_call0(klass, recv, id, oid, argc, argv, body, flags)
-    VALUE klass, recv;
-    ID    id;
-    ID    oid;
-    int argc;			/* OK */
-    VALUE *argv;		/* OK */
-    NODE * volatile body;
-    int flags;
+make_backtrace()
 {
-    NODE *b2;		/* OK */
+    return backtrace(-1);
+}
+
+ID
+rb_frame_last_func()
+{
+    return ruby_frame->last_func;
+}
+
+static NODE*
+compile(src, file, line)
+    VALUE src;
+    char *file;
+    int line;
+{
+    NODE *node;
+    int critical;
+
+    ruby_nerrs = 0;
+    StringValue(src);
+    /* the parser may add local variables to the current scope */
+    if (ruby_scope->flags & SCOPE_STACK) scope_promote(ruby_scope);
+    critical = rb_thread_critical;
+    rb_thread_critical = Qtrue;
+    node = rb_compile_string(file, src, line);
+    rb_thread_critical = critical;
+
+    if (ruby_nerrs == 0) return node;
+    return 0;
+}
+
+static VALUE
+eval(self, src, scope, file, line)
+    VALUE self, src, scope;
+    char *file;
+    int line;
+{
+    struct BLOCK *data = NULL;
     volatile VALUE result = Qnil;
-    int itr;
-    static int tick;
-    TMP_PROTECT;
-    volatile int safe = -1;
+    struct SCOPE * volatile old_scope;
+    struct BLOCK * volatile old_block;
+    struct RVarmap * volatile old_dyna_vars;
+    VALUE volatile old_cref;
+    int volatile old_vmode;
+    volatile VALUE old_wrapper;
+    struct FRAME frame;
+    NODE *nodesave = ruby_current_node;
+    volatile int iter = ruby_frame->iter;
+    volatile int safe = ruby_safe_level;
+    int state;
 
-    if (NOEX_SAFE(flags) > ruby_safe_level && NOEX_SAFE(flags) > 2) {
-	rb_raise(rb_eSecurityError, "calling insecure method: %s",
-		 rb_id2name(id));
+    if (!NIL_P(scope)) {
+	if (!rb_obj_is_proc(scope)) {
+	    rb_raise(rb_eTypeError, "wrong argument type %s (expected Proc/Binding)",
+		     rb_obj_classname(scope));
+	}
+
+	Data_Get_Struct(scope, struct BLOCK, data);
+	/* PUSH BLOCK from data */
+	frame = data->frame;
+	frame.tmp = ruby_frame;	/* gc protection */
+	ruby_frame = &(frame);
+	old_scope = ruby_scope;
+	ruby_scope = data->scope;
+	old_block = ruby_block;
+	ruby_block = data->prev;
+	old_dyna_vars = ruby_dyna_vars;
+	ruby_dyna_vars = data->dyna_vars;
+	old_vmode = scope_vmode;
+	scope_vmode = data->vmode;
+	old_cref = (VALUE)ruby_cref;
+	ruby_cref = data->cref;
+	old_wrapper = ruby_wrapper;
+	ruby_wrapper = data->wrapper;
+	if ((file == 0 || (line == 1 && strcmp(file, "(eval)") == 0)) && data->frame.node) {
+	    file = data->frame.node->nd_file;
+	    if (!file) file = "__builtin__";
+	    line = nd_line(data->frame.node);
+	}
+
+	self = data->self;
+	ruby_frame->iter = data->iter;
     }
-    switch (ruby_iter->iter) {
-      case ITER_PRE:
-      case ITER_PAS:
-	itr = ITER_CUR;
-	break;
-      case ITER_CUR:
-      default:
-	itr = ITER_NOT;
-	break;
+    else {
+	if (ruby_frame->prev) {
+	    ruby_frame->iter = ruby_frame->prev->iter;
+	}
     }
-
-    if ((++tick & 0xff) == 0) {
-	CHECK_INTS;		/* better than nothing */
-	stack_check();
-	rb_gc_finalize_deferred();
+    if (file == 0) {
+	ruby_set_current_source();
+	file = ruby_sourcefile;
+	line = ruby_sourceline;
     }
-    if (argc < 0) {
-	VALUE tmp;
-	VALUE *nargv;
-
-	argc = -argc-1;
-	tmp = splat_value(argv[argc]);
-	nargv = TMP_ALLOC(argc + RARRAY(tmp)->len);
-	MEMCPY(nargv, argv, VALUE, argc);
-	MEMCPY(nargv+argc, RARRAY(tmp)->ptr, VALUE, RARRAY(tmp)->len);
-	argc += RARRAY(tmp)->len;
-	argv = nargv;
+    PUSH_CLASS(data ? data->klass : ruby_class);
+    ruby_in_eval++;
+    if (TYPE(ruby_class) == T_ICLASS) {
+	ruby_class = RBASIC(ruby_class)->klass;
     }
-    PUSH_ITER(itr);
-    PUSH_FRAME();
-
-    ruby_frame->last_func = id;
-    ruby_frame->orig_func = oid;
-    ruby_frame->last_class = (flags & NOEX_NOSUPER)?0:klass;
-    ruby_frame->self = recv;
-    ruby_frame->argc = argc;
-    ruby_frame->flags = 0;
+    PUSH_TAG(PROT_NONE);
+    if ((state = EXEC_TAG()) == 0) {
+	NODE *node;
 
-    switch (nd_type(body)) {
-      case NODE_CFUNC:
-	{
-	    int len = body->nd_argc;
+	ruby_safe_level = 0;
+	result = ruby_errinfo;
+	ruby_errinfo = Qnil;
+	node = compile(src, file, line);
+	ruby_safe_level = safe;
+	if (ruby_nerrs > 0) {
+	    compile_error(0);
+	}
+	if (!NIL_P(result)) ruby_errinfo = result;
+	result = eval_node(self, node);
+    }
+    POP_TAG();
+    POP_CLASS();
+    ruby_in_eval--;
+    if (!NIL_P(scope)) {
+	int dont_recycle = ruby_scope->flags & SCOPE_DONT_RECYCLE;
 
-	    if (len < -2) {
-		rb_bug("bad argc (%d) specified for `%s(%s)'",
-		       len, rb_class2name(klass), rb_id2name(id));
-	    }
-	    if (event_hooks) {
-		int state;
+	ruby_wrapper = old_wrapper;
+	ruby_cref  = (NODE*)old_cref;
+	ruby_frame = frame.tmp;
+	ruby_scope = SCOPE_FORWARD(old_scope);
+	ruby_block = old_block;
+	ruby_dyna_vars = old_dyna_vars;
+	data->vmode = scope_vmode; /* write back visibility mode */
+	scope_vmode = old_vmode;
+	if (dont_recycle) {
+	    struct tag *tag;
+	    struct RVarmap *vars;
 
-		EXEC_EVENT_HOOK(RUBY_EVENT_C_CALL, ruby_current_node,
-				recv, id, klass);
-		PUSH_TAG(PROT_FUNC);
-		if ((state = EXEC_TAG()) == 0) {
-		    result = call_cfunc(body->nd_cfnc, recv, len, argc, argv);
-		}
-		POP_TAG();
-		ruby_current_node = ruby_frame->node;
-		EXEC_EVENT_HOOK(RUBY_EVENT_C_RETURN, ruby_current_node,
-				recv, id, klass);
-		if (state) JUMP_TAG(state);
+	    scope_dup(ruby_scope);
+	    for (tag=prot_tag; tag; tag=tag->prev) {
+		scope_dup(tag->scope);
 	    }
-	    else {
-		result = call_cfunc(body->nd_cfnc, recv, len, argc, argv);
+	    for (vars = ruby_dyna_vars; vars; vars = vars->next) {
+		FL_SET(vars, DVAR_DONT_RECYCLE);
 	    }
 	}
-	break;
+    }
+    else {
+	ruby_frame->iter = iter;
+    }
+    ruby_current_node = nodesave;
+    ruby_set_current_source();
+    if (state) {
+	if (state == TAG_RAISE) {
+	    if (strcmp(file, "(eval)") == 0) {
+		VALUE mesg, errat, bt2;
 
-	/* for attr get/set */
-      case NODE_IVAR:
-	if (argc != 0) {
-	    rb_raise(rb_eArgError, "wrong number of arguments (%d for 0)", argc);
+		errat = get_backtrace(ruby_errinfo);
+		mesg = rb_attr_get(ruby_errinfo, rb_intern("mesg"));
+		if (!NIL_P(errat) && TYPE(errat) == T_ARRAY &&
+		    (bt2 = backtrace(-2), RARRAY(bt2)->len > 0)) {
+		    if (!NIL_P(mesg) && TYPE(mesg) == T_STRING) {
+			rb_str_update(mesg, 0, 0, rb_str_new2(": "));
+			rb_str_update(mesg, 0, 0, RARRAY(errat)->ptr[0]);
+		    }
+		    RARRAY(errat)->ptr[0] = RARRAY(bt2)->ptr[0];
+		}
+	    }
+	    rb_exc_raise(ruby_errinfo);
 	}
-	result = rb_attr_get(recv, body->nd_vid);
-	break;
+	JUMP_TAG(state);
+    }
 
-      case NODE_ATTRSET:
-	if (argc != 1)
-	    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
-	result = rb_ivar_set(recv, body->nd_vid, argv[0]);
-	break;
+    return result;
+}
 
-      case NODE_ZSUPER:
-	result = rb_call_super(argc, argv);
-	break;
+/*
+ *  call-seq:
+ *     eval(string [, binding [, filename [,lineno]]])  => obj
+ *  
+ *  Evaluates the Ruby expression(s) in <em>string</em>. If
+ *  <em>binding</em> is given, the evaluation is performed in its
+ *  context. The binding may be a <code>Binding</code> object or a
+ *  <code>Proc</code> object. If the optional <em>filename</em> and
+ *  <em>lineno</em> parameters are present, they will be used when
+ *  reporting syntax errors.
+ *     
+ *     def getBinding(str)
+ *       return binding
+ *     end
+ *     str = "hello"
+ *     eval "str + ' Fred'"                      #=> "hello Fred"
+ *     eval "str + ' Fred'", getBinding("bye")   #=> "bye Fred"
+ */
 
-      case NODE_DMETHOD:
-	result = method_call(argc, argv, umethod_bind(body->nd_cval, recv));
-	break;
+static VALUE
+rb_f_eval(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    VALUE src, scope, vfile, vline;
+    char *file = "(eval)";
+    int line = 1;
 
-      case NODE_BMETHOD:
-	ruby_frame->flags |= FRAME_DMETH;
-	if (event_hooks) {
-	    struct BLOCK *data;
-	    Data_Get_Struct(body->nd_cval, struct BLOCK, data);
-	    EXEC_EVENT_HOOK(RUBY_EVENT_CALL, data->body, recv, id, klass);
-	}
-	result = proc_invoke(body->nd_cval, rb_ary_new4(argc, argv), recv, klass);
-	if (event_hooks) {
-	    EXEC_EVENT_HOOK(RUBY_EVENT_RETURN, body, recv, id, klass);
+    rb_scan_args(argc, argv, "13", &src, &scope, &vfile, &vline);
+    if (ruby_safe_level >= 4) {
+	StringValue(src);
+	if (!NIL_P(scope) && !OBJ_TAINTED(scope)) {
+	    rb_raise(rb_eSecurityError, "Insecure: can't modify trusted binding");
 	}
-	break;
+    }
+    else {
+	SafeStringValue(src);
+    }
+    if (argc >= 3) {
+	StringValue(vfile);
+    }
+    if (argc >= 4) {
+	line = NUM2INT(vline);
+    }
 
-      case NODE_SCOPE:
-	{
-	    int state;
-	    VALUE *local_vars;	/* OK */
-	    NODE *saved_cref = 0;
+    if (!NIL_P(vfile)) file = RSTRING(vfile)->ptr;
+    if (NIL_P(scope) && ruby_frame->prev) {
+	struct FRAME *prev;
+	VALUE val;
 
-	    PUSH_SCOPE();
-	    if (body->nd_rval) {
-		saved_cref = ruby_cref;
-		ruby_cref = (NODE*)body->nd_rval;
-	    }
-	    PUSH_CLASS(ruby_cbase);
-	    if (body->nd_tbl) {
-		local_vars = TMP_ALLOC(body->nd_tbl[0]+1);
-		*local_vars++ = (VALUE)body;
-		rb_mem_clear(local_vars, body->nd_tbl[0]);
-		ruby_scope->local_tbl = body->nd_tbl;
-		ruby_scope->local_vars = local_vars;
-	    }
-	    else {
-		local_vars = ruby_scope->local_vars = 0;
-		ruby_scope->local_tbl  = 0;
-	    }
-	    b2 = body = body->nd_next;
+	prev = ruby_frame;
+	PUSH_FRAME();
+	*ruby_frame = *prev->prev;
+	ruby_frame->prev = prev;
+	val = eval(self, src, scope, file, line);
+	POP_FRAME();
 
-	    if (NOEX_SAFE(flags) > ruby_safe_level) {
-		safe = ruby_safe_level;
-		ruby_safe_level = NOEX_SAFE(flags);
-	    }
-	    PUSH_VARS();
-	    PUSH_TAG(PROT_FUNC);
-	    if ((state = EXEC_TAG()) == 0) {
-		NODE *node = 0;
-		int i, nopt = 0;
+	return val;
+    }
+    return eval(self, src, scope, file, line);
+}
 
-		if (nd_type(body) == NODE_ARGS) {
-		    node = body;
-		    body = 0;
-		}
-		else if (nd_type(body) == NODE_BLOCK) {
-		    node = body->nd_head;
-		    body = body->nd_next;
-		}
-		if (node) {
-		    if (nd_type(node) != NODE_ARGS) {
-			rb_bug("no argument-node");
-		    }
+/* function to call func under the specified class/module context */
+static VALUE
+exec_under(func, under, cbase, args)
+    VALUE (*func)();
+    VALUE under, cbase;
+    void *args;
+{
+    VALUE val = Qnil;		/* OK */
+    int state;
+    int mode;
+    struct FRAME *f = ruby_frame;
 
-		    i = node->nd_cnt;
-		    if (i > argc) {
-			rb_raise(rb_eArgError, "wrong number of arguments (%d for %d)",
-				 argc, i);
-		    }
-		    if (!node->nd_rest) {
-			NODE *optnode = node->nd_opt;
+    PUSH_CLASS(under);
+    PUSH_FRAME();
+    ruby_frame->self = f->self;
+    ruby_frame->last_func = f->last_func;
+    ruby_frame->orig_func = f->orig_func;
+    ruby_frame->last_class = f->last_class;
+    ruby_frame->argc = f->argc;
+    if (cbase) {
+	PUSH_CREF(cbase);
+    }
 
-			nopt = i;
-			while (optnode) {
-			    nopt++;
-			    optnode = optnode->nd_next;
-			}
-			if (nopt < argc) {
-			    rb_raise(rb_eArgError,
-				     "wrong number of arguments (%d for %d)",
-				     argc, nopt);
-			}
-		    }
-		    if (local_vars) {
-			if (i > 0) {
-			    /* +2 for $_ and $~ */
-			    MEMCPY(local_vars+2, argv, VALUE, i);
-			}
-		    }
-		    argv += i; argc -= i;
-		    if (node->nd_opt) {
-			NODE *opt = node->nd_opt;
+    mode = scope_vmode;
+    SCOPE_SET(SCOPE_PUBLIC);
+    PUSH_TAG(PROT_NONE);
+    if ((state = EXEC_TAG()) == 0) {
+	val = (*func)(args);
+    }
+    POP_TAG();
+    if (cbase) POP_CREF();
+    SCOPE_SET(mode);
+    POP_FRAME();
+    POP_CLASS();
+    if (state) JUMP_TAG(state);
 
-			while (opt && argc) {
-			    assign(recv, opt->nd_head, *argv, 1);
-			    argv++; argc--;
-			    ++i;
-			    opt = opt->nd_next;
-			}
-			if (opt) {
-			    rb_eval(recv, opt);
-			    while (opt) {
-				opt = opt->nd_next;
-				++i;
-			    }
-			}
-		    }
-		    if (!node->nd_rest) {
-			i = nopt;
-		    }
-		    else {
-			VALUE v;
-			
-			if (argc > 0) {
-			    v = rb_ary_new4(argc,argv);
-			    i = -i - 1;
-			}
-			else {
-			    v = rb_ary_new2(0);
-			}
-			assign(recv, node->nd_rest, v, 1);
-		    }
-		    ruby_frame->argc = i;
-		}
-		if (event_hooks) {
-		    EXEC_EVENT_HOOK(RUBY_EVENT_CALL, b2, recv, id, klass);
-		}
-		result = rb_eval(recv, body);
-	    }
-	    else if (state == TAG_RETURN && TAG_DST()) {
-		result = prot_tag->retval;
-		state = 0;
-	    }
-	    POP_TAG();
-	    if (event_hooks) {
-		EXEC_EVENT_HOOK(RUBY_EVENT_RETURN, body, recv, id, klass);
-	    }
-	    POP_VARS();
-	    POP_CLASS();
-	    POP_SCOPE();
-	    ruby_cref = saved_cref;
-	    if (safe >= 0) ruby_safe_level = safe;
-	    switch (state) {
-	      case 0:
-		break;
+    return val;
+}
 
-	      case TAG_BREAK:
-	      case TAG_RETURN:
-		JUMP_TAG(state);
-		break;
+static VALUE
+eval_under_i(args)
+    VALUE *args;
+{
+    struct FRAME *f = ruby_frame;
 
-	      case TAG_RETRY:
-		if (rb_block_given_p()) JUMP_TAG(state);
-		/* fall through */
-	      default:
-		jump_tag_but_local_jump(state, result);
-		break;
-	    }
-	}
-	break;
+    if (f && (f = f->prev) && (f = f->prev)) {
+	ruby_frame = f;
+    }
+    return eval(args[0], args[1], Qnil, (char*)args[2], (int)args[3]);
+}
 
-      default:
-	unknown_node(body);
-	break;
+/* string eval under the class/module context */
+static VALUE
+eval_under(under, self, src, file, line)
+    VALUE under, self, src;
+    const char *file;
+    int line;
+{
+    VALUE args[4];
+
+    if (ruby_safe_level >= 4) {
+	StringValue(src);
+    }
+    else {
+	SafeStringValue(src);
     }
-    POP_FRAME();
-    POP_ITER();
-    return result;
+    args[0] = self;
+    args[1] = src;
+    args[2] = (VALUE)file;
+    args[3] = (VALUE)line;
+    return exec_under(eval_under_i, under, under, args);
 }
 
 static VALUE
-rb_call(klass, recv, mid, argc, argv, scope, self)
-    VALUE klass, recv;
-    ID    mid;
-    int argc;			/* OK */
-    const VALUE *argv;		/* OK */
-    int scope;
+yield_under_i(self)
     VALUE self;
 {
-    NODE  *body;		/* OK */
-    int    noex;
-    ID     id = mid;
-    struct cache_entry *ent;
+    return rb_yield_0(self, self, ruby_class, YIELD_PUBLIC_DEF, Qfalse);
+}
 
-    if (!klass) {
-	rb_raise(rb_eNotImpError, "method `%s' called on terminated object (0x%lx)",
-		 rb_id2name(mid), recv);
-    }
-    /* is it in the method cache? */
-    ent = cache + EXPR1(klass, mid);
-    if (ent->mid == mid && ent->klass == klass) {
-	if (!ent->method)
-	    return method_missing(recv, mid, argc, argv, scope==2?CSTAT_VCALL:0);
-	klass = ent->origin;
-	id    = ent->mid0;
-	noex  = ent->noex;
-	body  = ent->method;
-    }
-    else if ((body = rb_get_method_body(&klass, &id, &noex)) == 0) {
-	if (scope == 3) {
-	    return method_missing(recv, mid, argc, argv, CSTAT_SUPER);
+/* block eval under the class/module context */
+static VALUE
+yield_under(under, self)
+    VALUE under, self;
+{
+    return exec_under(yield_under_i, under, 0, self);
+}
+
+static VALUE
+specific_eval(argc, argv, klass, self)
+    int argc;
+    VALUE *argv;
+    VALUE klass, self;
+{
+    if (rb_block_given_p()) {
+	if (argc > 0) {
+	    rb_raise(rb_eArgError, "wrong number of arguments (%d for 0)", argc);
 	}
-	return method_missing(recv, mid, argc, argv, scope==2?CSTAT_VCALL:0);
+	return yield_under(klass, self);
     }
+    else {
+	char *file = "(eval)";
+	int   line = 1;
 
-    if (mid != missing && scope == 0) {
-	/* receiver specified form for private method */
-	if (noex & NOEX_PRIVATE)
-	    return method_missing(recv, mid, argc, argv, CSTAT_PRIV);
-
-	/* self must be kind of a specified form for protected method */
-	if (noex & NOEX_PROTECTED) {
-	    VALUE defined_class = klass;
-
-	    if (self == Qundef) self = ruby_frame->self;
-	    if (TYPE(defined_class) == T_ICLASS) {
-		defined_class = RBASIC(defined_class)->klass;
+	if (argc == 0) {
+	    rb_raise(rb_eArgError, "block not supplied");
+	}
+	else {
+	    if (ruby_safe_level >= 4) {
+		StringValue(argv[0]);
+	    }
+	    else {
+		SafeStringValue(argv[0]);
+	    }
+	    if (argc > 3) {
+		rb_raise(rb_eArgError, "wrong number of arguments: %s(src) or %s{..}",
+			 rb_id2name(ruby_frame->last_func),
+			 rb_id2name(ruby_frame->last_func));
+	    }
+	    if (argc > 2) line = NUM2INT(argv[2]);
+	    if (argc > 1) {
+		file = StringValuePtr(argv[1]);
 	    }
-	    if (!rb_obj_is_kind_of(self, rb_class_real(defined_class)))
-		return method_missing(recv, mid, argc, argv, CSTAT_PROT);
 	}
+	return eval_under(klass, self, argv[0], file, line);
     }
-
-    return rb_call0(klass, recv, mid, id, argc, argv, body, noex);
 }
 
+/*
+ *  call-seq:
+ *     obj.instance_eval(string [, filename [, lineno]] )   => obj
+ *     obj.instance_eval {| | block }                       => obj
+ *  
+ *  Evaluates a string containing Ruby source code, or the given block,
+ *  within the context of the receiver (_obj_). In order to set the
+ *  context, the variable +self+ is set to _obj_ while
+ *  the code is executing, giving the code access to _obj_'s
+ *  instance variables. In the version of <code>instance_eval</code>
+ *  that takes a +String+, the optional second and third
+ *  parameters supply a filename and starting line number that are used
+ *  when reporting compilation errors.
+ *     
+ *     class Klass
+ *       def initialize
+ *         @secret = 99
+ *       end
+ *     end
+ *     k = Klass.new
+ *     k.instance_eval { @secret }   #=> 99
+ */
+
 VALUE
-rb_apply(recv, mid, args)
-    VALUE recv;
-    ID mid;
-    VALUE args;
-{
+rb_obj_instance_eval(argc, argv, self)
     int argc;
     VALUE *argv;
+    VALUE self;
+{
+    VALUE klass;
 
-    argc = RARRAY(args)->len; /* Assigns LONG, but argc is INT */
-    argv = ALLOCA_N(VALUE, argc);
-    MEMCPY(argv, RARRAY(args)->ptr, VALUE, argc);
-    return rb_call(CLASS_OF(recv), recv, mid, argc, argv, 1, Qundef);
+    if (SPECIAL_CONST_P(self)) {
+	klass = Qnil;
+    }
+    else {
+	klass = rb_singleton_class(self);
+    }
+    return specific_eval(argc, argv, klass, self);
 }
 
 /*
  *  call-seq:
- *     obj.send(symbol [, args...])        => obj
- *     obj.__send__(symbol [, args...])    => obj
+ *     mod.class_eval(string [, filename [, lineno]])  => obj
+ *     mod.module_eval {|| block }                     => obj
  *  
- *  Invokes the method identified by _symbol_, passing it any
- *  arguments specified. You can use <code>\_\_send__</code> if the name
- *  +send+ clashes with an existing method in _obj_.
+ *  Evaluates the string or block in the context of _mod_. This can
+ *  be used to add methods to a class. <code>module_eval</code> returns
+ *  the result of evaluating its argument. The optional _filename_
+ *  and _lineno_ parameters set the text for error messages.
  *     
- *     class Klass
- *       def hello(*args)
- *         "Hello " + args.join(' ')
- *       end
+ *     class Thing
  *     end
- *     k = Klass.new
- *     k.send :hello, "gentle", "readers"   #=> "Hello gentle readers"
+ *     a = %q{def hello() "Hello there!" end}
+ *     Thing.module_eval(a)
+ *     puts Thing.new.hello()
+ *     Thing.module_eval("invalid code", "dummy", 123)
+ *     
+ *  <em>produces:</em>
+ *     
+ *     Hello there!
+ *     dummy:123:in `module_eval': undefined local variable
+ *         or method `code' for Thing:Class
  */
 
-static VALUE
-rb_f_send(argc, argv, recv)
+VALUE
+rb_mod_module_eval(argc, argv, mod)
     int argc;
     VALUE *argv;
-    VALUE recv;
+    VALUE mod;
 {
-    VALUE vid;
-
-    if (argc == 0) rb_raise(rb_eArgError, "no method name given");
+    return specific_eval(argc, argv, mod, mod);
+}
 
-    vid = *argv++; argc--;
-    PUSH_ITER(rb_block_given_p()?ITER_PRE:ITER_NOT);
-    vid = rb_call(CLASS_OF(recv), recv, rb_to_id(vid), argc, argv, 1, Qundef);
-    POP_ITER();
+VALUE rb_load_path;
 
-    return vid;
-}
+NORETURN(static void load_failed _((VALUE)));
 
-static VALUE
-vafuncall(recv, mid, n, ar)
-    VALUE recv;
-    ID mid;
-    int n;
-    va_list *ar;
+void
+rb_load(fname, wrap)
+    VALUE fname;
+    int wrap;
 {
-    VALUE *argv;
+    VALUE tmp;
+    int state;
+    volatile int prohibit_int = rb_prohibit_interrupt;
+    volatile ID last_func;
+    volatile VALUE wrapper = ruby_wrapper;
+    volatile VALUE self = ruby_top_self;
+    NODE *volatile last_node;
+    NODE *saved_cref = ruby_cref;
 
-    if (n > 0) {
-	long i;
+    if (wrap && ruby_safe_level >= 4) {
+	StringValue(fname);
+    }
+    else {
+	SafeStringValue(fname);
+    }
+    fname = rb_str_new4(fname);
+    tmp = rb_find_file(fname);
+    if (!tmp) {
+	load_failed(fname);
+    }
+    fname = tmp;
 
-	argv = ALLOCA_N(VALUE, n);
+    ruby_errinfo = Qnil;	/* ensure */
+    PUSH_VARS();
+    PUSH_CLASS(ruby_wrapper);
+    ruby_cref = ruby_top_cref;
+    if (!wrap) {
+	rb_secure(4);		/* should alter global state */
+	ruby_class = rb_cObject;
+	ruby_wrapper = 0;
+    }
+    else {
+	/* load in anonymous module as toplevel */
+	ruby_class = ruby_wrapper = rb_module_new();
+	self = rb_obj_clone(ruby_top_self);
+	rb_extend_object(self, ruby_wrapper);
+	PUSH_CREF(ruby_wrapper);
+    }
+    PUSH_ITER(ITER_NOT);
+    PUSH_FRAME();
+    ruby_frame->last_func = 0;
+    ruby_frame->last_class = 0;
+    ruby_frame->self = self;
+    PUSH_SCOPE();
+    /* default visibility is private at loading toplevel */
+    SCOPE_SET(SCOPE_PRIVATE);
+    PUSH_TAG(PROT_NONE);
+    state = EXEC_TAG();
+    last_func = ruby_frame->last_func;
+    last_node = ruby_current_node;
+    if (!ruby_current_node && ruby_sourcefile) {
+	last_node = NEW_NEWLINE(0);
+    }
+    ruby_current_node = 0;
+    if (state == 0) {
+	NODE *node;
+	volatile int critical;
 
-	for (i=0;i<n;i++) {
-	    argv[i] = va_arg(*ar, VALUE);
+	DEFER_INTS;
+	ruby_in_eval++;
+	critical = rb_thread_critical;
+	rb_thread_critical = Qtrue;
+	rb_load_file(RSTRING(fname)->ptr);
+	ruby_in_eval--;
+	node = ruby_eval_tree;
+	rb_thread_critical = critical;
+	ALLOW_INTS;
+	if (ruby_nerrs == 0) {
+	    eval_node(self, node);
 	}
-	va_end(*ar);
     }
-    else {
-	argv = 0;
+    ruby_frame->last_func = last_func;
+    ruby_current_node = last_node;
+    ruby_sourcefile = 0;
+    ruby_set_current_source();
+    if (ruby_scope->flags == SCOPE_ALLOCA && ruby_class == rb_cObject) {
+	if (ruby_scope->local_tbl) /* toplevel was empty */
+	    free(ruby_scope->local_tbl);
     }
-
-    return rb_call(CLASS_OF(recv), recv, mid, n, argv, 1, Qundef);
-}
-
-VALUE
-#ifdef HAVE_STDARG_PROTOTYPES
-rb_funcall(VALUE recv, ID mid, int n, ...)
-#else
-rb_funcall(recv, mid, n, va_alist)
-    VALUE recv;
-    ID mid;
-    int n;
-    va_dcl
-#endif
-{
-    va_list ar;
-    va_init_list(ar, n);
-
-    return vafuncall(recv, mid, n, &ar);
+    POP_TAG();
+    rb_prohibit_interrupt = prohibit_int;
+    ruby_cref = saved_cref;
+    POP_SCOPE();
+    POP_FRAME();
+    POP_ITER();
+    POP_CLASS();
+    POP_VARS();
+    ruby_wrapper = wrapper;
+    if (ruby_nerrs > 0) {
+	ruby_nerrs = 0;
+	rb_exc_raise(ruby_errinfo);
+    }
+    if (state) jump_tag_but_local_jump(state, Qundef);
+    if (!NIL_P(ruby_errinfo))	/* exception during load */
+	rb_exc_raise(ruby_errinfo);
 }
 
-VALUE
-#ifdef HAVE_STDARG_PROTOTYPES
-rb_funcall_rescue(VALUE recv, ID mid, int n, ...)
-#else
-rb_funcall_rescue(recv, mid, n, va_alist)
-    VALUE recv;
-    ID mid;
-    int n;
-    va_dcl
-#endif
+void
+rb_load_protect(fname, wrap, state)
+    VALUE fname;
+    int wrap;
+    int *state;
 {
-    VALUE result = Qnil;	/* OK */
     int status;
-    va_list ar;
-
-    va_init_list(ar, n);
 
     PUSH_TAG(PROT_NONE);
     if ((status = EXEC_TAG()) == 0) {
-	result = vafuncall(recv, mid, n, &ar);
+	rb_load(fname, wrap);
     }
     POP_TAG();
-    switch (status) {
-      case 0:
-	return result;
-      case TAG_RAISE:
-	return Qundef;
-      default:
-	JUMP_TAG(status);
-    }
+    if (state) *state = status;
 }
 
-VALUE
-rb_funcall2(recv, mid, argc, argv)
-    VALUE recv;
-    ID mid;
-    int argc;
-    const VALUE *argv;
-{
-    return rb_call(CLASS_OF(recv), recv, mid, argc, argv, 1, Qundef);
-}
+/*
+ *  call-seq:
+ *     load(filename, wrap=false)   => true
+ *  
+ *  Loads and executes the Ruby
+ *  program in the file _filename_. If the filename does not
+ *  resolve to an absolute path, the file is searched for in the library
+ *  directories listed in <code>$:</code>. If the optional _wrap_
+ *  parameter is +true+, the loaded script will be executed
+ *  under an anonymous module, protecting the calling program's global
+ *  namespace. In no circumstance will any local variables in the loaded
+ *  file be propagated to the loading environment.
+ */
 
-VALUE
-rb_funcall3(recv, mid, argc, argv)
-    VALUE recv;
-    ID mid;
+
+static VALUE
+rb_f_load(argc, argv)
     int argc;
-    const VALUE *argv;
+    VALUE *argv;
 {
-    return rb_call(CLASS_OF(recv), recv, mid, argc, argv, 0, Qundef);
+    VALUE fname, wrap;
+
+    rb_scan_args(argc, argv, "11", &fname, &wrap);
+    rb_load(fname, RTEST(wrap));
+    return Qtrue;
 }
 
-VALUE
-rb_call_super(argc, argv)
-    int argc;
-    const VALUE *argv;
-{
-    VALUE result, self, klass;
+VALUE ruby_dln_librefs;
+static VALUE rb_features;
+static st_table *loading_tbl;
 
-    if (ruby_frame->last_class == 0) {
-	rb_name_error(ruby_frame->last_func, "calling `super' from `%s' is prohibited",
-		      rb_id2name(ruby_frame->orig_func));
-    }
+#define IS_SOEXT(e) (strcmp(e, ".so") == 0 || strcmp(e, ".o") == 0)
+#ifdef DLEXT2
+#define IS_DLEXT(e) (strcmp(e, DLEXT) == 0 || strcmp(e, DLEXT2) == 0)
+#else
+#define IS_DLEXT(e) (strcmp(e, DLEXT) == 0)
+#endif
 
-    self = ruby_frame->self;
-    klass = ruby_frame->last_class;
-    if (RCLASS(klass)->super == 0) {
-	return method_missing(self, ruby_frame->orig_func, argc, argv, CSTAT_SUPER);
-    }
 
-    PUSH_ITER(ruby_iter->iter ? ITER_PRE : ITER_NOT);
-    result = rb_call(RCLASS(klass)->super, self, ruby_frame->orig_func, argc, argv, 3, Qundef);
-    POP_ITER();
+static const char *const loadable_ext[] = {
+    ".rb", DLEXT,
+#ifdef DLEXT2
+    DLEXT2,
+#endif
+    0
+};
 
-    return result;
-}
+static int rb_feature_p _((const char *, const char *, int));
+static int search_required _((VALUE, VALUE *, VALUE *));
 
-static VALUE
-backtrace(lev)
-    int lev;
+static int
+rb_feature_p(feature, ext, rb)
+    const char *feature, *ext;
+    int rb;
 {
-    struct FRAME *frame = ruby_frame;
-    char buf[BUFSIZ];
-    VALUE ary;
-    NODE *n;
+    VALUE v;
+    const char *f, *e;
+    long i, len, elen;
 
-    ary = rb_ary_new();
-    if (frame->last_func == ID_ALLOCATOR) {
-	frame = frame->prev;
-    }
-    if (lev < 0) {
-	ruby_set_current_source();
-	if (frame->last_func) {
-	    snprintf(buf, BUFSIZ, "%s:%d:in `%s'",
-		     ruby_sourcefile, ruby_sourceline,
-		     rb_id2name(frame->last_func));
-	}
-	else if (ruby_sourceline == 0) {
-	    snprintf(buf, BUFSIZ, "%s", ruby_sourcefile);
-	}
-	else {
-	    snprintf(buf, BUFSIZ, "%s:%d", ruby_sourcefile, ruby_sourceline);
-	}
-	rb_ary_push(ary, rb_str_new2(buf));
-	if (lev < -1) return ary;
+    if (ext) {
+	len = ext - feature;
+	elen = strlen(ext);
     }
     else {
-	while (lev-- > 0) {
-	    frame = frame->prev;
-	    if (!frame) {
-		ary = Qnil;
-		break;
-	    }
-	}
-    }
-    for (; frame && (n = frame->node); frame = frame->prev) {
-	if (frame->prev && frame->prev->last_func) {
-	    if (frame->prev->node == n) {
-		if (frame->prev->last_func == frame->last_func) continue;
-	    }
-	    snprintf(buf, BUFSIZ, "%s:%d:in `%s'",
-		     n->nd_file, nd_line(n),
-		     rb_id2name(frame->prev->last_func));
-	}
-	else {
-	    snprintf(buf, BUFSIZ, "%s:%d", n->nd_file, nd_line(n));
-	}
-	rb_ary_push(ary, rb_str_new2(buf));
+	len = strlen(feature);
+	elen = 0;
     }
+    for (i = 0; i < RARRAY_LEN(rb_features); ++i) {
+	v = RARRAY_PTR(rb_features)[i];
+	f = StringValuePtr(v);
+	if (RSTRING_LEN(v) < len || strncmp(f, feature, len) != 0)
+	    continue;
+	if (!*(e = f + len)) {
+	    if (ext) continue;
+	    return 'u';
+	}
+	if (*e != '.') continue;
+	if ((!rb || !ext) && (IS_SOEXT(e) || IS_DLEXT(e))) {
+	    return 's';
+	}
+	if ((rb || !ext) && (strcmp(e, ".rb") == 0)) {
+	    return 'r';
+	}
+    }
+    if (loading_tbl) {
+	if (st_lookup(loading_tbl, (st_data_t)feature, 0)) {
+	    if (!ext) return 'u';
+	    return strcmp(ext, ".rb") ? 's' : 'r';
+	}
+	else {
+	    char *buf;
 
-    return ary;
-}
-
-/*
- *  call-seq:
- *     caller(start=1)    => array
- *  
- *  Returns the current execution stack---an array containing strings in
- *  the form ``<em>file:line</em>'' or ``<em>file:line: in
- *  `method'</em>''. The optional _start_ parameter
- *  determines the number of initial stack entries to omit from the
- *  result.
- *     
- *     def a(skip)
- *       caller(skip)
- *     end
- *     def b(skip)
- *       a(skip)
- *     end
- *     def c(skip)
- *       b(skip)
- *     end
- *     c(0)   #=> ["prog:2:in `a'", "prog:5:in `b'", "prog:8:in `c'", "prog:10"]
- *     c(1)   #=> ["prog:5:in `b'", "prog:8:in `c'", "prog:11"]
- *     c(2)   #=> ["prog:8:in `c'", "prog:12"]
- *     c(3)   #=> ["prog:13"]
- */
-
-static VALUE
-rb_f_caller(argc, argv)
-    int argc;
-    VALUE *argv;
-{
-    VALUE level;
-    int lev;
-
-    rb_scan_args(argc, argv, "01", &level);
-
-    if (NIL_P(level)) lev = 1;
-    else lev = NUM2INT(level);
-    if (lev < 0) rb_raise(rb_eArgError, "negative level (%d)", lev);
-
-    return backtrace(lev);
+	    if (ext && *ext) return 0;
+	    buf = ALLOCA_N(char, len + DLEXT_MAXLEN + 1);
+	    MEMCPY(buf, feature, char, len);
+	    for (i = 0; (e = loadable_ext[i]) != 0; i++) {
+		strncpy(buf + len, e, DLEXT_MAXLEN + 1);
+		if (st_lookup(loading_tbl, (st_data_t)buf, 0)) {
+		    return i ? 's' : 'r';
+		}
+	    }
+	}
+    }
+    return 0;
 }
 
-void
-rb_backtrace()
+int
+rb_provided(feature)
+    const char *feature;
 {
-    long i;
-    VALUE ary;
+    const char *ext = strrchr(feature, '.');
 
-    ary = backtrace(-1);
-    for (i=0; i<RARRAY(ary)->len; i++) {
-	printf("\tfrom %s\n", RSTRING(RARRAY(ary)->ptr[i])->ptr);
+    if (ext && !strchr(ext, '/')) {
+	if (strcmp(".rb", ext) == 0) {
+	    if (rb_feature_p(feature, ext, Qtrue)) return Qtrue;
+	    return Qfalse;
+	}
+	else if (IS_SOEXT(ext) || IS_DLEXT(ext)) {
+	    if (rb_feature_p(feature, ext, Qfalse)) return Qtrue;
+	    return Qfalse;
+	}
     }
-}
+    if (rb_feature_p(feature, feature + strlen(feature), Qtrue))
+	return Qtrue;
 
-static VALUE
-make_backtrace()
-{
-    return backtrace(-1);
+    return Qfalse;
 }
 
-ID
-rb_frame_last_func()
+static void
+rb_provide_feature(feature)
+    VALUE feature;
 {
-    return ruby_frame->last_func;
+    rb_ary_push(rb_features, feature);
 }
 
-static NODE*
-compile(src, file, line)
-    VALUE src;
-    char *file;
-    int line;
+void
+rb_provide(feature)
+    const char *feature;
 {
-    NODE *node;
-    int critical;
-
-    ruby_nerrs = 0;
-    StringValue(src);
-    critical = rb_thread_critical;
-    rb_thread_critical = Qtrue;
-    node = rb_compile_string(file, src, line);
-    rb_thread_critical = critical;
-
-    if (ruby_nerrs == 0) return node;
-    return 0;
+    rb_provide_feature(rb_str_new2(feature));
 }
 
-static VALUE
-eval(self, src, scope, file, line)
-    VALUE self, src, scope;
-    char *file;
-    int line;
+static char *
+load_lock(ftptr)
+    const char *ftptr;
 {
-    struct BLOCK *data = NULL;
-    volatile VALUE result = Qnil;
-    struct SCOPE * volatile old_scope;
-    struct BLOCK * volatile old_block;
-    struct RVarmap * volatile old_dyna_vars;
-    VALUE volatile old_cref;
-    int volatile old_vmode;
-    volatile VALUE old_wrapper;
-    struct FRAME frame;
-    NODE *nodesave = ruby_current_node;
-    volatile int iter = ruby_frame->iter;
-    volatile int safe = ruby_safe_level;
-    int state;
-
-    if (!NIL_P(scope)) {
-	if (!rb_obj_is_proc(scope)) {
-	    rb_raise(rb_eTypeError, "wrong argument type %s (expected Proc/Binding)",
-		     rb_obj_classname(scope));
-	}
-
-	Data_Get_Struct(scope, struct BLOCK, data);
-	/* PUSH BLOCK from data */
-	frame = data->frame;
-	frame.tmp = ruby_frame;	/* gc protection */
-	ruby_frame = &(frame);
-	old_scope = ruby_scope;
-	ruby_scope = data->scope;
-	old_block = ruby_block;
-	ruby_block = data->prev;
-	old_dyna_vars = ruby_dyna_vars;
-	ruby_dyna_vars = data->dyna_vars;
-	old_vmode = scope_vmode;
-	scope_vmode = data->vmode;
-	old_cref = (VALUE)ruby_cref;
-	ruby_cref = data->cref;
-	old_wrapper = ruby_wrapper;
-	ruby_wrapper = data->wrapper;
-	if ((file == 0 || (line == 1 && strcmp(file, "(eval)") == 0)) && data->frame.node) {
-	    file = data->frame.node->nd_file;
-	    if (!file) file = "__builtin__";
-	    line = nd_line(data->frame.node);
-	}
-
-	self = data->self;
-	ruby_frame->iter = data->iter;
-    }
-    else {
-	if (ruby_frame->prev) {
-	    ruby_frame->iter = ruby_frame->prev->iter;
-	}
-    }
-    if (file == 0) {
-	ruby_set_current_source();
-	file = ruby_sourcefile;
-	line = ruby_sourceline;
-    }
-    PUSH_CLASS(data ? data->klass : ruby_class);
-    ruby_in_eval++;
-    if (TYPE(ruby_class) == T_ICLASS) {
-	ruby_class = RBASIC(ruby_class)->klass;
-    }
-    PUSH_TAG(PROT_NONE);
-    if ((state = EXEC_TAG()) == 0) {
-	NODE *node;
-
-	ruby_safe_level = 0;
-	result = ruby_errinfo;
-	ruby_errinfo = Qnil;
-	node = compile(src, file, line);
-	ruby_safe_level = safe;
-	if (ruby_nerrs > 0) {
-	    compile_error(0);
-	}
-	if (!NIL_P(result)) ruby_errinfo = result;
-	result = eval_node(self, node);
-    }
-    POP_TAG();
-    POP_CLASS();
-    ruby_in_eval--;
-    if (!NIL_P(scope)) {
-	int dont_recycle = ruby_scope->flags & SCOPE_DONT_RECYCLE;
-
-	ruby_wrapper = old_wrapper;
-	ruby_cref  = (NODE*)old_cref;
-	ruby_frame = frame.tmp;
-	ruby_scope = old_scope;
-	ruby_block = old_block;
-	ruby_dyna_vars = old_dyna_vars;
-	data->vmode = scope_vmode; /* write back visibility mode */
-	scope_vmode = old_vmode;
-	if (dont_recycle) {
-	    struct tag *tag;
-	    struct RVarmap *vars;
+    st_data_t th;
 
-	    scope_dup(ruby_scope);
-	    for (tag=prot_tag; tag; tag=tag->prev) {
-		scope_dup(tag->scope);
-	    }
-	    for (vars = ruby_dyna_vars; vars; vars = vars->next) {
-		FL_SET(vars, DVAR_DONT_RECYCLE);
-	    }
+    if (!loading_tbl ||
+	!st_lookup(loading_tbl, (st_data_t)ftptr, &th))
+    {
+	/* loading ruby library should be serialized. */
+	if (!loading_tbl) {
+	    loading_tbl = st_init_strtable();
 	}
+	/* partial state */
+	ftptr = ruby_strdup(ftptr);
+	st_insert(loading_tbl, (st_data_t)ftptr, (st_data_t)curr_thread);
+	return (char *)ftptr;
     }
-    else {
-	ruby_frame->iter = iter;
-    }
-    ruby_current_node = nodesave;
-    ruby_set_current_source();
-    if (state) {
-	if (state == TAG_RAISE) {
-	    if (strcmp(file, "(eval)") == 0) {
-		VALUE mesg, errat, bt2;
+    do {
+	if ((rb_thread_t)th == curr_thread) return 0;
+	CHECK_INTS;
+    } while (st_lookup(loading_tbl, (st_data_t)ftptr, &th));
+    return 0;
+}
 
-		errat = get_backtrace(ruby_errinfo);
-		mesg = rb_attr_get(ruby_errinfo, rb_intern("mesg"));
-		if (!NIL_P(errat) && TYPE(errat) == T_ARRAY &&
-		    (bt2 = backtrace(-2), RARRAY(bt2)->len > 0)) {
-		    if (!NIL_P(mesg) && TYPE(mesg) == T_STRING) {
-			rb_str_update(mesg, 0, 0, rb_str_new2(": "));
-			rb_str_update(mesg, 0, 0, RARRAY(errat)->ptr[0]);
-		    }
-		    RARRAY(errat)->ptr[0] = RARRAY(bt2)->ptr[0];
-		}
-	    }
-	    rb_exc_raise(ruby_errinfo);
+static void
+load_unlock(const char *ftptr)
+{
+    if (ftptr) {
+	st_data_t key = (st_data_t)ftptr;
+	
+	if (st_delete(loading_tbl, &key, 0)) {
+	    free((char *)key);
 	}
-	JUMP_TAG(state);
     }
-
-    return result;
 }
 
 /*
  *  call-seq:
- *     eval(string [, binding [, filename [,lineno]]])  => obj
- *  
- *  Evaluates the Ruby expression(s) in <em>string</em>. If
- *  <em>binding</em> is given, the evaluation is performed in its
- *  context. The binding may be a <code>Binding</code> object or a
- *  <code>Proc</code> object. If the optional <em>filename</em> and
- *  <em>lineno</em> parameters are present, they will be used when
- *  reporting syntax errors.
+ *     require(string)    => true or false
+ *  
+ *  Ruby tries to load the library named _string_, returning
+ *  +true+ if successful. If the filename does not resolve to
+ *  an absolute path, it will be searched for in the directories listed
+ *  in <code>$:</code>. If the file has the extension ``.rb'', it is
+ *  loaded as a source file; if the extension is ``.so'', ``.o'', or
+ *  ``.dll'', or whatever the default shared library extension is on
+ *  the current platform, Ruby loads the shared library as a Ruby
+ *  extension. Otherwise, Ruby tries adding ``.rb'', ``.so'', and so on
+ *  to the name. The name of the loaded feature is added to the array in
+ *  <code>$"</code>. A feature will not be loaded if it's name already
+ *  appears in <code>$"</code>. However, the file name is not converted
+ *  to an absolute path, so that ``<code>require 'a';require
+ *  './a'</code>'' will load <code>a.rb</code> twice.
  *     
- *     def getBinding(str)
- *       return binding
- *     end
- *     str = "hello"
- *     eval "str + ' Fred'"                      #=> "hello Fred"
- *     eval "str + ' Fred'", getBinding("bye")   #=> "bye Fred"
+ *     require "my-library.rb"
+ *     require "db-driver"
  */
 
-static VALUE
-rb_f_eval(argc, argv, self)
-    int argc;
-    VALUE *argv;
-    VALUE self;
+VALUE
+rb_f_require(obj, fname)
+    VALUE obj, fname;
 {
-    VALUE src, scope, vfile, vline;
-    char *file = "(eval)";
-    int line = 1;
+    return rb_require_safe(fname, ruby_safe_level);
+}
 
-    rb_scan_args(argc, argv, "13", &src, &scope, &vfile, &vline);
-    if (ruby_safe_level >= 4) {
-	StringValue(src);
-	if (!NIL_P(scope) && !OBJ_TAINTED(scope)) {
-	    rb_raise(rb_eSecurityError, "Insecure: can't modify trusted binding");
+static int
+search_required(fname, featurep, path)
+    VALUE fname, *featurep, *path;
+{
+    VALUE tmp;
+    char *ext, *ftptr;
+    int type;
+
+    *featurep = fname;
+    *path = 0;
+    ext = strrchr(ftptr = RSTRING_PTR(fname), '.');
+    if (ext && !strchr(ext, '/')) {
+	if (strcmp(".rb", ext) == 0) {
+	    if (rb_feature_p(ftptr, ext, Qtrue)) return 'r';
+	    if ((*path = rb_find_file(fname)) != 0) return 'r';
+	    return 0;
+	}
+	else if (IS_SOEXT(ext)) {
+	    if (rb_feature_p(ftptr, ext, Qfalse)) return 's';
+	    tmp = rb_str_new(RSTRING_PTR(fname), ext-RSTRING_PTR(fname));
+	    *featurep = tmp;
+#ifdef DLEXT2
+	    OBJ_FREEZE(tmp);
+	    if (rb_find_file_ext(&tmp, loadable_ext+1)) {
+		*featurep = tmp;
+		*path = rb_find_file(tmp);
+		return 's';
+	    }
+#else
+	    rb_str_cat2(tmp, DLEXT);
+	    OBJ_FREEZE(tmp);
+	    if ((*path = rb_find_file(tmp)) != 0) {
+		return 's';
+	    }
+#endif
+	}
+	else if (IS_DLEXT(ext)) {
+	    if (rb_feature_p(ftptr, ext, Qfalse)) return 's';
+	    if ((*path = rb_find_file(fname)) != 0) return 's';
 	}
     }
-    else {
-	SafeStringValue(src);
-    }
-    if (argc >= 3) {
-	StringValue(vfile);
-    }
-    if (argc >= 4) {
-	line = NUM2INT(vline);
-    }
-
-    if (!NIL_P(vfile)) file = RSTRING(vfile)->ptr;
-    if (NIL_P(scope) && ruby_frame->prev) {
-	struct FRAME *prev;
-	VALUE val;
-
-	prev = ruby_frame;
-	PUSH_FRAME();
-	*ruby_frame = *prev->prev;
-	ruby_frame->prev = prev;
-	val = eval(self, src, scope, file, line);
-	POP_FRAME();
+    tmp = fname;
+    type = rb_find_file_ext(&tmp, loadable_ext);
+    *featurep = tmp;
+    switch (type) {
+      case 0:
+	ftptr = RSTRING_PTR(tmp);
+	return rb_feature_p(ftptr, 0, Qfalse);
 
-	return val;
+      default:
+	ext = strrchr(ftptr = RSTRING(tmp)->ptr, '.');
+	if (rb_feature_p(ftptr, ext, !--type)) break;
+	*path = rb_find_file(tmp);
     }
-    return eval(self, src, scope, file, line);
+    return type ? 's' : 'r';
 }
 
-/* function to call func under the specified class/module context */
-static VALUE
-exec_under(func, under, cbase, args)
-    VALUE (*func)();
-    VALUE under, cbase;
-    void *args;
+static void
+load_failed(fname)
+    VALUE fname;
 {
-    VALUE val = Qnil;		/* OK */
+    rb_raise(rb_eLoadError, "no such file to load -- %s", RSTRING(fname)->ptr);
+}
+
+VALUE
+rb_require_safe(fname, safe)
+    VALUE fname;
+    int safe;
+{
+    VALUE result = Qnil;
+    volatile VALUE errinfo = ruby_errinfo;
     int state;
-    int mode;
-    struct FRAME *f = ruby_frame;
+    struct {
+	NODE *node;
+	ID func;
+	int vmode, safe;
+    } volatile saved;
+    char *volatile ftptr = 0;
 
-    PUSH_CLASS(under);
-    PUSH_FRAME();
-    ruby_frame->self = f->self;
-    ruby_frame->last_func = f->last_func;
-    ruby_frame->orig_func = f->orig_func;
-    ruby_frame->last_class = f->last_class;
-    ruby_frame->argc = f->argc;
-    if (cbase) {
-	PUSH_CREF(cbase);
+    if (OBJ_TAINTED(fname)) {
+	rb_check_safe_obj(fname);
     }
-
-    mode = scope_vmode;
-    SCOPE_SET(SCOPE_PUBLIC);
+    StringValue(fname);
+    fname = rb_str_new4(fname);
+    saved.vmode = scope_vmode;
+    saved.node = ruby_current_node;
+    saved.func = ruby_frame->last_func;
+    saved.safe = ruby_safe_level;
     PUSH_TAG(PROT_NONE);
     if ((state = EXEC_TAG()) == 0) {
-	val = (*func)(args);
+	VALUE feature, path;
+	long handle;
+	int found;
+
+	ruby_safe_level = safe;
+	found = search_required(fname, &feature, &path);
+	if (found) {
+	    if (!path || !(ftptr = load_lock(RSTRING_PTR(feature)))) {
+		result = Qfalse;
+	    }
+	    else {
+		ruby_safe_level = 0;
+		switch (found) {
+		  case 'r':
+		    rb_load(path, 0);
+		    break;
+
+		  case 's':
+		    ruby_current_node = 0;
+		    ruby_sourcefile = rb_source_filename(RSTRING(path)->ptr);
+		    ruby_sourceline = 0;
+		    ruby_frame->last_func = 0;
+		    SCOPE_SET(SCOPE_PUBLIC);
+		    handle = (long)dln_load(RSTRING(path)->ptr);
+		    rb_ary_push(ruby_dln_librefs, LONG2NUM(handle));
+		    break;
+		}
+		rb_provide_feature(feature);
+		result = Qtrue;
+	    }
+	}
     }
     POP_TAG();
-    if (cbase) POP_CREF();
-    SCOPE_SET(mode);
-    POP_FRAME();
-    POP_CLASS();
+    ruby_current_node = saved.node;
+    ruby_set_current_source();
+    ruby_frame->last_func = saved.func;
+    SCOPE_SET(saved.vmode);
+    ruby_safe_level = saved.safe;
+    load_unlock(ftptr);
     if (state) JUMP_TAG(state);
+    if (NIL_P(result)) {
+	load_failed(fname);
+    }
+    ruby_errinfo = errinfo;
 
-    return val;
+    return result;
 }
 
-static VALUE
-eval_under_i(args)
-    VALUE *args;
+VALUE
+rb_require(fname)
+    const char *fname;
 {
-    struct FRAME *f = ruby_frame;
-
-    if (f && (f = f->prev) && (f = f->prev)) {
-	ruby_frame = f;
-    }
-    return eval(args[0], args[1], Qnil, (char*)args[2], (int)args[3]);
+    VALUE fn = rb_str_new2(fname);
+    OBJ_FREEZE(fn);
+    return rb_require_safe(fn, ruby_safe_level);
 }
 
-/* string eval under the class/module context */
-static VALUE
-eval_under(under, self, src, file, line)
-    VALUE under, self, src;
-    const char *file;
-    int line;
+void
+ruby_init_ext(name, init)
+    const char *name;
+    void (*init) _((void));
 {
-    VALUE args[4];
-
-    if (ruby_safe_level >= 4) {
-	StringValue(src);
-    }
-    else {
-	SafeStringValue(src);
-    }
-    args[0] = self;
-    args[1] = src;
-    args[2] = (VALUE)file;
-    args[3] = (VALUE)line;
-    return exec_under(eval_under_i, under, under, args);
+    ruby_current_node = 0;
+    ruby_sourcefile = rb_source_filename(name);
+    ruby_sourceline = 0;
+    ruby_frame->last_func = 0;
+    ruby_frame->orig_func = 0;
+    SCOPE_SET(SCOPE_PUBLIC);
+    if (load_lock(name)) {
+	(*init)();
+	rb_provide(name);
+	load_unlock(name);
+    }
 }
 
-static VALUE
-yield_under_i(self)
+static void
+secure_visibility(self)
     VALUE self;
 {
-    return rb_yield_0(self, self, ruby_class, YIELD_PUBLIC_DEF, Qfalse);
-}
-
-/* block eval under the class/module context */
-static VALUE
-yield_under(under, self)
-    VALUE under, self;
-{
-    return exec_under(yield_under_i, under, 0, self);
+    if (ruby_safe_level >= 4 && !OBJ_TAINTED(self)) {
+	rb_raise(rb_eSecurityError, "Insecure: can't change method visibility");
+    }
 }
 
-static VALUE
-specific_eval(argc, argv, klass, self)
+static void
+set_method_visibility(self, argc, argv, ex)
+    VALUE self;
     int argc;
     VALUE *argv;
-    VALUE klass, self;
+    ID ex;
 {
-    if (rb_block_given_p()) {
-	if (argc > 0) {
-	    rb_raise(rb_eArgError, "wrong number of arguments (%d for 0)", argc);
-	}
-	return yield_under(klass, self);
-    }
-    else {
-	char *file = "(eval)";
-	int   line = 1;
+    int i;
 
-	if (argc == 0) {
-	    rb_raise(rb_eArgError, "block not supplied");
-	}
-	else {
-	    if (ruby_safe_level >= 4) {
-		StringValue(argv[0]);
-	    }
-	    else {
-		SafeStringValue(argv[0]);
-	    }
-	    if (argc > 3) {
-		rb_raise(rb_eArgError, "wrong number of arguments: %s(src) or %s{..}",
-			 rb_id2name(ruby_frame->last_func),
-			 rb_id2name(ruby_frame->last_func));
-	    }
-	    if (argc > 2) line = NUM2INT(argv[2]);
-	    if (argc > 1) {
-		file = StringValuePtr(argv[1]);
-	    }
-	}
-	return eval_under(klass, self, argv[0], file, line);
+    secure_visibility(self);
+    for (i=0; i<argc; i++) {
+	rb_export_method(self, rb_to_id(argv[i]), ex);
     }
+    rb_clear_cache_by_class(self);
 }
 
 /*
  *  call-seq:
- *     obj.instance_eval(string [, filename [, lineno]] )   => obj
- *     obj.instance_eval {| | block }                       => obj
+ *     public                 => self
+ *     public(symbol, ...)    => self
  *  
- *  Evaluates a string containing Ruby source code, or the given block,
- *  within the context of the receiver (_obj_). In order to set the
- *  context, the variable +self+ is set to _obj_ while
- *  the code is executing, giving the code access to _obj_'s
- *  instance variables. In the version of <code>instance_eval</code>
- *  that takes a +String+, the optional second and third
- *  parameters supply a filename and starting line number that are used
- *  when reporting compilation errors.
- *     
- *     class Klass
- *       def initialize
- *         @secret = 99
- *       end
- *     end
- *     k = Klass.new
- *     k.instance_eval { @secret }   #=> 99
+ *  With no arguments, sets the default visibility for subsequently
+ *  defined methods to public. With arguments, sets the named methods to
+ *  have public visibility.
  */
 
-VALUE
-rb_obj_instance_eval(argc, argv, self)
+static VALUE
+rb_mod_public(argc, argv, module)
     int argc;
     VALUE *argv;
-    VALUE self;
+    VALUE module;
 {
-    VALUE klass;
-
-    if (SPECIAL_CONST_P(self)) {
-	klass = Qnil;
+    secure_visibility(module);
+    if (argc == 0) {
+	SCOPE_SET(SCOPE_PUBLIC);
     }
     else {
-	klass = rb_singleton_class(self);
+	set_method_visibility(module, argc, argv, NOEX_PUBLIC);
     }
-    return specific_eval(argc, argv, klass, self);
+    return module;
 }
 
 /*
  *  call-seq:
- *     mod.class_eval(string [, filename [, lineno]])  => obj
- *     mod.module_eval {|| block }                     => obj
+ *     protected                => self
+ *     protected(symbol, ...)   => self
  *  
- *  Evaluates the string or block in the context of _mod_. This can
- *  be used to add methods to a class. <code>module_eval</code> returns
- *  the result of evaluating its argument. The optional _filename_
- *  and _lineno_ parameters set the text for error messages.
- *     
- *     class Thing
- *     end
- *     a = %q{def hello() "Hello there!" end}
- *     Thing.module_eval(a)
- *     puts Thing.new.hello()
- *     Thing.module_eval("invalid code", "dummy", 123)
- *     
- *  <em>produces:</em>
- *     
- *     Hello there!
- *     dummy:123:in `module_eval': undefined local variable
- *         or method `code' for Thing:Class
+ *  With no arguments, sets the default visibility for subsequently
+ *  defined methods to protected. With arguments, sets the named methods
+ *  to have protected visibility.
  */
 
-VALUE
-rb_mod_module_eval(argc, argv, mod)
+static VALUE
+rb_mod_protected(argc, argv, module)
     int argc;
     VALUE *argv;
-    VALUE mod;
-{
-    return specific_eval(argc, argv, mod, mod);
-}
-
-VALUE rb_load_path;
-
-NORETURN(static void load_failed _((VALUE)));
-
-void
-rb_load(fname, wrap)
-    VALUE fname;
-    int wrap;
+    VALUE module;
 {
-    VALUE tmp;
-    int state;
-    volatile int prohibit_int = rb_prohibit_interrupt;
-    volatile ID last_func;
-    volatile VALUE wrapper = ruby_wrapper;
-    volatile VALUE self = ruby_top_self;
-    NODE *volatile last_node;
-    NODE *saved_cref = ruby_cref;
-
-    if (wrap && ruby_safe_level >= 4) {
-	StringValue(fname);
-    }
-    else {
-	SafeStringValue(fname);
-    }
-    fname = rb_str_new4(fname);
-    tmp = rb_find_file(fname);
-    if (!tmp) {
-	load_failed(fname);
-    }
-    fname = tmp;
-
-    ruby_errinfo = Qnil;	/* ensure */
-    PUSH_VARS();
-    PUSH_CLASS(ruby_wrapper);
-    ruby_cref = ruby_top_cref;
-    if (!wrap) {
-	rb_secure(4);		/* should alter global state */
-	ruby_class = rb_cObject;
-	ruby_wrapper = 0;
+    secure_visibility(module);
+    if (argc == 0) {
+	SCOPE_SET(SCOPE_PROTECTED);
     }
     else {
-	/* load in anonymous module as toplevel */
-	ruby_class = ruby_wrapper = rb_module_new();
-	self = rb_obj_clone(ruby_top_self);
-	rb_extend_object(self, ruby_wrapper);
-	PUSH_CREF(ruby_wrapper);
-    }
-    PUSH_ITER(ITER_NOT);
-    PUSH_FRAME();
-    ruby_frame->last_func = 0;
-    ruby_frame->last_class = 0;
-    ruby_frame->self = self;
-    PUSH_SCOPE();
-    /* default visibility is private at loading toplevel */
-    SCOPE_SET(SCOPE_PRIVATE);
-    PUSH_TAG(PROT_NONE);
-    state = EXEC_TAG();
-    last_func = ruby_frame->last_func;
-    last_node = ruby_current_node;
-    if (!ruby_current_node && ruby_sourcefile) {
-	last_node = NEW_NEWLINE(0);
-    }
-    ruby_current_node = 0;
-    if (state == 0) {
-	NODE *node;
-	volatile int critical;
-
-	DEFER_INTS;
-	ruby_in_eval++;
-	critical = rb_thread_critical;
-	rb_thread_critical = Qtrue;
-	rb_load_file(RSTRING(fname)->ptr);
-	ruby_in_eval--;
-	node = ruby_eval_tree;
-	rb_thread_critical = critical;
-	ALLOW_INTS;
-	if (ruby_nerrs == 0) {
-	    eval_node(self, node);
-	}
-    }
-    ruby_frame->last_func = last_func;
-    ruby_current_node = last_node;
-    ruby_sourcefile = 0;
-    ruby_set_current_source();
-    if (ruby_scope->flags == SCOPE_ALLOCA && ruby_class == rb_cObject) {
-	if (ruby_scope->local_tbl) /* toplevel was empty */
-	    free(ruby_scope->local_tbl);
-    }
-    POP_TAG();
-    rb_prohibit_interrupt = prohibit_int;
-    ruby_cref = saved_cref;
-    POP_SCOPE();
-    POP_FRAME();
-    POP_ITER();
-    POP_CLASS();
-    POP_VARS();
-    ruby_wrapper = wrapper;
-    if (ruby_nerrs > 0) {
-	ruby_nerrs = 0;
-	rb_exc_raise(ruby_errinfo);
-    }
-    if (state) jump_tag_but_local_jump(state, Qundef);
-    if (!NIL_P(ruby_errinfo))	/* exception during load */
-	rb_exc_raise(ruby_errinfo);
-}
-
-void
-rb_load_protect(fname, wrap, state)
-    VALUE fname;
-    int wrap;
-    int *state;
-{
-    int status;
-
-    PUSH_TAG(PROT_NONE);
-    if ((status = EXEC_TAG()) == 0) {
-	rb_load(fname, wrap);
-    }
-    POP_TAG();
-    if (state) *state = status;
+	set_method_visibility(module, argc, argv, NOEX_PROTECTED);
+    }
+    return module;
 }
 
 /*
  *  call-seq:
- *     load(filename, wrap=false)   => true
+ *     private                 => self
+ *     private(symbol, ...)    => self
  *  
- *  Loads and executes the Ruby
- *  program in the file _filename_. If the filename does not
- *  resolve to an absolute path, the file is searched for in the library
- *  directories listed in <code>$:</code>. If the optional _wrap_
- *  parameter is +true+, the loaded script will be executed
- *  under an anonymous module, protecting the calling program's global
- *  namespace. In no circumstance will any local variables in the loaded
- *  file be propagated to the loading environment.
+ *  With no arguments, sets the default visibility for subsequently
+ *  defined methods to private. With arguments, sets the named methods
+ *  to have private visibility.
+ *     
+ *     module Mod
+ *       def a()  end
+ *       def b()  end
+ *       private
+ *       def c()  end
+ *       private :a
+ *     end
+ *     Mod.private_instance_methods   #=> ["a", "c"]
  */
 
-
 static VALUE
-rb_f_load(argc, argv)
+rb_mod_private(argc, argv, module)
     int argc;
     VALUE *argv;
+    VALUE module;
 {
-    VALUE fname, wrap;
-
-    rb_scan_args(argc, argv, "11", &fname, &wrap);
-    rb_load(fname, RTEST(wrap));
-    return Qtrue;
-}
-
-VALUE ruby_dln_librefs;
-static VALUE rb_features;
-static st_table *loading_tbl;
-
-#define IS_SOEXT(e) (strcmp(e, ".so") == 0 || strcmp(e, ".o") == 0)
-#ifdef DLEXT2
-#define IS_DLEXT(e) (strcmp(e, DLEXT) == 0 || strcmp(e, DLEXT2) == 0)
-#else
-#define IS_DLEXT(e) (strcmp(e, DLEXT) == 0)
-#endif
-
-
-static const char *const loadable_ext[] = {
-    ".rb", DLEXT,
-#ifdef DLEXT2
-    DLEXT2,
-#endif
-    0
-};
-
-static int rb_feature_p _((const char *, const char *, int));
-static int search_required _((VALUE, VALUE *, VALUE *));
-
-static int
-rb_feature_p(feature, ext, rb)
-    const char *feature, *ext;
-    int rb;
-{
-    VALUE v;
-    const char *f, *e;
-    long i, len, elen;
-
-    if (ext) {
-	len = ext - feature;
-	elen = strlen(ext);
+    secure_visibility(module);
+    if (argc == 0) {
+	SCOPE_SET(SCOPE_PRIVATE);
     }
     else {
-	len = strlen(feature);
-	elen = 0;
-    }
-    for (i = 0; i < RARRAY_LEN(rb_features); ++i) {
-	v = RARRAY_PTR(rb_features)[i];
-	f = StringValuePtr(v);
-	if (RSTRING_LEN(v) < len || strncmp(f, feature, len) != 0)
-	    continue;
-	if (!*(e = f + len)) {
-	    if (ext) continue;
-	    return 'u';
-	}
-	if (*e != '.') continue;
-	if ((!rb || !ext) && (IS_SOEXT(e) || IS_DLEXT(e))) {
-	    return 's';
-	}
-	if ((rb || !ext) && (strcmp(e, ".rb") == 0)) {
-	    return 'r';
-	}
-    }
-    if (loading_tbl) {
-	if (st_lookup(loading_tbl, (st_data_t)feature, 0)) {
-	    if (!ext) return 'u';
-	    return strcmp(ext, ".rb") ? 's' : 'r';
-	}
-	else {
-	    char *buf;
-
-	    if (ext && *ext) return 0;
-	    buf = ALLOCA_N(char, len + DLEXT_MAXLEN + 1);
-	    MEMCPY(buf, feature, char, len);
-	    for (i = 0; (e = loadable_ext[i]) != 0; i++) {
-		strncpy(buf + len, e, DLEXT_MAXLEN + 1);
-		if (st_lookup(loading_tbl, (st_data_t)buf, 0)) {
-		    return i ? 's' : 'r';
-		}
-	    }
-	}
+	set_method_visibility(module, argc, argv, NOEX_PRIVATE);
     }
-    return 0;
+    return module;
 }
 
-int
-rb_provided(feature)
-    const char *feature;
-{
-    const char *ext = strrchr(feature, '.');
-
-    if (ext && !strchr(ext, '/')) {
-	if (strcmp(".rb", ext) == 0) {
-	    if (rb_feature_p(feature, ext, Qtrue)) return Qtrue;
-	    return Qfalse;
-	}
-	else if (IS_SOEXT(ext) || IS_DLEXT(ext)) {
-	    if (rb_feature_p(feature, ext, Qfalse)) return Qtrue;
-	    return Qfalse;
-	}
-    }
-    if (rb_feature_p(feature, feature + strlen(feature), Qtrue))
-	return Qtrue;
+/*
+ *  call-seq:
+ *     mod.public_class_method(symbol, ...)    => mod
+ *  
+ *  Makes a list of existing class methods public.
+ */
 
-    return Qfalse;
+static VALUE
+rb_mod_public_method(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    set_method_visibility(CLASS_OF(obj), argc, argv, NOEX_PUBLIC);
+    return obj;
 }
 
-static void
-rb_provide_feature(feature)
-    VALUE feature;
+/*
+ *  call-seq:
+ *     mod.private_class_method(symbol, ...)   => mod
+ *  
+ *  Makes existing class methods private. Often used to hide the default
+ *  constructor <code>new</code>.
+ *     
+ *     class SimpleSingleton  # Not thread safe
+ *       private_class_method :new
+ *       def SimpleSingleton.create(*args, &block)
+ *         @me = new(*args, &block) if ! @me
+ *         @me
+ *       end
+ *     end
+ */
+
+static VALUE
+rb_mod_private_method(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
 {
-    rb_ary_push(rb_features, feature);
+    set_method_visibility(CLASS_OF(obj), argc, argv, NOEX_PRIVATE);
+    return obj;
 }
 
-void
-rb_provide(feature)
-    const char *feature;
+/*
+ *  call-seq:
+ *     public
+ *     public(symbol, ...)
+ *  
+ *  With no arguments, sets the default visibility for subsequently
+ *  defined methods to public. With arguments, sets the named methods to
+ *  have public visibility.
+ */
+
+static VALUE
+top_public(argc, argv)
+    int argc;
+    VALUE *argv;
 {
-    rb_provide_feature(rb_str_new2(feature));
+    return rb_mod_public(argc, argv, rb_cObject);
 }
 
-static char *
-load_lock(ftptr)
-    const char *ftptr;
+static VALUE
+top_private(argc, argv)
+    int argc;
+    VALUE *argv;
 {
-    st_data_t th;
-
-    if (!loading_tbl ||
-	!st_lookup(loading_tbl, (st_data_t)ftptr, &th))
-    {
-	/* loading ruby library should be serialized. */
-	if (!loading_tbl) {
-	    loading_tbl = st_init_strtable();
-	}
-	/* partial state */
-	ftptr = ruby_strdup(ftptr);
-	st_insert(loading_tbl, (st_data_t)ftptr, (st_data_t)curr_thread);
-	return (char *)ftptr;
-    }
-    do {
-	if ((rb_thread_t)th == curr_thread) return 0;
-	CHECK_INTS;
-    } while (st_lookup(loading_tbl, (st_data_t)ftptr, &th));
-    return 0;
+    return rb_mod_private(argc, argv, rb_cObject);
 }
 
-static void
-load_unlock(const char *ftptr)
+/*
+ *  call-seq:
+ *     module_function(symbol, ...)    => self
+ *  
+ *  Creates module functions for the named methods. These functions may
+ *  be called with the module as a receiver, and also become available
+ *  as instance methods to classes that mix in the module. Module
+ *  functions are copies of the original, and so may be changed
+ *  independently. The instance-method versions are made private. If
+ *  used with no arguments, subsequently defined methods become module
+ *  functions.
+ *     
+ *     module Mod
+ *       def one
+ *         "This is one"
+ *       end
+ *       module_function :one
+ *     end
+ *     class Cls
+ *       include Mod
+ *       def callOne
+ *         one
+ *       end
+ *     end
+ *     Mod.one     #=> "This is one"
+ *     c = Cls.new
+ *     c.callOne   #=> "This is one"
+ *     module Mod
+ *       def one
+ *         "This is the new one"
+ *       end
+ *     end
+ *     Mod.one     #=> "This is one"
+ *     c.callOne   #=> "This is the new one"
+ */
+
+static VALUE
+rb_mod_modfunc(argc, argv, module)
+    int argc;
+    VALUE *argv;
+    VALUE module;
 {
-    if (ftptr) {
-	st_data_t key = (st_data_t)ftptr;
-	
-	if (st_delete(loading_tbl, &key, 0)) {
-	    free((char *)key);
+    int i;
+    ID id;
+    NODE *body;
+
+    if (TYPE(module) != T_MODULE) {
+	rb_raise(rb_eTypeError, "module_function must be called for modules");
+    }
+
+    secure_visibility(module);
+    if (argc == 0) {
+	SCOPE_SET(SCOPE_MODFUNC);
+	return module;
+    }
+
+    set_method_visibility(module, argc, argv, NOEX_PRIVATE);
+    for (i=0; i<argc; i++) {
+	VALUE m = module;
+
+	id = rb_to_id(argv[i]);
+	for (;;) {
+	    body = search_method(m, id, &m);
+	    if (body == 0) {
+		body = search_method(rb_cObject, id, &m);
+	    }
+	    if (body == 0 || body->nd_body == 0) {
+		rb_bug("undefined method `%s'; can't happen", rb_id2name(id));
+	    }
+	    if (nd_type(body->nd_body) != NODE_ZSUPER) {
+		break;		/* normal case: need not to follow 'super' link */
+	    }
+	    m = RCLASS(m)->super;
+	    if (!m) break;
 	}
+	rb_add_method(rb_singleton_class(module), id, body->nd_body, NOEX_PUBLIC);
     }
+    return module;
 }
 
 /*
  *  call-seq:
- *     require(string)    => true or false
+ *     append_features(mod)   => mod
  *  
- *  Ruby tries to load the library named _string_, returning
- *  +true+ if successful. If the filename does not resolve to
- *  an absolute path, it will be searched for in the directories listed
- *  in <code>$:</code>. If the file has the extension ``.rb'', it is
- *  loaded as a source file; if the extension is ``.so'', ``.o'', or
- *  ``.dll'', or whatever the default shared library extension is on
- *  the current platform, Ruby loads the shared library as a Ruby
- *  extension. Otherwise, Ruby tries adding ``.rb'', ``.so'', and so on
- *  to the name. The name of the loaded feature is added to the array in
- *  <code>$"</code>. A feature will not be loaded if it's name already
- *  appears in <code>$"</code>. However, the file name is not converted
- *  to an absolute path, so that ``<code>require 'a';require
- *  './a'</code>'' will load <code>a.rb</code> twice.
- *     
- *     require "my-library.rb"
- *     require "db-driver"
+ *  When this module is included in another, Ruby calls
+ *  <code>append_features</code> in this module, passing it the
+ *  receiving module in _mod_. Ruby's default implementation is
+ *  to add the constants, methods, and module variables of this module
+ *  to _mod_ if this module has not already been added to
+ *  _mod_ or one of its ancestors. See also <code>Module#include</code>.
  */
 
-VALUE
-rb_f_require(obj, fname)
-    VALUE obj, fname;
+static VALUE
+rb_mod_append_features(module, include)
+    VALUE module, include;
 {
-    return rb_require_safe(fname, ruby_safe_level);
+    switch (TYPE(include)) {
+      case T_CLASS:
+      case T_MODULE:
+	break;
+      default:
+	Check_Type(include, T_CLASS);
+	break;
+    }
+    rb_include_module(include, module);
+
+    return module;
 }
 
-static int
-search_required(fname, featurep, path)
-    VALUE fname, *featurep, *path;
+/*
+ *  call-seq:
+ *     include(module, ...)    => self
+ *  
+ *  Invokes <code>Module.append_features</code> on each parameter in turn.
+ */
+
+static VALUE
+rb_mod_include(argc, argv, module)
+    int argc;
+    VALUE *argv;
+    VALUE module;
 {
-    VALUE tmp;
-    char *ext, *ftptr;
-    int type;
+    int i;
 
-    *featurep = fname;
-    *path = 0;
-    ext = strrchr(ftptr = RSTRING_PTR(fname), '.');
-    if (ext && !strchr(ext, '/')) {
-	if (strcmp(".rb", ext) == 0) {
-	    if (rb_feature_p(ftptr, ext, Qtrue)) return 'r';
-	    if ((*path = rb_find_file(fname)) != 0) return 'r';
-	    return 0;
-	}
-	else if (IS_SOEXT(ext)) {
-	    if (rb_feature_p(ftptr, ext, Qfalse)) return 's';
-	    tmp = rb_str_new(RSTRING_PTR(fname), ext-RSTRING_PTR(fname));
-	    *featurep = tmp;
-#ifdef DLEXT2
-	    OBJ_FREEZE(tmp);
-	    if (rb_find_file_ext(&tmp, loadable_ext+1)) {
-		*featurep = tmp;
-		*path = rb_find_file(tmp);
-		return 's';
-	    }
-#else
-	    rb_str_cat2(tmp, DLEXT);
-	    OBJ_FREEZE(tmp);
-	    if ((*path = rb_find_file(tmp)) != 0) {
-		return 's';
-	    }
-#endif
-	}
-	else if (IS_DLEXT(ext)) {
-	    if (rb_feature_p(ftptr, ext, Qfalse)) return 's';
-	    if ((*path = rb_find_file(fname)) != 0) return 's';
-	}
+    for (i=0; i<argc; i++) Check_Type(argv[i], T_MODULE);
+    while (argc--) {
+	rb_funcall(argv[argc], rb_intern("append_features"), 1, module);
+	rb_funcall(argv[argc], rb_intern("included"), 1, module);
     }
-    tmp = fname;
-    type = rb_find_file_ext(&tmp, loadable_ext);
-    *featurep = tmp;
-    switch (type) {
-      case 0:
-	ftptr = RSTRING_PTR(tmp);
-	return rb_feature_p(ftptr, 0, Qfalse);
+    return module;
+}
 
-      default:
-	ext = strrchr(ftptr = RSTRING(tmp)->ptr, '.');
-	if (rb_feature_p(ftptr, ext, !--type)) break;
-	*path = rb_find_file(tmp);
-    }
-    return type ? 's' : 'r';
+void
+rb_obj_call_init(obj, argc, argv)
+    VALUE obj;
+    int argc;
+    VALUE *argv;
+{
+    PUSH_ITER(rb_block_given_p()?ITER_PRE:ITER_NOT);
+    rb_funcall2(obj, init, argc, argv);
+    POP_ITER();
 }
 
-static void
-load_failed(fname)
-    VALUE fname;
+void
+rb_extend_object(obj, module)
+    VALUE obj, module;
 {
-    rb_raise(rb_eLoadError, "no such file to load -- %s", RSTRING(fname)->ptr);
+    rb_include_module(rb_singleton_class(obj), module);
 }
 
-VALUE
-rb_require_safe(fname, safe)
-    VALUE fname;
-    int safe;
+/*
+ *  call-seq:
+ *     extend_object(obj)    => obj
+ *  
+ *  Extends the specified object by adding this module's constants and
+ *  methods (which are added as singleton methods). This is the callback
+ *  method used by <code>Object#extend</code>.
+ *     
+ *     module Picky
+ *       def Picky.extend_object(o)
+ *         if String === o
+ *           puts "Can't add Picky to a String"
+ *         else
+ *           puts "Picky added to #{o.class}"
+ *           super
+ *         end
+ *       end
+ *     end
+ *     (s = Array.new).extend Picky  # Call Object.extend
+ *     (s = "quick brown fox").extend Picky
+ *     
+ *  <em>produces:</em>
+ *     
+ *     Picky added to Array
+ *     Can't add Picky to a String
+ */
+
+static VALUE
+rb_mod_extend_object(mod, obj)
+    VALUE mod, obj;
 {
-    VALUE result = Qnil;
-    volatile VALUE errinfo = ruby_errinfo;
-    int state;
-    struct {
-	NODE *node;
-	ID func;
-	int vmode, safe;
-    } volatile saved;
-    char *volatile ftptr = 0;
+    rb_extend_object(obj, mod);
+    return obj;
+}
 
-    if (OBJ_TAINTED(fname)) {
-	rb_check_safe_obj(fname);
-    }
-    StringValue(fname);
-    fname = rb_str_new4(fname);
-    saved.vmode = scope_vmode;
-    saved.node = ruby_current_node;
-    saved.func = ruby_frame->last_func;
-    saved.safe = ruby_safe_level;
-    PUSH_TAG(PROT_NONE);
-    if ((state = EXEC_TAG()) == 0) {
-	VALUE feature, path;
-	long handle;
-	int found;
+/*
+ *  call-seq:
+ *     obj.extend(module, ...)    => obj
+ *  
+ *  Adds to _obj_ the instance methods from each module given as a
+ *  parameter.
+ *     
+ *     module Mod
+ *       def hello
+ *         "Hello from Mod.\n"
+ *       end
+ *     end
+ *     
+ *     class Klass
+ *       def hello
+ *         "Hello from Klass.\n"
+ *       end
+ *     end
+ *     
+ *     k = Klass.new
+ *     k.hello         #=> "Hello from Klass.\n"
+ *     k.extend(Mod)   #=> #<Klass:0x401b3bc8>
+ *     k.hello         #=> "Hello from Mod.\n"
+ */
 
-	ruby_safe_level = safe;
-	found = search_required(fname, &feature, &path);
-	if (found) {
-	    if (!path || !(ftptr = load_lock(RSTRING_PTR(feature)))) {
-		result = Qfalse;
-	    }
-	    else {
-		ruby_safe_level = 0;
-		switch (found) {
-		  case 'r':
-		    rb_load(path, 0);
-		    break;
+static VALUE
+rb_obj_extend(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    int i;
 
-		  case 's':
-		    ruby_current_node = 0;
-		    ruby_sourcefile = rb_source_filename(RSTRING(path)->ptr);
-		    ruby_sourceline = 0;
-		    ruby_frame->last_func = 0;
-		    SCOPE_SET(SCOPE_PUBLIC);
-		    handle = (long)dln_load(RSTRING(path)->ptr);
-		    rb_ary_push(ruby_dln_librefs, LONG2NUM(handle));
-		    break;
-		}
-		rb_provide_feature(feature);
-		result = Qtrue;
-	    }
-	}
+    if (argc == 0) {
+	rb_raise(rb_eArgError, "wrong number of arguments (0 for 1)");
     }
-    POP_TAG();
-    ruby_current_node = saved.node;
-    ruby_set_current_source();
-    ruby_frame->last_func = saved.func;
-    SCOPE_SET(saved.vmode);
-    ruby_safe_level = saved.safe;
-    load_unlock(ftptr);
-    if (state) JUMP_TAG(state);
-    if (NIL_P(result)) {
-	load_failed(fname);
+    for (i=0; i<argc; i++) Check_Type(argv[i], T_MODULE);
+    while (argc--) {
+	rb_funcall(argv[argc], rb_intern("extend_object"), 1, obj);
+	rb_funcall(argv[argc], rb_intern("extended"), 1, obj);
     }
-    ruby_errinfo = errinfo;
-
-    return result;
+    return obj;
 }
 
-VALUE
-rb_require(fname)
-    const char *fname;
-{
-    VALUE fn = rb_str_new2(fname);
-    OBJ_FREEZE(fn);
-    return rb_require_safe(fn, ruby_safe_level);
-}
+/*
+ *  call-seq:
+ *     include(module, ...)   => self
+ *  
+ *  Invokes <code>Module.append_features</code>
+ *  on each parameter in turn. Effectively adds the methods and constants
+ *  in each module to the receiver.
+ */
 
-void
-ruby_init_ext(name, init)
-    const char *name;
-    void (*init) _((void));
+static VALUE
+top_include(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
 {
-    ruby_current_node = 0;
-    ruby_sourcefile = rb_source_filename(name);
-    ruby_sourceline = 0;
-    ruby_frame->last_func = 0;
-    ruby_frame->orig_func = 0;
-    SCOPE_SET(SCOPE_PUBLIC);
-    if (load_lock(name)) {
-	(*init)();
-	rb_provide(name);
-	load_unlock(name);
+    rb_secure(4);
+    if (ruby_wrapper) {
+	rb_warning("main#include in the wrapped load is effective only in wrapper module");
+	return rb_mod_include(argc, argv, ruby_wrapper);
     }
+    return rb_mod_include(argc, argv, rb_cObject);
 }
 
+VALUE rb_f_trace_var();
+VALUE rb_f_untrace_var();
+
 static void
-secure_visibility(self)
-    VALUE self;
+errinfo_setter(val, id, var)
+    VALUE val;
+    ID id;
+    VALUE *var;
 {
-    if (ruby_safe_level >= 4 && !OBJ_TAINTED(self)) {
-	rb_raise(rb_eSecurityError, "Insecure: can't change method visibility");
+    if (!NIL_P(val) && !rb_obj_is_kind_of(val, rb_eException)) {
+	rb_raise(rb_eTypeError, "assigning non-exception to $!");
     }
+    *var = val;
 }
 
-static void
-set_method_visibility(self, argc, argv, ex)
-    VALUE self;
-    int argc;
-    VALUE *argv;
-    ID ex;
+static VALUE
+errat_getter(id)
+    ID id;
 {
-    int i;
+    return get_backtrace(ruby_errinfo);
+}
 
-    secure_visibility(self);
-    for (i=0; i<argc; i++) {
-	rb_export_method(self, rb_to_id(argv[i]), ex);
+static void
+errat_setter(val, id, var)
+    VALUE val;
+    ID id;
+    VALUE *var;
+{
+    if (NIL_P(ruby_errinfo)) {
+	rb_raise(rb_eArgError, "$! not set");
     }
-    rb_clear_cache_by_class(self);
+    set_backtrace(ruby_errinfo, val);
 }
 
 /*
  *  call-seq:
- *     public                 => self
- *     public(symbol, ...)    => self
+ *     local_variables    => array
  *  
- *  With no arguments, sets the default visibility for subsequently
- *  defined methods to public. With arguments, sets the named methods to
- *  have public visibility.
+ *  Returns the names of the current local variables.
+ *     
+ *     fred = 1
+ *     for i in 1..10
+ *        # ...
+ *     end
+ *     local_variables   #=> ["fred", "i"]
  */
 
 static VALUE
-rb_mod_public(argc, argv, module)
-    int argc;
-    VALUE *argv;
-    VALUE module;
+rb_f_local_variables()
 {
-    secure_visibility(module);
-    if (argc == 0) {
-	SCOPE_SET(SCOPE_PUBLIC);
+    ID *tbl;
+    int n, i;
+    VALUE ary = rb_ary_new();
+    struct RVarmap *vars;
+
+    tbl = ruby_scope->local_tbl;
+    if (tbl) {
+	n = *tbl++;
+	for (i=2; i<n; i++) {	/* skip first 2 ($_ and $~) */
+	    if (!rb_is_local_id(tbl[i])) continue; /* skip flip states */
+	    rb_ary_push(ary, rb_str_new2(rb_id2name(tbl[i])));
+	}
     }
-    else {
-	set_method_visibility(module, argc, argv, NOEX_PUBLIC);
+
+    vars = ruby_dyna_vars;
+    while (vars) {
+	if (vars->id && rb_is_local_id(vars->id)) { /* skip $_, $~ and flip states */
+	    rb_ary_push(ary, rb_str_new2(rb_id2name(vars->id)));
+	}
+	vars = vars->next;
     }
-    return module;
+
+    return ary;
 }
 
-/*
- *  call-seq:
- *     protected                => self
- *     protected(symbol, ...)   => self
- *  
- *  With no arguments, sets the default visibility for subsequently
- *  defined methods to protected. With arguments, sets the named methods
- *  to have protected visibility.
- */
+static VALUE rb_f_catch _((VALUE,VALUE));
+NORETURN(static VALUE rb_f_throw _((int,VALUE*)));
+
+struct end_proc_data {
+    void (*func)();
+    VALUE data;
+    int safe;
+    struct end_proc_data *next;
+};
+
+static struct end_proc_data *end_procs, *ephemeral_end_procs, *tmp_end_procs;
+
+void
+rb_set_end_proc(func, data)
+    void (*func) _((VALUE));
+    VALUE data;
+{
+    struct end_proc_data *link = ALLOC(struct end_proc_data);
+    struct end_proc_data **list;
+
+    if (ruby_wrapper) list = &ephemeral_end_procs;
+    else              list = &end_procs;
+    link->next = *list;
+    link->func = func;
+    link->data = data;
+    link->safe = ruby_safe_level;
+    *list = link;
+}
+
+void
+rb_mark_end_proc()
+{
+    struct end_proc_data *link;
+
+    link = end_procs;
+    while (link) {
+	rb_gc_mark(link->data);
+	link = link->next;
+    }
+    link = ephemeral_end_procs;
+    while (link) {
+	rb_gc_mark(link->data);
+	link = link->next;
+    }
+    link = tmp_end_procs;
+    while (link) {
+	rb_gc_mark(link->data);
+	link = link->next;
+    }
+}
+
+static void call_end_proc _((VALUE data));
+
+static void
+call_end_proc(data)
+    VALUE data;
+{
+    PUSH_ITER(ITER_NOT);
+    PUSH_FRAME();
+    ruby_frame->self = ruby_frame->prev->self;
+    ruby_frame->node = 0;
+    ruby_frame->last_func = 0;
+    ruby_frame->last_class = 0;
+    proc_invoke(data, rb_ary_new2(0), Qundef, 0);
+    POP_FRAME();
+    POP_ITER();
+}
 
-static VALUE
-rb_mod_protected(argc, argv, module)
-    int argc;
-    VALUE *argv;
-    VALUE module;
+static void
+rb_f_END()
 {
-    secure_visibility(module);
-    if (argc == 0) {
-	SCOPE_SET(SCOPE_PROTECTED);
-    }
-    else {
-	set_method_visibility(module, argc, argv, NOEX_PROTECTED);
-    }
-    return module;
+    PUSH_FRAME();
+    ruby_frame->argc = 0;
+    ruby_frame->iter = ITER_CUR;
+    rb_set_end_proc(call_end_proc, rb_block_proc());
+    POP_FRAME();
 }
 
 /*
  *  call-seq:
- *     private                 => self
- *     private(symbol, ...)    => self
+ *     at_exit { block } -> proc
  *  
- *  With no arguments, sets the default visibility for subsequently
- *  defined methods to private. With arguments, sets the named methods
- *  to have private visibility.
+ *  Converts _block_ to a +Proc+ object (and therefore
+ *  binds it at the point of call) and registers it for execution when
+ *  the program exits. If multiple handlers are registered, they are
+ *  executed in reverse order of registration.
  *     
- *     module Mod
- *       def a()  end
- *       def b()  end
- *       private
- *       def c()  end
- *       private :a
+ *     def do_at_exit(str1)
+ *       at_exit { print str1 }
  *     end
- *     Mod.private_instance_methods   #=> ["a", "c"]
+ *     at_exit { puts "cruel world" }
+ *     do_at_exit("goodbye ")
+ *     exit
+ *     
+ *  <em>produces:</em>
+ *     
+ *     goodbye cruel world
  */
 
 static VALUE
-rb_mod_private(argc, argv, module)
-    int argc;
-    VALUE *argv;
-    VALUE module;
+rb_f_at_exit()
 {
-    secure_visibility(module);
-    if (argc == 0) {
-	SCOPE_SET(SCOPE_PRIVATE);
-    }
-    else {
-	set_method_visibility(module, argc, argv, NOEX_PRIVATE);
+    VALUE proc;
+
+    if (!rb_block_given_p()) {
+	rb_raise(rb_eArgError, "called without a block");
     }
-    return module;
+    proc = rb_block_proc();
+    rb_set_end_proc(call_end_proc, proc);
+    return proc;
 }
 
-/*
- *  call-seq:
- *     mod.public_class_method(symbol, ...)    => mod
- *  
- *  Makes a list of existing class methods public.
- */
-
-static VALUE
-rb_mod_public_method(argc, argv, obj)
-    int argc;
-    VALUE *argv;
-    VALUE obj;
+void
+rb_exec_end_proc()
 {
-    set_method_visibility(CLASS_OF(obj), argc, argv, NOEX_PUBLIC);
-    return obj;
-}
+    struct end_proc_data *link, *tmp;
+    int status;
+    volatile int safe = ruby_safe_level;
 
-/*
- *  call-seq:
- *     mod.private_class_method(symbol, ...)   => mod
- *  
- *  Makes existing class methods private. Often used to hide the default
- *  constructor <code>new</code>.
- *     
- *     class SimpleSingleton  # Not thread safe
- *       private_class_method :new
- *       def SimpleSingleton.create(*args, &block)
- *         @me = new(*args, &block) if ! @me
- *         @me
- *       end
- *     end
- */
+    while (ephemeral_end_procs) {
+	tmp_end_procs = link = ephemeral_end_procs;
+	ephemeral_end_procs = 0;
+	while (link) {
+	    PUSH_TAG(PROT_NONE);
+	    if ((status = EXEC_TAG()) == 0) {
+		ruby_safe_level = link->safe;
+		(*link->func)(link->data);
+	    }
+	    POP_TAG();
+	    if (status) {
+		error_handle(status);
+	    }
+	    tmp = link;
+	    tmp_end_procs = link = link->next;
+	    free(tmp);
+	}
+    }
+    while (end_procs) {
+	tmp_end_procs = link = end_procs;
+	end_procs = 0;
+	while (link) {
+	    PUSH_TAG(PROT_NONE);
+	    if ((status = EXEC_TAG()) == 0) {
+		ruby_safe_level = link->safe;
+		(*link->func)(link->data);
+	    }
+	    POP_TAG();
+	    if (status) {
+		error_handle(status);
+	    }
+	    tmp = link;
+	    tmp_end_procs = link = link->next;
+	    free(tmp);
+	}
+    }
+    ruby_safe_level = safe;
+}
 
-static VALUE
-rb_mod_private_method(argc, argv, obj)
-    int argc;
-    VALUE *argv;
-    VALUE obj;
+void
+Init_eval()
 {
-    set_method_visibility(CLASS_OF(obj), argc, argv, NOEX_PRIVATE);
-    return obj;
+    VALUE mObSpace;
+
+    init = rb_intern("initialize");
+    eqq = rb_intern("===");
+    each = rb_intern("each");
+
+    aref = rb_intern("[]");
+    aset = rb_intern("[]=");
+    match = rb_intern("=~");
+    missing = rb_intern("method_missing");
+    added = rb_intern("method_added");
+    singleton_added = rb_intern("singleton_method_added");
+    removed = rb_intern("method_removed");
+    singleton_removed = rb_intern("singleton_method_removed");
+    undefined = rb_intern("method_undefined");
+    singleton_undefined = rb_intern("singleton_method_undefined");
+
+    __id__ = rb_intern("__id__");
+    __send__ = rb_intern("__send__");
+
+    basic_ops[BOP_PLUS] = rb_intern("+");
+    basic_ops[BOP_MINUS] = rb_intern("-");
+    basic_ops[BOP_MULT] = rb_intern("*");
+    basic_ops[BOP_LT] = rb_intern("<");
+    basic_ops[BOP_LE] = rb_intern("<=");
+    basic_ops[BOP_GT] = rb_intern(">");
+    basic_ops[BOP_GE] = rb_intern(">=");
+    basic_ops[BOP_EQ] = rb_intern("==");
+    basic_ops[BOP_AREF] = aref;
+    basic_ops[BOP_NIL_P] = rb_intern("nil?");
+
+    rb_global_variable((void *)&top_scope);
+    rb_global_variable((void *)&ruby_eval_tree_begin);
+
+    rb_global_variable((void *)&ruby_eval_tree);
+    rb_global_variable((void *)&ruby_dyna_vars);
+
+    rb_define_virtual_variable("$@", errat_getter, errat_setter);
+    rb_define_hooked_variable("$!", &ruby_errinfo, 0, errinfo_setter);
+
+    rb_define_global_function("eval", rb_f_eval, -1);
+    rb_define_global_function("iterator?", rb_f_block_given_p, 0);
+    rb_define_global_function("block_given?", rb_f_block_given_p, 0);
+    rb_define_global_function("method_missing", rb_method_missing, -1);
+    rb_define_global_function("loop", rb_f_loop, 0);
+
+    rb_define_method(rb_mKernel, "respond_to?", obj_respond_to, -1);
+    respond_to   = rb_intern("respond_to?");
+    rb_global_variable((void *)&basic_respond_to);
+    basic_respond_to = rb_method_node(rb_cObject, respond_to);
+    
+    rb_define_global_function("raise", rb_f_raise, -1);
+    rb_define_global_function("fail", rb_f_raise, -1);
+
+    rb_define_global_function("caller", rb_f_caller, -1);
+
+    rb_define_global_function("exit", rb_f_exit, -1);
+    rb_define_global_function("abort", rb_f_abort, -1);
+
+    rb_define_global_function("at_exit", rb_f_at_exit, 0);
+
+    rb_define_global_function("catch", rb_f_catch, 1);
+    rb_define_global_function("throw", rb_f_throw, -1);
+    rb_define_global_function("global_variables", rb_f_global_variables, 0); /* in variable.c */
+    rb_define_global_function("local_variables", rb_f_local_variables, 0);
+
+    rb_define_method(rb_mKernel, "send", rb_f_send, -1);
+    rb_define_method(rb_mKernel, "__send__", rb_f_send, -1);
+    rb_define_method(rb_mKernel, "instance_eval", rb_obj_instance_eval, -1);
+
+    mObSpace = rb_define_module("ObjectSpace");
+    rb_define_module_function(mObSpace, "method_cache_stat", method_cache_stat, 0);
+    rb_define_module_function(mObSpace, "clear_method_cache_stats", method_cache_clear_stats, 0);
+
+    rb_define_private_method(rb_cModule, "append_features", rb_mod_append_features, 1);
+    rb_define_private_method(rb_cModule, "extend_object", rb_mod_extend_object, 1);
+    rb_define_private_method(rb_cModule, "include", rb_mod_include, -1);
+    rb_define_private_method(rb_cModule, "public", rb_mod_public, -1);
+    rb_define_private_method(rb_cModule, "protected", rb_mod_protected, -1);
+    rb_define_private_method(rb_cModule, "private", rb_mod_private, -1);
+    rb_define_private_method(rb_cModule, "module_function", rb_mod_modfunc, -1);
+    rb_define_method(rb_cModule, "method_defined?", rb_mod_method_defined, 1);
+    rb_define_method(rb_cModule, "public_method_defined?", rb_mod_public_method_defined, 1);
+    rb_define_method(rb_cModule, "private_method_defined?", rb_mod_private_method_defined, 1);
+    rb_define_method(rb_cModule, "protected_method_defined?", rb_mod_protected_method_defined, 1);
+    rb_define_method(rb_cModule, "public_class_method", rb_mod_public_method, -1);
+    rb_define_method(rb_cModule, "private_class_method", rb_mod_private_method, -1);
+    rb_define_method(rb_cModule, "module_eval", rb_mod_module_eval, -1);
+    rb_define_method(rb_cModule, "class_eval", rb_mod_module_eval, -1);
+
+    rb_undef_method(rb_cClass, "module_function");
+
+    rb_define_private_method(rb_cModule, "remove_method", rb_mod_remove_method, -1);
+    rb_define_private_method(rb_cModule, "undef_method", rb_mod_undef_method, -1);
+    rb_define_private_method(rb_cModule, "alias_method", rb_mod_alias_method, 2);
+    rb_define_private_method(rb_cModule, "define_method", rb_mod_define_method, -1);
+
+    rb_define_singleton_method(rb_cModule, "nesting", rb_mod_nesting, 0);
+    rb_define_singleton_method(rb_cModule, "constants", rb_mod_s_constants, 0);
+
+    rb_define_singleton_method(ruby_top_self, "include", top_include, -1);
+    rb_define_singleton_method(ruby_top_self, "public", top_public, -1);
+    rb_define_singleton_method(ruby_top_self, "private", top_private, -1);
+
+    rb_define_method(rb_mKernel, "extend", rb_obj_extend, -1);
+
+    rb_define_global_function("trace_var", rb_f_trace_var, -1); /* in variable.c */
+    rb_define_global_function("untrace_var", rb_f_untrace_var, -1); /* in variable.c */
+
+    rb_define_global_function("set_trace_func", set_trace_func, 1);
+    rb_global_variable(&trace_func);
+
+    rb_define_virtual_variable("$SAFE", safe_getter, safe_setter);
 }
 
 /*
  *  call-seq:
- *     public
- *     public(symbol, ...)
- *  
- *  With no arguments, sets the default visibility for subsequently
- *  defined methods to public. With arguments, sets the named methods to
- *  have public visibility.
+ *     mod.autoload(name, filename)   => nil
+ *
+ *  Registers _filename_ to be loaded (using <code>Kernel::require</code>) 
+ *  the first time that _name_ (which may be a <code>String</code> or
+ *  a symbol) is accessed in the namespace of _mod_.
+ *
+ *     module A
+ *     end
+ *     A.autoload(:B, "b")
+ *     A::B.doit            # autoloads "b"
  */
 
 static VALUE
-top_public(argc, argv)
-    int argc;
-    VALUE *argv;
+rb_mod_autoload(mod, sym, file)
+    VALUE mod;
+    VALUE sym;
+    VALUE file;
 {
-    return rb_mod_public(argc, argv, rb_cObject);
-}
+    ID id = rb_to_id(sym);
 
-static VALUE
-top_private(argc, argv)
-    int argc;
-    VALUE *argv;
-{
-    return rb_mod_private(argc, argv, rb_cObject);
+    Check_SafeStr(file);
+    rb_autoload(mod, id, RSTRING(file)->ptr);
+    return Qnil;
 }
 
 /*
  *  call-seq:
- *     module_function(symbol, ...)    => self
- *  
- *  Creates module functions for the named methods. These functions may
- *  be called with the module as a receiver, and also become available
- *  as instance methods to classes that mix in the module. Module
- *  functions are copies of the original, and so may be changed
- *  independently. The instance-method versions are made private. If
- *  used with no arguments, subsequently defined methods become module
- *  functions.
- *     
- *     module Mod
- *       def one
- *         "This is one"
- *       end
- *       module_function :one
- *     end
- *     class Cls
- *       include Mod
- *       def callOne
- *         one
- *       end
- *     end
- *     Mod.one     #=> "This is one"
- *     c = Cls.new
- *     c.callOne   #=> "This is one"
- *     module Mod
- *       def one
- *         "This is the new one"
- *       end
+ *     mod.autoload?(name)   => String or nil
+ *
+ *  Returns _filename_ to be loaded if _name_ is registered as
+ *  +autoload+ in the namespace of _mod_.
+ *
+ *     module A
  *     end
- *     Mod.one     #=> "This is one"
- *     c.callOne   #=> "This is the new one"
+ *     A.autoload(:B, "b")
+ *     A.autoload?(:B)            # => "b"
  */
 
 static VALUE
-rb_mod_modfunc(argc, argv, module)
-    int argc;
-    VALUE *argv;
-    VALUE module;
+rb_mod_autoload_p(mod, sym)
+    VALUE mod, sym;
 {
-    int i;
-    ID id;
-    NODE *body;
-
-    if (TYPE(module) != T_MODULE) {
-	rb_raise(rb_eTypeError, "module_function must be called for modules");
-    }
-
-    secure_visibility(module);
-    if (argc == 0) {
-	SCOPE_SET(SCOPE_MODFUNC);
-	return module;
-    }
-
-    set_method_visibility(module, argc, argv, NOEX_PRIVATE);
-    for (i=0; i<argc; i++) {
-	VALUE m = module;
-
-	id = rb_to_id(argv[i]);
-	for (;;) {
-	    body = search_method(m, id, &m);
-	    if (body == 0) {
-		body = search_method(rb_cObject, id, &m);
-	    }
-	    if (body == 0 || body->nd_body == 0) {
-		rb_bug("undefined method `%s'; can't happen", rb_id2name(id));
-	    }
-	    if (nd_type(body->nd_body) != NODE_ZSUPER) {
-		break;		/* normal case: need not to follow 'super' link */
-	    }
-	    m = RCLASS(m)->super;
-	    if (!m) break;
-	}
-	rb_add_method(rb_singleton_class(module), id, body->nd_body, NOEX_PUBLIC);
-    }
-    return module;
+    return rb_autoload_p(mod, rb_to_id(sym));
 }
 
 /*
  *  call-seq:
- *     append_features(mod)   => mod
+ *     autoload(module, filename)   => nil
  *  
- *  When this module is included in another, Ruby calls
- *  <code>append_features</code> in this module, passing it the
- *  receiving module in _mod_. Ruby's default implementation is
- *  to add the constants, methods, and module variables of this module
- *  to _mod_ if this module has not already been added to
- *  _mod_ or one of its ancestors. See also <code>Module#include</code>.
+ *  Registers _filename_ to be loaded (using <code>Kernel::require</code>) 
+ *  the first time that _module_ (which may be a <code>String</code> or
+ *  a symbol) is accessed.
+ *     
+ *     autoload(:MyModule, "/usr/local/lib/modules/my_module.rb")
  */
 
 static VALUE
-rb_mod_append_features(module, include)
-    VALUE module, include;
+rb_f_autoload(obj, sym, file)
+    VALUE obj;
+    VALUE sym;
+    VALUE file;
 {
-    switch (TYPE(include)) {
-      case T_CLASS:
-      case T_MODULE:
-	break;
-      default:
-	Check_Type(include, T_CLASS);
-	break;
+    if (NIL_P(ruby_cbase)) {
+	rb_raise(rb_eTypeError, "no class/module for autoload target");
     }
-    rb_include_module(include, module);
-
-    return module;
+    return rb_mod_autoload(ruby_cbase, sym, file);
 }
 
 /*
  *  call-seq:
- *     include(module, ...)    => self
- *  
- *  Invokes <code>Module.append_features</code> on each parameter in turn.
+ *     autoload(module, filename)   => nil
+ *
+ *  Registers _filename_ to be loaded (using <code>Kernel::require</code>)
+ *  the first time that _module_ (which may be a <code>String</code> or
+ *  a symbol) is accessed.
+ *
+ *     autoload(:MyModule, "/usr/local/lib/modules/my_module.rb")
  */
 
 static VALUE
-rb_mod_include(argc, argv, module)
-    int argc;
-    VALUE *argv;
-    VALUE module;
+rb_f_autoload_p(obj, sym)
+    VALUE obj;
+    VALUE sym;
 {
-    int i;
-
-    for (i=0; i<argc; i++) Check_Type(argv[i], T_MODULE);
-    while (argc--) {
-	rb_funcall(argv[argc], rb_intern("append_features"), 1, module);
-	rb_funcall(argv[argc], rb_intern("included"), 1, module);
+    /* use ruby_cbase as same as rb_f_autoload. */
+    if (NIL_P(ruby_cbase)) {
+	return Qfalse;
     }
-    return module;
+    return rb_mod_autoload_p(ruby_cbase, sym);
 }
 
 void
-rb_obj_call_init(obj, argc, argv)
-    VALUE obj;
-    int argc;
-    VALUE *argv;
+Init_load()
 {
-    PUSH_ITER(rb_block_given_p()?ITER_PRE:ITER_NOT);
-    rb_funcall2(obj, init, argc, argv);
-    POP_ITER();
-}
+    rb_define_readonly_variable("$:", &rb_load_path);
+    rb_define_readonly_variable("$-I", &rb_load_path);
+    rb_define_readonly_variable("$LOAD_PATH", &rb_load_path);
+    rb_load_path = rb_ary_new();
 
-void
-rb_extend_object(obj, module)
-    VALUE obj, module;
-{
-    rb_include_module(rb_singleton_class(obj), module);
-}
+    rb_define_readonly_variable("$\"", &rb_features);
+    rb_define_readonly_variable("$LOADED_FEATURES", &rb_features);
+    rb_features = rb_ary_new();
 
-/*
- *  call-seq:
- *     extend_object(obj)    => obj
- *  
- *  Extends the specified object by adding this module's constants and
- *  methods (which are added as singleton methods). This is the callback
- *  method used by <code>Object#extend</code>.
- *     
- *     module Picky
- *       def Picky.extend_object(o)
- *         if String === o
- *           puts "Can't add Picky to a String"
- *         else
- *           puts "Picky added to #{o.class}"
- *           super
- *         end
- *       end
- *     end
- *     (s = Array.new).extend Picky  # Call Object.extend
- *     (s = "quick brown fox").extend Picky
- *     
- *  <em>produces:</em>
- *     
- *     Picky added to Array
- *     Can't add Picky to a String
- */
+    rb_define_global_function("load", rb_f_load, -1);
+    rb_define_global_function("require", rb_f_require, 1);
+    rb_define_method(rb_cModule, "autoload",  rb_mod_autoload,   2);
+    rb_define_method(rb_cModule, "autoload?", rb_mod_autoload_p, 1);
+    rb_define_global_function("autoload",  rb_f_autoload,   2);
+    rb_define_global_function("autoload?", rb_f_autoload_p, 1);
+    rb_global_variable(&ruby_wrapper);
 
-static VALUE
-rb_mod_extend_object(mod, obj)
-    VALUE mod, obj;
-{
-    rb_extend_object(obj, mod);
-    return obj;
+    rb_global_variable(&ruby_dln_librefs);
+    ruby_dln_librefs = rb_ary_new();
 }
 
-/*
- *  call-seq:
- *     obj.extend(module, ...)    => obj
- *  
- *  Adds to _obj_ the instance methods from each module given as a
- *  parameter.
- *     
- *     module Mod
- *       def hello
- *         "Hello from Mod.\n"
- *       end
- *     end
- *     
- *     class Klass
- *       def hello
- *         "Hello from Klass.\n"
- *       end
- *     end
- *     
- *     k = Klass.new
- *     k.hello         #=> "Hello from Klass.\n"
- *     k.extend(Mod)   #=> #<Klass:0x401b3bc8>
- *     k.hello         #=> "Hello from Mod.\n"
- */
-
-static VALUE
-rb_obj_extend(argc, argv, obj)
-    int argc;
-    VALUE *argv;
-    VALUE obj;
+static struct SCOPE *
+scope_promote(scope)
+    struct SCOPE *scope;
 {
-    int i;
+    struct SCOPE *heap;
 
-    if (argc == 0) {
-	rb_raise(rb_eArgError, "wrong number of arguments (0 for 1)");
-    }
-    for (i=0; i<argc; i++) Check_Type(argv[i], T_MODULE);
-    while (argc--) {
-	rb_funcall(argv[argc], rb_intern("extend_object"), 1, obj);
-	rb_funcall(argv[argc], rb_intern("extended"), 1, obj);
+    if (!(scope->flags & SCOPE_STACK)) return scope;
+    heap = (struct SCOPE*)scope->super.klass;
+    if (!heap) {
+	NEWOBJ(_scope, struct SCOPE);
+	OBJSETUP(_scope, 0, T_SCOPE);
+	_scope->local_tbl = scope->local_tbl;
+	_scope->local_vars = scope->local_vars;
+	_scope->flags = scope->flags & ~SCOPE_STACK;
+	scope->super.klass = (VALUE)_scope;
+	heap = _scope;
     }
-    return obj;
+    if (ruby_scope == scope) ruby_scope = heap;
+    return heap;
 }
 
-/*
- *  call-seq:
- *     include(module, ...)   => self
- *  
- *  Invokes <code>Module.append_features</code>
- *  on each parameter in turn. Effectively adds the methods and constants
- *  in each module to the receiver.
- */
-
-static VALUE
-top_include(argc, argv, self)
-    int argc;
-    VALUE *argv;
-    VALUE self;
+static struct SCOPE *
+scope_dup(scope)
+    struct SCOPE *scope;
 {
-    rb_secure(4);
-    if (ruby_wrapper) {
-	rb_warning("main#include in the wrapped load is effective only in wrapper module");
-	return rb_mod_include(argc, argv, ruby_wrapper);
+    ID *tbl;
+    VALUE *vars;
+
+    scope = scope_promote(scope);
+    scope->flags |= SCOPE_DONT_RECYCLE;
+    if (scope->flags & SCOPE_MALLOC) return scope;
+
+    if (scope->local_tbl) {
+	tbl = scope->local_tbl;
+	vars = ALLOC_N(VALUE, tbl[0]+1);
+	*vars++ = scope->local_vars[-1];
+	MEMCPY(vars, scope->local_vars, VALUE, tbl[0]);
+	scope->local_vars = vars;
+	scope->flags |= SCOPE_MALLOC;
     }
-    return rb_mod_include(argc, argv, rb_cObject);
+    return scope;
 }
 
-VALUE rb_f_trace_var();
-VALUE rb_f_untrace_var();
-
 static void
-errinfo_setter(val, id, var)
-    VALUE val;
-    ID id;
-    VALUE *var;
+blk_mark(data)
+    struct BLOCK *data;
 {
-    if (!NIL_P(val) && !rb_obj_is_kind_of(val, rb_eException)) {
-	rb_raise(rb_eTypeError, "assigning non-exception to $!");
+    while (data) {
+	rb_gc_mark_frame(&data->frame);
+	rb_gc_mark((VALUE)data->scope);
+	rb_gc_mark((VALUE)data->var);
+	rb_gc_mark((VALUE)data->body);
+	rb_gc_mark((VALUE)data->self);
+	rb_gc_mark((VALUE)data->dyna_vars);
+	rb_gc_mark((VALUE)data->cref);
+	rb_gc_mark(data->wrapper);
+	rb_gc_mark(data->block_obj);
+	data = data->prev;
     }
-    *var = val;
 }
 
-static VALUE
-errat_getter(id)
-    ID id;
+static void
+frame_free(frame)
+    struct FRAME *frame;
 {
-    return get_backtrace(ruby_errinfo);
+    struct FRAME *tmp;
+
+    frame = frame->prev;
+    while (frame) {
+	tmp = frame;
+	frame = frame->prev;
+	free(tmp);
+    }
 }
 
 static void
-errat_setter(val, id, var)
-    VALUE val;
-    ID id;
-    VALUE *var;
+blk_free(data)
+    struct BLOCK *data;
 {
-    if (NIL_P(ruby_errinfo)) {
-	rb_raise(rb_eArgError, "$! not set");
+    void *tmp;
+
+    while (data) {
+	frame_free(&data->frame);
+	tmp = data;
+	data = data->prev;
+	free(tmp);
     }
-    set_backtrace(ruby_errinfo, val);
 }
 
-/*
- *  call-seq:
- *     local_variables    => array
- *  
- *  Returns the names of the current local variables.
- *     
- *     fred = 1
- *     for i in 1..10
- *        # ...
- *     end
- *     local_variables   #=> ["fred", "i"]
- */
-
-static VALUE
-rb_f_local_variables()
+static void
+frame_dup(frame)
+    struct FRAME *frame;
 {
-    ID *tbl;
-    int n, i;
-    VALUE ary = rb_ary_new();
-    struct RVarmap *vars;
-
-    tbl = ruby_scope->local_tbl;
-    if (tbl) {
-	n = *tbl++;
-	for (i=2; i<n; i++) {	/* skip first 2 ($_ and $~) */
-	    if (!rb_is_local_id(tbl[i])) continue; /* skip flip states */
-	    rb_ary_push(ary, rb_str_new2(rb_id2name(tbl[i])));
-	}
-    }
+    struct FRAME *tmp;
 
-    vars = ruby_dyna_vars;
-    while (vars) {
-	if (vars->id && rb_is_local_id(vars->id)) { /* skip $_, $~ and flip states */
-	    rb_ary_push(ary, rb_str_new2(rb_id2name(vars->id)));
-	}
-	vars = vars->next;
+    for (;;) {
+	frame->tmp = 0;		/* should not preserve tmp */
+	if (!frame->prev) break;
+	tmp = ALLOC(struct FRAME);
+	*tmp = *frame->prev;
+	frame->prev = tmp;
+	frame = tmp;
     }
-
-    return ary;
 }
 
-static VALUE rb_f_catch _((VALUE,VALUE));
-NORETURN(static VALUE rb_f_throw _((int,VALUE*)));
 
-struct end_proc_data {
-    void (*func)();
-    VALUE data;
-    int safe;
-    struct end_proc_data *next;
-};
+static void
+blk_copy_prev(block)
+    struct BLOCK *block;
+{
+    struct BLOCK *tmp;
+    struct RVarmap* vars;
 
-static struct end_proc_data *end_procs, *ephemeral_end_procs, *tmp_end_procs;
+    while (block->prev) {
+	tmp = ALLOC_N(struct BLOCK, 1);
+	MEMCPY(tmp, block->prev, struct BLOCK, 1);
+	tmp->flags &= ~BLOCK_STACK;
+	tmp->spare_vars = 0;
+	tmp->scope = scope_dup(tmp->scope);
+	frame_dup(&tmp->frame);
 
-void
-rb_set_end_proc(func, data)
-    void (*func) _((VALUE));
-    VALUE data;
-{
-    struct end_proc_data *link = ALLOC(struct end_proc_data);
-    struct end_proc_data **list;
+	for (vars = tmp->dyna_vars; vars; vars = vars->next) {
+	    if (FL_TEST(vars, DVAR_DONT_RECYCLE)) break;
+	    FL_SET(vars, DVAR_DONT_RECYCLE);
+	}
 
-    if (ruby_wrapper) list = &ephemeral_end_procs;
-    else              list = &end_procs;
-    link->next = *list;
-    link->func = func;
-    link->data = data;
-    link->safe = ruby_safe_level;
-    *list = link;
+	block->prev = tmp;
+	block = tmp;
+    }
 }
 
-void
-rb_mark_end_proc()
+
+static void
+blk_dup(dup, orig)
+    struct BLOCK *dup, *orig;
 {
-    struct end_proc_data *link;
+    MEMCPY(dup, orig, struct BLOCK, 1);
+    frame_dup(&dup->frame);
 
-    link = end_procs;
-    while (link) {
-	rb_gc_mark(link->data);
-	link = link->next;
-    }
-    link = ephemeral_end_procs;
-    while (link) {
-	rb_gc_mark(link->data);
-	link = link->next;
+    if (dup->iter) {
+	blk_copy_prev(dup);
     }
-    link = tmp_end_procs;
-    while (link) {
-	rb_gc_mark(link->data);
-	link = link->next;
+    else {
+	dup->prev = 0;
     }
 }
 
-static void call_end_proc _((VALUE data));
+/*
+ * MISSING: documentation
+ */
 
-static void
-call_end_proc(data)
-    VALUE data;
+static VALUE
+proc_clone(self)
+    VALUE self;
 {
-    PUSH_ITER(ITER_NOT);
-    PUSH_FRAME();
-    ruby_frame->self = ruby_frame->prev->self;
-    ruby_frame->node = 0;
-    ruby_frame->last_func = 0;
-    ruby_frame->last_class = 0;
-    proc_invoke(data, rb_ary_new2(0), Qundef, 0);
-    POP_FRAME();
-    POP_ITER();
+    struct BLOCK *orig, *data;
+    VALUE bind;
+
+    Data_Get_Struct(self, struct BLOCK, orig);
+    bind = Data_Make_Struct(rb_obj_class(self),struct BLOCK,blk_mark,blk_free,data);
+    CLONESETUP(bind, self);
+    blk_dup(data, orig);
+
+    return bind;
 }
 
-static void
-rb_f_END()
+/*
+ * MISSING: documentation
+ */
+
+#define PROC_TSHIFT (FL_USHIFT+1)
+#define PROC_TMASK  (FL_USER1|FL_USER2|FL_USER3)
+#define PROC_TMAX   (PROC_TMASK >> PROC_TSHIFT)
+
+static int proc_get_safe_level(VALUE);
+
+static VALUE
+proc_dup(self)
+    VALUE self;
 {
-    PUSH_FRAME();
-    ruby_frame->argc = 0;
-    ruby_frame->iter = ITER_CUR;
-    rb_set_end_proc(call_end_proc, rb_block_proc());
-    POP_FRAME();
+    struct BLOCK *orig, *data;
+    VALUE bind;
+    int safe = proc_get_safe_level(self);
+
+    Data_Get_Struct(self, struct BLOCK, orig);
+    bind = Data_Make_Struct(rb_obj_class(self),struct BLOCK,blk_mark,blk_free,data);
+    blk_dup(data, orig);
+    if (safe > PROC_TMAX) safe = PROC_TMAX;
+    FL_SET(bind, (safe << PROC_TSHIFT) & PROC_TMASK);
+
+    return bind;
 }
 
 /*
  *  call-seq:
- *     at_exit { block } -> proc
+ *     binding -> a_binding
  *  
- *  Converts _block_ to a +Proc+ object (and therefore
- *  binds it at the point of call) and registers it for execution when
- *  the program exits. If multiple handlers are registered, they are
- *  executed in reverse order of registration.
+ *  Returns a +Binding+ object, describing the variable and
+ *  method bindings at the point of call. This object can be used when
+ *  calling +eval+ to execute the evaluated command in this
+ *  environment. Also see the description of class +Binding+.
  *     
- *     def do_at_exit(str1)
- *       at_exit { print str1 }
+ *     def getBinding(param)
+ *       return binding
  *     end
- *     at_exit { puts "cruel world" }
- *     do_at_exit("goodbye ")
- *     exit
- *     
- *  <em>produces:</em>
- *     
- *     goodbye cruel world
+ *     b = getBinding("hello")
+ *     eval("param", b)   #=> "hello"
  */
 
 static VALUE
-rb_f_at_exit()
+rb_f_binding(self)
+    VALUE self;
 {
-    VALUE proc;
+    struct BLOCK *data, *p;
+    struct RVarmap *vars;
+    VALUE bind;
 
-    if (!rb_block_given_p()) {
-	rb_raise(rb_eArgError, "called without a block");
-    }
-    proc = rb_block_proc();
-    rb_set_end_proc(call_end_proc, proc);
-    return proc;
-}
+    PUSH_BLOCK(0,0);
+    bind = Data_Make_Struct(rb_cBinding,struct BLOCK,blk_mark,blk_free,data);
+    *data = *ruby_block;
+    data->flags &= ~BLOCK_STACK;
+    data->spare_vars = 0;
 
-void
-rb_exec_end_proc()
-{
-    struct end_proc_data *link, *tmp;
-    int status;
-    volatile int safe = ruby_safe_level;
+    data->orig_thread = rb_thread_current();
+    data->wrapper = ruby_wrapper;
+    data->iter = rb_f_block_given_p();
+    frame_dup(&data->frame);
+    if (ruby_frame->prev) {
+	data->frame.last_func = ruby_frame->prev->last_func;
+	data->frame.last_class = ruby_frame->prev->last_class;
+	data->frame.orig_func = ruby_frame->prev->orig_func;
+    }
 
-    while (ephemeral_end_procs) {
-	tmp_end_procs = link = ephemeral_end_procs;
-	ephemeral_end_procs = 0;
-	while (link) {
-	    PUSH_TAG(PROT_NONE);
-	    if ((status = EXEC_TAG()) == 0) {
-		ruby_safe_level = link->safe;
-		(*link->func)(link->data);
-	    }
-	    POP_TAG();
-	    if (status) {
-		error_handle(status);
-	    }
-	    tmp = link;
-	    tmp_end_procs = link = link->next;
-	    free(tmp);
-	}
+    if (data->iter) {
+	blk_copy_prev(data);
     }
-    while (end_procs) {
-	tmp_end_procs = link = end_procs;
-	end_procs = 0;
-	while (link) {
-	    PUSH_TAG(PROT_NONE);
-	    if ((status = EXEC_TAG()) == 0) {
-		ruby_safe_level = link->safe;
-		(*link->func)(link->data);
-	    }
-	    POP_TAG();
-	    if (status) {
-		error_handle(status);
-	    }
-	    tmp = link;
-	    tmp_end_procs = link = link->next;
-	    free(tmp);
-	}
+    else {
+	data->prev = 0;
     }
-    ruby_safe_level = safe;
-}
-
-void
-Init_eval()
-{
-    init = rb_intern("initialize");
-    eqq = rb_intern("===");
-    each = rb_intern("each");
-
-    aref = rb_intern("[]");
-    aset = rb_intern("[]=");
-    match = rb_intern("=~");
-    missing = rb_intern("method_missing");
-    added = rb_intern("method_added");
-    singleton_added = rb_intern("singleton_method_added");
-    removed = rb_intern("method_removed");
-    singleton_removed = rb_intern("singleton_method_removed");
-    undefined = rb_intern("method_undefined");
-    singleton_undefined = rb_intern("singleton_method_undefined");
-
-    __id__ = rb_intern("__id__");
-    __send__ = rb_intern("__send__");
-
-    rb_global_variable((void *)&top_scope);
-    rb_global_variable((void *)&ruby_eval_tree_begin);
-
-    rb_global_variable((void *)&ruby_eval_tree);
-    rb_global_variable((void *)&ruby_dyna_vars);
-
-    rb_define_virtual_variable("$@", errat_getter, errat_setter);
-    rb_define_hooked_variable("$!", &ruby_errinfo, 0, errinfo_setter);
-
-    rb_define_global_function("eval", rb_f_eval, -1);
-    rb_define_global_function("iterator?", rb_f_block_given_p, 0);
-    rb_define_global_function("block_given?", rb_f_block_given_p, 0);
-    rb_define_global_function("method_missing", rb_method_missing, -1);
-    rb_define_global_function("loop", rb_f_loop, 0);
-
-    rb_define_method(rb_mKernel, "respond_to?", obj_respond_to, -1);
-    respond_to   = rb_intern("respond_to?");
-    rb_global_variable((void *)&basic_respond_to);
-    basic_respond_to = rb_method_node(rb_cObject, respond_to);
-    
-    rb_define_global_function("raise", rb_f_raise, -1);
-    rb_define_global_function("fail", rb_f_raise, -1);
-
-    rb_define_global_function("caller", rb_f_caller, -1);
-
-    rb_define_global_function("exit", rb_f_exit, -1);
-    rb_define_global_function("abort", rb_f_abort, -1);
 
-    rb_define_global_function("at_exit", rb_f_at_exit, 0);
+    for (p = data; p; p = p->prev) {
+	for (vars = p->dyna_vars; vars; vars = vars->next) {
+	    if (FL_TEST(vars, DVAR_DONT_RECYCLE)) break;
+	    FL_SET(vars, DVAR_DONT_RECYCLE);
+	}
+    }
+    data->scope = scope_dup(data->scope);
+    POP_BLOCK();
 
-    rb_define_global_function("catch", rb_f_catch, 1);
-    rb_define_global_function("throw", rb_f_throw, -1);
-    rb_define_global_function("global_variables", rb_f_global_variables, 0); /* in variable.c */
-    rb_define_global_function("local_variables", rb_f_local_variables, 0);
+    return bind;
+}
 
-    rb_define_method(rb_mKernel, "send", rb_f_send, -1);
-    rb_define_method(rb_mKernel, "__send__", rb_f_send, -1);
-    rb_define_method(rb_mKernel, "instance_eval", rb_obj_instance_eval, -1);
+#define SAFE_LEVEL_MAX PROC_TMASK
 
-    rb_define_private_method(rb_cModule, "append_features", rb_mod_append_features, 1);
-    rb_define_private_method(rb_cModule, "extend_object", rb_mod_extend_object, 1);
-    rb_define_private_method(rb_cModule, "include", rb_mod_include, -1);
-    rb_define_private_method(rb_cModule, "public", rb_mod_public, -1);
-    rb_define_private_method(rb_cModule, "protected", rb_mod_protected, -1);
-    rb_define_private_method(rb_cModule, "private", rb_mod_private, -1);
-    rb_define_private_method(rb_cModule, "module_function", rb_mod_modfunc, -1);
-    rb_define_method(rb_cModule, "method_defined?", rb_mod_method_defined, 1);
-    rb_define_method(rb_cModule, "public_method_defined?", rb_mod_public_method_defined, 1);
-    rb_define_method(rb_cModule, "private_method_defined?", rb_mod_private_method_defined, 1);
-    rb_define_method(rb_cModule, "protected_method_defined?", rb_mod_protected_method_defined, 1);
-    rb_define_method(rb_cModule, "public_class_method", rb_mod_public_method, -1);
-    rb_define_method(rb_cModule, "private_class_method", rb_mod_private_method, -1);
-    rb_define_method(rb_cModule, "module_eval", rb_mod_module_eval, -1);
-    rb_define_method(rb_cModule, "class_eval", rb_mod_module_eval, -1);
+static void
+proc_save_safe_level(data)
+    VALUE data;
+{
+    int safe = ruby_safe_level;
+    if (safe > PROC_TMAX) safe = PROC_TMAX;
+    FL_SET(data, (safe << PROC_TSHIFT) & PROC_TMASK);
+}
 
-    rb_undef_method(rb_cClass, "module_function");
+static int
+proc_get_safe_level(data)
+    VALUE data;
+{
+    return (RBASIC(data)->flags & PROC_TMASK) >> PROC_TSHIFT;
+}
 
-    rb_define_private_method(rb_cModule, "remove_method", rb_mod_remove_method, -1);
-    rb_define_private_method(rb_cModule, "undef_method", rb_mod_undef_method, -1);
-    rb_define_private_method(rb_cModule, "alias_method", rb_mod_alias_method, 2);
-    rb_define_private_method(rb_cModule, "define_method", rb_mod_define_method, -1);
+static void
+proc_set_safe_level(data)
+    VALUE data;
+{
+    ruby_safe_level = proc_get_safe_level(data);
+}
 
-    rb_define_singleton_method(rb_cModule, "nesting", rb_mod_nesting, 0);
-    rb_define_singleton_method(rb_cModule, "constants", rb_mod_s_constants, 0);
+static VALUE
+proc_alloc(klass, proc)
+    VALUE klass;
+    int proc;
+{
+    volatile VALUE block;
+    struct BLOCK *data, *p;
+    struct RVarmap *vars;
 
-    rb_define_singleton_method(ruby_top_self, "include", top_include, -1);
-    rb_define_singleton_method(ruby_top_self, "public", top_public, -1);
-    rb_define_singleton_method(ruby_top_self, "private", top_private, -1);
+    if (!rb_block_given_p() && !rb_f_block_given_p()) {
+	rb_raise(rb_eArgError, "tried to create Proc object without a block");
+    }
+    if (proc && !rb_block_given_p()) {
+	rb_warn("tried to create Proc object without a block");
+    }
 
-    rb_define_method(rb_mKernel, "extend", rb_obj_extend, -1);
+    if (!proc && ruby_block->block_obj && CLASS_OF(ruby_block->block_obj) == klass) {
+	return ruby_block->block_obj;
+    }
+    block = Data_Make_Struct(klass, struct BLOCK, blk_mark, blk_free, data);
+    *data = *ruby_block;
+    data->flags &= ~BLOCK_STACK;
+    data->spare_vars = 0;
 
-    rb_define_global_function("trace_var", rb_f_trace_var, -1); /* in variable.c */
-    rb_define_global_function("untrace_var", rb_f_untrace_var, -1); /* in variable.c */
+    data->orig_thread = rb_thread_current();
+    data->wrapper = ruby_wrapper;
+    data->iter = data->prev?Qtrue:Qfalse;
+    data->block_obj = block;
+    frame_dup(&data->frame);
+    if (data->iter) {
+	blk_copy_prev(data);
+    }
+    else {
+	data->prev = 0;
+    }
 
-    rb_define_global_function("set_trace_func", set_trace_func, 1);
-    rb_global_variable(&trace_func);
+    for (p = data; p; p = p->prev) {
+	for (vars = p->dyna_vars; vars; vars = vars->next) {
+	    if (FL_TEST(vars, DVAR_DONT_RECYCLE)) break;
+	    FL_SET(vars, DVAR_DONT_RECYCLE);
+	}
+    }
+    data->scope = scope_dup(data->scope);
+    proc_save_safe_level(block);
+    if (proc) {
+	data->flags |= BLOCK_LAMBDA;
+    }
+    else {
+	ruby_block->block_obj = block;
+    }
 
-    rb_define_virtual_variable("$SAFE", safe_getter, safe_setter);
+    return block;
 }
 
 /*
  *  call-seq:
- *     mod.autoload(name, filename)   => nil
- *
- *  Registers _filename_ to be loaded (using <code>Kernel::require</code>) 
- *  the first time that _name_ (which may be a <code>String</code> or
- *  a symbol) is accessed in the namespace of _mod_.
- *
- *     module A
+ *     Proc.new {|...| block } => a_proc 
+ *     Proc.new                => a_proc 
+ *  
+ *  Creates a new <code>Proc</code> object, bound to the current
+ *  context. <code>Proc::new</code> may be called without a block only
+ *  within a method with an attached block, in which case that block is
+ *  converted to the <code>Proc</code> object.
+ *     
+ *     def proc_from
+ *       Proc.new
  *     end
- *     A.autoload(:B, "b")
- *     A::B.doit            # autoloads "b"
+ *     proc = proc_from { "hello" }
+ *     proc.call   #=> "hello"
  */
 
 static VALUE
-rb_mod_autoload(mod, sym, file)
-    VALUE mod;
-    VALUE sym;
-    VALUE file;
+proc_s_new(argc, argv, klass)
+    int argc;
+    VALUE *argv;
+    VALUE klass;
 {
-    ID id = rb_to_id(sym);
+    VALUE block = proc_alloc(klass, Qfalse);
 
-    Check_SafeStr(file);
-    rb_autoload(mod, id, RSTRING(file)->ptr);
-    return Qnil;
+    rb_obj_call_init(block, argc, argv);
+    return block;
 }
 
-/*
- *  call-seq:
- *     mod.autoload?(name)   => String or nil
- *
- *  Returns _filename_ to be loaded if _name_ is registered as
- *  +autoload+ in the namespace of _mod_.
- *
- *     module A
- *     end
- *     A.autoload(:B, "b")
- *     A.autoload?(:B)            # => "b"
- */
-
-static VALUE
-rb_mod_autoload_p(mod, sym)
-    VALUE mod, sym;
+VALUE
+rb_block_proc()
 {
-    return rb_autoload_p(mod, rb_to_id(sym));
+    return proc_alloc(rb_cProc, Qfalse);
 }
 
-/*
- *  call-seq:
- *     autoload(module, filename)   => nil
- *  
- *  Registers _filename_ to be loaded (using <code>Kernel::require</code>) 
- *  the first time that _module_ (which may be a <code>String</code> or
- *  a symbol) is accessed.
- *     
- *     autoload(:MyModule, "/usr/local/lib/modules/my_module.rb")
- */
-
-static VALUE
-rb_f_autoload(obj, sym, file)
-    VALUE obj;
-    VALUE sym;
-    VALUE file;
+VALUE
+rb_f_lambda()
 {
-    if (NIL_P(ruby_cbase)) {
-	rb_raise(rb_eTypeError, "no class/module for autoload target");
-    }
-    return rb_mod_autoload(ruby_cbase, sym, file);
+    rb_warn("rb_f_lambda() is deprecated; use rb_block_proc() instead");
+    return proc_alloc(rb_cProc, Qtrue);
 }
 
 /*
- *  call-seq:
- *     autoload(module, filename)   => nil
- *
- *  Registers _filename_ to be loaded (using <code>Kernel::require</code>)
- *  the first time that _module_ (which may be a <code>String</code> or
- *  a symbol) is accessed.
+ * call-seq:
+ *   proc   { |...| block }  => a_proc
+ *   lambda { |...| block }  => a_proc
  *
- *     autoload(:MyModule, "/usr/local/lib/modules/my_module.rb")
+ * Equivalent to <code>Proc.new</code>, except the resulting Proc objects
+ * check the number of parameters passed when called.
  */
 
 static VALUE
-rb_f_autoload_p(obj, sym)
-    VALUE obj;
-    VALUE sym;
-{
-    /* use ruby_cbase as same as rb_f_autoload. */
-    if (NIL_P(ruby_cbase)) {
-	return Qfalse;
-    }
-    return rb_mod_autoload_p(ruby_cbase, sym);
-}
-
-void
-Init_load()
-{
-    rb_define_readonly_variable("$:", &rb_load_path);
-    rb_define_readonly_variable("$-I", &rb_load_path);
-    rb_define_readonly_variable("$LOAD_PATH", &rb_load_path);
-    rb_load_path = rb_ary_new();
-
-    rb_define_readonly_variable("$\"", &rb_features);
-    rb_define_readonly_variable("$LOADED_FEATURES", &rb_features);
-    rb_features = rb_ary_new();
-
-    rb_define_global_function("load", rb_f_load, -1);
-    rb_define_global_function("require", rb_f_require, 1);
-    rb_define_method(rb_cModule, "autoload",  rb_mod_autoload,   2);
-    rb_define_method(rb_cModule, "autoload?", rb_mod_autoload_p, 1);
-    rb_define_global_function("autoload",  rb_f_autoload,   2);
-    rb_define_global_function("autoload?", rb_f_autoload_p, 1);
-    rb_global_variable(&ruby_wrapper);
-
-    rb_global_variable(&ruby_dln_librefs);
-    ruby_dln_librefs = rb_ary_new();
-}
-
-static void
-scope_dup(scope)
-    struct SCOPE *scope;
+proc_lambda()
 {
-    ID *tbl;
-    VALUE *vars;
-
-    scope->flags |= SCOPE_DONT_RECYCLE;
-    if (scope->flags & SCOPE_MALLOC) return;
-
-    if (scope->local_tbl) {
-	tbl = scope->local_tbl;
-	vars = ALLOC_N(VALUE, tbl[0]+1);
-	*vars++ = scope->local_vars[-1];
-	MEMCPY(vars, scope->local_vars, VALUE, tbl[0]);
-	scope->local_vars = vars;
-	scope->flags |= SCOPE_MALLOC;
-    }
+    return proc_alloc(rb_cProc, Qtrue);
 }
 
-static void
-blk_mark(data)
+static int
+block_orphan(data)
     struct BLOCK *data;
 {
-    while (data) {
-	rb_gc_mark_frame(&data->frame);
-	rb_gc_mark((VALUE)data->scope);
-	rb_gc_mark((VALUE)data->var);
-	rb_gc_mark((VALUE)data->body);
-	rb_gc_mark((VALUE)data->self);
-	rb_gc_mark((VALUE)data->dyna_vars);
-	rb_gc_mark((VALUE)data->cref);
-	rb_gc_mark(data->wrapper);
-	rb_gc_mark(data->block_obj);
-	data = data->prev;
+    if (data->scope->flags & SCOPE_NOSTACK) {
+	return 1;
+    }
+    if (data->orig_thread != rb_thread_current()) {
+	return 1;
     }
+    return 0;
 }
 
-static void
-frame_free(frame)
-    struct FRAME *frame;
+static VALUE
+proc_invoke(proc, args, self, klass)
+    VALUE proc, args;		/* OK */
+    VALUE self, klass;
 {
-    struct FRAME *tmp;
+    struct BLOCK * volatile old_block;
+    struct BLOCK _block;
+    struct BLOCK *data;
+    volatile VALUE result = Qundef;
+    int state;
+    volatile int safe = ruby_safe_level;
+    volatile VALUE old_wrapper = ruby_wrapper;
+    volatile int pcall, avalue = Qtrue;
+    volatile VALUE tmp = args;
 
-    frame = frame->prev;
-    while (frame) {
-	tmp = frame;
-	frame = frame->prev;
-	free(tmp);
+    if (rb_block_given_p() && ruby_frame->last_func) {
+	if (klass != ruby_frame->last_class)
+	    klass = rb_obj_class(proc);
+	rb_warning("block for %s#%s is useless",
+		   rb_class2name(klass),
+		   rb_id2name(ruby_frame->last_func));
     }
-}
 
-static void
-blk_free(data)
-    struct BLOCK *data;
-{
-    void *tmp;
+    Data_Get_Struct(proc, struct BLOCK, data);
+    pcall = (data->flags & BLOCK_LAMBDA) ? YIELD_LAMBDA_CALL : 0;
+    if (!pcall && RARRAY(args)->len == 1) {
+	avalue = Qfalse;
+	args = RARRAY(args)->ptr[0];
+    }
 
-    while (data) {
-	frame_free(&data->frame);
-	tmp = data;
-	data = data->prev;
-	free(tmp);
+    PUSH_VARS();
+    ruby_wrapper = data->wrapper;
+    ruby_dyna_vars = data->dyna_vars;
+    /* PUSH BLOCK from data */
+    old_block = ruby_block;
+    _block = *data;
+    _block.flags |= BLOCK_STACK;
+    if (self != Qundef) _block.frame.self = self;
+    if (klass) _block.frame.last_class = klass;
+    _block.frame.argc = RARRAY(tmp)->len;
+    _block.frame.flags = ruby_frame->flags;
+    if (_block.frame.argc && DMETHOD_P()) {
+        NEWOBJ(scope, struct SCOPE);
+        OBJSETUP(scope, tmp, T_SCOPE);
+        scope->local_tbl = _block.scope->local_tbl;
+        scope->local_vars = _block.scope->local_vars;
+        scope->flags |= SCOPE_CLONE;
+        _block.scope = scope;
+    }
+    /* modify current frame */
+    ruby_block = &_block;
+    PUSH_ITER(ITER_CUR);
+    ruby_frame->iter = ITER_CUR;
+    PUSH_TAG(pcall ? PROT_LAMBDA : PROT_NONE);
+    state = EXEC_TAG();
+    if (state == 0) {
+	proc_set_safe_level(proc);
+	result = rb_yield_0(args, self, (self!=Qundef)?CLASS_OF(self):0, pcall, avalue);
     }
-}
-
-static void
-frame_dup(frame)
-    struct FRAME *frame;
-{
-    struct FRAME *tmp;
-
-    for (;;) {
-	frame->tmp = 0;		/* should not preserve tmp */
-	if (!frame->prev) break;
-	tmp = ALLOC(struct FRAME);
-	*tmp = *frame->prev;
-	frame->prev = tmp;
-	frame = tmp;
+    else if (TAG_DST()) {
+	result = prot_tag->retval;
     }
-}
-
-
-static void
-blk_copy_prev(block)
-    struct BLOCK *block;
-{
-    struct BLOCK *tmp;
-    struct RVarmap* vars;
-
-    while (block->prev) {
-	tmp = ALLOC_N(struct BLOCK, 1);
-	MEMCPY(tmp, block->prev, struct BLOCK, 1);
-	scope_dup(tmp->scope);
-	frame_dup(&tmp->frame);
+    POP_TAG();
+    POP_ITER();
+    ruby_block = old_block;
+    ruby_wrapper = old_wrapper;
+    POP_VARS();
+    ruby_safe_level = safe;
 
-	for (vars = tmp->dyna_vars; vars; vars = vars->next) {
-	    if (FL_TEST(vars, DVAR_DONT_RECYCLE)) break;
-	    FL_SET(vars, DVAR_DONT_RECYCLE);
+    switch (state) {
+      case 0:
+	break;
+      case TAG_RETRY:
+	proc_jump_error(TAG_RETRY, Qnil); /* xxx */
+	JUMP_TAG(state);
+	break;
+      case TAG_NEXT:
+      case TAG_BREAK:
+	if (!pcall && result != Qundef) {
+	    proc_jump_error(state, result);
 	}
-
-	block->prev = tmp;
-	block = tmp;
+      case TAG_RETURN:
+	if (result != Qundef) {
+	    if (pcall) break;
+	    return_jump(result);
+	}
+      default:
+	JUMP_TAG(state);
     }
+    return result;
 }
 
-
-static void
-blk_dup(dup, orig)
-    struct BLOCK *dup, *orig;
-{
-    MEMCPY(dup, orig, struct BLOCK, 1);
-    frame_dup(&dup->frame);
-
-    if (dup->iter) {
-	blk_copy_prev(dup);
-    }
-    else {
-	dup->prev = 0;
-    }
-}
+/* CHECKME: are the argument checking semantics correct? */
 
 /*
- * MISSING: documentation
+ *  call-seq:
+ *     prc.call(params,...)   => obj
+ *     prc[params,...]        => obj
+ *  
+ *  Invokes the block, setting the block's parameters to the values in
+ *  <i>params</i> using something close to method calling semantics.
+ *  Generates a warning if multiple values are passed to a proc that
+ *  expects just one (previously this silently converted the parameters
+ *  to an array). 
+ *
+ *  For procs created using <code>Kernel.proc</code>, generates an 
+ *  error if the wrong number of parameters
+ *  are passed to a proc with multiple parameters. For procs created using
+ *  <code>Proc.new</code>, extra parameters are silently discarded.
+ *
+ *  Returns the value of the last expression evaluated in the block. See
+ *  also <code>Proc#yield</code>.
+ *     
+ *     a_proc = Proc.new {|a, *b| b.collect {|i| i*a }}
+ *     a_proc.call(9, 1, 2, 3)   #=> [9, 18, 27]
+ *     a_proc[9, 1, 2, 3]        #=> [9, 18, 27]
+ *     a_proc = Proc.new {|a,b| a}
+ *     a_proc.call(1,2,3)
+ *     
+ *  <em>produces:</em>
+ *     
+ *     prog.rb:5: wrong number of arguments (3 for 2) (ArgumentError)
+ *     	from prog.rb:4:in `call'
+ *     	from prog.rb:5
  */
 
 static VALUE
-proc_clone(self)
-    VALUE self;
+proc_call(proc, args)
+    VALUE proc, args;		/* OK */
 {
-    struct BLOCK *orig, *data;
-    VALUE bind;
-
-    Data_Get_Struct(self, struct BLOCK, orig);
-    bind = Data_Make_Struct(rb_obj_class(self),struct BLOCK,blk_mark,blk_free,data);
-    CLONESETUP(bind, self);
-    blk_dup(data, orig);
-
-    return bind;
+    return proc_invoke(proc, args, Qundef, 0);
 }
 
-/*
- * MISSING: documentation
- */
-
-#define PROC_TSHIFT (FL_USHIFT+1)
-#define PROC_TMASK  (FL_USER1|FL_USER2|FL_USER3)
-#define PROC_TMAX   (PROC_TMASK >> PROC_TSHIFT)
-
-static int proc_get_safe_level(VALUE);
-
-static VALUE
-proc_dup(self)
-    VALUE self;
-{
-    struct BLOCK *orig, *data;
-    VALUE bind;
-    int safe = proc_get_safe_level(self);
-
-    Data_Get_Struct(self, struct BLOCK, orig);
-    bind = Data_Make_Struct(rb_obj_class(self),struct BLOCK,blk_mark,blk_free,data);
-    blk_dup(data, orig);
-    if (safe > PROC_TMAX) safe = PROC_TMAX;
-    FL_SET(bind, (safe << PROC_TSHIFT) & PROC_TMASK);
-
-    return bind;
-}
+static VALUE bmcall _((VALUE, VALUE));
+static VALUE method_arity _((VALUE));
 
 /*
  *  call-seq:
- *     binding -> a_binding
+ *     prc.arity -> fixnum
  *  
- *  Returns a +Binding+ object, describing the variable and
- *  method bindings at the point of call. This object can be used when
- *  calling +eval+ to execute the evaluated command in this
- *  environment. Also see the description of class +Binding+.
+ *  Returns the number of arguments that would not be ignored. If the block
+ *  is declared to take no arguments, returns 0. If the block is known
+ *  to take exactly n arguments, returns n. If the block has optional
+ *  arguments, return -n-1, where n is the number of mandatory
+ *  arguments. A <code>proc</code> with no argument declarations
+ *  is the same a block declaring <code>||</code> as its arguments.
  *     
- *     def getBinding(param)
- *       return binding
- *     end
- *     b = getBinding("hello")
- *     eval("param", b)   #=> "hello"
+ *     Proc.new {}.arity          #=>  0
+ *     Proc.new {||}.arity        #=>  0
+ *     Proc.new {|a|}.arity       #=>  1
+ *     Proc.new {|a,b|}.arity     #=>  2
+ *     Proc.new {|a,b,c|}.arity   #=>  3
+ *     Proc.new {|*a|}.arity      #=> -1
+ *     Proc.new {|a,*b|}.arity    #=> -2
  */
 
 static VALUE
-rb_f_binding(self)
-    VALUE self;
+proc_arity(proc)
+    VALUE proc;
 {
-    struct BLOCK *data, *p;
-    struct RVarmap *vars;
-    VALUE bind;
-
-    PUSH_BLOCK(0,0);
-    bind = Data_Make_Struct(rb_cBinding,struct BLOCK,blk_mark,blk_free,data);
-    *data = *ruby_block;
-
-    data->orig_thread = rb_thread_current();
-    data->wrapper = ruby_wrapper;
-    data->iter = rb_f_block_given_p();
-    frame_dup(&data->frame);
-    if (ruby_frame->prev) {
-	data->frame.last_func = ruby_frame->prev->last_func;
-	data->frame.last_class = ruby_frame->prev->last_class;
-	data->frame.orig_func = ruby_frame->prev->orig_func;
-    }
-
-    if (data->iter) {
-	blk_copy_prev(data);
-    }
-    else {
-	data->prev = 0;
-    }
+    struct BLOCK *data;
+    NODE *list;
+    int n;
 
-    for (p = data; p; p = p->prev) {
-	for (vars = p->dyna_vars; vars; vars = vars->next) {
-	    if (FL_TEST(vars, DVAR_DONT_RECYCLE)) break;
-	    FL_SET(vars, DVAR_DONT_RECYCLE);
+    Data_Get_Struct(proc, struct BLOCK, data);
+    if (data->var == 0) {
+	if (data->body && nd_type(data->body) == NODE_IFUNC &&
+	    data->body->nd_cfnc == bmcall) {
+	    return method_arity(data->body->nd_tval);
 	}
+	return INT2FIX(-1);
+    }
+    if (data->var == (NODE*)1) return INT2FIX(0);
+    if (data->var == (NODE*)2) return INT2FIX(0);
+    switch (nd_type(data->var)) {
+      default:
+	return INT2FIX(1);
+      case NODE_MASGN:
+	list = data->var->nd_head;
+	n = 0;
+	while (list) {
+	    n++;
+	    list = list->nd_next;
+	}
+	if (data->var->nd_args) return INT2FIX(-n-1);
+	return INT2FIX(n);
     }
-    scope_dup(data->scope);
-    POP_BLOCK();
-
-    return bind;
-}
-
-#define SAFE_LEVEL_MAX PROC_TMASK
-
-static void
-proc_save_safe_level(data)
-    VALUE data;
-{
-    int safe = ruby_safe_level;
-    if (safe > PROC_TMAX) safe = PROC_TMAX;
-    FL_SET(data, (safe << PROC_TSHIFT) & PROC_TMASK);
-}
-
-static int
-proc_get_safe_level(data)
-    VALUE data;
-{
-    return (RBASIC(data)->flags & PROC_TMASK) >> PROC_TSHIFT;
-}
-
-static void
-proc_set_safe_level(data)
-    VALUE data;
-{
-    ruby_safe_level = proc_get_safe_level(data);
 }
 
+/*
+ * call-seq:
+ *   prc == other_proc   =>  true or false
+ *
+ * Return <code>true</code> if <i>prc</i> is the same object as
+ * <i>other_proc</i>, or if they are both procs with the same body.
+ */
+
 static VALUE
-proc_alloc(klass, proc)
-    VALUE klass;
-    int proc;
+proc_eq(self, other)
+    VALUE self, other;
 {
-    volatile VALUE block;
-    struct BLOCK *data, *p;
-    struct RVarmap *vars;
+    struct BLOCK *data, *data2;
 
-    if (!rb_block_given_p() && !rb_f_block_given_p()) {
-	rb_raise(rb_eArgError, "tried to create Proc object without a block");
-    }
-    if (proc && !rb_block_given_p()) {
-	rb_warn("tried to create Proc object without a block");
-    }
+    if (self == other) return Qtrue;
+    if (TYPE(other) != T_DATA) return Qfalse;
+    if (RDATA(other)->dmark != (RUBY_DATA_FUNC)blk_mark) return Qfalse;
+    if (CLASS_OF(self) != CLASS_OF(other)) return Qfalse;
+    Data_Get_Struct(self, struct BLOCK, data);
+    Data_Get_Struct(other, struct BLOCK, data2);
+    if (data->body != data2->body) return Qfalse;
+    if (data->var != data2->var) return Qfalse;
+    if (data->scope != data2->scope) return Qfalse;
+    if (data->dyna_vars != data2->dyna_vars) return Qfalse;
+    if (data->flags != data2->flags) return Qfalse;
 
-    if (!proc && ruby_block->block_obj && CLASS_OF(ruby_block->block_obj) == klass) {
-	return ruby_block->block_obj;
-    }
-    block = Data_Make_Struct(klass, struct BLOCK, blk_mark, blk_free, data);
-    *data = *ruby_block;
+    return Qtrue;
+}
 
-    data->orig_thread = rb_thread_current();
-    data->wrapper = ruby_wrapper;
-    data->iter = data->prev?Qtrue:Qfalse;
-    data->block_obj = block;
-    frame_dup(&data->frame);
-    if (data->iter) {
-	blk_copy_prev(data);
-    }
-    else {
-	data->prev = 0;
-    }
+/*
+ * call-seq:
+ *   prc.to_s   => string
+ *
+ * Shows the unique identifier for this proc, along with
+ * an indication of where the proc was defined.
+ */
 
-    for (p = data; p; p = p->prev) {
-	for (vars = p->dyna_vars; vars; vars = vars->next) {
-	    if (FL_TEST(vars, DVAR_DONT_RECYCLE)) break;
-	    FL_SET(vars, DVAR_DONT_RECYCLE);
-	}
-    }
-    scope_dup(data->scope);
-    proc_save_safe_level(block);
-    if (proc) {
-	data->flags |= BLOCK_LAMBDA;
+static VALUE
+proc_to_s(self)
+    VALUE self;
+{
+    struct BLOCK *data;
+    NODE *node;
+    char *cname = rb_obj_classname(self);
+    const int w = (sizeof(VALUE) * CHAR_BIT) / 4;
+    long len = strlen(cname)+6+w; /* 6:tags 16:addr */
+    VALUE str;
+
+    Data_Get_Struct(self, struct BLOCK, data);
+    if ((node = data->frame.node) || (node = data->body)) {
+	len += strlen(node->nd_file) + 2 + (SIZEOF_LONG*CHAR_BIT-NODE_LSHIFT)/3;
+	str = rb_str_new(0, len);
+	snprintf(RSTRING(str)->ptr, len+1,
+		 "#<%s:0x%.*lx@%s:%d>", cname, w, (VALUE)data->body,
+		 node->nd_file, nd_line(node));
     }
     else {
-	ruby_block->block_obj = block;
+	str = rb_str_new(0, len);
+	snprintf(RSTRING(str)->ptr, len+1,
+		 "#<%s:0x%.*lx>", cname, w, (VALUE)data->body);
     }
+    RSTRING(str)->len = strlen(RSTRING(str)->ptr);
+    if (OBJ_TAINTED(self)) OBJ_TAINT(str);
 
-    return block;
+    return str;
 }
 
 /*
  *  call-seq:
- *     Proc.new {|...| block } => a_proc 
- *     Proc.new                => a_proc 
+ *     prc.to_proc -> prc
  *  
- *  Creates a new <code>Proc</code> object, bound to the current
- *  context. <code>Proc::new</code> may be called without a block only
- *  within a method with an attached block, in which case that block is
- *  converted to the <code>Proc</code> object.
- *     
- *     def proc_from
- *       Proc.new
- *     end
- *     proc = proc_from { "hello" }
- *     proc.call   #=> "hello"
+ *  Part of the protocol for converting objects to <code>Proc</code>
+ *  objects. Instances of class <code>Proc</code> simply return
+ *  themselves.
  */
 
 static VALUE
-proc_s_new(argc, argv, klass)
-    int argc;
-    VALUE *argv;
-    VALUE klass;
-{
-    VALUE block = proc_alloc(klass, Qfalse);
-
-    rb_obj_call_init(block, argc, argv);
-    return block;
-}
-
-VALUE
-rb_block_proc()
-{
-    return proc_alloc(rb_cProc, Qfalse);
-}
-
-VALUE
-rb_f_lambda()
+proc_to_self(self)
+    VALUE self;
 {
-    rb_warn("rb_f_lambda() is deprecated; use rb_block_proc() instead");
-    return proc_alloc(rb_cProc, Qtrue);
+    return self;
 }
 
 /*
- * call-seq:
- *   proc   { |...| block }  => a_proc
- *   lambda { |...| block }  => a_proc
- *
- * Equivalent to <code>Proc.new</code>, except the resulting Proc objects
- * check the number of parameters passed when called.
+ *  call-seq:
+ *     prc.binding    => binding
+ *  
+ *  Returns the binding associated with <i>prc</i>. Note that
+ *  <code>Kernel#eval</code> accepts either a <code>Proc</code> or a
+ *  <code>Binding</code> object as its second parameter.
+ *     
+ *     def fred(param)
+ *       proc {}
+ *     end
+ *     
+ *     b = fred(99)
+ *     eval("param", b.binding)   #=> 99
+ *     eval("param", b)           #=> 99
  */
 
 static VALUE
-proc_lambda()
+proc_binding(proc)
+    VALUE proc;
 {
-    return proc_alloc(rb_cProc, Qtrue);
-}
+    struct BLOCK *orig, *data;
+    VALUE bind;
 
-static int
-block_orphan(data)
-    struct BLOCK *data;
-{
-    if (data->scope->flags & SCOPE_NOSTACK) {
-	return 1;
+    Data_Get_Struct(proc, struct BLOCK, orig);
+    bind = Data_Make_Struct(rb_cBinding,struct BLOCK,blk_mark,blk_free,data);
+    MEMCPY(data, orig, struct BLOCK, 1);
+    frame_dup(&data->frame);
+
+    if (data->iter) {
+	blk_copy_prev(data);
     }
-    if (data->orig_thread != rb_thread_current()) {
-	return 1;
+    else {
+	data->prev = 0;
     }
-    return 0;
+
+    return bind;
 }
 
 static VALUE
-proc_invoke(proc, args, self, klass)
-    VALUE proc, args;		/* OK */
-    VALUE self, klass;
+block_pass(self, node)
+    VALUE self;
+    NODE *node;
 {
+    VALUE proc = rb_eval(self, node->nd_body);	/* OK */
+    VALUE b;
     struct BLOCK * volatile old_block;
     struct BLOCK _block;
     struct BLOCK *data;
-    volatile VALUE result = Qundef;
+    volatile VALUE result = Qnil;
     int state;
+    volatile int orphan;
     volatile int safe = ruby_safe_level;
-    volatile VALUE old_wrapper = ruby_wrapper;
-    volatile int pcall, avalue = Qtrue;
-    volatile VALUE tmp = args;
 
-    if (rb_block_given_p() && ruby_frame->last_func) {
-	if (klass != ruby_frame->last_class)
-	    klass = rb_obj_class(proc);
-	rb_warning("block for %s#%s is useless",
-		   rb_class2name(klass),
-		   rb_id2name(ruby_frame->last_func));
+    if (NIL_P(proc)) {
+	PUSH_ITER(ITER_NOT);
+	result = rb_eval(self, node->nd_iter);
+	POP_ITER();
+	return result;
+    }
+    if (!rb_obj_is_proc(proc)) {
+	b = rb_check_convert_type(proc, T_DATA, "Proc", "to_proc");
+	if (!rb_obj_is_proc(b)) {
+	    rb_raise(rb_eTypeError, "wrong argument type %s (expected Proc)",
+		     rb_obj_classname(proc));
+	}
+	proc = b;
     }
 
-    Data_Get_Struct(proc, struct BLOCK, data);
-    pcall = (data->flags & BLOCK_LAMBDA) ? YIELD_LAMBDA_CALL : 0;
-    if (!pcall && RARRAY(args)->len == 1) {
-	avalue = Qfalse;
-	args = RARRAY(args)->ptr[0];
+    if (ruby_safe_level >= 1 && OBJ_TAINTED(proc) &&
+	ruby_safe_level > proc_get_safe_level(proc)) {
+	rb_raise(rb_eSecurityError, "Insecure: tainted block value");
     }
 
-    PUSH_VARS();
-    ruby_wrapper = data->wrapper;
-    ruby_dyna_vars = data->dyna_vars;
+    if (ruby_block && ruby_block->block_obj == proc) {
+	PUSH_ITER(ITER_PAS);
+	result = rb_eval(self, node->nd_iter);
+	POP_ITER();
+	return result;
+    }
+
+    Data_Get_Struct(proc, struct BLOCK, data);
+    orphan = block_orphan(data);
+
     /* PUSH BLOCK from data */
     old_block = ruby_block;
     _block = *data;
-    if (self != Qundef) _block.frame.self = self;
-    if (klass) _block.frame.last_class = klass;
-    _block.frame.argc = RARRAY(tmp)->len;
-    _block.frame.flags = ruby_frame->flags;
-    if (_block.frame.argc && DMETHOD_P()) {
-        NEWOBJ(scope, struct SCOPE);
-        OBJSETUP(scope, tmp, T_SCOPE);
-        scope->local_tbl = _block.scope->local_tbl;
-        scope->local_vars = _block.scope->local_vars;
-        scope->flags |= SCOPE_CLONE;
-        _block.scope = scope;
-    }
-    /* modify current frame */
-    ruby_block = &_block;
-    PUSH_ITER(ITER_CUR);
-    ruby_frame->iter = ITER_CUR;
-    PUSH_TAG(pcall ? PROT_LAMBDA : PROT_NONE);
+    _block.flags |= BLOCK_STACK;
+    _block.outer = ruby_block;
+    if (orphan) _block.uniq = block_unique++;
+    ruby_block = &_block;
+    PUSH_ITER(ITER_PRE);
+    if (ruby_frame->iter == ITER_NOT)
+	ruby_frame->iter = ITER_PRE;
+
+    PUSH_TAG(PROT_LOOP);
     state = EXEC_TAG();
     if (state == 0) {
+      retry:
 	proc_set_safe_level(proc);
-	result = rb_yield_0(args, self, (self!=Qundef)?CLASS_OF(self):0, pcall, avalue);
+	if (safe > ruby_safe_level)
+	    ruby_safe_level = safe;
+	result = rb_eval(self, node->nd_iter);
     }
-    else if (TAG_DST()) {
+    else if (state == TAG_BREAK && TAG_DST()) {
 	result = prot_tag->retval;
+	state = 0;
+    }
+    else if (state == TAG_RETRY) {
+	state = 0;
+	goto retry;
     }
     POP_TAG();
     POP_ITER();
     ruby_block = old_block;
-    ruby_wrapper = old_wrapper;
-    POP_VARS();
     ruby_safe_level = safe;
 
-    switch (state) {
+    switch (state) {/* escape from orphan block */
       case 0:
 	break;
-      case TAG_RETRY:
-	proc_jump_error(TAG_RETRY, Qnil); /* xxx */
-	JUMP_TAG(state);
-	break;
-      case TAG_NEXT:
-      case TAG_BREAK:
-	if (!pcall && result != Qundef) {
-	    proc_jump_error(state, result);
-	}
       case TAG_RETURN:
-	if (result != Qundef) {
-	    if (pcall) break;
-	    return_jump(result);
+	if (orphan) {
+	    proc_jump_error(state, prot_tag->retval);
 	}
       default:
 	JUMP_TAG(state);
     }
+
     return result;
 }
 
-/* CHECKME: are the argument checking semantics correct? */
+struct METHOD {
+    VALUE klass, rklass;
+    VALUE recv;
+    ID id, oid;
+    int safe_level;
+    NODE *body;
+};
 
-/*
- *  call-seq:
- *     prc.call(params,...)   => obj
- *     prc[params,...]        => obj
- *  
- *  Invokes the block, setting the block's parameters to the values in
- *  <i>params</i> using something close to method calling semantics.
- *  Generates a warning if multiple values are passed to a proc that
- *  expects just one (previously this silently converted the parameters
- *  to an array). 
+static void
+bm_mark(data)
+    struct METHOD *data;
+{
+    rb_gc_mark(data->rklass);
+    rb_gc_mark(data->klass);
+    rb_gc_mark(data->recv);
+    rb_gc_mark((VALUE)data->body);
+}
+
+static VALUE
+mnew(klass, obj, id, mklass)
+    VALUE klass, obj, mklass;
+    ID id;
+{
+    VALUE method;
+    NODE *body;
+    int noex;
+    struct METHOD *data;
+    VALUE rklass = klass;
+    ID oid = id;
+
+  again:
+    if ((body = rb_get_method_body(&klass, &id, &noex)) == 0) {
+	print_undef(rklass, oid);
+    }
+
+    if (nd_type(body) == NODE_ZSUPER) {
+	klass = RCLASS(klass)->super;
+	goto again;
+    }
+
+    while (rklass != klass &&
+	   (FL_TEST(rklass, FL_SINGLETON) || TYPE(rklass) == T_ICLASS)) {
+	rklass = RCLASS(rklass)->super;
+    }
+    method = Data_Make_Struct(mklass, struct METHOD, bm_mark, free, data);
+    data->klass = klass;
+    data->recv = obj;
+    data->id = id;
+    data->body = body;
+    data->rklass = rklass;
+    data->oid = oid;
+    data->safe_level = NOEX_WITH_SAFE(noex);
+    OBJ_INFECT(method, klass);
+
+    return method;
+}
+
+
+/**********************************************************************
  *
- *  For procs created using <code>Kernel.proc</code>, generates an 
- *  error if the wrong number of parameters
- *  are passed to a proc with multiple parameters. For procs created using
- *  <code>Proc.new</code>, extra parameters are silently discarded.
+ * Document-class : Method
  *
- *  Returns the value of the last expression evaluated in the block. See
- *  also <code>Proc#yield</code>.
+ *  Method objects are created by <code>Object#method</code>, and are
+ *  associated with a particular object (not just with a class). They
+ *  may be used to invoke the method within the object, and as a block
+ *  associated with an iterator. They may also be unbound from one
+ *  object (creating an <code>UnboundMethod</code>) and bound to
+ *  another.
  *     
- *     a_proc = Proc.new {|a, *b| b.collect {|i| i*a }}
- *     a_proc.call(9, 1, 2, 3)   #=> [9, 18, 27]
- *     a_proc[9, 1, 2, 3]        #=> [9, 18, 27]
- *     a_proc = Proc.new {|a,b| a}
- *     a_proc.call(1,2,3)
+ *     class Thing
+ *       def square(n)
+ *         n*n
+ *       end
+ *     end
+ *     thing = Thing.new
+ *     meth  = thing.method(:square)
  *     
- *  <em>produces:</em>
+ *     meth.call(9)                 #=> 81
+ *     [ 1, 2, 3 ].collect(&meth)   #=> [1, 4, 9]
  *     
- *     prog.rb:5: wrong number of arguments (3 for 2) (ArgumentError)
- *     	from prog.rb:4:in `call'
- *     	from prog.rb:5
  */
 
+/*
+ * call-seq:
+ *   meth == other_meth  => true or false
+ *
+ * Two method objects are equal if that are bound to the same
+ * object and contain the same body.
+ */
+
+
 static VALUE
-proc_call(proc, args)
-    VALUE proc, args;		/* OK */
+method_eq(method, other)
+    VALUE method, other;
 {
-    return proc_invoke(proc, args, Qundef, 0);
+    struct METHOD *m1, *m2;
+
+    if (TYPE(other) != T_DATA || RDATA(other)->dmark != (RUBY_DATA_FUNC)bm_mark)
+	return Qfalse;
+    if (CLASS_OF(method) != CLASS_OF(other))
+	return Qfalse;
+
+    Data_Get_Struct(method, struct METHOD, m1);
+    Data_Get_Struct(other, struct METHOD, m2);
+
+    if (m1->klass != m2->klass || m1->rklass != m2->rklass ||
+	m1->recv != m2->recv || m1->body != m2->body)
+	return Qfalse;
+
+    return Qtrue;
 }
 
-static VALUE bmcall _((VALUE, VALUE));
-static VALUE method_arity _((VALUE));
+/*
+ *  call-seq:
+ *     meth.unbind    => unbound_method
+ *  
+ *  Dissociates <i>meth</i> from it's current receiver. The resulting
+ *  <code>UnboundMethod</code> can subsequently be bound to a new object
+ *  of the same class (see <code>UnboundMethod</code>).
+ */
+
+static VALUE
+method_unbind(obj)
+    VALUE obj;
+{
+    VALUE method;
+    struct METHOD *orig, *data;
+
+    Data_Get_Struct(obj, struct METHOD, orig);
+    method = Data_Make_Struct(rb_cUnboundMethod, struct METHOD, bm_mark, free, data);
+    data->klass = orig->klass;
+    data->recv = Qundef;
+    data->id = orig->id;
+    data->body = orig->body;
+    data->rklass = orig->rklass;
+    data->oid = orig->oid;
+    OBJ_INFECT(method, obj);
+
+    return method;
+}
 
 /*
  *  call-seq:
- *     prc.arity -> fixnum
+ *     obj.method(sym)    => method
  *  
- *  Returns the number of arguments that would not be ignored. If the block
- *  is declared to take no arguments, returns 0. If the block is known
- *  to take exactly n arguments, returns n. If the block has optional
- *  arguments, return -n-1, where n is the number of mandatory
- *  arguments. A <code>proc</code> with no argument declarations
- *  is the same a block declaring <code>||</code> as its arguments.
+ *  Looks up the named method as a receiver in <i>obj</i>, returning a
+ *  <code>Method</code> object (or raising <code>NameError</code>). The
+ *  <code>Method</code> object acts as a closure in <i>obj</i>'s object
+ *  instance, so instance variables and the value of <code>self</code>
+ *  remain available.
+ *     
+ *     class Demo
+ *       def initialize(n)
+ *         @iv = n
+ *       end
+ *       def hello()
+ *         "Hello, @iv = #{@iv}"
+ *       end
+ *     end
+ *     
+ *     k = Demo.new(99)
+ *     m = k.method(:hello)
+ *     m.call   #=> "Hello, @iv = 99"
+ *     
+ *     l = Demo.new('Fred')
+ *     m = l.method("hello")
+ *     m.call   #=> "Hello, @iv = Fred"
+ */
+
+static VALUE
+rb_obj_method(obj, vid)
+    VALUE obj;
+    VALUE vid;
+{
+    return mnew(CLASS_OF(obj), obj, rb_to_id(vid), rb_cMethod);
+}
+
+/*
+ *  call-seq:
+ *     mod.instance_method(symbol)   => unbound_method
+ *  
+ *  Returns an +UnboundMethod+ representing the given
+ *  instance method in _mod_.
+ *     
+ *     class Interpreter
+ *       def do_a() print "there, "; end
+ *       def do_d() print "Hello ";  end
+ *       def do_e() print "!\n";     end
+ *       def do_v() print "Dave";    end
+ *       Dispatcher = {
+ *        ?a => instance_method(:do_a),
+ *        ?d => instance_method(:do_d),
+ *        ?e => instance_method(:do_e),
+ *        ?v => instance_method(:do_v)
+ *       }
+ *       def interpret(string)
+ *         string.each_byte {|b| Dispatcher[b].bind(self).call }
+ *       end
+ *     end
  *     
- *     Proc.new {}.arity          #=>  0
- *     Proc.new {||}.arity        #=>  0
- *     Proc.new {|a|}.arity       #=>  1
- *     Proc.new {|a,b|}.arity     #=>  2
- *     Proc.new {|a,b,c|}.arity   #=>  3
- *     Proc.new {|*a|}.arity      #=> -1
- *     Proc.new {|a,*b|}.arity    #=> -2
+ *     
+ *     interpreter = Interpreter.new
+ *     interpreter.interpret('dave')
+ *     
+ *  <em>produces:</em>
+ *     
+ *     Hello there, Dave!
  */
 
 static VALUE
-proc_arity(proc)
-    VALUE proc;
+rb_mod_method(mod, vid)
+    VALUE mod;
+    VALUE vid;
 {
-    struct BLOCK *data;
-    NODE *list;
-    int n;
-
-    Data_Get_Struct(proc, struct BLOCK, data);
-    if (data->var == 0) {
-	if (data->body && nd_type(data->body) == NODE_IFUNC &&
-	    data->body->nd_cfnc == bmcall) {
-	    return method_arity(data->body->nd_tval);
-	}
-	return INT2FIX(-1);
-    }
-    if (data->var == (NODE*)1) return INT2FIX(0);
-    if (data->var == (NODE*)2) return INT2FIX(0);
-    switch (nd_type(data->var)) {
-      default:
-	return INT2FIX(1);
-      case NODE_MASGN:
-	list = data->var->nd_head;
-	n = 0;
-	while (list) {
-	    n++;
-	    list = list->nd_next;
-	}
-	if (data->var->nd_args) return INT2FIX(-n-1);
-	return INT2FIX(n);
-    }
+    return mnew(mod, Qundef, rb_to_id(vid), rb_cUnboundMethod);
 }
 
 /*
- * call-seq:
- *   prc == other_proc   =>  true or false
- *
- * Return <code>true</code> if <i>prc</i> is the same object as
- * <i>other_proc</i>, or if they are both procs with the same body.
+ * MISSING: documentation
  */
 
 static VALUE
-proc_eq(self, other)
-    VALUE self, other;
+method_clone(self)
+    VALUE self;
 {
-    struct BLOCK *data, *data2;
+    VALUE clone;
+    struct METHOD *orig, *data;
 
-    if (self == other) return Qtrue;
-    if (TYPE(other) != T_DATA) return Qfalse;
-    if (RDATA(other)->dmark != (RUBY_DATA_FUNC)blk_mark) return Qfalse;
-    if (CLASS_OF(self) != CLASS_OF(other)) return Qfalse;
-    Data_Get_Struct(self, struct BLOCK, data);
-    Data_Get_Struct(other, struct BLOCK, data2);
-    if (data->body != data2->body) return Qfalse;
-    if (data->var != data2->var) return Qfalse;
-    if (data->scope != data2->scope) return Qfalse;
-    if (data->dyna_vars != data2->dyna_vars) return Qfalse;
-    if (data->flags != data2->flags) return Qfalse;
+    Data_Get_Struct(self, struct METHOD, orig);
+    clone = Data_Make_Struct(CLASS_OF(self),struct METHOD, bm_mark, free, data);
+    CLONESETUP(clone, self);
+    *data = *orig;
 
-    return Qtrue;
+    return clone;
 }
 
 /*
- * call-seq:
- *   prc.to_s   => string
- *
- * Shows the unique identifier for this proc, along with
- * an indication of where the proc was defined.
+ *  call-seq:
+ *     meth.call(args, ...)    => obj
+ *     meth[args, ...]         => obj
+ *  
+ *  Invokes the <i>meth</i> with the specified arguments, returning the
+ *  method's return value.
+ *     
+ *     m = 12.method("+")
+ *     m.call(3)    #=> 15
+ *     m.call(20)   #=> 32
  */
 
 static VALUE
-proc_to_s(self)
-    VALUE self;
+method_call(argc, argv, method)
+    int argc;
+    VALUE *argv;
+    VALUE method;
 {
-    struct BLOCK *data;
-    NODE *node;
-    char *cname = rb_obj_classname(self);
-    const int w = (sizeof(VALUE) * CHAR_BIT) / 4;
-    long len = strlen(cname)+6+w; /* 6:tags 16:addr */
-    VALUE str;
+    VALUE result = Qnil;	/* OK */
+    struct METHOD *data;
+    int safe;
 
-    Data_Get_Struct(self, struct BLOCK, data);
-    if ((node = data->frame.node) || (node = data->body)) {
-	len += strlen(node->nd_file) + 2 + (SIZEOF_LONG*CHAR_BIT-NODE_LSHIFT)/3;
-	str = rb_str_new(0, len);
-	snprintf(RSTRING(str)->ptr, len+1,
-		 "#<%s:0x%.*lx@%s:%d>", cname, w, (VALUE)data->body,
-		 node->nd_file, nd_line(node));
+    Data_Get_Struct(method, struct METHOD, data);
+    if (data->recv == Qundef) {
+	rb_raise(rb_eTypeError, "can't call unbound method; bind first");
+    }
+    if (OBJ_TAINTED(method)) {
+        safe = NOEX_WITH(data->safe_level, 4)|NOEX_TAINTED;
     }
     else {
-	str = rb_str_new(0, len);
-	snprintf(RSTRING(str)->ptr, len+1,
-		 "#<%s:0x%.*lx>", cname, w, (VALUE)data->body);
+	safe = data->safe_level;
     }
-    RSTRING(str)->len = strlen(RSTRING(str)->ptr);
-    if (OBJ_TAINTED(self)) OBJ_TAINT(str);
-
-    return str;
+    PUSH_ITER(rb_block_given_p()?ITER_PRE:ITER_NOT);
+    result = rb_call0(data->klass,data->recv,data->id,data->oid,argc,argv,data->body,safe);
+    POP_ITER();
+    return result;
 }
 
+/**********************************************************************
+ *
+ * Document-class: UnboundMethod
+ *
+ *  Ruby supports two forms of objectified methods. Class
+ *  <code>Method</code> is used to represent methods that are associated
+ *  with a particular object: these method objects are bound to that
+ *  object. Bound method objects for an object can be created using
+ *  <code>Object#method</code>.
+ *     
+ *  Ruby also supports unbound methods; methods objects that are not
+ *  associated with a particular object. These can be created either by
+ *  calling <code>Module#instance_method</code> or by calling
+ *  <code>unbind</code> on a bound method object. The result of both of
+ *  these is an <code>UnboundMethod</code> object.
+ *     
+ *  Unbound methods can only be called after they are bound to an
+ *  object. That object must be be a kind_of? the method's original
+ *  class.
+ *     
+ *     class Square
+ *       def area
+ *         @side * @side
+ *       end
+ *       def initialize(side)
+ *         @side = side
+ *       end
+ *     end
+ *     
+ *     area_un = Square.instance_method(:area)
+ *     
+ *     s = Square.new(12)
+ *     area = area_un.bind(s)
+ *     area.call   #=> 144
+ *     
+ *  Unbound methods are a reference to the method at the time it was
+ *  objectified: subsequent changes to the underlying class will not
+ *  affect the unbound method.
+ *     
+ *     class Test
+ *       def test
+ *         :original
+ *       end
+ *     end
+ *     um = Test.instance_method(:test)
+ *     class Test
+ *       def test
+ *         :modified
+ *       end
+ *     end
+ *     t = Test.new
+ *     t.test            #=> :modified
+ *     um.bind(t).call   #=> :original
+ *     
+ */
+
 /*
  *  call-seq:
- *     prc.to_proc -> prc
+ *     umeth.bind(obj) -> method
  *  
- *  Part of the protocol for converting objects to <code>Proc</code>
- *  objects. Instances of class <code>Proc</code> simply return
- *  themselves.
+ *  Bind <i>umeth</i> to <i>obj</i>. If <code>Klass</code> was the class
+ *  from which <i>umeth</i> was obtained,
+ *  <code>obj.kind_of?(Klass)</code> must be true.
+ *     
+ *     class A
+ *       def test
+ *         puts "In test, class = #{self.class}"
+ *       end
+ *     end
+ *     class B < A
+ *     end
+ *     class C < B
+ *     end
+ *     
+ *     
+ *     um = B.instance_method(:test)
+ *     bm = um.bind(C.new)
+ *     bm.call
+ *     bm = um.bind(B.new)
+ *     bm.call
+ *     bm = um.bind(A.new)
+ *     bm.call
+ *     
+ *  <em>produces:</em>
+ *     
+ *     In test, class = C
+ *     In test, class = B
+ *     prog.rb:16:in `bind': bind argument must be an instance of B (TypeError)
+ *     	from prog.rb:16
  */
 
 static VALUE
-proc_to_self(self)
-    VALUE self;
+umethod_bind(method, recv)
+    VALUE method, recv;
 {
-    return self;
+    struct METHOD *data, *bound;
+    VALUE rklass = CLASS_OF(recv);
+
+    Data_Get_Struct(method, struct METHOD, data);
+    if (data->rklass != rklass) {
+	if (FL_TEST(data->rklass, FL_SINGLETON)) {
+	    rb_raise(rb_eTypeError, "singleton method bound for a different object");
+	}
+	if (TYPE(data->rklass) == T_MODULE) {
+	    st_table *m_tbl = RCLASS(data->rklass)->m_tbl;
+	    while (RCLASS(rklass)->m_tbl != m_tbl) {
+		rklass = RCLASS(rklass)->super;
+		if (!rklass) goto not_instace;
+	    }
+	}
+	else if (!rb_obj_is_kind_of(recv, data->rklass)) {
+	  not_instace:
+	    rb_raise(rb_eTypeError, "bind argument must be an instance of %s",
+		     rb_class2name(data->rklass));
+	}
+    }
+
+    method = Data_Make_Struct(rb_cMethod,struct METHOD,bm_mark,free,bound);
+    *bound = *data;
+    bound->recv = recv;
+    bound->rklass = rklass;
+
+    return method;
 }
 
 /*
  *  call-seq:
- *     prc.binding    => binding
+ *     meth.arity    => fixnum
  *  
- *  Returns the binding associated with <i>prc</i>. Note that
- *  <code>Kernel#eval</code> accepts either a <code>Proc</code> or a
- *  <code>Binding</code> object as its second parameter.
+ *  Returns an indication of the number of arguments accepted by a
+ *  method. Returns a nonnegative integer for methods that take a fixed
+ *  number of arguments. For Ruby methods that take a variable number of
+ *  arguments, returns -n-1, where n is the number of required
+ *  arguments. For methods written in C, returns -1 if the call takes a
+ *  variable number of arguments.
  *     
- *     def fred(param)
- *       proc {}
+ *     class C
+ *       def one;    end
+ *       def two(a); end
+ *       def three(*a);  end
+ *       def four(a, b); end
+ *       def five(a, b, *c);    end
+ *       def six(a, b, *c, &d); end
  *     end
+ *     c = C.new
+ *     c.method(:one).arity     #=> 0
+ *     c.method(:two).arity     #=> 1
+ *     c.method(:three).arity   #=> -1
+ *     c.method(:four).arity    #=> 2
+ *     c.method(:five).arity    #=> -3
+ *     c.method(:six).arity     #=> -3
  *     
- *     b = fred(99)
- *     eval("param", b.binding)   #=> 99
- *     eval("param", b)           #=> 99
+ *     "cat".method(:size).arity      #=> 0
+ *     "cat".method(:replace).arity   #=> 1
+ *     "cat".method(:squeeze).arity   #=> -1
+ *     "cat".method(:count).arity     #=> -1
  */
 
 static VALUE
-proc_binding(proc)
-    VALUE proc;
-{
-    struct BLOCK *orig, *data;
-    VALUE bind;
-
-    Data_Get_Struct(proc, struct BLOCK, orig);
-    bind = Data_Make_Struct(rb_cBinding,struct BLOCK,blk_mark,blk_free,data);
-    MEMCPY(data, orig, struct BLOCK, 1);
-    frame_dup(&data->frame);
-
-    if (data->iter) {
-	blk_copy_prev(data);
-    }
-    else {
-	data->prev = 0;
-    }
-
-    return bind;
-}
-
-static VALUE
-block_pass(self, node)
-    VALUE self;
-    NODE *node;
+method_arity(method)
+    VALUE method;
 {
-    VALUE proc = rb_eval(self, node->nd_body);	/* OK */
-    VALUE b;
-    struct BLOCK * volatile old_block;
-    struct BLOCK _block;
-    struct BLOCK *data;
-    volatile VALUE result = Qnil;
-    int state;
-    volatile int orphan;
-    volatile int safe = ruby_safe_level;
-
-    if (NIL_P(proc)) {
-	PUSH_ITER(ITER_NOT);
-	result = rb_eval(self, node->nd_iter);
-	POP_ITER();
-	return result;
-    }
-    if (!rb_obj_is_proc(proc)) {
-	b = rb_check_convert_type(proc, T_DATA, "Proc", "to_proc");
-	if (!rb_obj_is_proc(b)) {
-	    rb_raise(rb_eTypeError, "wrong argument type %s (expected Proc)",
-		     rb_obj_classname(proc));
-	}
-	proc = b;
-    }
-
-    if (ruby_safe_level >= 1 && OBJ_TAINTED(proc) &&
-	ruby_safe_level > proc_get_safe_level(proc)) {
-	rb_raise(rb_eSecurityError, "Insecure: tainted block value");
-    }
-
-    if (ruby_block && ruby_block->block_obj == proc) {
-	PUSH_ITER(ITER_PAS);
-	result = rb_eval(self, node->nd_iter);
-	POP_ITER();
-	return result;
-    }
-
-    Data_Get_Struct(proc, struct BLOCK, data);
-    orphan = block_orphan(data);
-
-    /* PUSH BLOCK from data */
-    old_block = ruby_block;
-    _block = *data;
-    _block.outer = ruby_block;
-    if (orphan) _block.uniq = block_unique++;
-    ruby_block = &_block;
-    PUSH_ITER(ITER_PRE);
-    if (ruby_frame->iter == ITER_NOT)
-	ruby_frame->iter = ITER_PRE;
+    struct METHOD *data;
+    NODE *body;
+    int n;
 
-    PUSH_TAG(PROT_LOOP);
-    state = EXEC_TAG();
-    if (state == 0) {
-      retry:
-	proc_set_safe_level(proc);
-	if (safe > ruby_safe_level)
-	    ruby_safe_level = safe;
-	result = rb_eval(self, node->nd_iter);
-    }
-    else if (state == TAG_BREAK && TAG_DST()) {
-	result = prot_tag->retval;
-	state = 0;
-    }
-    else if (state == TAG_RETRY) {
-	state = 0;
-	goto retry;
-    }
-    POP_TAG();
-    POP_ITER();
-    ruby_block = old_block;
-    ruby_safe_level = safe;
+    Data_Get_Struct(method, struct METHOD, data);
 
-    switch (state) {/* escape from orphan block */
-      case 0:
-	break;
-      case TAG_RETURN:
-	if (orphan) {
-	    proc_jump_error(state, prot_tag->retval);
-	}
+    body = data->body;
+    switch (nd_type(body)) {
+      case NODE_CFUNC:
+	if (body->nd_argc < 0) return INT2FIX(-1);
+	return INT2FIX(body->nd_argc);
+      case NODE_ZSUPER:
+	return INT2FIX(-1);
+      case NODE_ATTRSET:
+	return INT2FIX(1);
+      case NODE_IVAR:
+	return INT2FIX(0);
+      case NODE_BMETHOD:
+	return proc_arity(body->nd_cval);
+      case NODE_DMETHOD:
+	return method_arity(body->nd_cval);
+      case NODE_SCOPE:
+	body = body->nd_next;	/* skip NODE_SCOPE */
+	if (nd_type(body) == NODE_BLOCK)
+	    body = body->nd_head;
+	if (!body) return INT2FIX(0);
+	n = body->nd_cnt;
+	if (body->nd_opt || body->nd_rest)
+	    n = -n-1;
+	return INT2FIX(n);
       default:
-	JUMP_TAG(state);
-    }
-
-    return result;
+	rb_raise(rb_eArgError, "invalid node 0x%x", nd_type(body));
+   }
 }
 
-struct METHOD {
-    VALUE klass, rklass;
-    VALUE recv;
-    ID id, oid;
-    int safe_level;
-    NODE *body;
-};
-
-static void
-bm_mark(data)
-    struct METHOD *data;
-{
-    rb_gc_mark(data->rklass);
-    rb_gc_mark(data->klass);
-    rb_gc_mark(data->recv);
-    rb_gc_mark((VALUE)data->body);
-}
+/*
+ *  call-seq:
+ *   meth.to_s      =>  string
+ *   meth.inspect   =>  string
+ *
+ *  Show the name of the underlying method.
+ *
+ *    "cat".method(:count).inspect   #=> "#<Method: String#count>"
+ */
 
 static VALUE
-mnew(klass, obj, id, mklass)
-    VALUE klass, obj, mklass;
-    ID id;
-{
+method_inspect(method)
     VALUE method;
-    NODE *body;
-    int noex;
+{
     struct METHOD *data;
-    VALUE rklass = klass;
-    ID oid = id;
+    VALUE str;
+    const char *s;
+    char *sharp = "#";
 
-  again:
-    if ((body = rb_get_method_body(&klass, &id, &noex)) == 0) {
-	print_undef(rklass, oid);
-    }
+    Data_Get_Struct(method, struct METHOD, data);
+    str = rb_str_buf_new2("#<");
+    s = rb_obj_classname(method);
+    rb_str_buf_cat2(str, s);
+    rb_str_buf_cat2(str, ": ");
 
-    if (nd_type(body) == NODE_ZSUPER) {
-	klass = RCLASS(klass)->super;
-	goto again;
-    }
+    if (FL_TEST(data->klass, FL_SINGLETON)) {
+	VALUE v = rb_iv_get(data->klass, "__attached__");
 
-    while (rklass != klass &&
-	   (FL_TEST(rklass, FL_SINGLETON) || TYPE(rklass) == T_ICLASS)) {
-	rklass = RCLASS(rklass)->super;
+	if (data->recv == Qundef) {
+	    rb_str_buf_append(str, rb_inspect(data->klass));
+	}
+	else if (data->recv == v) {
+	    rb_str_buf_append(str, rb_inspect(v));
+	    sharp = ".";
+	}
+	else {
+	    rb_str_buf_append(str, rb_inspect(data->recv));
+	    rb_str_buf_cat2(str, "(");
+	    rb_str_buf_append(str, rb_inspect(v));
+	    rb_str_buf_cat2(str, ")");
+	    sharp = ".";
+	}
+    }
+    else {
+	rb_str_buf_cat2(str, rb_class2name(data->rklass));
+	if (data->rklass != data->klass) {
+	    VALUE klass = data -> klass;
+	    if (TYPE(klass) == T_ICLASS) {
+		klass = RBASIC(klass)->klass;
+	    }
+	    rb_str_buf_cat2(str, "(");
+	    rb_str_buf_cat2(str, rb_class2name(klass));
+	    rb_str_buf_cat2(str, ")");
+	}
     }
-    method = Data_Make_Struct(mklass, struct METHOD, bm_mark, free, data);
-    data->klass = klass;
-    data->recv = obj;
-    data->id = id;
-    data->body = body;
-    data->rklass = rklass;
-    data->oid = oid;
-    data->safe_level = NOEX_WITH_SAFE(noex);
-    OBJ_INFECT(method, klass);
+    rb_str_buf_cat2(str, sharp);
+    rb_str_buf_cat2(str, rb_id2name(data->oid));
+    rb_str_buf_cat2(str, ">");
 
-    return method;
+    return str;
 }
 
+static VALUE
+mproc(method)
+    VALUE method;
+{
+    VALUE proc;
 
-/**********************************************************************
- *
- * Document-class : Method
- *
- *  Method objects are created by <code>Object#method</code>, and are
- *  associated with a particular object (not just with a class). They
- *  may be used to invoke the method within the object, and as a block
- *  associated with an iterator. They may also be unbound from one
- *  object (creating an <code>UnboundMethod</code>) and bound to
- *  another.
- *     
- *     class Thing
- *       def square(n)
- *         n*n
- *       end
- *     end
- *     thing = Thing.new
- *     meth  = thing.method(:square)
- *     
- *     meth.call(9)                 #=> 81
- *     [ 1, 2, 3 ].collect(&meth)   #=> [1, 4, 9]
- *     
- */
-
-/*
- * call-seq:
- *   meth == other_meth  => true or false
- *
- * Two method objects are equal if that are bound to the same
- * object and contain the same body.
- */
+    /* emulate ruby's method call */
+    PUSH_ITER(ITER_CUR);
+    PUSH_FRAME();
+    proc = rb_block_proc();
+    POP_FRAME();
+    POP_ITER();
 
+    return proc;
+}
 
 static VALUE
-method_eq(method, other)
-    VALUE method, other;
+bmcall(args, method)
+    VALUE args, method;
 {
-    struct METHOD *m1, *m2;
-
-    if (TYPE(other) != T_DATA || RDATA(other)->dmark != (RUBY_DATA_FUNC)bm_mark)
-	return Qfalse;
-    if (CLASS_OF(method) != CLASS_OF(other))
-	return Qfalse;
+    volatile VALUE a;
+    VALUE ret;
 
-    Data_Get_Struct(method, struct METHOD, m1);
-    Data_Get_Struct(other, struct METHOD, m2);
+    a = svalue_to_avalue(args);
+    ret = method_call(RARRAY(a)->len, RARRAY(a)->ptr, method);
+    a = Qnil; /* prevent tail call */
+    return ret;
+}
 
-    if (m1->klass != m2->klass || m1->rklass != m2->rklass ||
-	m1->recv != m2->recv || m1->body != m2->body)
-	return Qfalse;
+VALUE
+rb_proc_new(func, val)
+    VALUE (*func)(ANYARGS);	/* VALUE yieldarg[, VALUE procarg] */
+    VALUE val;
+{
+    struct BLOCK *data;
+    VALUE proc = rb_iterate((VALUE(*)_((VALUE)))mproc, 0, func, val);
 
-    return Qtrue;
+    Data_Get_Struct(proc, struct BLOCK, data);
+    data->body->nd_state = YIELD_FUNC_AVALUE;
+    return proc;
 }
 
 /*
  *  call-seq:
- *     meth.unbind    => unbound_method
+ *     meth.to_proc    => prc
  *  
- *  Dissociates <i>meth</i> from it's current receiver. The resulting
- *  <code>UnboundMethod</code> can subsequently be bound to a new object
- *  of the same class (see <code>UnboundMethod</code>).
+ *  Returns a <code>Proc</code> object corresponding to this method.
  */
 
 static VALUE
-method_unbind(obj)
-    VALUE obj;
-{
+method_proc(method)
     VALUE method;
-    struct METHOD *orig, *data;
+{
+    VALUE proc;
+    struct METHOD *mdata;
+    struct BLOCK *bdata;
 
-    Data_Get_Struct(obj, struct METHOD, orig);
-    method = Data_Make_Struct(rb_cUnboundMethod, struct METHOD, bm_mark, free, data);
-    data->klass = orig->klass;
-    data->recv = Qundef;
-    data->id = orig->id;
-    data->body = orig->body;
-    data->rklass = orig->rklass;
-    data->oid = orig->oid;
-    OBJ_INFECT(method, obj);
+    proc = rb_iterate((VALUE(*)_((VALUE)))mproc, 0, bmcall, method);
+    Data_Get_Struct(method, struct METHOD, mdata);
+    Data_Get_Struct(proc, struct BLOCK, bdata);
+    bdata->body->nd_file = mdata->body->nd_file;
+    nd_set_line(bdata->body, nd_line(mdata->body));
+    bdata->body->nd_state = YIELD_FUNC_SVALUE;
 
-    return method;
+    return proc;
+}
+
+static VALUE
+rb_obj_is_method(m)
+    VALUE m;
+{
+    if (TYPE(m) == T_DATA && RDATA(m)->dmark == (RUBY_DATA_FUNC)bm_mark) {
+	return Qtrue;
+    }
+    return Qfalse;
 }
 
 /*
  *  call-seq:
- *     obj.method(sym)    => method
+ *     define_method(symbol, method)     => new_method
+ *     define_method(symbol) { block }   => proc
  *  
- *  Looks up the named method as a receiver in <i>obj</i>, returning a
- *  <code>Method</code> object (or raising <code>NameError</code>). The
- *  <code>Method</code> object acts as a closure in <i>obj</i>'s object
- *  instance, so instance variables and the value of <code>self</code>
- *  remain available.
+ *  Defines an instance method in the receiver. The _method_
+ *  parameter can be a +Proc+ or +Method+ object.
+ *  If a block is specified, it is used as the method body. This block
+ *  is evaluated using <code>instance_eval</code>, a point that is
+ *  tricky to demonstrate because <code>define_method</code> is private.
+ *  (This is why we resort to the +send+ hack in this example.)
  *     
- *     class Demo
- *       def initialize(n)
- *         @iv = n
+ *     class A
+ *       def fred
+ *         puts "In Fred"
  *       end
- *       def hello()
- *         "Hello, @iv = #{@iv}"
+ *       def create_method(name, &block)
+ *         self.class.send(:define_method, name, &block)
  *       end
+ *       define_method(:wilma) { puts "Charge it!" }
+ *     end
+ *     class B < A
+ *       define_method(:barney, instance_method(:fred))
  *     end
+ *     a = B.new
+ *     a.barney
+ *     a.wilma
+ *     a.create_method(:betty) { p self }
+ *     a.betty
  *     
- *     k = Demo.new(99)
- *     m = k.method(:hello)
- *     m.call   #=> "Hello, @iv = 99"
+ *  <em>produces:</em>
  *     
- *     l = Demo.new('Fred')
- *     m = l.method("hello")
- *     m.call   #=> "Hello, @iv = Fred"
+ *     In Fred
+ *     Charge it!
+ *     #<B:0x401b39e8>
  */
 
 static VALUE
-rb_obj_method(obj, vid)
-    VALUE obj;
-    VALUE vid;
+rb_mod_define_method(argc, argv, mod)
+    int argc;
+    VALUE *argv;
+    VALUE mod;
 {
-    return mnew(CLASS_OF(obj), obj, rb_to_id(vid), rb_cMethod);
+    ID id;
+    VALUE body;
+    NODE *node;
+    int noex;
+
+    if (argc == 1) {
+	id = rb_to_id(argv[0]);
+	body = proc_lambda();
+    }
+    else if (argc == 2) {
+	id = rb_to_id(argv[0]);
+	body = argv[1];
+	if (!rb_obj_is_method(body) && !rb_obj_is_proc(body)) {
+	    rb_raise(rb_eTypeError, "wrong argument type %s (expected Proc/Method)",
+		     rb_obj_classname(body));
+	}
+    }
+    else {
+	rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+    }
+    if (RDATA(body)->dmark == (RUBY_DATA_FUNC)bm_mark) {
+	node = NEW_DMETHOD(method_unbind(body));
+    }
+    else if (RDATA(body)->dmark == (RUBY_DATA_FUNC)blk_mark) {
+	struct BLOCK *block;
+
+	body = proc_clone(body);
+	Data_Get_Struct(body, struct BLOCK, block);
+	block->frame.last_func = id;
+	block->frame.orig_func = id;
+	block->frame.last_class = mod;
+	node = NEW_BMETHOD(body);
+    }
+    else {
+	/* type error */
+	rb_raise(rb_eTypeError, "wrong argument type (expected Proc/Method)");
+    }
+
+    noex = NOEX_PUBLIC;
+    if (ruby_cbase == mod) {
+	if (SCOPE_TEST(SCOPE_PRIVATE)) {
+	    noex = NOEX_PRIVATE;
+	}
+	else if (SCOPE_TEST(SCOPE_PROTECTED)) {
+	    noex = NOEX_PROTECTED;
+	}
+    }
+    rb_add_method(mod, id, node, noex);
+    return body;
 }
 
 /*
- *  call-seq:
- *     mod.instance_method(symbol)   => unbound_method
- *  
- *  Returns an +UnboundMethod+ representing the given
- *  instance method in _mod_.
- *     
- *     class Interpreter
- *       def do_a() print "there, "; end
- *       def do_d() print "Hello ";  end
- *       def do_e() print "!\n";     end
- *       def do_v() print "Dave";    end
- *       Dispatcher = {
- *        ?a => instance_method(:do_a),
- *        ?d => instance_method(:do_d),
- *        ?e => instance_method(:do_e),
- *        ?v => instance_method(:do_v)
- *       }
- *       def interpret(string)
- *         string.each_byte {|b| Dispatcher[b].bind(self).call }
- *       end
- *     end
+ *  <code>Proc</code> objects are blocks of code that have been bound to
+ *  a set of local variables. Once bound, the code may be called in
+ *  different contexts and still access those variables.
  *     
+ *     def gen_times(factor)
+ *       return Proc.new {|n| n*factor }
+ *     end
  *     
- *     interpreter = Interpreter.new
- *     interpreter.interpret('dave')
+ *     times3 = gen_times(3)
+ *     times5 = gen_times(5)
  *     
- *  <em>produces:</em>
+ *     times3.call(12)               #=> 36
+ *     times5.call(5)                #=> 25
+ *     times3.call(times5.call(4))   #=> 60
  *     
- *     Hello there, Dave!
  */
 
-static VALUE
-rb_mod_method(mod, vid)
-    VALUE mod;
-    VALUE vid;
+void
+Init_Proc()
 {
-    return mnew(mod, Qundef, rb_to_id(vid), rb_cUnboundMethod);
-}
+    rb_eLocalJumpError = rb_define_class("LocalJumpError", rb_eStandardError);
+    rb_define_method(rb_eLocalJumpError, "exit_value", localjump_xvalue, 0);
+    rb_define_method(rb_eLocalJumpError, "reason", localjump_reason, 0);
 
-/*
- * MISSING: documentation
- */
+    rb_global_variable(&exception_error);
+    exception_error = rb_exc_new3(rb_eFatal,
+				  rb_obj_freeze(rb_str_new2("exception reentered")));
+    OBJ_TAINT(exception_error);
+    OBJ_FREEZE(exception_error);
 
-static VALUE
-method_clone(self)
-    VALUE self;
-{
-    VALUE clone;
-    struct METHOD *orig, *data;
+    rb_eSysStackError = rb_define_class("SystemStackError", rb_eStandardError);
+    rb_global_variable(&sysstack_error);
+    sysstack_error = rb_exc_new3(rb_eSysStackError,
+				 rb_obj_freeze(rb_str_new2("stack level too deep")));
+    OBJ_TAINT(sysstack_error);
+    OBJ_FREEZE(sysstack_error);
 
-    Data_Get_Struct(self, struct METHOD, orig);
-    clone = Data_Make_Struct(CLASS_OF(self),struct METHOD, bm_mark, free, data);
-    CLONESETUP(clone, self);
-    *data = *orig;
+    rb_cProc = rb_define_class("Proc", rb_cObject);
+    rb_undef_alloc_func(rb_cProc);
+    rb_define_singleton_method(rb_cProc, "new", proc_s_new, -1);
 
-    return clone;
-}
+    rb_define_method(rb_cProc, "clone", proc_clone, 0);
+    rb_define_method(rb_cProc, "dup", proc_dup, 0);
+    rb_define_method(rb_cProc, "call", proc_call, -2);
+    rb_define_method(rb_cProc, "arity", proc_arity, 0);
+    rb_define_method(rb_cProc, "[]", proc_call, -2);
+    rb_define_method(rb_cProc, "==", proc_eq, 1);
+    rb_define_method(rb_cProc, "to_s", proc_to_s, 0);
+    rb_define_method(rb_cProc, "to_proc", proc_to_self, 0);
+    rb_define_method(rb_cProc, "binding", proc_binding, 0);
 
-/*
- *  call-seq:
- *     meth.call(args, ...)    => obj
- *     meth[args, ...]         => obj
- *  
- *  Invokes the <i>meth</i> with the specified arguments, returning the
- *  method's return value.
- *     
- *     m = 12.method("+")
- *     m.call(3)    #=> 15
- *     m.call(20)   #=> 32
- */
+    rb_define_global_function("proc", proc_lambda, 0);
+    rb_define_global_function("lambda", proc_lambda, 0);
 
-static VALUE
-method_call(argc, argv, method)
-    int argc;
-    VALUE *argv;
-    VALUE method;
-{
-    VALUE result = Qnil;	/* OK */
-    struct METHOD *data;
-    int safe;
+    rb_cMethod = rb_define_class("Method", rb_cObject);
+    rb_undef_alloc_func(rb_cMethod);
+    rb_undef_method(CLASS_OF(rb_cMethod), "new");
+    rb_define_method(rb_cMethod, "==", method_eq, 1);
+    rb_define_method(rb_cMethod, "clone", method_clone, 0);
+    rb_define_method(rb_cMethod, "call", method_call, -1);
+    rb_define_method(rb_cMethod, "[]", method_call, -1);
+    rb_define_method(rb_cMethod, "arity", method_arity, 0);
+    rb_define_method(rb_cMethod, "inspect", method_inspect, 0);
+    rb_define_method(rb_cMethod, "to_s", method_inspect, 0);
+    rb_define_method(rb_cMethod, "to_proc", method_proc, 0);
+    rb_define_method(rb_cMethod, "unbind", method_unbind, 0);
+    rb_define_method(rb_mKernel, "method", rb_obj_method, 1);
 
-    Data_Get_Struct(method, struct METHOD, data);
-    if (data->recv == Qundef) {
-	rb_raise(rb_eTypeError, "can't call unbound method; bind first");
-    }
-    if (OBJ_TAINTED(method)) {
-        safe = NOEX_WITH(data->safe_level, 4)|NOEX_TAINTED;
-    }
-    else {
-	safe = data->safe_level;
-    }
-    PUSH_ITER(rb_block_given_p()?ITER_PRE:ITER_NOT);
-    result = rb_call0(data->klass,data->recv,data->id,data->oid,argc,argv,data->body,safe);
-    POP_ITER();
-    return result;
+    rb_cUnboundMethod = rb_define_class("UnboundMethod", rb_cObject);
+    rb_undef_alloc_func(rb_cUnboundMethod);
+    rb_undef_method(CLASS_OF(rb_cUnboundMethod), "new");
+    rb_define_method(rb_cUnboundMethod, "==", method_eq, 1);
+    rb_define_method(rb_cUnboundMethod, "clone", method_clone, 0);
+    rb_define_method(rb_cUnboundMethod, "arity", method_arity, 0);
+    rb_define_method(rb_cUnboundMethod, "inspect", method_inspect, 0);
+    rb_define_method(rb_cUnboundMethod, "to_s", method_inspect, 0);
+    rb_define_method(rb_cUnboundMethod, "bind", umethod_bind, 1);
+    rb_define_method(rb_cModule, "instance_method", rb_mod_method, 1);
 }
 
-/**********************************************************************
- *
- * Document-class: UnboundMethod
- *
- *  Ruby supports two forms of objectified methods. Class
- *  <code>Method</code> is used to represent methods that are associated
- *  with a particular object: these method objects are bound to that
- *  object. Bound method objects for an object can be created using
- *  <code>Object#method</code>.
- *     
- *  Ruby also supports unbound methods; methods objects that are not
- *  associated with a particular object. These can be created either by
- *  calling <code>Module#instance_method</code> or by calling
- *  <code>unbind</code> on a bound method object. The result of both of
- *  these is an <code>UnboundMethod</code> object.
+/*
+ *  Objects of class <code>Binding</code> encapsulate the execution
+ *  context at some particular place in the code and retain this context 
+ *  for future use. The variables, methods, value of <code>self</code>,
+ *  and possibly an iterator block that can be accessed in this context
+ *  are all retained. Binding objects can be created using
+ *  <code>Kernel#binding</code>, and are made available to the callback
+ *  of <code>Kernel#set_trace_func</code>.
  *     
- *  Unbound methods can only be called after they are bound to an
- *  object. That object must be be a kind_of? the method's original
- *  class.
+ *  These binding objects can be passed as the second argument of the
+ *  <code>Kernel#eval</code> method, establishing an environment for the
+ *  evaluation.
  *     
- *     class Square
- *       def area
- *         @side * @side
+ *     class Demo
+ *       def initialize(n)
+ *         @secret = n
  *       end
- *       def initialize(side)
- *         @side = side
+ *       def getBinding
+ *         return binding()
  *       end
  *     end
  *     
- *     area_un = Square.instance_method(:area)
- *     
- *     s = Square.new(12)
- *     area = area_un.bind(s)
- *     area.call   #=> 144
+ *     k1 = Demo.new(99)
+ *     b1 = k1.getBinding
+ *     k2 = Demo.new(-3)
+ *     b2 = k2.getBinding
  *     
- *  Unbound methods are a reference to the method at the time it was
- *  objectified: subsequent changes to the underlying class will not
- *  affect the unbound method.
+ *     eval("@secret", b1)   #=> 99
+ *     eval("@secret", b2)   #=> -3
+ *     eval("@secret")       #=> nil
  *     
- *     class Test
- *       def test
- *         :original
- *       end
- *     end
- *     um = Test.instance_method(:test)
- *     class Test
- *       def test
- *         :modified
- *       end
- *     end
- *     t = Test.new
- *     t.test            #=> :modified
- *     um.bind(t).call   #=> :original
+ *  Binding objects have no class-specific methods.
  *     
  */
 
-/*
- *  call-seq:
- *     umeth.bind(obj) -> method
- *  
- *  Bind <i>umeth</i> to <i>obj</i>. If <code>Klass</code> was the class
- *  from which <i>umeth</i> was obtained,
- *  <code>obj.kind_of?(Klass)</code> must be true.
- *     
- *     class A
- *       def test
- *         puts "In test, class = #{self.class}"
- *       end
- *     end
- *     class B < A
- *     end
- *     class C < B
- *     end
- *     
- *     
- *     um = B.instance_method(:test)
- *     bm = um.bind(C.new)
- *     bm.call
- *     bm = um.bind(B.new)
- *     bm.call
- *     bm = um.bind(A.new)
- *     bm.call
- *     
- *  <em>produces:</em>
- *     
- *     In test, class = C
- *     In test, class = B
- *     prog.rb:16:in `bind': bind argument must be an instance of B (TypeError)
- *     	from prog.rb:16
- */
+void 
+Init_Binding() 
+{
+    rb_cBinding = rb_define_class("Binding", rb_cObject);
+    rb_undef_alloc_func(rb_cBinding);
+    rb_undef_method(CLASS_OF(rb_cBinding), "new");
+    rb_define_method(rb_cBinding, "clone", proc_clone, 0);
+    rb_define_method(rb_cBinding, "dup", proc_dup, 0);
+    rb_define_global_function("binding", rb_f_binding, 0);
+}
+
+/* Windows SEH refers data on the stack. */
+#undef SAVE_WIN32_EXCEPTION_LIST
+#if defined _WIN32 || defined __CYGWIN__
+#if defined __CYGWIN__
+typedef unsigned long DWORD;
+#endif
+
+static inline DWORD
+win32_get_exception_list()
+{
+    DWORD p;
+# if defined _MSC_VER
+#   ifdef _M_IX86
+#   define SAVE_WIN32_EXCEPTION_LIST
+#   if _MSC_VER >= 1310
+      /* warning: unsafe assignment to fs:0 ... this is ok */
+#     pragma warning(disable: 4733)
+#   endif
+    __asm mov eax, fs:[0];
+    __asm mov p, eax;
+#   endif
+# elif defined __GNUC__
+#   ifdef __i386__
+#   define SAVE_WIN32_EXCEPTION_LIST
+    __asm__("movl %%fs:0,%0" : "=r"(p));
+#   endif
+# elif defined __BORLANDC__
+#   define SAVE_WIN32_EXCEPTION_LIST
+    __emit__(0x64, 0xA1, 0, 0, 0, 0); /* mov eax, fs:[0] */
+    p = _EAX;
+# endif
+    return p;
+}
 
-static VALUE
-umethod_bind(method, recv)
-    VALUE method, recv;
+static inline void
+win32_set_exception_list(p)
+    DWORD p;
 {
-    struct METHOD *data, *bound;
-    VALUE rklass = CLASS_OF(recv);
+# if defined _MSC_VER
+#   ifdef _M_IX86
+    __asm mov eax, p;
+    __asm mov fs:[0], eax;
+#   endif
+# elif defined __GNUC__
+#   ifdef __i386__
+    __asm__("movl %0,%%fs:0" :: "r"(p));
+#   endif
+# elif defined __BORLANDC__
+    _EAX = p;
+    __emit__(0x64, 0xA3, 0, 0, 0, 0); /* mov fs:[0], eax */
+# endif
+}
 
-    Data_Get_Struct(method, struct METHOD, data);
-    if (data->rklass != rklass) {
-	if (FL_TEST(data->rklass, FL_SINGLETON)) {
-	    rb_raise(rb_eTypeError, "singleton method bound for a different object");
-	}
-	if (TYPE(data->rklass) == T_MODULE) {
-	    st_table *m_tbl = RCLASS(data->rklass)->m_tbl;
-	    while (RCLASS(rklass)->m_tbl != m_tbl) {
-		rklass = RCLASS(rklass)->super;
-		if (!rklass) goto not_instace;
-	    }
-	}
-	else if (!rb_obj_is_kind_of(recv, data->rklass)) {
-	  not_instace:
-	    rb_raise(rb_eTypeError, "bind argument must be an instance of %s",
-		     rb_class2name(data->rklass));
-	}
-    }
+#if !defined SAVE_WIN32_EXCEPTION_LIST && !defined _WIN32_WCE
+# error unsupported platform
+#endif
+#endif
 
-    method = Data_Make_Struct(rb_cMethod,struct METHOD,bm_mark,free,bound);
-    *bound = *data;
-    bound->recv = recv;
-    bound->rklass = rklass;
+int rb_thread_pending = 0;
 
-    return method;
-}
+VALUE rb_cThread;
 
-/*
- *  call-seq:
- *     meth.arity    => fixnum
- *  
- *  Returns an indication of the number of arguments accepted by a
- *  method. Returns a nonnegative integer for methods that take a fixed
- *  number of arguments. For Ruby methods that take a variable number of
- *  arguments, returns -n-1, where n is the number of required
- *  arguments. For methods written in C, returns -1 if the call takes a
- *  variable number of arguments.
- *     
- *     class C
- *       def one;    end
- *       def two(a); end
- *       def three(*a);  end
- *       def four(a, b); end
- *       def five(a, b, *c);    end
- *       def six(a, b, *c, &d); end
- *     end
- *     c = C.new
- *     c.method(:one).arity     #=> 0
- *     c.method(:two).arity     #=> 1
- *     c.method(:three).arity   #=> -1
- *     c.method(:four).arity    #=> 2
- *     c.method(:five).arity    #=> -3
- *     c.method(:six).arity     #=> -3
- *     
- *     "cat".method(:size).arity      #=> 0
- *     "cat".method(:replace).arity   #=> 1
- *     "cat".method(:squeeze).arity   #=> -1
- *     "cat".method(:count).arity     #=> -1
- */
+extern VALUE rb_last_status;
 
-static VALUE
-method_arity(method)
-    VALUE method;
-{
-    struct METHOD *data;
-    NODE *body;
-    int n;
+#define WAIT_FD		(1<<0)
+#define WAIT_SELECT	(1<<1)
+#define WAIT_TIME	(1<<2)
+#define WAIT_JOIN	(1<<3)
+#define WAIT_PID	(1<<4)
+#define WAIT_WRITABLE	(1<<5)	/* with WAIT_FD: for writing, not reading */
 
-    Data_Get_Struct(method, struct METHOD, data);
+/* +infty, for this purpose */
+#define DELAY_INFTY 1E30
 
-    body = data->body;
-    switch (nd_type(body)) {
-      case NODE_CFUNC:
-	if (body->nd_argc < 0) return INT2FIX(-1);
-	return INT2FIX(body->nd_argc);
-      case NODE_ZSUPER:
-	return INT2FIX(-1);
-      case NODE_ATTRSET:
-	return INT2FIX(1);
-      case NODE_IVAR:
-	return INT2FIX(0);
-      case NODE_BMETHOD:
-	return proc_arity(body->nd_cval);
-      case NODE_DMETHOD:
-	return method_arity(body->nd_cval);
-      case NODE_SCOPE:
-	body = body->nd_next;	/* skip NODE_SCOPE */
-	if (nd_type(body) == NODE_BLOCK)
-	    body = body->nd_head;
-	if (!body) return INT2FIX(0);
-	n = body->nd_cnt;
-	if (body->nd_opt || body->nd_rest)
-	    n = -n-1;
-	return INT2FIX(n);
-      default:
-	rb_raise(rb_eArgError, "invalid node 0x%x", nd_type(body));
-   }
-}
+#if !defined HAVE_PAUSE
+# if defined _WIN32 && !defined __CYGWIN__
+#  define pause() Sleep(INFINITE)
+# else
+#  define pause() sleep(0x7fffffff)
+# endif
+#endif
 
-/*
- *  call-seq:
- *   meth.to_s      =>  string
- *   meth.inspect   =>  string
- *
- *  Show the name of the underlying method.
- *
- *    "cat".method(:count).inspect   #=> "#<Method: String#count>"
- */
+#define THREAD_TERMINATING 0x400 /* persistent flag */
+#define THREAD_NO_ENSURE   0x800 /* persistent flag */
+#define THREAD_FLAGS_MASK 0xfc00 /* mask for persistent flags */
 
-static VALUE
-method_inspect(method)
-    VALUE method;
-{
-    struct METHOD *data;
-    VALUE str;
-    const char *s;
-    char *sharp = "#";
+#define FOREACH_THREAD_FROM(f,x) x = f; do { x = x->next;
+#define END_FOREACH_FROM(f,x) } while (x != f)
 
-    Data_Get_Struct(method, struct METHOD, data);
-    str = rb_str_buf_new2("#<");
-    s = rb_obj_classname(method);
-    rb_str_buf_cat2(str, s);
-    rb_str_buf_cat2(str, ": ");
+#define FOREACH_THREAD(x) FOREACH_THREAD_FROM(curr_thread,x)
+#define END_FOREACH(x)    END_FOREACH_FROM(curr_thread,x)
 
-    if (FL_TEST(data->klass, FL_SINGLETON)) {
-	VALUE v = rb_iv_get(data->klass, "__attached__");
+/*
+ * On Linux, the descriptors threads wait for (WAIT_FD and WAIT_SELECT)
+ * are kept in an epoll set instead of being gathered into fd_sets for
+ * select() on every pass of the scheduler.  A descriptor stays in the
+ * set once added and is armed one-shot for what its waiters want, so a
+ * pass only looks at the descriptors which got ready and the threads
+ * waiting for them.  Descriptors epoll will not take, such as regular
+ * files, are left to select() as before.
+ */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE)
+#include <sys/epoll.h>
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#define USE_EPOLL 1
+#endif
 
-	if (data->recv == Qundef) {
-	    rb_str_buf_append(str, rb_inspect(data->klass));
-	}
-	else if (data->recv == v) {
-	    rb_str_buf_append(str, rb_inspect(v));
-	    sharp = ".";
-	}
-	else {
-	    rb_str_buf_append(str, rb_inspect(data->recv));
-	    rb_str_buf_cat2(str, "(");
-	    rb_str_buf_append(str, rb_inspect(v));
-	    rb_str_buf_cat2(str, ")");
-	    sharp = ".";
-	}
-    }
-    else {
-	rb_str_buf_cat2(str, rb_class2name(data->rklass));
-	if (data->rklass != data->klass) {
-	    VALUE klass = data -> klass;
-	    if (TYPE(klass) == T_ICLASS) {
-		klass = RBASIC(klass)->klass;
-	    }
-	    rb_str_buf_cat2(str, "(");
-	    rb_str_buf_cat2(str, rb_class2name(klass));
-	    rb_str_buf_cat2(str, ")");
-	}
-    }
-    rb_str_buf_cat2(str, sharp);
-    rb_str_buf_cat2(str, rb_id2name(data->oid));
-    rb_str_buf_cat2(str, ">");
+#ifdef USE_EPOLL
+struct fd_waiter {
+    struct fd_waiter *next, *prev;
+    rb_thread_t th;
+    int fd;
+    unsigned int events;
+};
 
-    return str;
-}
+struct fd_watch {
+    struct fd_waiter *waiters;
+    unsigned int armed;		/* events epoll waits for */
+    unsigned int gen;		/* bumped when the descriptor is closed */
+    int registered;
+    unsigned long round;	/* pass of fd_watch_wait() it got ready in */
+    int ready;			/* FD_READY_* not yet handed to a thread */
+};
 
-static VALUE
-mproc(method)
-    VALUE method;
-{
-    VALUE proc;
+#define FD_READY_READ   1
+#define FD_READY_WRITE  2
+#define FD_READY_EXCEPT 4
+#define FD_MAX_EVENTS 256
 
-    /* emulate ruby's method call */
-    PUSH_ITER(ITER_CUR);
-    PUSH_FRAME();
-    proc = rb_block_proc();
-    POP_FRAME();
-    POP_ITER();
+static int sched_epfd = -1;
+static int sched_epoll_failed;
+static struct fd_watch *fd_watches;
+static int fd_watch_size;
+static unsigned long fd_watch_round;
+static struct epoll_event fd_events[FD_MAX_EVENTS];
 
-    return proc;
-}
+/* whether the descriptors th waits for are in the epoll set */
+#define FD_WATCHED(th) ((th)->fd_nwaiters > 0)
+#define FD_WAITING(th) ((th)->status == THREAD_STOPPED && \
+			((th)->wait_for & (WAIT_FD|WAIT_SELECT)))
 
-static VALUE
-bmcall(args, method)
-    VALUE args, method;
-{
-    volatile VALUE a;
-    VALUE ret;
+static int
+fd_watch_ctl(fd, events)
+    int fd;
+    unsigned int events;
+{
+    struct fd_watch *w = &fd_watches[fd];
+    struct epoll_event ev;
+
+    ev.events = events | EPOLLONESHOT;
+    if (w->registered) {
+	ev.data.u64 = (unsigned long long)w->gen << 32 | (unsigned int)fd;
+	if (epoll_ctl(sched_epfd, EPOLL_CTL_MOD, fd, &ev) == 0) goto armed;
+	if (errno != ENOENT) return -1;
+	/* closed and opened again behind our back */
+	w->registered = 0;
+	w->gen++;
+    }
+    ev.data.u64 = (unsigned long long)w->gen << 32 | (unsigned int)fd;
+    if (epoll_ctl(sched_epfd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+	(errno != EEXIST || epoll_ctl(sched_epfd, EPOLL_CTL_MOD, fd, &ev) < 0)) {
+	return -1;
+    }
+    w->registered = 1;
+  armed:
+    w->armed = events;
+    return 0;
+}
 
-    a = svalue_to_avalue(args);
-    ret = method_call(RARRAY(a)->len, RARRAY(a)->ptr, method);
-    a = Qnil; /* prevent tail call */
-    return ret;
+static int
+fd_watch_add(th, fd, events)
+    rb_thread_t th;
+    int fd;
+    unsigned int events;
+{
+    struct fd_watch *w;
+    struct fd_waiter *p;
+
+    if (fd >= fd_watch_size) {
+	int n = fd_watch_size ? fd_watch_size : 64;
+
+	while (n <= fd) n *= 2;
+	REALLOC_N(fd_watches, struct fd_watch, n);
+	MEMZERO(fd_watches + fd_watch_size, struct fd_watch, n - fd_watch_size);
+	fd_watch_size = n;
+    }
+    w = &fd_watches[fd];
+    /* arm it even if it seems armed already: it may have been closed
+       and opened again without rb_thread_fd_close(), by a finalizer
+       or an extension, and so be unknown to epoll */
+    if (fd_watch_ctl(fd, w->armed | events) < 0) return -1;
+    p = &th->fd_waiters[th->fd_nwaiters++];
+    p->th = th;
+    p->fd = fd;
+    p->events = events;
+    p->prev = 0;
+    p->next = w->waiters;
+    if (w->waiters) w->waiters->prev = p;
+    w->waiters = p;
+    return 0;
 }
 
-VALUE
-rb_proc_new(func, val)
-    VALUE (*func)(ANYARGS);	/* VALUE yieldarg[, VALUE procarg] */
-    VALUE val;
+static void
+thread_unwatch(th)
+    rb_thread_t th;
 {
-    struct BLOCK *data;
-    VALUE proc = rb_iterate((VALUE(*)_((VALUE)))mproc, 0, func, val);
+    struct fd_waiter *p = th->fd_waiters, *end = p + th->fd_nwaiters;
 
-    Data_Get_Struct(proc, struct BLOCK, data);
-    data->body->nd_state = YIELD_FUNC_AVALUE;
-    return proc;
+    for (; p < end; p++) {
+	if (p->prev) p->prev->next = p->next;
+	else fd_watches[p->fd].waiters = p->next;
+	if (p->next) p->next->prev = p->prev;
+    }
+    th->fd_nwaiters = 0;
 }
 
-/*
- *  call-seq:
- *     meth.to_proc    => prc
- *  
- *  Returns a <code>Proc</code> object corresponding to this method.
- */
-
-static VALUE
-method_proc(method)
-    VALUE method;
+/* puts the descriptors th is about to wait for into the epoll set, or
+   leaves them all to select() if epoll will not take one of them */
+static int
+thread_watch(th)
+    rb_thread_t th;
 {
-    VALUE proc;
-    struct METHOD *mdata;
-    struct BLOCK *bdata;
+    int i, n = 0;
 
-    proc = rb_iterate((VALUE(*)_((VALUE)))mproc, 0, bmcall, method);
-    Data_Get_Struct(method, struct METHOD, mdata);
-    Data_Get_Struct(proc, struct BLOCK, bdata);
-    bdata->body->nd_file = mdata->body->nd_file;
-    nd_set_line(bdata->body, nd_line(mdata->body));
-    bdata->body->nd_state = YIELD_FUNC_SVALUE;
+    thread_unwatch(th);
+    if (sched_epfd < 0) {
+	if (sched_epoll_failed) return -1;
+	sched_epfd = epoll_create(FD_MAX_EVENTS);
+	if (sched_epfd < 0) {
+	    sched_epoll_failed = 1;
+	    return -1;
+	}
+#ifdef FD_CLOEXEC
+	fcntl(sched_epfd, F_SETFD, FD_CLOEXEC);
+#endif
+    }
+    if (th->wait_for & WAIT_FD) {
+	n = 1;
+    }
+    else {
+	for (i = 0; i < th->fd && i < FD_SETSIZE; i++) {
+	    if (FD_ISSET(i, &th->readfds) || FD_ISSET(i, &th->writefds) ||
+		FD_ISSET(i, &th->exceptfds)) {
+		n++;
+	    }
+	}
+    }
+    if (n > th->fd_maxwaiters) {
+	REALLOC_N(th->fd_waiters, struct fd_waiter, n);
+	th->fd_maxwaiters = n;
+    }
+    if (th->wait_for & WAIT_FD) {
+	if (th->fd < 0 ||
+	    fd_watch_add(th, th->fd,
+			 (th->wait_for & WAIT_WRITABLE) ? EPOLLOUT : EPOLLIN) < 0) {
+	    thread_unwatch(th);
+	    return -1;
+	}
+	return 0;
+    }
+    for (i = 0; i < th->fd && i < FD_SETSIZE; i++) {
+	unsigned int events = 0;
 
-    return proc;
+	if (FD_ISSET(i, &th->readfds)) events |= EPOLLIN;
+	if (FD_ISSET(i, &th->writefds)) events |= EPOLLOUT;
+	if (FD_ISSET(i, &th->exceptfds)) events |= EPOLLPRI;
+	if (events && fd_watch_add(th, i, events) < 0) {
+	    thread_unwatch(th);
+	    return -1;
+	}
+    }
+    return 0;
 }
 
-static VALUE
-rb_obj_is_method(m)
-    VALUE m;
+/* watches again for a thread which waits already.  One waiting for a
+   descriptor too high for select() is woken if epoll cannot have it. */
+static void
+thread_rewatch(th)
+    rb_thread_t th;
 {
-    if (TYPE(m) == T_DATA && RDATA(m)->dmark == (RUBY_DATA_FUNC)bm_mark) {
-	return Qtrue;
+    if (thread_watch(th) < 0 && (th->wait_for & WAIT_FD) &&
+	th->fd >= FD_SETSIZE) {
+	th->status = THREAD_RUNNABLE;
+	th->wait_for = 0;
     }
-    return Qfalse;
 }
 
-/*
- *  call-seq:
- *     define_method(symbol, method)     => new_method
- *     define_method(symbol) { block }   => proc
- *  
- *  Defines an instance method in the receiver. The _method_
- *  parameter can be a +Proc+ or +Method+ object.
- *  If a block is specified, it is used as the method body. This block
- *  is evaluated using <code>instance_eval</code>, a point that is
- *  tricky to demonstrate because <code>define_method</code> is private.
- *  (This is why we resort to the +send+ hack in this example.)
- *     
- *     class A
- *       def fred
- *         puts "In Fred"
- *       end
- *       def create_method(name, &block)
- *         self.class.send(:define_method, name, &block)
- *       end
- *       define_method(:wilma) { puts "Charge it!" }
- *     end
- *     class B < A
- *       define_method(:barney, instance_method(:fred))
- *     end
- *     a = B.new
- *     a.barney
- *     a.wilma
- *     a.create_method(:betty) { p self }
- *     a.betty
- *     
- *  <em>produces:</em>
- *     
- *     In Fred
- *     Charge it!
- *     #<B:0x401b39e8>
- */
-
-static VALUE
-rb_mod_define_method(argc, argv, mod)
-    int argc;
-    VALUE *argv;
-    VALUE mod;
+/* forgets the epoll set, closing it if it is still ours, and puts
+   the waiting threads into a new one */
+static void
+fd_watch_reset(close_it)
+    int close_it;
 {
-    ID id;
-    VALUE body;
-    NODE *node;
-    int noex;
+    rb_thread_t th;
 
-    if (argc == 1) {
-	id = rb_to_id(argv[0]);
-	body = proc_lambda();
-    }
-    else if (argc == 2) {
-	id = rb_to_id(argv[0]);
-	body = argv[1];
-	if (!rb_obj_is_method(body) && !rb_obj_is_proc(body)) {
-	    rb_raise(rb_eTypeError, "wrong argument type %s (expected Proc/Method)",
-		     rb_obj_classname(body));
-	}
-    }
-    else {
-	rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+    if (sched_epfd < 0) return;
+    if (close_it) close(sched_epfd);
+    sched_epfd = -1;
+    MEMZERO(fd_watches, struct fd_watch, fd_watch_size);
+    FOREACH_THREAD(th) {
+	th->fd_nwaiters = 0;
     }
-    if (RDATA(body)->dmark == (RUBY_DATA_FUNC)bm_mark) {
-	node = NEW_DMETHOD(method_unbind(body));
+    END_FOREACH(th);
+    FOREACH_THREAD(th) {
+	if (FD_WAITING(th)) thread_rewatch(th);
     }
-    else if (RDATA(body)->dmark == (RUBY_DATA_FUNC)blk_mark) {
-	struct BLOCK *block;
+    END_FOREACH(th);
+}
 
-	body = proc_clone(body);
-	Data_Get_Struct(body, struct BLOCK, block);
-	block->frame.last_func = id;
-	block->frame.orig_func = id;
-	block->frame.last_class = mod;
-	node = NEW_BMETHOD(body);
+/* wakes th if the descriptors ready in this pass are what it waits for */
+static int
+fd_watch_wake(th)
+    rb_thread_t th;
+{
+    struct fd_waiter *p = th->fd_waiters, *end = p + th->fd_nwaiters;
+    struct fd_watch *w;
+    fd_set readfds, writefds, exceptfds;
+    int n = 0;
+
+    if (th->wait_for & WAIT_FD) {
+	int want = (th->wait_for & WAIT_WRITABLE) ? FD_READY_WRITE : FD_READY_READ;
+
+	w = &fd_watches[th->fd];
+	if (w->round != fd_watch_round || !(w->ready & want)) return 0;
+	/* Wake up only one thread per fd. */
+	w->ready &= ~want;
+	th->fd = 0;
     }
     else {
-	/* type error */
-	rb_raise(rb_eTypeError, "wrong argument type (expected Proc/Method)");
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	FD_ZERO(&exceptfds);
+	for (; p < end; p++) {
+	    w = &fd_watches[p->fd];
+	    if (w->round != fd_watch_round) continue;
+	    if ((p->events & EPOLLIN) && (w->ready & FD_READY_READ)) {
+		w->ready &= ~FD_READY_READ;
+		FD_SET(p->fd, &readfds);
+		n++;
+	    }
+	    if ((p->events & EPOLLOUT) && (w->ready & FD_READY_WRITE)) {
+		w->ready &= ~FD_READY_WRITE;
+		FD_SET(p->fd, &writefds);
+		n++;
+	    }
+	    if ((p->events & EPOLLPRI) && (w->ready & FD_READY_EXCEPT)) {
+		w->ready &= ~FD_READY_EXCEPT;
+		FD_SET(p->fd, &exceptfds);
+		n++;
+	    }
+	}
+	if (n == 0) return 0;
+	th->readfds = readfds;
+	th->writefds = writefds;
+	th->exceptfds = exceptfds;
+	th->select_value = n;
     }
+    th->status = THREAD_RUNNABLE;
+    th->wait_for = 0;
+    return 1;
+}
 
-    noex = NOEX_PUBLIC;
-    if (ruby_cbase == mod) {
-	if (SCOPE_TEST(SCOPE_PRIVATE)) {
-	    noex = NOEX_PRIVATE;
-	}
-	else if (SCOPE_TEST(SCOPE_PROTECTED)) {
-	    noex = NOEX_PROTECTED;
+/* waits for the epoll set as long as delay_ptr says, and makes the
+   threads whose descriptors got ready runnable.  Returns how many it
+   woke, or -1 if it has to be called again. */
+static int
+fd_watch_wait(delay_ptr)
+    struct timeval *delay_ptr;
+{
+    int i, n, woken = 0, timeout = -1;
+
+    if (delay_ptr) {
+	if (delay_ptr->tv_sec >= 1000000) timeout = 1000000000;
+	else timeout = delay_ptr->tv_sec * 1000 + (delay_ptr->tv_usec + 999) / 1000;
+    }
+    n = epoll_wait(sched_epfd, fd_events, FD_MAX_EVENTS, timeout);
+    if (n < 0) {
+	if (errno == EINTR) return -1;
+	/* the program closed it under us */
+	fd_watch_reset(Qfalse);
+	return -1;
+    }
+    fd_watch_round++;
+    for (i = 0; i < n; i++) {
+	int fd = (int)(fd_events[i].data.u64 & 0xffffffff);
+	unsigned int gen = (unsigned int)(fd_events[i].data.u64 >> 32);
+	unsigned int ev = fd_events[i].events;
+	struct fd_watch *w;
+
+	if (fd >= fd_watch_size) continue;
+	w = &fd_watches[fd];
+	/* an event of a descriptor closed since is stale */
+	if (!w->registered || w->gen != gen) continue;
+	w->armed = 0;
+	w->round = fd_watch_round;
+	w->ready = 0;
+	if (ev & (EPOLLIN|EPOLLHUP|EPOLLERR)) w->ready |= FD_READY_READ;
+	if (ev & (EPOLLOUT|EPOLLHUP|EPOLLERR)) w->ready |= FD_READY_WRITE;
+	if (ev & EPOLLPRI) w->ready |= FD_READY_EXCEPT;
+    }
+    for (i = 0; i < n; i++) {
+	int fd = (int)(fd_events[i].data.u64 & 0xffffffff);
+	struct fd_waiter *p;
+
+	if (fd >= fd_watch_size || fd_watches[fd].round != fd_watch_round) continue;
+	for (p = fd_watches[fd].waiters; p; p = p->next) {
+	    if (FD_WAITING(p->th) && fd_watch_wake(p->th)) woken++;
+	}
+    }
+    /* arm the descriptors again for the threads still waiting */
+    for (i = 0; i < n; i++) {
+	int fd = (int)(fd_events[i].data.u64 & 0xffffffff);
+	unsigned int events = 0;
+	struct fd_waiter *p;
+
+	if (fd >= fd_watch_size || fd_watches[fd].round != fd_watch_round) continue;
+	for (p = fd_watches[fd].waiters; p; p = p->next) {
+	    if (FD_WAITING(p->th)) events |= p->events;
+	}
+	if (events && fd_watch_ctl(fd, events) < 0) {
+	    for (p = fd_watches[fd].waiters; p; p = p->next) {
+		/* let them find out what is wrong with it */
+		if (FD_WAITING(p->th)) {
+		    if (p->th->wait_for & WAIT_SELECT) p->th->select_value = -1;
+		    p->th->status = THREAD_RUNNABLE;
+		    p->th->wait_for = 0;
+		    woken++;
+		}
+	    }
 	}
     }
-    rb_add_method(mod, id, node, noex);
-    return body;
+    return woken;
+}
+#else
+#define FD_WATCHED(th) 0
+#endif
+
+/* gives the child of a fork() an epoll set of its own; it shares the
+   one of its parent until then */
+void
+rb_thread_reset_fd_watch()
+{
+#ifdef USE_EPOLL
+    fd_watch_reset(Qtrue);
+#endif
 }
 
 /*
- *  <code>Proc</code> objects are blocks of code that have been bound to
- *  a set of local variables. Once bound, the code may be called in
- *  different contexts and still access those variables.
- *     
- *     def gen_times(factor)
- *       return Proc.new {|n| n*factor }
- *     end
- *     
- *     times3 = gen_times(3)
- *     times5 = gen_times(5)
- *     
- *     times3.call(12)               #=> 36
- *     times5.call(5)                #=> 25
- *     times3.call(times5.call(4))   #=> 60
- *     
+ * Threads sleeping until a time (WAIT_TIME, but not forever) are kept
+ * in a binary heap ordered by their delay, so the scheduler finds the
+ * next one to wake at the top instead of by scanning every thread.  A
+ * thread woken before its time stays in the heap until it runs again
+ * or comes up to the top.
  */
+static rb_thread_t *timer_heap;
+static int timer_heap_len, timer_heap_max;
 
-void
-Init_Proc()
+static void
+timer_heap_set(i, th)
+    int i;
+    rb_thread_t th;
 {
-    rb_eLocalJumpError = rb_define_class("LocalJumpError", rb_eStandardError);
-    rb_define_method(rb_eLocalJumpError, "exit_value", localjump_xvalue, 0);
-    rb_define_method(rb_eLocalJumpError, "reason", localjump_reason, 0);
+    timer_heap[i] = th;
+    th->timer_pos = i;
+}
 
-    rb_global_variable(&exception_error);
-    exception_error = rb_exc_new3(rb_eFatal,
-				  rb_obj_freeze(rb_str_new2("exception reentered")));
-    OBJ_TAINT(exception_error);
-    OBJ_FREEZE(exception_error);
+static void
+timer_heap_up(i)
+    int i;
+{
+    rb_thread_t th = timer_heap[i];
 
-    rb_eSysStackError = rb_define_class("SystemStackError", rb_eStandardError);
-    rb_global_variable(&sysstack_error);
-    sysstack_error = rb_exc_new3(rb_eSysStackError,
-				 rb_obj_freeze(rb_str_new2("stack level too deep")));
-    OBJ_TAINT(sysstack_error);
-    OBJ_FREEZE(sysstack_error);
+    while (i > 0 && timer_heap[(i - 1) / 2]->delay > th->delay) {
+	timer_heap_set(i, timer_heap[(i - 1) / 2]);
+	i = (i - 1) / 2;
+    }
+    timer_heap_set(i, th);
+}
 
-    rb_cProc = rb_define_class("Proc", rb_cObject);
-    rb_undef_alloc_func(rb_cProc);
-    rb_define_singleton_method(rb_cProc, "new", proc_s_new, -1);
+static void
+timer_heap_down(i)
+    int i;
+{
+    rb_thread_t th = timer_heap[i];
+    int c;
 
-    rb_define_method(rb_cProc, "clone", proc_clone, 0);
-    rb_define_method(rb_cProc, "dup", proc_dup, 0);
-    rb_define_method(rb_cProc, "call", proc_call, -2);
-    rb_define_method(rb_cProc, "arity", proc_arity, 0);
-    rb_define_method(rb_cProc, "[]", proc_call, -2);
-    rb_define_method(rb_cProc, "==", proc_eq, 1);
-    rb_define_method(rb_cProc, "to_s", proc_to_s, 0);
-    rb_define_method(rb_cProc, "to_proc", proc_to_self, 0);
-    rb_define_method(rb_cProc, "binding", proc_binding, 0);
+    while ((c = 2 * i + 1) < timer_heap_len) {
+	if (c + 1 < timer_heap_len && timer_heap[c + 1]->delay < timer_heap[c]->delay)
+	    c++;
+	if (timer_heap[c]->delay >= th->delay) break;
+	timer_heap_set(i, timer_heap[c]);
+	i = c;
+    }
+    timer_heap_set(i, th);
+}
 
-    rb_define_global_function("proc", proc_lambda, 0);
-    rb_define_global_function("lambda", proc_lambda, 0);
+static void
+timer_remove(th)
+    rb_thread_t th;
+{
+    int i = th->timer_pos;
+    rb_thread_t last;
 
-    rb_cMethod = rb_define_class("Method", rb_cObject);
-    rb_undef_alloc_func(rb_cMethod);
-    rb_undef_method(CLASS_OF(rb_cMethod), "new");
-    rb_define_method(rb_cMethod, "==", method_eq, 1);
-    rb_define_method(rb_cMethod, "clone", method_clone, 0);
-    rb_define_method(rb_cMethod, "call", method_call, -1);
-    rb_define_method(rb_cMethod, "[]", method_call, -1);
-    rb_define_method(rb_cMethod, "arity", method_arity, 0);
-    rb_define_method(rb_cMethod, "inspect", method_inspect, 0);
-    rb_define_method(rb_cMethod, "to_s", method_inspect, 0);
-    rb_define_method(rb_cMethod, "to_proc", method_proc, 0);
-    rb_define_method(rb_cMethod, "unbind", method_unbind, 0);
-    rb_define_method(rb_mKernel, "method", rb_obj_method, 1);
+    if (i < 0) return;
+    th->timer_pos = -1;
+    if (i == --timer_heap_len) return;
+    last = timer_heap[timer_heap_len];
+    timer_heap_set(i, last);
+    timer_heap_up(i);
+    timer_heap_down(last->timer_pos);
+}
 
-    rb_cUnboundMethod = rb_define_class("UnboundMethod", rb_cObject);
-    rb_undef_alloc_func(rb_cUnboundMethod);
-    rb_undef_method(CLASS_OF(rb_cUnboundMethod), "new");
-    rb_define_method(rb_cUnboundMethod, "==", method_eq, 1);
-    rb_define_method(rb_cUnboundMethod, "clone", method_clone, 0);
-    rb_define_method(rb_cUnboundMethod, "arity", method_arity, 0);
-    rb_define_method(rb_cUnboundMethod, "inspect", method_inspect, 0);
-    rb_define_method(rb_cUnboundMethod, "to_s", method_inspect, 0);
-    rb_define_method(rb_cUnboundMethod, "bind", umethod_bind, 1);
-    rb_define_method(rb_cModule, "instance_method", rb_mod_method, 1);
+/* puts th, about to sleep until th->delay, into the heap, or takes it
+   out if it sleeps forever.  Whoever changes the delay of a thread has
+   to call this, to keep the heap in order. */
+static void
+timer_add(th)
+    rb_thread_t th;
+{
+    if (th->delay >= DELAY_INFTY) {
+	timer_remove(th);
+	return;
+    }
+    if (th->timer_pos < 0) {
+	if (timer_heap_len == timer_heap_max) {
+	    timer_heap_max = timer_heap_max ? timer_heap_max * 2 : 64;
+	    REALLOC_N(timer_heap, rb_thread_t, timer_heap_max);
+	}
+	timer_heap_set(timer_heap_len++, th);
+    }
+    timer_heap_up(th->timer_pos);
+    timer_heap_down(th->timer_pos);
 }
 
 /*
- *  Objects of class <code>Binding</code> encapsulate the execution
- *  context at some particular place in the code and retain this context 
- *  for future use. The variables, methods, value of <code>self</code>,
- *  and possibly an iterator block that can be accessed in this context
- *  are all retained. Binding objects can be created using
- *  <code>Kernel#binding</code>, and are made available to the callback
- *  of <code>Kernel#set_trace_func</code>.
- *     
- *  These binding objects can be passed as the second argument of the
- *  <code>Kernel#eval</code> method, establishing an environment for the
- *  evaluation.
- *     
- *     class Demo
- *       def initialize(n)
- *         @secret = n
- *       end
- *       def getBinding
- *         return binding()
- *       end
- *     end
- *     
- *     k1 = Demo.new(99)
- *     b1 = k1.getBinding
- *     k2 = Demo.new(-3)
- *     b2 = k2.getBinding
- *     
- *     eval("@secret", b1)   #=> 99
- *     eval("@secret", b2)   #=> -3
- *     eval("@secret")       #=> nil
- *     
- *  Binding objects have no class-specific methods.
- *     
+ * Thread.deadline: a thread may ask to be raised in at a time, with no
+ * thread of its own to do it.  The deadlines of all threads are kept in
+ * a binary heap like the sleepers above; the scheduler marks those that
+ * have passed as expired and wakes their threads, and a thread raises
+ * for its expired deadline when it goes on running.
  */
+struct thread_deadline {
+    double at;
+    VALUE klass;		/* the exception to raise */
+    VALUE self;
+    rb_thread_t th;
+    int pos;			/* in the deadline heap, or -1 */
+    int expired;		/* 1 when due, 2 once raised */
+    struct thread_deadline *prev;	/* the enclosing one */
+};
 
-void 
-Init_Binding() 
+static struct thread_deadline **deadline_heap;
+static int deadline_heap_len, deadline_heap_max;
+
+/* a thread with a deadline must not block where the scheduler would
+   never get to raise in it, so it is not alone */
+#define THREAD_ALONE() \
+    (curr_thread == curr_thread->next && deadline_heap_len == 0)
+
+static void
+deadline_heap_set(i, d)
+    int i;
+    struct thread_deadline *d;
 {
-    rb_cBinding = rb_define_class("Binding", rb_cObject);
-    rb_undef_alloc_func(rb_cBinding);
-    rb_undef_method(CLASS_OF(rb_cBinding), "new");
-    rb_define_method(rb_cBinding, "clone", proc_clone, 0);
-    rb_define_method(rb_cBinding, "dup", proc_dup, 0);
-    rb_define_global_function("binding", rb_f_binding, 0);
+    deadline_heap[i] = d;
+    d->pos = i;
 }
 
-/* Windows SEH refers data on the stack. */
-#undef SAVE_WIN32_EXCEPTION_LIST
-#if defined _WIN32 || defined __CYGWIN__
-#if defined __CYGWIN__
-typedef unsigned long DWORD;
-#endif
+static void
+deadline_heap_up(i)
+    int i;
+{
+    struct thread_deadline *d = deadline_heap[i];
 
-static inline DWORD
-win32_get_exception_list()
+    while (i > 0 && deadline_heap[(i - 1) / 2]->at > d->at) {
+	deadline_heap_set(i, deadline_heap[(i - 1) / 2]);
+	i = (i - 1) / 2;
+    }
+    deadline_heap_set(i, d);
+}
+
+static void
+deadline_heap_down(i)
+    int i;
 {
-    DWORD p;
-# if defined _MSC_VER
-#   ifdef _M_IX86
-#   define SAVE_WIN32_EXCEPTION_LIST
-#   if _MSC_VER >= 1310
-      /* warning: unsafe assignment to fs:0 ... this is ok */
-#     pragma warning(disable: 4733)
-#   endif
-    __asm mov eax, fs:[0];
-    __asm mov p, eax;
-#   endif
-# elif defined __GNUC__
-#   ifdef __i386__
-#   define SAVE_WIN32_EXCEPTION_LIST
-    __asm__("movl %%fs:0,%0" : "=r"(p));
-#   endif
-# elif defined __BORLANDC__
-#   define SAVE_WIN32_EXCEPTION_LIST
-    __emit__(0x64, 0xA1, 0, 0, 0, 0); /* mov eax, fs:[0] */
-    p = _EAX;
-# endif
-    return p;
+    struct thread_deadline *d = deadline_heap[i];
+    int c;
+
+    while ((c = 2 * i + 1) < deadline_heap_len) {
+	if (c + 1 < deadline_heap_len && deadline_heap[c + 1]->at < deadline_heap[c]->at)
+	    c++;
+	if (deadline_heap[c]->at >= d->at) break;
+	deadline_heap_set(i, deadline_heap[c]);
+	i = c;
+    }
+    deadline_heap_set(i, d);
 }
 
-static inline void
-win32_set_exception_list(p)
-    DWORD p;
+static void
+deadline_remove(d)
+    struct thread_deadline *d;
 {
-# if defined _MSC_VER
-#   ifdef _M_IX86
-    __asm mov eax, p;
-    __asm mov fs:[0], eax;
-#   endif
-# elif defined __GNUC__
-#   ifdef __i386__
-    __asm__("movl %0,%%fs:0" :: "r"(p));
-#   endif
-# elif defined __BORLANDC__
-    _EAX = p;
-    __emit__(0x64, 0xA3, 0, 0, 0, 0); /* mov fs:[0], eax */
-# endif
+    int i = d->pos;
+    struct thread_deadline *last;
+
+    if (i < 0) return;
+    d->pos = -1;
+    if (i == --deadline_heap_len) return;
+    last = deadline_heap[deadline_heap_len];
+    deadline_heap_set(i, last);
+    deadline_heap_up(i);
+    deadline_heap_down(last->pos);
 }
 
-#if !defined SAVE_WIN32_EXCEPTION_LIST && !defined _WIN32_WCE
-# error unsupported platform
-#endif
-#endif
+static void
+deadline_add(d)
+    struct thread_deadline *d;
+{
+    if (deadline_heap_len == deadline_heap_max) {
+	deadline_heap_max = deadline_heap_max ? deadline_heap_max * 2 : 16;
+	REALLOC_N(deadline_heap, struct thread_deadline*, deadline_heap_max);
+    }
+    deadline_heap_set(deadline_heap_len++, d);
+    deadline_heap_up(d->pos);
+}
 
-int rb_thread_pending = 0;
+static void rb_thread_ready _((rb_thread_t));
 
-VALUE rb_cThread;
+/* marks the deadlines up to now as expired and wakes their threads;
+   returns the time of the next one, or DELAY_INFTY */
+static double
+deadline_expire(now)
+    double now;
+{
+    struct thread_deadline *d;
 
-extern VALUE rb_last_status;
+    while (deadline_heap_len > 0) {
+	d = deadline_heap[0];
+	if (d->at > now) return d->at;
+	deadline_remove(d);
+	d->expired = 1;
+	if (d->th->status == THREAD_STOPPED) {
+	    rb_thread_ready(d->th);
+	}
+    }
+    return DELAY_INFTY;
+}
 
-#define WAIT_FD		(1<<0)
-#define WAIT_SELECT	(1<<1)
-#define WAIT_TIME	(1<<2)
-#define WAIT_JOIN	(1<<3)
-#define WAIT_PID	(1<<4)
+/* raises in the current thread for the outermost of its deadlines that
+   has expired; the inner ones are unwound with it */
+static void
+deadline_check()
+{
+    struct thread_deadline *d, *expired = 0;
 
-/* +infty, for this purpose */
-#define DELAY_INFTY 1E30
+    for (d = curr_thread->deadlines; d; d = d->prev) {
+	if (d->expired == 1) expired = d;
+    }
+    if (expired) {
+	expired->expired = 2;
+	rb_raise(expired->klass, "execution expired");
+    }
+}
 
-#if !defined HAVE_PAUSE
-# if defined _WIN32 && !defined __CYGWIN__
-#  define pause() Sleep(INFINITE)
-# else
-#  define pause() sleep(0x7fffffff)
-# endif
-#endif
+static void
+deadline_mark(th)
+    rb_thread_t th;
+{
+    struct thread_deadline *d;
 
-#define THREAD_TERMINATING 0x400 /* persistent flag */
-#define THREAD_NO_ENSURE   0x800 /* persistent flag */
-#define THREAD_FLAGS_MASK 0xfc00 /* mask for persistent flags */
+    for (d = th->deadlines; d; d = d->prev) {
+	rb_gc_mark(d->self);
+    }
+}
 
-#define FOREACH_THREAD_FROM(f,x) x = f; do { x = x->next;
-#define END_FOREACH_FROM(f,x) } while (x != f)
+static void
+deadline_clear(th)
+    rb_thread_t th;
+{
+    struct thread_deadline *d;
 
-#define FOREACH_THREAD(x) FOREACH_THREAD_FROM(curr_thread,x)
-#define END_FOREACH(x)    END_FOREACH_FROM(curr_thread,x)
+    for (d = th->deadlines; d; d = d->prev) {
+	deadline_remove(d);
+    }
+    th->deadlines = 0;
+}
 
 struct thread_status_t {
     NODE *node;
@@ -9979,8 +12417,6 @@ thread_no_ensure()
     return ((curr_thread->flags & THREAD_NO_ENSURE) == THREAD_NO_ENSURE);
 }
 
-static void rb_thread_ready _((rb_thread_t));
-
 static VALUE run_trap_eval _((VALUE));
 static VALUE
 run_trap_eval(arg)
@@ -10009,6 +12445,12 @@ rb_trap_eval(cmd, sig, safe)
     val = rb_protect(run_trap_eval, (VALUE)&arg, &state);
     POP_ITER();
     THREAD_COPY_STATUS(&save, curr_thread);
+    /* the handler may have waited for descriptors or time of its own */
+#ifdef USE_EPOLL
+    if (FD_WAITING(curr_thread)) thread_rewatch(curr_thread);
+#endif
+    if (curr_thread->wait_for & WAIT_TIME) timer_add(curr_thread);
+    else timer_remove(curr_thread);
 
     if (state) {
 	rb_trap_immediate = 0;
@@ -10084,6 +12526,231 @@ timeofday()
     return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
 }
 
+/*
+ * Threads and continuations come and go often.  When they are freed,
+ * up to thread_pool_limit each of their structs, of the buffers their
+ * stacks are copied into and of the native stacks of threads are kept,
+ * to be used again instead of allocating new ones.
+ * RUBY_THREAD_POOL_SIZE sets the limit; Thread.pool_stat tells how
+ * they are used.
+ */
+#define THREAD_POOL_SIZE 16
+#define THREAD_POOL_MAX  1024
+#define THREAD_POOL_BUF_MAX (64*1024)	/* VALUEs in a buffer worth keeping */
+
+static int thread_pool_limit = THREAD_POOL_SIZE;
+static rb_thread_t thread_pool;		/* linked by next */
+static int thread_pool_len;
+static unsigned long thread_pool_reused;
+static struct {
+    VALUE *ptr;
+    long max;
+} stk_buf_pool[THREAD_POOL_MAX];
+static int stk_buf_pool_len;
+static unsigned long stk_buf_pool_reused;
+
+static void
+init_thread_pool()
+{
+    char *ptr = getenv("RUBY_THREAD_POOL_SIZE"), *end;
+    long size;
+
+    if (ptr) {
+	size = strtol(ptr, &end, 10);
+	if (end != ptr && !*end && size >= 0) {
+	    thread_pool_limit = size > THREAD_POOL_MAX ? THREAD_POOL_MAX : size;
+	}
+    }
+}
+
+static rb_thread_t
+thread_pool_get()
+{
+    rb_thread_t th = thread_pool;
+
+    if (th) {
+	thread_pool = th->next;
+	thread_pool_len--;
+	thread_pool_reused++;
+	return th;
+    }
+    return ALLOC(struct rb_thread);
+}
+
+static void
+thread_pool_put(th)
+    rb_thread_t th;
+{
+    if (thread_pool_len < thread_pool_limit) {
+	th->next = thread_pool;
+	thread_pool = th;
+	thread_pool_len++;
+    }
+    else {
+	free(th);
+    }
+}
+
+/* a kept buffer for at least len VALUEs, its size in *max; or 0 */
+static VALUE *
+stk_buf_get(len, max)
+    long len, *max;
+{
+    VALUE *ptr;
+    int i;
+
+    for (i = 0; i < stk_buf_pool_len; i++) {
+	if (stk_buf_pool[i].max >= len) {
+	    ptr = stk_buf_pool[i].ptr;
+	    *max = stk_buf_pool[i].max;
+	    stk_buf_pool[i] = stk_buf_pool[--stk_buf_pool_len];
+	    stk_buf_pool_reused++;
+	    return ptr;
+	}
+    }
+    return 0;
+}
+
+static void
+stk_buf_put(ptr, max)
+    VALUE *ptr;
+    long max;
+{
+    if (stk_buf_pool_len < thread_pool_limit && max <= THREAD_POOL_BUF_MAX) {
+	stk_buf_pool[stk_buf_pool_len].ptr = ptr;
+	stk_buf_pool[stk_buf_pool_len].max = max;
+	stk_buf_pool_len++;
+    }
+    else {
+	free(ptr);
+    }
+}
+
+/*
+ * On x86 and x86_64, every thread but the main one runs on a native
+ * stack of its own, mapped when the thread starts.  A context switch is
+ * then only a longjmp(): no stack is copied, so it costs the same
+ * however deep the threads are, and GC marks the stack of a thread that
+ * is not running where it is.  Continuations still copy the part of
+ * the stack they need.  Elsewhere all threads run on the process stack
+ * and copy themselves in and out of it.
+ */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+    !defined(USE_CONTEXT) && !defined(__CYGWIN__) && \
+    defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifdef MAP_ANONYMOUS
+#define USE_THREAD_STACKS 1
+#endif
+#endif
+
+#ifdef USE_THREAD_STACKS
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#define THREAD_STACK_SIZE (SIZEOF_VOIDP > 4 ? 8*1024*1024 : 1024*1024)
+#define THREAD_STACK_MIN  (512*1024)
+
+extern unsigned int rb_gc_stack_level_max;
+static size_t thread_stack_size = THREAD_STACK_SIZE;
+static void *dead_stack_base;	/* of a thread that died on it */
+static size_t dead_stack_size;
+static void *stack_pool[THREAD_POOL_MAX];	/* all thread_stack_size */
+static int stack_pool_len;
+static unsigned long stack_pool_reused;
+
+/* whether the stack of th stays where it is while others run */
+#define STACK_IN_PLACE(th) ((th) == main_thread || (th)->stk_base)
+
+static void
+init_thread_stack()
+{
+    char *ptr = getenv("RUBY_THREAD_STACK_SIZE"), *end;
+    long size;
+
+    if (ptr) {
+	size = strtol(ptr, &end, 10);
+	if (end != ptr && !*end && size > 0) {
+	    thread_stack_size = size < THREAD_STACK_MIN ? THREAD_STACK_MIN : size;
+	}
+    }
+}
+
+static void
+thread_stack_alloc(th)
+    rb_thread_t th;
+{
+    size_t page = getpagesize();
+    size_t size = (thread_stack_size + page - 1) & ~(page - 1);
+    size_t space = size / 5;
+    void *base;
+
+    if (stack_pool_len > 0) {
+	base = stack_pool[--stack_pool_len];
+	stack_pool_reused++;
+    }
+    else {
+	base = mmap(0, size + page, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) rb_memerror();
+	/* a guard page below, to fault rather than overwrite the heap */
+	mprotect(base, page, PROT_NONE);
+    }
+    th->stk_base = base;
+    th->stk_size = size + page;
+    th->stk_start = (VALUE*)((char*)base + size + page);
+    /* leave room to raise SystemStackError, as Init_stack() does, and
+       for the calls between two checks of the stack */
+    if (space > 1024*1024) space = 1024*1024;
+    if (space < 256*1024) space = 256*1024;
+    th->stk_level_max = (size - space) / sizeof(VALUE);
+}
+
+static void
+thread_stack_put(base, size)
+    void *base;
+    size_t size;
+{
+    if (stack_pool_len < thread_pool_limit) {
+	stack_pool[stack_pool_len++] = base;
+    }
+    else {
+	munmap(base, size);
+    }
+}
+
+/* gives up the stack of th, or leaves it for thread_stack_reap() if th
+   is still running on it */
+static void
+thread_stack_free(th)
+    rb_thread_t th;
+{
+    if (!th->stk_base) return;
+    if (th == curr_thread) {
+	dead_stack_base = th->stk_base;
+	dead_stack_size = th->stk_size;
+    }
+    else {
+	thread_stack_put(th->stk_base, th->stk_size);
+    }
+    th->stk_base = 0;
+}
+
+static void
+thread_stack_reap()
+{
+    if (dead_stack_base) {
+	thread_stack_put(dead_stack_base, dead_stack_size);
+	dead_stack_base = 0;
+    }
+}
+#else
+#define STACK_IN_PLACE(th) 0
+#endif
+
 #define STACK(addr) (th->stk_pos<(VALUE*)(addr) && (VALUE*)(addr)<th->stk_pos+th->stk_len)
 #define ADJ(addr) (void*)(STACK(addr)?(((VALUE*)(addr)-th->stk_pos)+th->stk_ptr):(VALUE*)(addr))
 static void
@@ -10101,7 +12768,7 @@ thread_mark(th)
     rb_gc_mark(th->wrapper);
     rb_gc_mark((VALUE)th->cref);
 
-    rb_gc_mark((VALUE)th->scope);
+    rb_gc_mark_maybe((VALUE)th->scope);
     rb_gc_mark((VALUE)th->dyna_vars);
     rb_gc_mark(th->errinfo);
     rb_gc_mark(th->last_status);
@@ -10110,16 +12777,23 @@ thread_mark(th)
     rb_mark_tbl(th->locals);
     rb_gc_mark(th->thgroup);
     rb_gc_mark_maybe(th->sandbox);
+    deadline_mark(th);
 
     /* mark data in copied stack */
     if (th == curr_thread) return;
     if (th->status == THREAD_KILLED) return;
     if (th->stk_len == 0) return;  /* stack not active, no need to mark. */
     if (th->stk_ptr) {
+	/* a stack in place has stk_ptr == stk_pos, so ADJ() is a no-op */
 	rb_gc_mark_locations(th->stk_ptr, th->stk_ptr+th->stk_len);
 #if defined(THINK_C) || defined(__human68k__)
 	rb_gc_mark_locations(th->stk_ptr+2, th->stk_ptr+th->stk_len+2);
 #endif
+	if (STACK_IN_PLACE(th)) {
+	    /* and the registers it switched out with */
+	    rb_gc_mark_locations((VALUE*)th->context,
+				 (VALUE*)((char*)th->context + sizeof(th->context)));
+	}
 #ifdef __ia64
 	if (th->bstr_ptr) {
             rb_gc_mark_locations(th->bstr_ptr, th->bstr_ptr+th->bstr_len);
@@ -10194,7 +12868,7 @@ rb_gc_abort_threads()
         return;
 
     FOREACH_THREAD_FROM(main_thread, th) {
-	if (FL_TEST(th->thread, FL_MARK)) continue;
+	if (rb_gc_marked_p(th->thread)) continue;
 	if (th->status == THREAD_STOPPED) {
 	    th->status = THREAD_TO_KILL;
 	    rb_gc_mark(th->thread);
@@ -10206,8 +12880,17 @@ static void
 thread_free(th)
     rb_thread_t th;
 {
-    if (th->stk_ptr) free(th->stk_ptr);
+    if (th->stk_max) stk_buf_put(th->stk_ptr, th->stk_max);
     th->stk_ptr = 0;
+#ifdef USE_THREAD_STACKS
+    thread_stack_free(th);
+#endif
+#ifdef USE_EPOLL
+    thread_unwatch(th);
+    if (th->fd_waiters) free(th->fd_waiters);
+#endif
+    timer_remove(th);
+    deadline_clear(th);
 #ifdef __ia64
     if (th->bstr_ptr) free(th->bstr_ptr);
     th->bstr_ptr = 0;
@@ -10217,7 +12900,7 @@ thread_free(th)
 	if (th->prev) th->prev->next = th->next;
 	if (th->next) th->next->prev = th->prev;
     }
-    if (th != main_thread) free(th);
+    if (th != main_thread) thread_pool_put(th);
 }
 
 static rb_thread_t
@@ -10262,15 +12945,29 @@ rb_thread_save_context(th)
     len = ruby_stack_length(&pos);
     th->stk_len = 0;
     th->stk_pos = pos;
-    if (len > th->stk_max) {
-	VALUE *ptr = realloc(th->stk_ptr, sizeof(VALUE) * len);
-	if (!ptr) rb_memerror();
-	th->stk_ptr = ptr;
-	th->stk_max = len;
+#ifdef USE_THREAD_STACKS
+    th->stk_start = rb_gc_stack_start;
+    th->stk_level_max = rb_gc_stack_level_max;
+#endif
+    if (STACK_IN_PLACE(th)) {
+	th->stk_ptr = pos;
+	th->stk_len = len;
+    }
+    else {
+	if (len > th->stk_max) {
+	    VALUE *ptr = th->stk_ptr ? 0 : stk_buf_get(len, &th->stk_max);
+
+	    if (!ptr) {
+		ptr = realloc(th->stk_ptr, sizeof(VALUE) * len);
+		if (!ptr) rb_memerror();
+		th->stk_max = len;
+	    }
+	    th->stk_ptr = ptr;
+	}
+	th->stk_len = len;
+	FLUSH_REGISTER_WINDOWS;
+	MEMCPY(th->stk_ptr, th->stk_pos, VALUE, th->stk_len);
     }
-    th->stk_len = len;
-    FLUSH_REGISTER_WINDOWS;
-    MEMCPY(th->stk_ptr, th->stk_pos, VALUE, th->stk_len);
 #ifdef __ia64
     th->bstr_pos = rb_gc_register_stack_start;
     len = (VALUE*)rb_ia64_bsp() - th->bstr_pos;
@@ -10323,6 +13020,9 @@ static int
 rb_thread_switch(n)
     int n;
 {
+#ifdef USE_THREAD_STACKS
+    thread_stack_reap();
+#endif
     rb_trap_immediate = (curr_thread->flags&0x100)?1:0;
     switch (n) {
       case 0:
@@ -10354,6 +13054,7 @@ rb_thread_switch(n)
 	break;
       case RESTORE_NORMAL:
       default:
+	if (curr_thread->deadlines) deadline_check();
 	break;
     }
     return 1;
@@ -10394,6 +13095,10 @@ rb_thread_restore_context_0(rb_thread_t th, int exit, void *vp)
     ruby_safe_level = th->safe;
 
     ruby_current_node = th->node;
+#ifdef USE_THREAD_STACKS
+    rb_gc_stack_start = th->stk_start;
+    rb_gc_stack_level_max = th->stk_level_max;
+#endif
 
 #ifdef SAVE_WIN32_EXCEPTION_LIST
     win32_set_exception_list(th->win32_exception_list);
@@ -10401,7 +13106,9 @@ rb_thread_restore_context_0(rb_thread_t th, int exit, void *vp)
     tmp = th;
     ex = exit;
     FLUSH_REGISTER_WINDOWS;
-    MEMCPY(tmp->stk_pos, tmp->stk_ptr, VALUE, tmp->stk_len);
+    if (!STACK_IN_PLACE(tmp)) {
+	MEMCPY(tmp->stk_pos, tmp->stk_ptr, VALUE, tmp->stk_len);
+    }
 #ifdef __ia64
     MEMCPY(tmp->bstr_pos, tmp->bstr_ptr, VALUE, tmp->bstr_len);
 #endif
@@ -10485,6 +13192,10 @@ rb_thread_restore_context(th, exit)
 {
     VALUE v;
     if (!th->stk_ptr) rb_bug("unsaved context");
+    if (STACK_IN_PLACE(th)) {
+	/* nothing to copy back, so no need to get out of the way */
+	rb_thread_restore_context_0(th, exit, &v);
+    }
     stack_extend(th, exit, &v);
 }
 
@@ -10504,8 +13215,17 @@ rb_thread_die(th)
 {
     th->thgroup = 0;
     th->status = THREAD_KILLED;
-    if (th->stk_ptr) free(th->stk_ptr);
+    if (th->stk_max) stk_buf_put(th->stk_ptr, th->stk_max);
     th->stk_ptr = 0;
+    th->stk_max = 0;
+#ifdef USE_THREAD_STACKS
+    thread_stack_free(th);
+#endif
+#ifdef USE_EPOLL
+    thread_unwatch(th);
+#endif
+    timer_remove(th);
+    deadline_clear(th);
 }
 
 static void
@@ -10533,6 +13253,17 @@ rb_thread_fd_close(fd)
 {
     rb_thread_t th;
 
+#ifdef USE_EPOLL
+    if (fd < fd_watch_size && fd_watches[fd].registered) {
+	struct epoll_event ev;
+
+	/* fails if fd is closed already, but a dup of it may live on */
+	epoll_ctl(sched_epfd, EPOLL_CTL_DEL, fd, &ev);
+	fd_watches[fd].registered = 0;
+	fd_watches[fd].armed = 0;
+	fd_watches[fd].gen++;
+    }
+#endif
     FOREACH_THREAD(th) {
 	if (((th->wait_for & WAIT_FD) && fd == th->fd) ||
 	    ((th->wait_for & WAIT_SELECT) && (fd < th->fd) &&
@@ -10658,6 +13389,9 @@ rb_thread_schedule()
     int n, max;
     int need_select = 0;
     int select_timeout = 0;
+#ifdef USE_EPOLL
+    int need_epoll = 0;
+#endif
 
 #ifdef HAVE_NATIVETHREAD
     if (!is_ruby_native_thread()) {
@@ -10666,8 +13400,13 @@ rb_thread_schedule()
 #endif
     rb_thread_pending = 0;
     if (curr_thread == curr_thread->next
-	&& curr_thread->status == THREAD_RUNNABLE)
+	&& curr_thread->status == THREAD_RUNNABLE) {
+	if (deadline_heap_len > 0) {
+	    deadline_expire(timeofday());
+	    if (curr_thread->deadlines) deadline_check();
+	}
 	return;
+    }
 
     next = 0;
     curr = curr_thread;		/* starting thread */
@@ -10684,6 +13423,43 @@ rb_thread_schedule()
     delay = DELAY_INFTY;
     now = -1.0;
 
+    /* wake the threads whose time is up */
+    while (timer_heap_len > 0) {
+	th = timer_heap[0];
+	if (th->status != THREAD_STOPPED || !(th->wait_for & WAIT_TIME)) {
+	    /* woken otherwise */
+	    timer_remove(th);
+	    continue;
+	}
+	if (now < 0.0) now = timeofday();
+	if (th->delay > now) {
+	    delay = th->delay - now;
+	    need_select = 1;
+	    break;
+	}
+	timer_remove(th);
+	th->status = THREAD_RUNNABLE;
+	if (th->wait_for & WAIT_SELECT) {
+	    /* timed out, nothing is ready */
+	    FD_ZERO(&th->readfds);
+	    FD_ZERO(&th->writefds);
+	    FD_ZERO(&th->exceptfds);
+	}
+	found = 1;
+    }
+
+    /* wake the threads whose deadline has passed, to raise there */
+    if (deadline_heap_len > 0) {
+	double at;
+
+	if (now < 0.0) now = timeofday();
+	at = deadline_expire(now);
+	if (at < DELAY_INFTY) {
+	    if (at - now < delay) delay = at - now;
+	    need_select = 1;
+	}
+    }
+
     FOREACH_THREAD_FROM(curr, th) {
 	if (!found && th->status <= THREAD_RUNNABLE) {
 	    found = 1;
@@ -10695,12 +13471,19 @@ rb_thread_schedule()
 		found = 1;
 	    }
 	}
-	if (th->wait_for & WAIT_FD) {
+#ifdef USE_EPOLL
+	if (FD_WAITING(th) && FD_WATCHED(th)) {
+	    /* its descriptors are in the epoll set */
+	    need_select = need_epoll = 1;
+	    th->select_value = 0;
+	}
+#endif
+	if ((th->wait_for & WAIT_FD) && !FD_WATCHED(th)) {
 	    FD_SET(th->fd, &readfds);
 	    if (max < th->fd) max = th->fd;
 	    need_select = 1;
 	}
-	if (th->wait_for & WAIT_SELECT) {
+	if ((th->wait_for & WAIT_SELECT) && !FD_WATCHED(th)) {
 	    copy_fds(&readfds, &th->readfds, th->fd);
 	    copy_fds(&writefds, &th->writefds, th->fd);
 	    copy_fds(&exceptfds, &th->exceptfds, th->fd);
@@ -10712,21 +13495,8 @@ rb_thread_schedule()
 	    th->select_value = 0;
 	}
 	if (th->wait_for & WAIT_TIME) {
-	    double th_delay;
-
-	    if (now < 0.0) now = timeofday();
-	    th_delay = th->delay - now;
-	    if (th_delay <= 0.0) {
-		th->status = THREAD_RUNNABLE;
-		found = 1;
-	    }
-	    else if (th_delay < delay) {
-		delay = th_delay;
-		need_select = 1;
-	    }
-	    else if (th->delay == DELAY_INFTY) {
-		need_select = 1;
-	    }
+	    /* the timer heap has the others */
+	    if (th->delay == DELAY_INFTY) need_select = 1;
 	}
     }
     END_FOREACH_FROM(curr, th);
@@ -10749,7 +13519,37 @@ rb_thread_schedule()
 	    delay_ptr = &delay_tv;
 	}
 
+#ifdef USE_EPOLL
+	if (need_epoll) {
+	    if (max >= 0) {
+		/* Some descriptors were left to select(), which epoll
+		   would not take: these are mostly regular files, ready
+		   at once.  Poll them, and do not sleep long in epoll. */
+		struct timeval zero_tv;
+
+		zero_tv.tv_sec = 0;
+		zero_tv.tv_usec = 0;
+		n = select(max+1, &readfds, &writefds, &exceptfds, &zero_tv);
+		if (n != 0) goto selected;
+		if (!delay_ptr || delay_tv.tv_sec > 0 || delay_tv.tv_usec > 10000) {
+		    delay_tv.tv_sec = 0;
+		    delay_tv.tv_usec = 10000;
+		    delay_ptr = &delay_tv;
+		}
+	    }
+	    n = fd_watch_wait(delay_ptr);
+	    if (n < 0) {
+		if (rb_trap_pending) rb_trap_exec();
+		goto again;
+	    }
+	    if (n > 0) found = 1;
+	    goto polled;
+	}
+#endif
 	n = select(max+1, &readfds, &writefds, &exceptfds, delay_ptr);
+#ifdef USE_EPOLL
+      selected:
+#endif
 	if (n < 0) {
 	    int e = errno;
 
@@ -10759,7 +13559,7 @@ rb_thread_schedule()
 	    if (e == ERESTART) goto again;
 #endif
 	    FOREACH_THREAD_FROM(curr, th) {
-		if (th->wait_for & WAIT_SELECT) {
+		if ((th->wait_for & WAIT_SELECT) && !FD_WATCHED(th)) {
 		    int v = 0;
 
 		    v |= find_bad_fds(&readfds, &th->readfds, th->fd);
@@ -10777,7 +13577,7 @@ rb_thread_schedule()
  	    if (now < 0.0) now = timeofday();
  	    FOREACH_THREAD_FROM(curr, th) {
  		if (((th->wait_for&(WAIT_SELECT|WAIT_TIME)) == (WAIT_SELECT|WAIT_TIME)) &&
-		    th->delay <= now) {
+		    !FD_WATCHED(th) && th->delay <= now) {
  		    th->status = THREAD_RUNNABLE;
  		    th->wait_for = 0;
  		    th->select_value = 0;
@@ -10794,7 +13594,8 @@ rb_thread_schedule()
 	    /* Some descriptors are ready.
 	       Make the corresponding threads runnable. */
 	    FOREACH_THREAD_FROM(curr, th) {
-		if ((th->wait_for&WAIT_FD) && FD_ISSET(th->fd, &readfds)) {
+		if ((th->wait_for&WAIT_FD) && !FD_WATCHED(th) &&
+		    FD_ISSET(th->fd, &readfds)) {
 		    /* Wake up only one thread per fd. */
 		    FD_CLR(th->fd, &readfds);
 		    th->status = THREAD_RUNNABLE;
@@ -10802,7 +13603,7 @@ rb_thread_schedule()
 		    th->wait_for = 0;
 		    found = 1;
 		}
-		if ((th->wait_for&WAIT_SELECT) &&
+		if ((th->wait_for&WAIT_SELECT) && !FD_WATCHED(th) &&
 		    (match_fds(&readfds, &th->readfds, max) ||
 		     match_fds(&writefds, &th->writefds, max) ||
 		     match_fds(&exceptfds, &th->exceptfds, max))) {
@@ -10818,6 +13619,9 @@ rb_thread_schedule()
 	    }
 	    END_FOREACH_FROM(curr, th);
 	}
+#ifdef USE_EPOLL
+      polled:
+#endif
 	/* The delays for some of the threads should have expired.
 	   Go through the loop once more, to check the delays. */
 	if (!found && delay != DELAY_INFTY)
@@ -10829,7 +13633,10 @@ rb_thread_schedule()
 	    next = th;
 	    break;
 	}
-	if (th->status == THREAD_RUNNABLE && th->stk_ptr) {
+	/* the current thread goes on without a saved context; with a
+	   deadline, it may be alone here */
+	if (th->status == THREAD_RUNNABLE &&
+	    (th->stk_ptr || th == curr_thread)) {
 	    if (!next || next->priority < th->priority)
 	       next = th;
 	}
@@ -10868,7 +13675,12 @@ rb_thread_schedule()
 	rb_thread_deadlock();
     }
     next->wait_for = 0;
+#ifdef USE_EPOLL
+    thread_unwatch(next);
+#endif
+    timer_remove(next);
     if (next->status == THREAD_RUNNABLE && next == curr_thread) {
+	if (curr_thread->deadlines) deadline_check();
 	return;
     }
 
@@ -10896,12 +13708,20 @@ rb_thread_wait_fd(fd)
 {
     if (rb_thread_critical) return;
     if (ruby_in_compile) return;
-    if (curr_thread == curr_thread->next) return;
+    if (THREAD_ALONE()) return;
     if (curr_thread->status == THREAD_TO_KILL) return;
 
-    curr_thread->status = THREAD_STOPPED;
     curr_thread->fd = fd;
     curr_thread->wait_for = WAIT_FD;
+#ifdef USE_EPOLL
+    if (thread_watch(curr_thread) < 0 && fd >= FD_SETSIZE) {
+	/* select() cannot wait for it */
+	curr_thread->wait_for = 0;
+	rb_thread_schedule();
+	return;
+    }
+#endif
+    curr_thread->status = THREAD_STOPPED;
     rb_thread_schedule();
 }
 
@@ -10910,17 +13730,35 @@ rb_thread_fd_writable(fd)
     int fd;
 {
     if (rb_thread_critical) return Qtrue;
-    if (curr_thread == curr_thread->next) return Qtrue;
+    if (THREAD_ALONE()) return Qtrue;
     if (curr_thread->status == THREAD_TO_KILL) return Qtrue;
     if (curr_thread->status == THREAD_KILLED) return Qtrue;
 
-    curr_thread->status = THREAD_STOPPED;
+#ifdef USE_EPOLL
+    if (fd >= FD_SETSIZE) {
+	/* too high for the fd_sets of WAIT_SELECT */
+	curr_thread->fd = fd;
+	curr_thread->wait_for = WAIT_FD|WAIT_WRITABLE;
+	if (thread_watch(curr_thread) < 0) {
+	    curr_thread->wait_for = 0;
+	    rb_thread_schedule();
+	    return Qfalse;
+	}
+	curr_thread->status = THREAD_STOPPED;
+	rb_thread_schedule();
+	return Qfalse;
+    }
+#endif
     FD_ZERO(&curr_thread->readfds);
     FD_ZERO(&curr_thread->writefds);
     FD_SET(fd, &curr_thread->writefds);
     FD_ZERO(&curr_thread->exceptfds);
     curr_thread->fd = fd+1;
     curr_thread->wait_for = WAIT_SELECT;
+#ifdef USE_EPOLL
+    thread_watch(curr_thread);
+#endif
+    curr_thread->status = THREAD_STOPPED;
     rb_thread_schedule();
     return Qfalse;
 }
@@ -10932,7 +13770,7 @@ rb_thread_wait_for(time)
     double date;
 
     if (rb_thread_critical ||
-	curr_thread == curr_thread->next ||
+	THREAD_ALONE() ||
 	curr_thread->status == THREAD_TO_KILL) {
 	int n;
 	int thr_critical = rb_thread_critical;
@@ -10976,6 +13814,7 @@ rb_thread_wait_for(time)
     curr_thread->status = THREAD_STOPPED;
     curr_thread->delay = date;
     curr_thread->wait_for = WAIT_TIME;
+    timer_add(curr_thread);
     rb_thread_schedule();
 }
 
@@ -10984,7 +13823,7 @@ void rb_thread_sleep_forever _((void));
 int
 rb_thread_alone()
 {
-    return curr_thread == curr_thread->next;
+    return THREAD_ALONE();
 }
 
 int
@@ -11015,7 +13854,7 @@ rb_thread_select(max, read, write, except, timeout)
 #endif
 
     if (rb_thread_critical ||
-	curr_thread == curr_thread->next ||
+	THREAD_ALONE() ||
 	curr_thread->status == THREAD_TO_KILL) {
 #ifndef linux
 	struct timeval tv, *tvp = timeout;
@@ -11056,7 +13895,6 @@ rb_thread_select(max, read, write, except, timeout)
 	}
     }
 
-    curr_thread->status = THREAD_STOPPED;
     if (read) curr_thread->readfds = *read;
     else FD_ZERO(&curr_thread->readfds);
     if (write) curr_thread->writefds = *write;
@@ -11069,7 +13907,12 @@ rb_thread_select(max, read, write, except, timeout)
 	curr_thread->delay = timeofday() +
 	    (double)timeout->tv_sec + (double)timeout->tv_usec*1e-6;
 	curr_thread->wait_for |= WAIT_TIME;
+	timer_add(curr_thread);
     }
+#ifdef USE_EPOLL
+    thread_watch(curr_thread);
+#endif
+    curr_thread->status = THREAD_STOPPED;
     rb_thread_schedule();
     if (read) *read = curr_thread->readfds;
     if (write) *write = curr_thread->writefds;
@@ -11102,6 +13945,7 @@ rb_thread_join(th, limit)
 	curr_thread->wait_for = WAIT_JOIN;
 	curr_thread->delay = timeofday() + limit;
 	if (limit < DELAY_INFTY) curr_thread->wait_for |= WAIT_TIME;
+	timer_add(curr_thread);
 	rb_thread_schedule();
 	curr_thread->status = last_status;
 	if (!rb_thread_dead(th)) return Qfalse;
@@ -11479,7 +14323,7 @@ rb_thread_stop()
     enum rb_thread_status last_status = THREAD_RUNNABLE;
 
     rb_thread_critical = 0;
-    if (curr_thread == curr_thread->next) {
+    if (THREAD_ALONE()) {
 	rb_raise(rb_eThreadError, "stopping only thread\n\tnote: use sleep to stop forever");
     }
     if (curr_thread->status == THREAD_TO_KILL)
@@ -11496,10 +14340,11 @@ struct timeval rb_time_timeval();
 void
 rb_thread_polling()
 {
-    if (curr_thread != curr_thread->next) {
+    if (!THREAD_ALONE()) {
 	curr_thread->status = THREAD_STOPPED;
 	curr_thread->delay = timeofday() + (double)0.06;
 	curr_thread->wait_for = WAIT_TIME;
+	timer_add(curr_thread);
 	rb_thread_schedule();
     }
 }
@@ -11508,7 +14353,7 @@ void
 rb_thread_sleep(sec)
     int sec;
 {
-    if (curr_thread == curr_thread->next) {
+    if (THREAD_ALONE()) {
 	TRAP_BEG;
 	sleep(sec);
 	TRAP_END;
@@ -11521,7 +14366,7 @@ void
 rb_thread_sleep_forever()
 {
     int thr_critical = rb_thread_critical;
-    if (curr_thread == curr_thread->next ||
+    if (THREAD_ALONE() ||
 	curr_thread->status == THREAD_TO_KILL) {
 	rb_thread_critical = Qtrue;
 	TRAP_BEG;
@@ -11533,6 +14378,7 @@ rb_thread_sleep_forever()
 
     curr_thread->delay = DELAY_INFTY;
     curr_thread->wait_for = WAIT_TIME;
+    timer_add(curr_thread);
     curr_thread->status = THREAD_STOPPED;
     rb_thread_schedule();
 }
@@ -11751,7 +14597,7 @@ rb_thread_group(thread)
 #endif
 
 #define THREAD_ALLOC(th) do {\
-    th = ALLOC(struct rb_thread);\
+    th = thread_pool_get();\
 \
     th->next = 0;\
     th->prev = 0;\
@@ -11763,7 +14609,15 @@ rb_thread_group(thread)
     th->stk_ptr = 0;\
     th->stk_len = 0;\
     th->stk_max = 0;\
+    th->stk_pos = 0;\
+    th->stk_start = 0;\
+    th->stk_level_max = 0;\
+    th->stk_base = 0;\
+    th->stk_size = 0;\
     th->wait_for = 0;\
+    th->fd_waiters = 0;\
+    th->fd_nwaiters = 0;\
+    th->fd_maxwaiters = 0;\
     IA64_INIT(th->bstr_ptr = 0);\
     IA64_INIT(th->bstr_len = 0);\
     IA64_INIT(th->bstr_max = 0);\
@@ -11771,6 +14625,8 @@ rb_thread_group(thread)
     FD_ZERO(&th->writefds);\
     FD_ZERO(&th->exceptfds);\
     th->delay = 0.0;\
+    th->timer_pos = -1;\
+    th->deadlines = 0;\
     th->join = 0;\
 \
     th->frame = 0;\
@@ -11816,6 +14672,42 @@ rb_thread_alloc(klass)
     return th;
 }
 
+/*
+ *  call-seq:
+ *     Thread.pool_stat    => hash
+ *  
+ *  Returns a hash telling how the structs, stack buffers and native
+ *  stacks of dead threads and continuations are kept for new ones:
+ *  how many of each may be kept (<code>:limit</code>, from
+ *  RUBY_THREAD_POOL_SIZE), how many are kept now, and how many times
+ *  one was used again.
+ *     
+ *     Thread.pool_stat   #=> {:limit=>16, :threads=>3, :buffers=>0,
+ *                        #    :stacks=>3, :threads_reused=>997,
+ *                        #    :buffers_reused=>0, :stacks_reused=>997}
+ */
+
+static VALUE
+rb_thread_s_pool_stat()
+{
+    VALUE hash = rb_hash_new();
+    int stacks = 0;
+    unsigned long stacks_reused = 0;
+
+#ifdef USE_THREAD_STACKS
+    stacks = stack_pool_len;
+    stacks_reused = stack_pool_reused;
+#endif
+    SET_STAT(hash, "limit", INT2NUM(thread_pool_limit));
+    SET_STAT(hash, "threads", INT2NUM(thread_pool_len));
+    SET_STAT(hash, "buffers", INT2NUM(stk_buf_pool_len));
+    SET_STAT(hash, "stacks", INT2NUM(stacks));
+    SET_STAT(hash, "threads_reused", ULONG2NUM(thread_pool_reused));
+    SET_STAT(hash, "buffers_reused", ULONG2NUM(stk_buf_pool_reused));
+    SET_STAT(hash, "stacks_reused", ULONG2NUM(stacks_reused));
+    return hash;
+}
+
 static int thread_init;
 
 #if defined(_THREAD_SAFE)
@@ -11954,65 +14846,21 @@ rb_thread_cancel_timer()
 }
 #endif
 
-static VALUE
-rb_thread_start_0(fn, arg, th)
+NORETURN(static void rb_thread_start_1 _((VALUE (*)(), void *, rb_thread_t, struct BLOCK *)));
+
+/* runs the new thread th to its end, then switches to another */
+static void
+rb_thread_start_1(fn, arg, th, block)
     VALUE (*fn)();
     void *arg;
     rb_thread_t th;
+    struct BLOCK *block;
 {
     volatile rb_thread_t th_save = th;
-    volatile VALUE thread = th->thread;
-    struct BLOCK *volatile saved_block = 0;
+    struct BLOCK *volatile saved_block = block;
     enum rb_thread_status status;
     int state;
 
-    if (OBJ_FROZEN(curr_thread->thgroup)) {
-	rb_raise(rb_eThreadError,
-		 "can't start a new thread (frozen ThreadGroup)");
-    }
-
-    if (!thread_init) {
-	thread_init = 1;
-#if defined(HAVE_SETITIMER) || defined(_THREAD_SAFE)
-#if defined(POSIX_SIGNAL)
-	posix_signal(SIGVTALRM, catch_timer);
-#else
-	signal(SIGVTALRM, catch_timer);
-#endif
-
-#ifdef _THREAD_SAFE
-	pthread_create(&time_thread, 0, thread_timer, 0);
-        time_thread_alive_p = 1;
-        pthread_atfork(0, 0, rb_child_atfork);
-#else
-	rb_thread_start_timer();
-#endif
-#endif
-    }
-
-    if (THREAD_SAVE_CONTEXT(curr_thread)) {
-	return thread;
-    }
-
-    if (ruby_block) {		/* should nail down higher blocks */
-	struct BLOCK dummy;
-
-	dummy.prev = ruby_block;
-	blk_copy_prev(&dummy);
-	saved_block = ruby_block = dummy.prev;
-    }
-    scope_dup(ruby_scope);
-
-    if (!th->next) {
-	/* merge in thread list */
-	th->prev = curr_thread;
-	curr_thread->next->prev = th;
-	th->next = curr_thread->next;
-	curr_thread->next = th;
-	th->priority = curr_thread->priority;
-	th->thgroup = curr_thread->thgroup;
-    }
-
     PUSH_TAG(PROT_THREAD);
     if ((state = EXEC_TAG()) == 0) {
 	if (THREAD_SAVE_CONTEXT(th) == 0) {
@@ -12065,6 +14913,142 @@ rb_thread_start_0(fn, arg, th)
     }
     rb_thread_schedule();
     ruby_stop(0);		/* last thread termination */
+}
+
+#ifdef USE_THREAD_STACKS
+static VALUE (*new_thread_fn)();
+static void *new_thread_arg;
+static rb_thread_t new_thread;
+static struct BLOCK *new_thread_block;
+
+NORETURN(NOINLINE(static void rb_thread_start_2(void)));
+
+/* the first function on the stack of a new thread */
+static void
+rb_thread_start_2()
+{
+    struct FRAME *frame, *frames, **prev;
+    struct iter iter;
+    int n = 0;
+
+    /*
+     * The frames, tags and iter records we start with are on the stack
+     * of the thread that started us, which goes on to reuse it.  Keep
+     * copies of the frames, for backtraces, and begin new chains of the
+     * others.
+     */
+    for (frame = ruby_frame; frame && frame != top_frame; frame = frame->prev) {
+	n++;
+    }
+    frames = ALLOCA_N(struct FRAME, n);
+    prev = &ruby_frame;
+    for (frame = ruby_frame; frame && frame != top_frame; frame = frame->prev) {
+	*frames = *frame;
+	frames->tmp = 0;
+	*prev = frames;
+	prev = &frames->prev;
+	frames++;
+    }
+    *prev = frame;
+    iter.iter = ruby_iter->iter;
+    iter.prev = 0;
+    ruby_iter = &iter;
+    prot_tag = 0;
+
+    rb_thread_start_1(new_thread_fn, new_thread_arg, new_thread, new_thread_block);
+}
+#endif
+
+/* starts the timer that makes the running thread call the scheduler;
+   it is needed once there is a second thread, or a deadline */
+static void
+thread_timer_init()
+{
+    if (!thread_init) {
+	thread_init = 1;
+#if defined(HAVE_SETITIMER) || defined(_THREAD_SAFE)
+#if defined(POSIX_SIGNAL)
+	posix_signal(SIGVTALRM, catch_timer);
+#else
+	signal(SIGVTALRM, catch_timer);
+#endif
+
+#ifdef _THREAD_SAFE
+	pthread_create(&time_thread, 0, thread_timer, 0);
+        time_thread_alive_p = 1;
+        pthread_atfork(0, 0, rb_child_atfork);
+#else
+	rb_thread_start_timer();
+#endif
+#endif
+    }
+}
+
+static VALUE
+rb_thread_start_0(fn, arg, th)
+    VALUE (*fn)();
+    void *arg;
+    rb_thread_t th;
+{
+    volatile VALUE thread = th->thread;
+    struct BLOCK *saved_block = 0;
+    struct BLOCK *block;
+
+    if (OBJ_FROZEN(curr_thread->thgroup)) {
+	rb_raise(rb_eThreadError,
+		 "can't start a new thread (frozen ThreadGroup)");
+    }
+
+    thread_timer_init();
+
+    /* the new thread can't use what is on this stack when we go on,
+       so the scopes it shares with us must be on the heap */
+    scope_dup(ruby_scope);
+    for (block = ruby_block; block; block = block->prev) {
+	scope_dup(block->scope);
+    }
+
+#ifdef USE_THREAD_STACKS
+    thread_stack_alloc(th);
+#endif
+    if (THREAD_SAVE_CONTEXT(curr_thread)) {
+	return thread;
+    }
+
+    if (ruby_block) {		/* should nail down higher blocks */
+	struct BLOCK dummy;
+
+	dummy.prev = ruby_block;
+	blk_copy_prev(&dummy);
+	saved_block = ruby_block = dummy.prev;
+    }
+
+    if (!th->next) {
+	/* merge in thread list */
+	th->prev = curr_thread;
+	curr_thread->next->prev = th;
+	th->next = curr_thread->next;
+	curr_thread->next = th;
+	th->priority = curr_thread->priority;
+	th->thgroup = curr_thread->thgroup;
+    }
+
+#ifdef USE_THREAD_STACKS
+    new_thread_fn = fn;
+    new_thread_arg = arg;
+    new_thread = th;
+    new_thread_block = saved_block;
+    rb_gc_stack_start = th->stk_start;
+    rb_gc_stack_level_max = th->stk_level_max;
+# ifdef __x86_64__
+    __asm__ volatile ("movq %0, %%rsp\n\tcall *%1"
+		      : : "r"(th->stk_start), "r"(rb_thread_start_2) : "memory");
+# else
+    __asm__ volatile ("movl %0, %%esp\n\tcall *%1"
+		      : : "r"(th->stk_start), "r"(rb_thread_start_2) : "memory");
+# endif
+#endif
+    rb_thread_start_1(fn, arg, th, saved_block);
     return 0;			/* not reached */
 }
 
@@ -12168,7 +15152,7 @@ rb_thread_initialize(thread, args)
 	rb_raise(rb_eThreadError, "must be called with a block");
     }
     th = rb_thread_check(thread);
-    if (th->stk_max) {
+    if (th->stk_pos) {
 	NODE *node = th->node;
 	if (!node) {
 	    rb_raise(rb_eThreadError, "already initialized thread");
@@ -12545,6 +15529,83 @@ rb_thread_raise_m(argc, argv, thread)
     return Qnil;		/* not reached */
 }
 
+static VALUE
+deadline_yield(sec)
+    VALUE sec;
+{
+    return rb_yield(sec);
+}
+
+static VALUE
+deadline_pop(self)
+    VALUE self;
+{
+    struct thread_deadline *d, **p;
+
+    Data_Get_Struct(self, struct thread_deadline, d);
+    deadline_remove(d);
+    for (p = &d->th->deadlines; *p; p = &(*p)->prev) {
+	if (*p == d) {
+	    *p = d->prev;
+	    break;
+	}
+    }
+    return Qnil;
+}
+
+static void
+deadline_data_mark(d)
+    struct thread_deadline *d;
+{
+    rb_gc_mark(d->klass);
+}
+
+/*
+ *  call-seq:
+ *     Thread.deadline(sec, exception=ThreadError) {|sec| block }  => obj
+ *  
+ *  Executes the block in the current thread, and returns its value. If
+ *  the block is still running <i>sec</i> seconds later, <i>exception</i>
+ *  is raised in it with the message "execution expired".
+ *  <code>Timeout.timeout</code> passes <code>Timeout::Error</code>.
+ *  Unlike a thread that sleeps and then calls <code>Thread#raise</code>,
+ *  this costs no thread; the scheduler keeps the time. Deadlines nest.
+ *     
+ *     Thread.deadline(0.1, RuntimeError) { sleep }
+ *     
+ *  <em>produces:</em>
+ *     
+ *     prog.rb:1:in `sleep': execution expired (RuntimeError)
+ */
+
+static VALUE
+rb_thread_s_deadline(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct thread_deadline *d;
+    VALUE sec, klass, dl;
+
+    if (rb_scan_args(argc, argv, "11", &sec, &klass) == 1) {
+	klass = rb_eThreadError;
+    }
+    Check_Type(klass, T_CLASS);
+    dl = Data_Make_Struct(rb_cData, struct thread_deadline,
+			  deadline_data_mark, -1, d);
+    d->at = timeofday() + NUM2DBL(sec);
+    d->klass = klass;
+    d->self = dl;
+    d->th = curr_thread;
+    d->pos = -1;
+    d->expired = 0;
+    d->prev = curr_thread->deadlines;
+    curr_thread->deadlines = d;
+    deadline_add(d);
+    thread_timer_init();
+    return rb_ensure(deadline_yield, sec, deadline_pop, dl);
+}
+
 VALUE
 rb_thread_local_aref(thread, id)
     VALUE thread;
@@ -12727,6 +15788,7 @@ rb_thread_atfork()
 {
     rb_thread_t th;
 
+    rb_thread_reset_fd_watch();
     if (rb_thread_alone()) return;
     FOREACH_THREAD(th) {
 	if (th != curr_thread) {
@@ -13077,6 +16139,10 @@ Init_Thread()
 {
     VALUE cThGroup;
 
+    init_thread_pool();
+#ifdef USE_THREAD_STACKS
+    init_thread_stack();
+#endif
     rb_eThreadError = rb_define_class("ThreadError", rb_eStandardError);
     rb_cThread = rb_define_class("Thread", rb_cObject);
     rb_undef_alloc_func(rb_cThread);
@@ -13093,6 +16159,8 @@ Init_Thread()
     rb_define_singleton_method(rb_cThread, "current", rb_thread_current, 0);
     rb_define_singleton_method(rb_cThread, "main", rb_thread_main, 0);
     rb_define_singleton_method(rb_cThread, "list", rb_thread_list, 0);
+    rb_define_singleton_method(rb_cThread, "deadline", rb_thread_s_deadline, -1);
+    rb_define_singleton_method(rb_cThread, "pool_stat", rb_thread_s_pool_stat, 0);
 
     rb_define_singleton_method(rb_cThread, "critical", rb_thread_critical_get, 0);
     rb_define_singleton_method(rb_cThread, "critical=", rb_thread_critical_set, 1);
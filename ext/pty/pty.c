@@ -145,12 +145,24 @@ raise_from_wait(state, info)
     rb_funcall(info->thread, rb_intern("raise"), 1, exc);
 }
 
-static VALUE
-pty_syswait(info)
+static void
+pty_info_mark(info)
     struct pty_info *info;
 {
+    rb_gc_mark(info->thread);
+}
+
+/* the thread outlives the stack of pty_getpty(), so it gets its
+   pty_info in an object of its own */
+static VALUE
+pty_syswait(obj)
+    VALUE obj;
+{
+    struct pty_info *info;
     int cpid, status;
 
+    Data_Get_Struct(obj, struct pty_info, info);
+
     for (;;) {
 	cpid = rb_waitpid(info->child_pid, &status, WUNTRACED);
 	if (cpid == -1) return Qnil;
@@ -414,8 +426,8 @@ pty_getpty(argc, argv, self)
     VALUE *argv;
     VALUE self;
 {
-    VALUE res;
-    struct pty_info info;
+    VALUE res, wait_obj;
+    struct pty_info info, *wait_info;
     struct pty_info thinfo;
     OpenFile *wfptr,*rfptr;
     VALUE rport = rb_obj_alloc(rb_cFile);
@@ -439,7 +451,9 @@ pty_getpty(argc, argv, self)
     rb_ary_store(res,1,(VALUE)wport);
     rb_ary_store(res,2,INT2FIX(info.child_pid));
 
-    thinfo.thread = rb_thread_create(pty_syswait, (void*)&info);
+    wait_obj = Data_Make_Struct(0, struct pty_info, pty_info_mark, -1, wait_info);
+    *wait_info = info;
+    thinfo.thread = rb_thread_create(pty_syswait, (void*)wait_obj);
     thinfo.child_pid = info.child_pid;
     rb_thread_schedule();
 
@@ -625,6 +625,14 @@ rb_syck_load_handler(p, n)
     if (n->id > 0 && !NIL_P(obj))
     {
         MEMCPY((void *)n->id, (void *)obj, RVALUE, 1);
+        if ( FL_TEST( n->id, ELTS_EMBED ) )
+        {
+            /* embedded contents moved along with the slot */
+            if ( BUILTIN_TYPE( n->id ) == T_STRING )
+                RSTRING(n->id)->ptr = (char *)&RSTRING(n->id)->aux;
+            else if ( BUILTIN_TYPE( n->id ) == T_ARRAY )
+                RARRAY(n->id)->ptr = (VALUE *)&RARRAY(n->id)->aux;
+        }
         MEMZERO((void *)obj, RVALUE, 1);
         obj = n->id;
     }
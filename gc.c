@@ -30,6 +30,16 @@
 #include <sys/resource.h>
 #endif
 
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifdef MAP_ANONYMOUS
+#define USE_MMAP_HEAP 1
+#endif
+#endif
+
 #if defined _WIN32 || defined __CYGWIN__
 #include <windows.h>
 #endif
@@ -69,10 +79,33 @@ void *alloca ();
 #endif
 
 static unsigned long malloc_increase = 0;
+static unsigned long gc_malloc_limit = GC_MALLOC_LIMIT;
 static unsigned long malloc_limit = GC_MALLOC_LIMIT;
 static void run_final();
 static VALUE nomem_error;
 static void garbage_collect();
+struct heap_class;
+static int gc_lazy_sweep _((struct heap_class *));
+
+/* statistics, reported by GC.stat */
+static unsigned long gc_count = 0;
+static double gc_mark_time = 0;		/* in microseconds */
+static double gc_sweep_time = 0;
+static unsigned long total_allocated_objects = 0;
+static unsigned long total_freed_objects = 0;
+static double total_allocated_size = 0;
+static unsigned long live_after_gc = 0;
+static unsigned long free_after_gc = 0;
+static unsigned long marked_objects = 0;
+
+static double
+gc_usec()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return (double)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
 NORETURN(void rb_exc_jump _((VALUE)));
 
@@ -116,6 +149,7 @@ ruby_xmalloc(size)
 	}
     }
     malloc_increase += size;
+    total_allocated_size += size;
 
     return mem;
 }
@@ -153,6 +187,7 @@ ruby_xrealloc(ptr, size)
         }
     }
     malloc_increase += size;
+    total_allocated_size += size;
 
     return mem;
 }
@@ -299,83 +334,404 @@ typedef struct RVALUE {
 #endif
 } RVALUE;
 
+/*
+ * A Float needs no more than an RBasic and a double, and gets a slot
+ * of this size from a heap of its own.  Other types keep full RVALUEs
+ * even where they would fit: extensions such as syck overwrite one
+ * object with another of a different type.  Object ids of Symbols are
+ * only kept apart from those of objects if slots of every size are 8
+ * byte aligned, so the small heap is used on LP64 only.
+ */
+typedef struct RSMALL {
+    union {
+	struct {
+	    unsigned long flags;	/* always 0 for freed obj */
+	    struct RVALUE *next;
+	} free;
+	struct RBasic  basic;
+	struct RFloat  flonum;
+    } as;
+} RSMALL;
+
+#if SIZEOF_VOIDP >= 8
+#define USE_SMALL_HEAP
+#endif
+
 #if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__CYGWIN__)
 #pragma pack(pop)
 #endif
 
-static RVALUE *freelist = 0;
 static RVALUE *deferred_final_list = 0;
 
+/* allocation tracing, see ObjectSpace.trace_allocations */
+static int alloc_trace_rate = 0;	/* sample every rate-th allocation */
+static int alloc_trace_countdown = 0;
+static unsigned long alloc_trace_seed = 2463534242UL;
+static RVALUE *alloc_trace_pending = 0;
+static char *alloc_trace_file;
+static int alloc_trace_line;
+static void alloc_trace_record();
+static void alloc_trace_mark();
+
+/* while dumping the heap, gc_mark writes references here instead */
+static FILE *heap_dump_file = 0;
+static void heap_dump_ref _((VALUE));
+
+/*
+ * The distance to the next sample, rate on average.  It is random so
+ * that allocations repeating with the same period as the sampling are
+ * not all or never sampled.
+ */
+static int
+alloc_trace_interval()
+{
+    unsigned long x = alloc_trace_seed;
+
+    if (alloc_trace_rate == 1) return 1;
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    alloc_trace_seed = x;
+    return 1 + (int)(x % (2 * (unsigned long)alloc_trace_rate - 1));
+}
+
+/*
+ * The object heap is made of fixed size pages.  Where mmap() is
+ * available pages are mapped from the OS, so that a page left empty by
+ * a collection can be given back with munmap() rather than free(),
+ * which rarely returns memory to the OS.
+ */
 #define HEAPS_INCREMENT 10
-static struct heaps_slot {
+#define HEAP_PAGE_SIZE 0x4000
+#define MARK_BITS (sizeof(unsigned long) * CHAR_BIT)
+#define MARK_TABLE_SIZE(n) (((n) + MARK_BITS - 1) / MARK_BITS)
+/* a mark bit for every word of a page, whatever the size of its slots */
+#define MARK_TABLE_LEN MARK_TABLE_SIZE(HEAP_PAGE_SIZE / sizeof(VALUE))
+#define MARK_INDEX(h, p) (((char*)(p) - (char*)(h)->membase) / sizeof(VALUE))
+
+/*
+ * Pages are given to one size class, which has its own freelist and
+ * queue of pages with free slots, and grows and shrinks on its own.
+ */
+struct heap_class {
+    int size;			/* bytes per slot */
+    RVALUE *freelist;
+    struct heaps_slot *free_pages;
+    struct heaps_slot **free_pages_tail;
+    int used;			/* pages */
+    int slots;			/* to be added by the next add_heap() */
+    int min_slots;		/* pages are not released below this */
+    unsigned long free_slots;	/* found, or expected, by the last sweep */
+    unsigned long sweep_slots;
+    unsigned long sweep_freed;
+    unsigned long sweep_free_min;
+    unsigned long sweep_free_max;
+};
+#ifdef USE_SMALL_HEAP
+#define HEAP_CLASSES 2
+#else
+#define HEAP_CLASSES 1
+#endif
+static struct heap_class heap_classes[HEAP_CLASSES];
+#define rvalue_heap (&heap_classes[0])
+#define small_heap (&heap_classes[HEAP_CLASSES - 1])
+#define heap_classes_end (heap_classes + HEAP_CLASSES)
+
+struct heaps_slot {
     void *membase;
     RVALUE *slot;
     int limit;
-} *heaps;
+    int size;			/* of its slots */
+    struct heap_class *heap;
+    int free_num;		/* free slots found by the sweep */
+    RVALUE *freelist;		/* not yet handed to rb_newobj() */
+    struct heaps_slot *next;	/* in free_pages or sweep_pages */
+    int unswept;
+    unsigned long marks[MARK_TABLE_LEN];
+};
+static struct heaps_slot **heaps;
+static RVALUE **heaps_start;	/* heaps[i]->slot, packed for searching */
 static int heaps_length = 0;
 static int heaps_used   = 0;
+static struct heaps_slot *last_heap = 0;
+
+#define SLOT_NEXT(h, p) ((RVALUE*)((char*)(p) + (h)->size))
+#define SLOT_END(h) ((RVALUE*)((char*)(h)->slot + (h)->limit * (h)->size))
 
 #define HEAP_MIN_SLOTS 10000
-static int heap_slots = HEAP_MIN_SLOTS;
+#define HEAP_GROWTH_FACTOR 1.8
+static int heap_min_slots = HEAP_MIN_SLOTS;
+static int heap_slots_increment = 0;
+static double heap_slots_growth_factor = HEAP_GROWTH_FACTOR;
 
 #define FREE_MIN  4096
+#define FREE_RATIO 0.2
+#define FREE_MAX_RATIO 0.65
+static int heap_free_min = FREE_MIN;
+static double heap_free_ratio = FREE_RATIO;
+static double heap_free_max_ratio = FREE_MAX_RATIO;
+static int lazy_sweep = 0;
+
+static int
+gc_param_long(name, val)
+    const char *name;
+    long *val;
+{
+    char *ptr = getenv(name), *end;
+    long v;
+
+    if (!ptr) return Qfalse;
+    v = strtol(ptr, &end, 10);
+    if (end == ptr || *end || v <= 0) return Qfalse;
+    *val = v;
+    return Qtrue;
+}
+
+static int
+gc_param_double(name, val)
+    const char *name;
+    double *val;
+{
+    char *ptr = getenv(name), *end;
+    double v;
+
+    if (!ptr) return Qfalse;
+    v = strtod(ptr, &end);
+    if (end == ptr || *end || !(v > 0.0)) return Qfalse;
+    *val = v;
+    return Qtrue;
+}
+
+/*
+ * Read heap sizing parameters from the environment so that large
+ * applications can start with a heap of their steady-state size
+ * instead of growing into it one garbage collection at a time.
+ */
+static void
+set_gc_parameters()
+{
+    long v;
+    double d;
+
+    if (gc_param_long("RUBY_HEAP_MIN_SLOTS", &v) && v <= INT_MAX) {
+	heap_min_slots = v;
+    }
+    if (gc_param_double("RUBY_HEAP_SLOTS_GROWTH_FACTOR", &d)) {
+	heap_slots_growth_factor = d;
+    }
+    if (gc_param_long("RUBY_HEAP_SLOTS_INCREMENT", &v) && v <= INT_MAX) {
+	heap_slots_increment = v;
+    }
+    else {
+	heap_slots_increment = heap_min_slots * heap_slots_growth_factor;
+	if (heap_slots_increment <= 0) heap_slots_increment = heap_min_slots;
+    }
+    if (gc_param_long("RUBY_GC_MALLOC_LIMIT", &v)) {
+	gc_malloc_limit = v;
+    }
+    if (gc_param_long("RUBY_HEAP_FREE_MIN", &v) && v <= INT_MAX) {
+	heap_free_min = v;
+    }
+    if (gc_param_double("RUBY_HEAP_FREE_RATIO", &d) && d < 1.0) {
+	heap_free_ratio = d;
+    }
+    if (gc_param_double("RUBY_HEAP_FREE_MAX_RATIO", &d) && d < 1.0) {
+	heap_free_max_ratio = d;
+    }
+    if (heap_free_max_ratio < heap_free_ratio) {
+	heap_free_max_ratio = heap_free_ratio;
+    }
+    if (gc_param_long("RUBY_GC_LAZY_SWEEP", &v)) {
+	lazy_sweep = Qtrue;
+    }
+    malloc_limit = gc_malloc_limit;
+}
+
+static void
+init_heap_class(hc, size, slots, min_slots)
+    struct heap_class *hc;
+    int size, slots, min_slots;
+{
+    hc->size = size;
+    hc->freelist = 0;
+    hc->free_pages = 0;
+    hc->free_pages_tail = &hc->free_pages;
+    hc->used = 0;
+    hc->slots = slots;
+    hc->min_slots = min_slots;
+}
 
 static RVALUE *himem, *lomem;
 
+/*
+ * Allocate n pages.  Mapped pages are contiguous and aligned to
+ * HEAP_PAGE_SIZE, so that the page of a slot is found by masking its
+ * address; without mmap() only a single page is allocated.
+ */
+static char *
+heap_pages_alloc(n)
+    int n;
+{
+    char *p;
+#ifdef USE_MMAP_HEAP
+    char *aligned;
+    size_t size = (size_t)(n + 1) * HEAP_PAGE_SIZE, head;
+
+    p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return 0;
+    aligned = (char*)(((VALUE)p + HEAP_PAGE_SIZE - 1) & ~(VALUE)(HEAP_PAGE_SIZE - 1));
+    head = aligned - p;
+    if (head) munmap(p, head);
+    munmap(aligned + (size_t)n * HEAP_PAGE_SIZE, HEAP_PAGE_SIZE - head);
+    return aligned;
+#else
+    RUBY_CRITICAL(p = (char*)malloc(HEAP_PAGE_SIZE));
+    return p;
+#endif
+}
+
 static void
-add_heap()
+heap_page_free(p)
+    void *p;
 {
-    RVALUE *p, *pend;
+#ifdef USE_MMAP_HEAP
+    munmap(p, HEAP_PAGE_SIZE);
+#else
+    RUBY_CRITICAL(free(p));
+#endif
+}
+
+static int
+heap_cmp(a, b)
+    const void *a, *b;
+{
+    RVALUE *x = (*(struct heaps_slot **)a)->slot;
+    RVALUE *y = (*(struct heaps_slot **)b)->slot;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+push_free_page(h)
+    struct heaps_slot *h;
+{
+    struct heap_class *hc = h->heap;
+
+    h->next = 0;
+    *hc->free_pages_tail = h;
+    hc->free_pages_tail = &h->next;
+}
+
+/* move the free slots of the next page in free_pages to freelist */
+static int
+pop_free_page(hc)
+    struct heap_class *hc;
+{
+    struct heaps_slot *h = hc->free_pages;
+
+    if (!h) return Qfalse;
+    if (!(hc->free_pages = h->next)) hc->free_pages_tail = &hc->free_pages;
+    h->next = 0;
+    hc->freelist = h->freelist;
+    h->freelist = 0;
+    return Qtrue;
+}
+
+/*
+ * Add hc->slots slots worth of pages to a size class.  heaps[] is kept
+ * sorted by address, so that the page containing a pointer can be
+ * found by binary search.
+ */
+static void
+add_heap(hc)
+    struct heap_class *hc;
+{
+    int page_slots = HEAP_PAGE_SIZE / hc->size;
+    int n = (hc->slots + page_slots - 1) / page_slots;
+    int i, added = 0;
+    char *pages = 0;
 
-    if (heaps_used == heaps_length) {
+    if (heaps_used + n > heaps_length) {
 	/* Realloc heaps */
-	struct heaps_slot *p;
-	int length;
-
-	heaps_length += HEAPS_INCREMENT;
-	length = heaps_length*sizeof(struct heaps_slot);
-	RUBY_CRITICAL(
-	    if (heaps_used > 0) {
-		p = (struct heaps_slot *)realloc(heaps, length);
-		if (p) heaps = p;
-	    }
-	    else {
-		p = heaps = (struct heaps_slot *)malloc(length);
-	    });
+	struct heaps_slot **p;
+	RVALUE **q;
+	int length = heaps_used + n + HEAPS_INCREMENT;
+
+	RUBY_CRITICAL(p = (struct heaps_slot **)realloc(heaps, length*sizeof(*heaps)));
 	if (p == 0) rb_memerror();
+	heaps = p;
+	RUBY_CRITICAL(q = (RVALUE **)realloc(heaps_start, length*sizeof(*heaps_start)));
+	if (q == 0) rb_memerror();
+	heaps_start = q;
+	heaps_length = length;
     }
 
-    for (;;) {
-	RUBY_CRITICAL(p = (RVALUE*)malloc(sizeof(RVALUE)*(heap_slots+1)));
-	if (p == 0) {
-	    if (heap_slots == HEAP_MIN_SLOTS) {
-		rb_memerror();
-	    }
-	    heap_slots = HEAP_MIN_SLOTS;
-	    continue;
-	}
-        heaps[heaps_used].membase = p;
-        if ((VALUE)p % sizeof(RVALUE) == 0)
-            heap_slots += 1;
-        else
-            p = (RVALUE*)((VALUE)p + sizeof(RVALUE) - ((VALUE)p % sizeof(RVALUE)));
-        heaps[heaps_used].slot = p;
-        heaps[heaps_used].limit = heap_slots;
-	break;
+    last_heap = 0;
+
+#ifdef USE_MMAP_HEAP
+    if (!(pages = heap_pages_alloc(n)) && !(pages = heap_pages_alloc(n = 1))) {
+	rb_memerror();
     }
-    pend = p + heap_slots;
-    if (lomem == 0 || lomem > p) lomem = p;
-    if (himem < pend) himem = pend;
-    heaps_used++;
-    heap_slots *= 1.8;
-    if (heap_slots <= 0) heap_slots = HEAP_MIN_SLOTS;
+#endif
+    for (i = 0; i < n; i++) {
+	struct heaps_slot *h;
+	RVALUE *p, *pend;
+	char *membase;
 
-    while (p < pend) {
-	p->as.free.flags = 0;
-	p->as.free.next = freelist;
-	freelist = p;
-	p++;
+	RUBY_CRITICAL(h = (struct heaps_slot *)malloc(sizeof(struct heaps_slot)));
+	if (h == 0) break;
+	if (pages) {
+	    membase = pages + (size_t)i * HEAP_PAGE_SIZE;
+	}
+	else if ((membase = heap_pages_alloc(1)) == 0) {
+	    RUBY_CRITICAL(free(h));
+	    break;
+	}
+	/* the page starts with a pointer back to its heaps_slot */
+	*(struct heaps_slot **)membase = h;
+	p = (RVALUE*)(membase + sizeof(struct heaps_slot *));
+	if ((VALUE)p % hc->size != 0)
+	    p = (RVALUE*)((VALUE)p + hc->size - ((VALUE)p % hc->size));
+	h->membase = membase;
+	h->slot = p;
+	h->size = hc->size;
+	h->heap = hc;
+	h->limit = (membase + HEAP_PAGE_SIZE - (char*)p) / hc->size;
+	h->unswept = Qfalse;
+	MEMZERO(h->marks, unsigned long, MARK_TABLE_LEN);
+
+	pend = SLOT_END(h);
+	if (lomem == 0 || lomem > p) lomem = p;
+	if (himem < pend) himem = pend;
+	h->freelist = 0;
+	while (p < pend) {
+	    p->as.free.flags = 0;
+	    p->as.free.next = h->freelist;
+	    h->freelist = p;
+	    p = SLOT_NEXT(h, p);
+	}
+	h->free_num = h->limit;
+	push_free_page(h);
+	heaps[heaps_used + added++] = h;
+    }
+#ifdef USE_MMAP_HEAP
+    if (added < n) {
+	munmap(pages + (size_t)added * HEAP_PAGE_SIZE, (size_t)(n - added) * HEAP_PAGE_SIZE);
+    }
+#endif
+    if (added == 0) rb_memerror();
+    heaps_used += added;
+    hc->used += added;
+    qsort(heaps, heaps_used, sizeof(*heaps), heap_cmp);
+    for (i = 0; i < heaps_used; i++) {
+	heaps_start[i] = heaps[i]->slot;
     }
+
+    if (hc->used == added)
+	hc->slots = heap_slots_increment;
+    else if (hc->slots * heap_slots_growth_factor < INT_MAX)
+	hc->slots *= heap_slots_growth_factor;
+    if (hc->slots <= 0) hc->slots = heap_min_slots;
 }
 #define RANY(o) ((RVALUE*)(o))
 
@@ -385,18 +741,41 @@ rb_during_gc()
     return during_gc;
 }
 
-VALUE
-rb_newobj()
+static inline VALUE
+heap_newobj(hc)
+    struct heap_class *hc;
 {
     VALUE obj;
 
     if (during_gc)
 	rb_bug("object allocation during garbage collection phase");
 
-    if (!freelist) garbage_collect();
+    if (alloc_trace_pending) alloc_trace_record();
+    if (!hc->freelist && !pop_free_page(hc)) {
+	if (!hc->used) add_heap(hc);	/* all its pages were released */
+	else if (!gc_lazy_sweep(hc)) garbage_collect();
+	if (!hc->freelist && !pop_free_page(hc)) rb_memerror();
+    }
+
+    obj = (VALUE)hc->freelist;
+    hc->freelist = hc->freelist->as.free.next;
+    total_allocated_objects++;
+    if (alloc_trace_rate && --alloc_trace_countdown <= 0) {
+	/* recorded on the next allocation, once the class is set */
+	alloc_trace_countdown = alloc_trace_interval();
+	alloc_trace_pending = RANY(obj);
+	ruby_set_current_source();
+	alloc_trace_file = ruby_sourcefile;
+	alloc_trace_line = ruby_sourceline;
+    }
+    return obj;
+}
+
+VALUE
+rb_newobj()
+{
+    VALUE obj = heap_newobj(rvalue_heap);
 
-    obj = (VALUE)freelist;
-    freelist = freelist->as.free.next;
     MEMZERO((void*)obj, RVALUE, 1);
 #ifdef GC_DEBUG
     RANY(obj)->file = ruby_sourcefile;
@@ -405,6 +784,20 @@ rb_newobj()
     return obj;
 }
 
+/* a slot for a Float, which fits in an RSMALL */
+VALUE
+rb_newobj_small()
+{
+#ifdef USE_SMALL_HEAP
+    VALUE obj = heap_newobj(small_heap);
+
+    MEMZERO((void*)obj, RSMALL, 1);
+    return obj;
+#else
+    return rb_newobj();
+#endif
+}
+
 VALUE
 rb_data_object_alloc(klass, datap, dmark, dfree)
     VALUE klass;
@@ -424,6 +817,9 @@ rb_data_object_alloc(klass, datap, dmark, dfree)
 
 extern st_table *rb_class_tbl;
 VALUE *rb_gc_stack_start = 0;
+/* STACK_LEVEL_MAX of the stack of the running thread, when that is
+   not the process stack; eval.c sets both as it switches threads */
+unsigned int rb_gc_stack_level_max = 0;
 #ifdef __ia64
 VALUE *rb_gc_register_stack_start = 0;
 #endif
@@ -496,7 +892,8 @@ stack_grow_direction(addr)
 
 #define CHECK_STACK(ret) do {\
     SET_STACK_END;\
-    (ret) = (STACK_LENGTH > STACK_LEVEL_MAX + GC_WATER_MARK);\
+    (ret) = (STACK_LENGTH > (rb_gc_stack_level_max ? rb_gc_stack_level_max : \
+			     STACK_LEVEL_MAX) + GC_WATER_MARK);\
 } while (0)
 
 int
@@ -574,6 +971,143 @@ sweep_source_filename(key, value)
     }
 }
 
+/*
+ * Mark bits normally live in RBasic.flags (FL_MARK).  In copy-on-write
+ * friendly mode they are kept in a bitmap per heaps_slot instead, so
+ * that marking never writes to the memory of live objects, and pages
+ * shared with a forking parent process stay shared.
+ *
+ * Lazy sweeping uses the bitmap too: live objects on heaps that are
+ * not swept yet would otherwise still carry FL_MARK, and code copying
+ * flags from them (clone, dup) would spread it to new objects.
+ *
+ * mark_bitmap is chosen at the start of each collection and holds
+ * until its sweep is finished.
+ */
+static int cow_friendly = 0;
+static int mark_bitmap = 0;
+
+static inline struct heaps_slot *
+find_heap_slot(p)
+    RVALUE *p;
+{
+    register struct heaps_slot *h = last_heap;
+    register int lo, hi, mid;
+
+    if (h && h->slot <= p && p < SLOT_END(h)) return h;
+    lo = 0; hi = heaps_used;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (p < heaps_start[mid]) hi = mid;
+	else lo = mid + 1;
+    }
+    if (lo == 0) return 0;
+    h = heaps[lo - 1];
+    if (p >= SLOT_END(h)) return 0;
+    return last_heap = h;
+}
+
+/* the page of a pointer known to be an object */
+#ifdef USE_MMAP_HEAP
+#define HEAP_PAGE_OF(p) \
+    (*(struct heaps_slot **)((VALUE)(p) & ~(VALUE)(HEAP_PAGE_SIZE - 1)))
+#else
+#define HEAP_PAGE_OF(p) find_heap_slot(p)
+#endif
+
+static inline int
+heap_marked_p(h, p)
+    struct heaps_slot *h;
+    RVALUE *p;
+{
+    long n;
+
+    if (!mark_bitmap) return p->as.basic.flags & FL_MARK;
+    if (p->as.basic.flags == FL_MARK) return Qtrue; /* to be finalized */
+    n = MARK_INDEX(h, p);
+    return (h->marks[n / MARK_BITS] >> (n % MARK_BITS)) & 1;
+}
+
+static inline int
+gc_marked_p(p)
+    RVALUE *p;
+{
+    struct heaps_slot *h;
+
+    if (!mark_bitmap) return p->as.basic.flags & FL_MARK;
+    if (!(h = HEAP_PAGE_OF(p))) return Qtrue;
+    return heap_marked_p(h, p);
+}
+
+/* mark p, returning true if it was already marked */
+static inline int
+gc_test_set_mark(p)
+    RVALUE *p;
+{
+    struct heaps_slot *h;
+    unsigned long *word, bit;
+    long n;
+
+    if (!mark_bitmap) {
+	if (p->as.basic.flags & FL_MARK) return Qtrue;
+	p->as.basic.flags |= FL_MARK;
+    }
+    else {
+	if (p->as.basic.flags == FL_MARK) return Qtrue; /* to be finalized */
+	if (!(h = HEAP_PAGE_OF(p))) return Qtrue;
+	n = MARK_INDEX(h, p);
+	word = &h->marks[n / MARK_BITS];
+	bit = 1UL << (n % MARK_BITS);
+	if (*word & bit) return Qtrue;
+	*word |= bit;
+    }
+    marked_objects++;
+    return Qfalse;
+}
+
+int
+rb_gc_marked_p(obj)
+    VALUE obj;
+{
+    if (rb_special_const_p(obj)) return Qtrue;
+    return gc_marked_p(RANY(obj));
+}
+
+/*
+ *  call-seq:
+ *     GC.copy_on_write_friendly?     => true or false
+ *
+ *  Returns <code>true</code> if the garbage collector keeps its mark
+ *  bits outside of the objects themselves.
+ *
+ */
+
+static VALUE
+gc_cow_friendly_get()
+{
+    return cow_friendly ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     GC.copy_on_write_friendly = bool   => bool
+ *
+ *  When set to <code>true</code>, marking stores mark bits in a
+ *  separate bitmap and never writes to live objects, so that heap
+ *  pages shared with a parent process after <code>fork</code> are not
+ *  copied by the next garbage collection.  Marking is slightly slower
+ *  in this mode.
+ *
+ */
+
+static VALUE
+gc_cow_friendly_set(self, val)
+    VALUE self, val;
+{
+    cow_friendly = RTEST(val);
+    return val;
+}
+
 static void gc_mark _((VALUE ptr, int lev));
 static void gc_mark_children _((VALUE ptr, int lev));
 
@@ -585,13 +1119,13 @@ gc_mark_all()
 
     init_mark_stack();
     for (i = 0; i < heaps_used; i++) {
-	p = heaps[i].slot; pend = p + heaps[i].limit;
+	p = heaps[i]->slot; pend = SLOT_END(heaps[i]);
 	while (p < pend) {
-	    if ((p->as.basic.flags & FL_MARK) &&
+	    if (heap_marked_p(heaps[i], p) &&
 		(p->as.basic.flags != FL_MARK)) {
 		gc_mark_children((VALUE)p, 0);
 	    }
-	    p++;
+	    p = SLOT_NEXT(heaps[i], p);
 	}
     }
 }
@@ -617,19 +1151,14 @@ is_pointer_to_heap(ptr)
     void *ptr;
 {
     register RVALUE *p = RANY(ptr);
-    register RVALUE *heap_org;
-    register long i;
+    struct heaps_slot *h;
 
     if (p < lomem || p > himem) return Qfalse;
-    if ((VALUE)p % sizeof(RVALUE) != 0) return Qfalse;
+    if ((VALUE)p % sizeof(VALUE) != 0) return Qfalse;
 
-    /* check if p looks like a pointer */
-    for (i=0; i < heaps_used; i++) {
-	heap_org = heaps[i].slot;
-	if (heap_org <= p && p < heap_org + heaps[i].limit)
-	    return Qtrue;
-    }
-    return Qfalse;
+    /* check if p looks like a pointer; slots are aligned to their size */
+    h = find_heap_slot(p);
+    return h && (VALUE)p % h->size == 0;
 }
 
 static void
@@ -731,8 +1260,11 @@ gc_mark(ptr, lev)
     obj = RANY(ptr);
     if (rb_special_const_p(ptr)) return; /* special const not marked */
     if (obj->as.basic.flags == 0) return;       /* free cell */
-    if (obj->as.basic.flags & FL_MARK) return;  /* already marked */
-    obj->as.basic.flags |= FL_MARK;
+    if (heap_dump_file) {
+	heap_dump_ref(ptr);
+	return;
+    }
+    if (gc_test_set_mark(obj)) return;          /* already marked */
 
     if (lev > GC_LEVEL_MAX || (lev == 0 && ruby_stack_check())) {
 	if (!mark_stack_overflow) {
@@ -769,8 +1301,11 @@ gc_mark_children(ptr, lev)
     obj = RANY(ptr);
     if (rb_special_const_p(ptr)) return; /* special const not marked */
     if (obj->as.basic.flags == 0) return;       /* free cell */
-    if (obj->as.basic.flags & FL_MARK) return;  /* already marked */
-    obj->as.basic.flags |= FL_MARK;
+    if (heap_dump_file) {
+	heap_dump_ref(ptr);
+	return;
+    }
+    if (gc_test_set_mark(obj)) return;          /* already marked */
 
   marking:
     if (FL_TEST(obj, FL_EXIVAR)) {
@@ -805,18 +1340,46 @@ gc_mark_children(ptr, lev)
 	  case NODE_DREGX_ONCE:
 	  case NODE_FBODY:
 	  case NODE_ENSURE:
-	  case NODE_CALL:
 	  case NODE_DEFS:
 	  case NODE_OP_ASGN1:
 	    gc_mark((VALUE)obj->as.node.u1.node, lev);
 	    /* fall through */
 	  case NODE_SUPER:	/* 3 */
-	  case NODE_FCALL:
 	  case NODE_DEFN:
 	  case NODE_NEWLINE:
 	    ptr = (VALUE)obj->as.node.u3.node;
 	    goto again;
 
+	  case NODE_CONST:	/* const cache,1 */
+	  case NODE_COLON2:
+	  case NODE_COLON3:
+	    if (obj->as.node.nd_ccache) {
+		gc_mark(obj->as.node.nd_ccache->key, lev);
+		gc_mark(obj->as.node.nd_ccache->value, lev);
+	    }
+	    if (nd_type(obj) != NODE_COLON2) break;
+	    ptr = (VALUE)obj->as.node.u1.node;
+	    goto again;
+
+	  case NODE_IVAR:	/* ivar cache */
+	  case NODE_IASGN:	/* ivar cache,2 */
+	  case NODE_ATTRSET:
+	    if (obj->as.node.nd_icache) {
+		gc_mark(obj->as.node.nd_icache->index, lev);
+	    }
+	    if (nd_type(obj) != NODE_IASGN) break;
+	    ptr = (VALUE)obj->as.node.u2.node;
+	    goto again;
+
+	  case NODE_CALL:	/* cache,3 */
+	  case NODE_FCALL:
+	  case NODE_ATTRASGN:
+	    if (obj->as.node.nd_cache) {
+		gc_mark((VALUE)obj->as.node.nd_cache->recv, lev);
+	    }
+	    ptr = (VALUE)obj->as.node.u3.node;
+	    goto again;
+
 	  case NODE_WHILE:	/* 1,2 */
 	  case NODE_UNTIL:
 	  case NODE_AND:
@@ -843,10 +1406,8 @@ gc_mark_children(ptr, lev)
 	  case NODE_LASGN:
 	  case NODE_DASGN:
 	  case NODE_DASGN_CURR:
-	  case NODE_IASGN:
 	  case NODE_CVDECL:
 	  case NODE_CVASGN:
-	  case NODE_COLON3:
 	  case NODE_OPT_N:
 	  case NODE_EVSTR:
 	  case NODE_UNDEF:
@@ -863,7 +1424,6 @@ gc_mark_children(ptr, lev)
 	  case NODE_BREAK:
 	  case NODE_NEXT:
 	  case NODE_YIELD:
-	  case NODE_COLON2:
 	  case NODE_SPLAT:
 	  case NODE_TO_ARY:
 	  case NODE_SVALUE:
@@ -884,7 +1444,6 @@ gc_mark_children(ptr, lev)
 	  case NODE_GVAR:
 	  case NODE_LVAR:
 	  case NODE_DVAR:
-	  case NODE_IVAR:
 	  case NODE_CVAR:
 	  case NODE_NTH_REF:
 	  case NODE_BACK_REF:
@@ -894,9 +1453,9 @@ gc_mark_children(ptr, lev)
 	  case NODE_NIL:
 	  case NODE_TRUE:
 	  case NODE_FALSE:
-	  case NODE_ATTRSET:
 	  case NODE_BLOCK_ARG:
 	  case NODE_POSTEXE:
+	  case NODE_IVINDEX:
 	    break;
 	  case NODE_ALLOCA:
 	    mark_locations_array((VALUE*)obj->as.node.u1.value,
@@ -961,7 +1520,15 @@ gc_mark_children(ptr, lev)
 	break;
 
       case T_OBJECT:
-	mark_tbl(obj->as.object.iv_tbl, lev);
+	gc_mark(obj->as.object.iv_index, lev);
+	{
+	    long i, len = obj->as.object.iv_len;
+	    VALUE *ptr = obj->as.object.iv_ptr;
+
+	    for (i=0; i < len; i++) {
+		gc_mark(*ptr++, lev);
+	    }
+	}
 	break;
 
       case T_FILE:
@@ -1022,9 +1589,11 @@ finalize_list(p)
 	RVALUE *tmp = p->as.free.next;
 	run_final((VALUE)p);
 	if (!FL_TEST(p, FL_SINGLETON)) { /* not freeing page */
+	    struct heap_class *hc = HEAP_PAGE_OF(p)->heap;
+
 	    p->as.free.flags = 0;
-	    p->as.free.next = freelist;
-	    freelist = p;
+	    p->as.free.next = hc->freelist;
+	    hc->freelist = p;
 	}
 	p = tmp;
     }
@@ -1035,47 +1604,124 @@ free_unused_heaps()
 {
     int i, j;
 
-    for (i = j = 1; j < heaps_used; i++) {
-	if (heaps[i].limit == 0) {
-	    free(heaps[i].membase);
-	    heaps_used--;
+    last_heap = 0;
+    for (i = j = 0; i < heaps_used; i++) {
+	if (heaps[i]->limit == 0) {
+	    heap_page_free(heaps[i]->membase);
+	    RUBY_CRITICAL(free(heaps[i]));
 	}
 	else {
-	    if (i != j) {
-		heaps[j] = heaps[i];
-	    }
-	    j++;
+	    heaps_start[j] = heaps_start[i];
+	    heaps[j++] = heaps[i];
 	}
     }
+    heaps_used = j;
 }
 
 void rb_gc_abort_threads(void);
 
-static void
-gc_sweep()
+/*
+ * Sweeping.  Normally every page is swept right after marking.  In
+ * lazy sweep mode garbage_collect() sweeps only until it finds free
+ * slots, and rb_newobj() sweeps the rest a page at a time as it runs
+ * out of slots, spreading the cost of the sweep over the allocations
+ * that follow a collection.
+ *
+ * Objects are never moved, so to let pages drain and be released
+ * rb_newobj() takes its slots from the fullest pages first: the pages
+ * with free slots are queued in free_pages by decreasing occupancy.
+ * A page found empty is unmapped once more than heap_free_max_ratio
+ * of the slots of its size class have been found free, as long as
+ * min_slots are left.
+ */
+static int heaps_unswept = 0;
+static struct heaps_slot *sweep_pages = 0;
+static unsigned long sweep_freed;	/* in all size classes */
+static unsigned long sweep_live;
+static int release_all_pages = 0;
+
+#define OCCUPANCY_BUCKETS 8
+
+/*
+ * Link the pages of size class hc, or of all classes if hc is null,
+ * into *list by decreasing occupancy, estimated from free_num, and
+ * return the address of the last link.  Pages with no free slots are
+ * left out unless all is true.  Within a bucket pages stay in address
+ * order, so that the order changes little from one collection to the
+ * next.
+ */
+static struct heaps_slot **
+link_fullest_first(hc, all, list)
+    struct heap_class *hc;
+    int all;
+    struct heaps_slot **list;
 {
-    RVALUE *p, *pend, *final_list;
-    int freed = 0;
-    int i;
-    unsigned long live = 0;
-    unsigned long free_min = 0;
+    struct heaps_slot *head[OCCUPANCY_BUCKETS], **tail[OCCUPANCY_BUCKETS];
+    struct heaps_slot **last = list;
+    int i, b;
 
+    for (b = 0; b < OCCUPANCY_BUCKETS; b++) {
+	head[b] = 0;
+	tail[b] = &head[b];
+    }
     for (i = 0; i < heaps_used; i++) {
-        free_min += heaps[i].limit;
+	struct heaps_slot *h = heaps[i];
+
+	if (h->limit == 0 || (!all && h->free_num == 0)) continue;
+	if (hc && h->heap != hc) continue;
+	b = (long)h->free_num * OCCUPANCY_BUCKETS / (h->limit + 1);
+	*tail[b] = h;
+	tail[b] = &h->next;
+    }
+    for (b = 0; b < OCCUPANCY_BUCKETS; b++) {
+	if (!head[b]) continue;
+	*last = head[b];
+	last = tail[b];
     }
-    free_min = free_min * 0.2;
-    if (free_min < FREE_MIN)
-        free_min = FREE_MIN;
+    *last = 0;
+    return last;
+}
 
-    if (ruby_in_compile && ruby_parser_stack_on_heap()) {
+static void
+gc_sweep_start()
+{
+    RVALUE *p, *pend;
+    struct heap_class *hc;
+    int i;
+    unsigned long free_min;
+
+    for (hc = heap_classes; hc < heap_classes_end; hc++) {
+	hc->sweep_slots = 0;
+    }
+    for (i = 0; i < heaps_used; i++) {
+	heaps[i]->heap->sweep_slots += heaps[i]->limit;
+	heaps[i]->freelist = 0;
+	heaps[i]->next = 0;
+    }
+    for (hc = heap_classes; hc < heap_classes_end; hc++) {
+	hc->sweep_free_max = hc->sweep_slots * heap_free_max_ratio;
+	free_min = hc->sweep_slots * heap_free_ratio;
+	if (free_min < heap_free_min)
+	    free_min = heap_free_min;
+	hc->sweep_free_min = free_min;
+	if (hc->sweep_free_max < free_min)
+	    hc->sweep_free_max = free_min;
+	hc->sweep_freed = 0;
+	hc->freelist = 0;
+	hc->free_pages = 0;
+	hc->free_pages_tail = &hc->free_pages;
+    }
+    sweep_freed = sweep_live = 0;
+
+    if (ruby_in_compile && ruby_parser_stack_on_heap()) {
 	/* should not reclaim nodes during compilation
            if yacc's semantic stack is not allocated on machine stack */
 	for (i = 0; i < heaps_used; i++) {
-	    p = heaps[i].slot; pend = p + heaps[i].limit;
+	    p = heaps[i]->slot; pend = SLOT_END(heaps[i]);
 	    while (p < pend) {
-		if (!(p->as.basic.flags&FL_MARK) && BUILTIN_TYPE(p) == T_NODE)
+		if (!heap_marked_p(heaps[i], p) && BUILTIN_TYPE(p) == T_NODE)
 		    gc_mark((VALUE)p, 0);
-		p++;
+		p = SLOT_NEXT(heaps[i], p);
 	    }
 	}
     }
@@ -1084,81 +1730,259 @@ gc_sweep()
     if (source_filenames) {
         st_foreach(source_filenames, sweep_source_filename, 0);
     }
+}
 
-    freelist = 0;
-    final_list = deferred_final_list;
-    deferred_final_list = 0;
-    for (i = 0; i < heaps_used; i++) {
-	int n = 0;
-	RVALUE *free = freelist;
-	RVALUE *final = final_list;
+/*
+ * Sweep a page, collecting its free slots in h->freelist.  Returns
+ * false if the page was found empty and is to be released.
+ */
+static int
+sweep_heap(h)
+    struct heaps_slot *h;
+{
+    struct heap_class *hc = h->heap;
+    RVALUE *p, *pend;
+    RVALUE *final = deferred_final_list;
+    RVALUE *free = 0;
+    int n = 0, nfree = 0;
 
-	p = heaps[i].slot; pend = p + heaps[i].limit;
-	while (p < pend) {
-	    if (!(p->as.basic.flags & FL_MARK)) {
-		if (p->as.basic.flags) {
-		    obj_free((VALUE)p);
-		}
-		if (need_call_final && FL_TEST(p, FL_FINALIZE)) {
-		    p->as.free.flags = FL_MARK; /* remain marked */
-		    p->as.free.next = final_list;
-		    final_list = p;
-		}
-		else {
-		    p->as.free.flags = 0;
-		    p->as.free.next = freelist;
-		    freelist = p;
-		}
-		n++;
+    p = h->slot; pend = SLOT_END(h);
+    while (p < pend) {
+	if (!heap_marked_p(h, p)) {
+	    if (p->as.basic.flags) {
+		obj_free((VALUE)p);
+		total_freed_objects++;
 	    }
-	    else if (RBASIC(p)->flags == FL_MARK) {
-		/* objects to be finalized */
-		/* do nothing remain marked */
+	    if (need_call_final && FL_TEST(p, FL_FINALIZE)) {
+		p->as.free.flags = FL_MARK; /* remain marked */
+		p->as.free.next = deferred_final_list;
+		deferred_final_list = p;
 	    }
 	    else {
-		RBASIC(p)->flags &= ~FL_MARK;
-		live++;
+		/* the freelist of a page is rebuilt in the same order
+		   every time; leave unchanged free cells untouched */
+		if (p->as.free.flags) p->as.free.flags = 0;
+		if (p->as.free.next != free) p->as.free.next = free;
+		free = p;
+		nfree++;
 	    }
-	    p++;
+	    n++;
 	}
-	if (n == heaps[i].limit && freed > free_min) {
-	    RVALUE *pp;
-
-	    heaps[i].limit = 0;
-	    for (pp = final_list; pp != final; pp = pp->as.free.next) {
-		pp->as.free.flags |= FL_SINGLETON; /* freeing page mark */
-	    }
-	    freelist = free;	/* cancel this page from freelist */
+	else if (RBASIC(p)->flags == FL_MARK) {
+	    /* objects to be finalized */
+	    /* do nothing remain marked */
 	}
 	else {
-	    freed += n;
+	    if (!mark_bitmap) RBASIC(p)->flags &= ~FL_MARK;
+	    sweep_live++;
 	}
+	p = SLOT_NEXT(h, p);
+    }
+    if (mark_bitmap) {
+	MEMZERO(h->marks, unsigned long, MARK_TABLE_LEN);
     }
+    if (n == h->limit && hc->sweep_slots - n >= hc->min_slots &&
+	(release_all_pages || hc->sweep_freed > hc->sweep_free_max)) {
+	RVALUE *pp;
+
+	hc->sweep_slots -= n;
+	hc->used--;
+	if (alloc_trace_pending && h->slot <= alloc_trace_pending &&
+	    alloc_trace_pending < pend) {
+	    alloc_trace_pending = 0;
+	}
+	h->limit = 0;
+	h->free_num = 0;
+	h->freelist = 0;
+	for (pp = deferred_final_list; pp != final; pp = pp->as.free.next) {
+	    pp->as.free.flags |= FL_SINGLETON; /* freeing page mark */
+	}
+	return Qfalse;
+    }
+    h->freelist = free;
+    h->free_num = nfree;
+    hc->sweep_freed += nfree;
+    sweep_freed += nfree;
+    return Qtrue;
+}
+
+static void
+gc_sweep_end(live, freed)
+    unsigned long live, freed;
+{
+    struct heap_class *hc;
+
     if (malloc_increase > malloc_limit) {
 	malloc_limit += (malloc_increase - malloc_limit) * (double)live / (live + freed);
-	if (malloc_limit < GC_MALLOC_LIMIT) malloc_limit = GC_MALLOC_LIMIT;
+	if (malloc_limit < gc_malloc_limit) malloc_limit = gc_malloc_limit;
     }
     malloc_increase = 0;
-    if (freed < free_min) {
-	add_heap();
+    live_after_gc = live;
+    free_after_gc = freed;
+    if (release_all_pages) return;
+    for (hc = heap_classes; hc < heap_classes_end; hc++) {
+	if (hc->free_slots < hc->sweep_free_min) add_heap(hc);
     }
-    during_gc = 0;
+}
 
-    /* clear finalization list */
-    if (final_list) {
-	deferred_final_list = final_list;
-	return;
+static void
+gc_sweep()
+{
+    struct heap_class *hc;
+    int i;
+
+    gc_sweep_start();
+    for (i = 0; i < heaps_used; i++) {
+	sweep_heap(heaps[i]);
+    }
+    for (hc = heap_classes; hc < heap_classes_end; hc++) {
+	hc->free_pages_tail = link_fullest_first(hc, Qfalse, &hc->free_pages);
+	hc->free_slots = hc->sweep_freed;
     }
+    gc_sweep_end(sweep_live, sweep_freed);
+
+    /* clear finalization list */
+    if (deferred_final_list) return;
     free_unused_heaps();
 }
 
+static int
+count_bits(x)
+    unsigned long x;
+{
+    int n = 0;
+
+    for (; x; x &= x - 1) n++;
+    return n;
+}
+
+static void
+gc_lazy_sweep_start()
+{
+    struct heap_class *hc;
+    unsigned long slots = 0;
+    int i, j;
+
+    gc_sweep_start();
+    heaps_unswept = 0;
+    for (hc = heap_classes; hc < heap_classes_end; hc++) {
+	hc->free_slots = 0;
+    }
+    for (i = 0; i < heaps_used; i++) {
+	struct heaps_slot *h = heaps[i];
+	int marked = 0;
+
+	if (h->limit == 0) continue;
+	for (j = 0; j < MARK_TABLE_LEN; j++) {
+	    marked += count_bits(h->marks[j]);
+	}
+	h->free_num = h->limit - marked;
+	h->heap->free_slots += h->free_num;
+	h->unswept = Qtrue;
+	heaps_unswept++;
+	slots += h->limit;
+    }
+    link_fullest_first(0, Qtrue, &sweep_pages);
+    /* estimate the result of the sweep from the marked objects */
+    gc_sweep_end(marked_objects, slots - marked_objects);
+}
+
+/*
+ * Sweep the pages left unswept by the last collection, the fullest
+ * first, until free slots of size class hc are found, or all of them
+ * if hc is null.
+ */
+static int
+gc_lazy_sweep(hc)
+    struct heap_class *hc;
+{
+    struct heaps_slot *h;
+    double start;
+
+    if (!heaps_unswept) return hc && hc->free_pages != 0;
+    start = gc_usec();
+    during_gc++;
+    while ((h = sweep_pages) != 0) {
+	sweep_pages = h->next;
+	h->unswept = Qfalse;
+	heaps_unswept--;
+	if (sweep_heap(h) && h->freelist) push_free_page(h);
+	if (hc && hc->free_pages) break;
+    }
+    during_gc--;
+    if (!heaps_unswept) {
+	live_after_gc = sweep_live;
+	free_after_gc = sweep_freed;
+	if (!deferred_final_list) free_unused_heaps();
+    }
+    gc_sweep_time += gc_usec() - start;
+    return hc && hc->free_pages != 0;
+}
+
+/* true if p is garbage that has not been swept yet */
+static inline int
+unswept_garbage_p(p)
+    RVALUE *p;
+{
+    struct heaps_slot *h;
+
+    if (!heaps_unswept) return Qfalse;
+    h = find_heap_slot(p);
+    return h && h->unswept && !heap_marked_p(h, p);
+}
+
 void
 rb_gc_force_recycle(p)
     VALUE p;
 {
+    struct heaps_slot *h;
+    struct heap_class *hc;
+
+    if (heaps_unswept && (h = find_heap_slot(RANY(p))) && h->unswept) {
+	/* leave it to the sweep; the slot is freed when its page is swept */
+	long n = MARK_INDEX(h, p);
+
+	h->marks[n / MARK_BITS] &= ~(1UL << (n % MARK_BITS));
+	RANY(p)->as.free.flags = 0;
+	return;
+    }
+    hc = HEAP_PAGE_OF(RANY(p))->heap;
     RANY(p)->as.free.flags = 0;
-    RANY(p)->as.free.next = freelist;
-    freelist = RANY(p);
+    RANY(p)->as.free.next = hc->freelist;
+    hc->freelist = RANY(p);
+}
+
+/*
+ *  call-seq:
+ *     GC.lazy_sweep?     => true or false
+ *
+ *  Returns <code>true</code> if lazy sweeping is enabled.
+ *
+ */
+
+static VALUE
+gc_lazy_sweep_get()
+{
+    return lazy_sweep ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     GC.lazy_sweep = bool   => bool
+ *
+ *  When set to <code>true</code>, a garbage collection sweeps the heap
+ *  only until it finds free slots, and object allocation sweeps the
+ *  rest of the heap a page at a time.  This shortens the pause of each
+ *  collection.  <code>GC.start</code> always sweeps the whole heap.
+ *
+ */
+
+static VALUE
+gc_lazy_sweep_set(self, val)
+    VALUE self, val;
+{
+    lazy_sweep = RTEST(val);
+    return val;
 }
 
 static void
@@ -1180,25 +2004,24 @@ obj_free(obj)
 
     switch (RANY(obj)->as.basic.flags & T_MASK) {
       case T_OBJECT:
-	if (RANY(obj)->as.object.iv_tbl) {
-	    st_free_table(RANY(obj)->as.object.iv_tbl);
+	if (RANY(obj)->as.object.iv_ptr) {
+	    RUBY_CRITICAL(free(RANY(obj)->as.object.iv_ptr));
 	}
 	break;
       case T_MODULE:
       case T_CLASS:
-	rb_clear_cache_by_class((VALUE)obj);
 	st_free_table(RANY(obj)->as.klass.m_tbl);
-	if (RANY(obj)->as.object.iv_tbl) {
-	    st_free_table(RANY(obj)->as.object.iv_tbl);
+	if (RANY(obj)->as.klass.iv_tbl) {
+	    st_free_table(RANY(obj)->as.klass.iv_tbl);
 	}
 	break;
       case T_STRING:
-	if (RANY(obj)->as.string.ptr && !FL_TEST(obj, ELTS_SHARED)) {
+	if (RANY(obj)->as.string.ptr && !FL_TEST(obj, ELTS_SHARED|ELTS_EMBED)) {
 	    RUBY_CRITICAL(free(RANY(obj)->as.string.ptr));
 	}
 	break;
       case T_ARRAY:
-	if (RANY(obj)->as.array.ptr && !FL_TEST(obj, ELTS_SHARED)) {
+	if (RANY(obj)->as.array.ptr && !FL_TEST(obj, ELTS_SHARED|ELTS_EMBED)) {
 	    RUBY_CRITICAL(free(RANY(obj)->as.array.ptr));
 	}
 	break;
@@ -1257,10 +2080,41 @@ obj_free(obj)
 	    if (RANY(obj)->as.node.u1.tbl) {
 		RUBY_CRITICAL(free(RANY(obj)->as.node.u1.tbl));
 	    }
+	    rb_tcode_free((NODE*)obj);
 	    break;
 	  case NODE_ALLOCA:
 	    RUBY_CRITICAL(free(RANY(obj)->as.node.u1.node));
 	    break;
+	  case NODE_CALL:
+	  case NODE_FCALL:
+	  case NODE_VCALL:
+	  case NODE_ATTRASGN:
+	    if (RANY(obj)->as.node.nd_cache) {
+		RUBY_CRITICAL(free(RANY(obj)->as.node.nd_cache));
+	    }
+	    break;
+	  case NODE_CONST:
+	  case NODE_COLON2:
+	  case NODE_COLON3:
+	    if (RANY(obj)->as.node.nd_ccache) {
+		RUBY_CRITICAL(free(RANY(obj)->as.node.nd_ccache));
+	    }
+	    break;
+	  case NODE_IVAR:
+	  case NODE_IASGN:
+	  case NODE_ATTRSET:
+	    if (RANY(obj)->as.node.nd_icache) {
+		RUBY_CRITICAL(free(RANY(obj)->as.node.nd_icache));
+	    }
+	    break;
+	  case NODE_IVINDEX:
+	    if (RANY(obj)->as.node.nd_ivids) {
+		RUBY_CRITICAL(free(RANY(obj)->as.node.nd_ivids));
+	    }
+	    if (RANY(obj)->as.node.nd_ivslots) {
+		st_free_table(RANY(obj)->as.node.nd_ivslots);
+	    }
+	    break;
 	}
 	return;			/* no need to free iv_tbl */
 
@@ -1338,6 +2192,8 @@ garbage_collect()
     struct gc_list *list;
     struct FRAME * volatile frame; /* gcc 2.7.2.3 -O2 bug??  */
     jmp_buf save_regs_gc_mark;
+    double start, mark_end;
+    struct heap_class *hc;
     SET_STACK_END;
 
 #ifdef HAVE_NATIVETHREAD
@@ -1346,15 +2202,20 @@ garbage_collect()
     }
 #endif
     if (dont_gc || during_gc) {
-	if (!freelist) {
-	    add_heap();
+	for (hc = heap_classes; hc < heap_classes_end; hc++) {
+	    if (!hc->freelist && !hc->free_pages) add_heap(hc);
 	}
 	return;
     }
     if (during_gc) return;
+    gc_lazy_sweep(0);
+    mark_bitmap = cow_friendly || lazy_sweep;
     during_gc++;
+    gc_count++;
+    start = gc_usec();
 
     init_mark_stack();
+    marked_objects = 0;
 
     gc_mark((VALUE)ruby_current_node, 0);
 
@@ -1414,6 +2275,7 @@ garbage_collect()
     rb_mark_generic_ivar_tbl();
 
     rb_gc_mark_parser();
+    alloc_trace_mark();
 
     /* gc_mark objects whose marking are not completed*/
     do {
@@ -1428,13 +2290,28 @@ garbage_collect()
 	rb_gc_abort_threads();
     } while (!MARK_STACK_EMPTY);
 
-    gc_sweep();
+    mark_end = gc_usec();
+    gc_mark_time += mark_end - start;
+    if (lazy_sweep) {
+	gc_lazy_sweep_start();
+	gc_sweep_time += gc_usec() - mark_end;
+	during_gc = 0;
+	for (hc = heap_classes; hc < heap_classes_end; hc++) {
+	    if (!gc_lazy_sweep(hc)) add_heap(hc);
+	}
+    }
+    else {
+	gc_sweep();
+	gc_sweep_time += gc_usec() - mark_end;
+	during_gc = 0;
+    }
 }
 
 void
 rb_gc()
 {
     garbage_collect();
+    gc_lazy_sweep(0);
     rb_gc_finalize_deferred();
 }
 
@@ -1455,6 +2332,551 @@ rb_gc_start()
     return Qnil;
 }
 
+/*
+ *  call-seq:
+ *     GC.count    => integer
+ *
+ *  Returns the number of garbage collections run so far.
+ *
+ */
+
+static VALUE
+gc_count_get()
+{
+    return ULONG2NUM(gc_count);
+}
+
+/*
+ *  call-seq:
+ *     GC.time    => integer
+ *
+ *  Returns the total time spent in garbage collection so far, in
+ *  microseconds.
+ *
+ *     t = GC.time
+ *     handle_request
+ *     gc_usec = GC.time - t
+ *
+ */
+
+static VALUE
+gc_time_get()
+{
+    return rb_dbl2big(gc_mark_time + gc_sweep_time);
+}
+
+#define SET_STAT(hash, name, val) \
+    rb_hash_aset(hash, ID2SYM(rb_intern(name)), val)
+
+/*
+ *  call-seq:
+ *     GC.stat    => hash
+ *
+ *  Returns a hash of garbage collector statistics.  Times are in
+ *  microseconds; <code>:heap_live_num</code> and
+ *  <code>:heap_free_num</code> are counted by the last sweep.
+ *  <code>:heap_used</code> counts heap pages, of which
+ *  <code>:heap_small_used</code> hold the smaller slots of Floats,
+ *  where there are such.
+ *
+ *     GC.stat   #=> {:count=>3, :time=>5231, :mark_time=>4102,
+ *               #    :sweep_time=>1129, :heap_used=>2, :heap_length=>28001,
+ *               #    :heap_live_num=>17212, :heap_free_num=>10789, ...}
+ *
+ */
+
+static VALUE
+gc_stat()
+{
+    VALUE hash = rb_hash_new();
+    unsigned long slots = 0;
+    int i;
+
+    for (i = 0; i < heaps_used; i++) {
+	slots += heaps[i]->limit;
+    }
+    SET_STAT(hash, "count", ULONG2NUM(gc_count));
+    SET_STAT(hash, "time", rb_dbl2big(gc_mark_time + gc_sweep_time));
+    SET_STAT(hash, "mark_time", rb_dbl2big(gc_mark_time));
+    SET_STAT(hash, "sweep_time", rb_dbl2big(gc_sweep_time));
+    SET_STAT(hash, "heap_used", INT2NUM(heaps_used));
+#ifdef USE_SMALL_HEAP
+    SET_STAT(hash, "heap_small_used", INT2NUM(small_heap->used));
+#endif
+    SET_STAT(hash, "heap_length", ULONG2NUM(slots));
+    SET_STAT(hash, "heap_live_num", ULONG2NUM(live_after_gc));
+    SET_STAT(hash, "heap_free_num", ULONG2NUM(free_after_gc));
+    SET_STAT(hash, "total_allocated_object", ULONG2NUM(total_allocated_objects));
+    SET_STAT(hash, "total_freed_object", ULONG2NUM(total_freed_objects));
+    SET_STAT(hash, "total_allocated_size", rb_dbl2big(total_allocated_size));
+    SET_STAT(hash, "malloc_increase", ULONG2NUM(malloc_increase));
+    SET_STAT(hash, "malloc_limit", ULONG2NUM(malloc_limit));
+    return hash;
+}
+
+/*
+ *  call-seq:
+ *     GC.clear_stats    => nil
+ *
+ *  Resets the collection count, the times and the allocation totals
+ *  reported by <code>GC.stat</code> to zero.
+ *
+ */
+
+static VALUE
+gc_clear_stats()
+{
+    gc_count = 0;
+    gc_mark_time = gc_sweep_time = 0;
+    total_allocated_objects = total_freed_objects = 0;
+    total_allocated_size = 0;
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     GC.fragmentation    => hash
+ *
+ *  Returns a hash describing how the live objects are spread over the
+ *  heap pages.  <code>:occupancy</code> counts the empty pages, then the
+ *  pages up to 10%, 20%, ... 100% full.  Empty pages can be given back
+ *  to the OS with <code>GC.trim</code>.  <code>:fragmentation</code> is
+ *  the fraction of slots unused in the pages that are not empty.
+ *
+ *     GC.fragmentation   #=> {:pages=>70, :page_slots=>409, :live=>17212,
+ *                        #    :free=>11419, :empty_pages=>3, :full_pages=>12,
+ *                        #    :fragmentation=>0.35, :occupancy=>[3, 1, ...]}
+ *
+ */
+
+static VALUE
+gc_fragmentation()
+{
+    VALUE hash = rb_hash_new(), occupancy;
+    unsigned long live = 0, free = 0, used_slots = 0;
+    long counts[11];
+    int i, empty = 0, full = 0, page_slots = 0;
+
+    gc_lazy_sweep(0);
+    MEMZERO(counts, long, 11);
+    for (i = 0; i < heaps_used; i++) {
+	struct heaps_slot *h = heaps[i];
+	RVALUE *p = h->slot, *pend = SLOT_END(h);
+	int n = 0;
+
+	if (h->limit == 0) continue;
+	if (page_slots < h->limit) page_slots = h->limit;
+	for (; p < pend; p = SLOT_NEXT(h, p)) {
+	    if (p->as.basic.flags) n++;
+	}
+	live += n;
+	free += h->limit - n;
+	if (n == 0) {
+	    empty++;
+	    counts[0]++;
+	}
+	else {
+	    used_slots += h->limit;
+	    counts[1 + (long)(n - 1) * 10 / h->limit]++;
+	}
+	if (n == h->limit) full++;
+    }
+    occupancy = rb_ary_new2(11);
+    for (i = 0; i < 11; i++) {
+	rb_ary_push(occupancy, LONG2NUM(counts[i]));
+    }
+    SET_STAT(hash, "pages", INT2NUM(heaps_used));
+    SET_STAT(hash, "page_slots", INT2NUM(page_slots));
+    SET_STAT(hash, "live", ULONG2NUM(live));
+    SET_STAT(hash, "free", ULONG2NUM(free));
+    SET_STAT(hash, "empty_pages", INT2NUM(empty));
+    SET_STAT(hash, "full_pages", INT2NUM(full));
+    SET_STAT(hash, "fragmentation",
+	     rb_float_new(used_slots ? 1.0 - (double)live / used_slots : 0.0));
+    SET_STAT(hash, "occupancy", occupancy);
+    return hash;
+}
+
+/*
+ *  call-seq:
+ *     GC.trim    => integer
+ *
+ *  Starts a garbage collection that gives every heap page left empty
+ *  back to the OS, regardless of <code>RUBY_HEAP_FREE_MAX_RATIO</code>,
+ *  down to <code>RUBY_HEAP_MIN_SLOTS</code>.  Meant for processes that have
+ *  gone idle after a peak.  Returns the number of pages released.
+ *
+ */
+
+static VALUE
+gc_trim()
+{
+    int used = heaps_used;
+
+    release_all_pages = Qtrue;
+    garbage_collect();
+    gc_lazy_sweep(0);
+    release_all_pages = Qfalse;
+    rb_gc_finalize_deferred();
+    if (!deferred_final_list && !heaps_unswept) free_unused_heaps();
+    return INT2NUM(used - heaps_used);
+}
+
+/*
+ * Allocation tracing.  Every alloc_trace_rate-th object allocated is
+ * recorded with the source position of the allocation, its class and
+ * its size.  The class is not set yet when rb_newobj() returns, so the
+ * sample is recorded at the next allocation.  Samples are aggregated
+ * in alloc_sites by file, line and class.
+ */
+struct alloc_site {
+    char *file;
+    int line;
+    int type;
+    VALUE klass;
+    unsigned long count;
+    double bytes;
+};
+
+static st_table *alloc_sites = 0;
+
+static int
+alloc_site_cmp(a, b)
+    struct alloc_site *a, *b;
+{
+    return a->file != b->file || a->line != b->line ||
+	a->type != b->type || a->klass != b->klass;
+}
+
+static int
+alloc_site_hash(a)
+    struct alloc_site *a;
+{
+    return (int)(((VALUE)a->file >> 3) ^ (a->line << 7) ^
+		 (a->klass >> 3) ^ a->type);
+}
+
+static struct st_hash_type alloc_site_type = {
+    alloc_site_cmp,
+    alloc_site_hash,
+};
+
+/* approximate memory used by obj, including what it points to */
+static long
+obj_memsize(obj)
+    RVALUE *obj;
+{
+    long size = HEAP_PAGE_OF(obj)->size;
+
+    switch (BUILTIN_TYPE(obj)) {
+      case T_STRING:
+	if (obj->as.string.ptr && !FL_TEST(obj, ELTS_SHARED|ELTS_EMBED))
+	    size += obj->as.string.len + 1;
+	break;
+      case T_ARRAY:
+	if (obj->as.array.ptr && !FL_TEST(obj, ELTS_SHARED|ELTS_EMBED))
+	    size += obj->as.array.aux.capa * sizeof(VALUE);
+	break;
+      case T_HASH:
+	if (obj->as.hash.tbl)
+	    size += obj->as.hash.tbl->num_bins * sizeof(void*) +
+		obj->as.hash.tbl->num_entries * 4 * sizeof(void*);
+	break;
+      case T_OBJECT:
+	size += obj->as.object.iv_len * sizeof(VALUE);
+	break;
+      case T_BIGNUM:
+	size += obj->as.bignum.len * SIZEOF_BDIGITS;
+	break;
+    }
+    return size;
+}
+
+static void
+alloc_trace_record()
+{
+    RVALUE *obj = alloc_trace_pending;
+    volatile VALUE klass = 0;	/* on the stack, in case st_* runs GC */
+    struct alloc_site key, *site;
+
+    alloc_trace_pending = 0;
+    key.file = alloc_trace_file;
+    key.line = alloc_trace_line;
+    key.type = obj->as.basic.flags ? BUILTIN_TYPE(obj) : T_NONE;
+    switch (key.type) {
+      case T_NONE: case T_ICLASS: case T_VARMAP: case T_SCOPE: case T_NODE:
+	break;
+      default:
+	if (!obj->as.basic.klass || unswept_garbage_p(obj)) break;
+	klass = rb_class_real(obj->as.basic.klass);
+	if (RBASIC(klass)->flags == 0 || BUILTIN_TYPE(klass) != T_CLASS)
+	    klass = 0;
+    }
+    key.klass = klass;
+
+    if (!alloc_sites) alloc_sites = st_init_table(&alloc_site_type);
+    if (!st_lookup(alloc_sites, (st_data_t)&key, (st_data_t *)&site)) {
+	site = ALLOC(struct alloc_site);
+	*site = key;
+	site->count = 0;
+	site->bytes = 0;
+	st_add_direct(alloc_sites, (st_data_t)site, (st_data_t)site);
+    }
+    site->count += alloc_trace_rate;
+    if (key.type != T_NONE)
+	site->bytes += (double)obj_memsize(obj) * alloc_trace_rate;
+}
+
+static int
+mark_alloc_site(key, site)
+    st_data_t key;
+    struct alloc_site *site;
+{
+    if (site->klass) gc_mark(site->klass, 0);
+    mark_source_filename(site->file);
+    return ST_CONTINUE;
+}
+
+static void
+alloc_trace_mark()
+{
+    if (alloc_trace_pending) {
+	/* keep the sample alive until it is recorded */
+	if (alloc_trace_pending->as.basic.flags)
+	    gc_mark((VALUE)alloc_trace_pending, 0);
+	mark_source_filename(alloc_trace_file);
+    }
+    if (alloc_sites) st_foreach(alloc_sites, mark_alloc_site, 0);
+}
+
+/*
+ *  call-seq:
+ *     ObjectSpace.untrace_allocations    => nil
+ *
+ *  Stops recording allocations.  The samples recorded so far are kept.
+ */
+
+static VALUE
+untrace_allocations()
+{
+    if (alloc_trace_pending) alloc_trace_record();
+    alloc_trace_rate = 0;
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     ObjectSpace.trace_allocations(rate=1)                => nil
+ *     ObjectSpace.trace_allocations(rate=1) { block }      => obj
+ *
+ *  Starts recording every <i>rate</i>-th object allocation, with the
+ *  file and line it is allocated at, its class and its size.  With a
+ *  block, only the allocations made while the block runs are recorded.
+ *  Samples are added up by call site; see
+ *  <code>ObjectSpace.allocation_sites</code>.
+ *
+ *     ObjectSpace.trace_allocations(100) { handle(request) }
+ *     ObjectSpace.dump_allocation_sites("/tmp/allocations.tsv")
+ */
+
+static VALUE
+trace_allocations(argc, argv)
+    int argc;
+    VALUE *argv;
+{
+    VALUE vrate;
+    long rate = 1;
+
+    if (rb_scan_args(argc, argv, "01", &vrate) == 1) {
+	rate = NUM2LONG(vrate);
+	if (rate <= 0 || rate > INT_MAX) {
+	    rb_raise(rb_eArgError, "invalid sampling rate - %ld", rate);
+	}
+    }
+    untrace_allocations();
+    alloc_trace_rate = rate;
+    alloc_trace_countdown = alloc_trace_interval();
+    if (rb_block_given_p()) {
+	return rb_ensure(rb_yield, Qnil, untrace_allocations, 0);
+    }
+    return Qnil;
+}
+
+static int
+collect_alloc_site(key, site, list)
+    st_data_t key;
+    struct alloc_site *site;
+    struct alloc_site ***list;
+{
+    *(*list)++ = site;
+    return ST_CONTINUE;
+}
+
+static int
+alloc_site_count_cmp(a, b)
+    const void *a, *b;
+{
+    unsigned long x = (*(struct alloc_site **)a)->count;
+    unsigned long y = (*(struct alloc_site **)b)->count;
+
+    return x > y ? -1 : x < y;
+}
+
+/* the call sites recorded so far, the busiest first */
+static struct alloc_site **
+sorted_alloc_sites(np)
+    long *np;
+{
+    struct alloc_site **list, **p;
+    long n;
+
+    if (alloc_trace_pending) alloc_trace_record();
+    n = alloc_sites ? alloc_sites->num_entries : 0;
+    list = p = ALLOC_N(struct alloc_site *, n + 1);
+    if (alloc_sites) st_foreach(alloc_sites, collect_alloc_site, (st_data_t)&p);
+    qsort(list, n, sizeof(*list), alloc_site_count_cmp);
+    *np = n;
+    return list;
+}
+
+static const char *
+builtin_type_name(type)
+    int type;
+{
+    switch (type) {
+      case T_NONE:	return "T_NONE";
+      case T_OBJECT:	return "T_OBJECT";
+      case T_CLASS:	return "T_CLASS";
+      case T_ICLASS:	return "T_ICLASS";
+      case T_MODULE:	return "T_MODULE";
+      case T_FLOAT:	return "T_FLOAT";
+      case T_STRING:	return "T_STRING";
+      case T_REGEXP:	return "T_REGEXP";
+      case T_ARRAY:	return "T_ARRAY";
+      case T_HASH:	return "T_HASH";
+      case T_STRUCT:	return "T_STRUCT";
+      case T_BIGNUM:	return "T_BIGNUM";
+      case T_FILE:	return "T_FILE";
+      case T_DATA:	return "T_DATA";
+      case T_MATCH:	return "T_MATCH";
+      case T_BLKTAG:	return "T_BLKTAG";
+      case T_VARMAP:	return "T_VARMAP";
+      case T_SCOPE:	return "T_SCOPE";
+      case T_NODE:	return "T_NODE";
+      default:		return "unknown";
+    }
+}
+
+static VALUE
+alloc_site_class(site)
+    struct alloc_site *site;
+{
+    if (site->klass) return site->klass;
+    return rb_str_new2(builtin_type_name(site->type));
+}
+
+/*
+ *  call-seq:
+ *     ObjectSpace.allocation_sites    => array
+ *
+ *  Returns the allocations recorded by
+ *  <code>ObjectSpace.trace_allocations</code>, added up by call site,
+ *  as arrays of <code>[file, line, class, count, bytes]</code>, the
+ *  busiest site first.  <i>count</i> and <i>bytes</i> are scaled by the
+ *  sampling rate.  <i>class</i> is a string naming the internal type
+ *  for objects that have no class.
+ *
+ *     ObjectSpace.allocation_sites.first
+ *        #=> ["app/models/user.rb", 42, String, 18200, 1164800]
+ */
+
+static VALUE
+allocation_sites()
+{
+    struct alloc_site **list;
+    VALUE ary;
+    long i, n;
+
+    list = sorted_alloc_sites(&n);
+    ary = rb_ary_new2(n);
+    for (i = 0; i < n; i++) {
+	struct alloc_site *site = list[i];
+
+	rb_ary_push(ary, rb_ary_new3(5,
+				     site->file ? rb_str_new2(site->file) : Qnil,
+				     INT2NUM(site->line),
+				     alloc_site_class(site),
+				     ULONG2NUM(site->count),
+				     rb_dbl2big(site->bytes)));
+    }
+    free(list);
+    return ary;
+}
+
+/*
+ *  call-seq:
+ *     ObjectSpace.dump_allocation_sites(path)    => integer
+ *
+ *  Writes <code>ObjectSpace.allocation_sites</code> to the file
+ *  <i>path</i>, one call site per line with tab separated count, bytes,
+ *  file, line and class, after a header line naming the columns.
+ *  Returns the number of call sites written.
+ */
+
+static VALUE
+dump_allocation_sites(self, path)
+    VALUE self, path;
+{
+    struct alloc_site **list;
+    long i, n;
+    FILE *f;
+
+    SafeStringValue(path);
+    f = fopen(RSTRING(path)->ptr, "w");
+    if (!f) rb_sys_fail(RSTRING(path)->ptr);
+    list = sorted_alloc_sites(&n);
+    fprintf(f, "count\tbytes\tfile\tline\tclass\n");
+    for (i = 0; i < n; i++) {
+	struct alloc_site *site = list[i];
+	const char *name = site->klass ? rb_class2name(site->klass) :
+	    builtin_type_name(site->type);
+
+	fprintf(f, "%lu\t%.0f\t%s\t%d\t%s\n", site->count, site->bytes,
+		site->file ? site->file : "", site->line, name);
+    }
+    free(list);
+    fclose(f);
+    return LONG2NUM(n);
+}
+
+static int
+free_alloc_site(key, site)
+    st_data_t key;
+    struct alloc_site *site;
+{
+    free(site);
+    return ST_DELETE;
+}
+
+/*
+ *  call-seq:
+ *     ObjectSpace.clear_allocation_sites    => nil
+ *
+ *  Discards the allocations recorded so far.
+ */
+
+static VALUE
+clear_allocation_sites()
+{
+    alloc_trace_pending = 0;
+    if (alloc_sites) {
+	st_foreach(alloc_sites, free_alloc_site, 0);
+	st_free_table(alloc_sites);
+	alloc_sites = 0;
+    }
+    return Qnil;
+}
+
 void
 ruby_set_stack_size(size)
     size_t size;
@@ -1610,22 +3032,50 @@ Init_heap()
     if (!rb_gc_stack_start) {
 	Init_stack(0);
     }
-    add_heap();
+    set_gc_parameters();
+    init_heap_class(rvalue_heap, sizeof(RVALUE), heap_min_slots, heap_min_slots);
+    add_heap(rvalue_heap);
+#ifdef USE_SMALL_HEAP
+    /* starts with a page, and grows like the main heap from there */
+    init_heap_class(small_heap, sizeof(RSMALL), HEAP_PAGE_SIZE / sizeof(RSMALL), 0);
+    add_heap(small_heap);
+#endif
+}
+
+/*
+ * The heap following the one that starts at last, in address order.
+ * Iterating this way is not confused by heaps added while a block
+ * runs.
+ */
+static struct heaps_slot *
+next_heap_slot(last)
+    RVALUE *last;
+{
+    int lo = 0, hi = heaps_used, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (heaps[mid]->slot <= last) lo = mid + 1;
+	else hi = mid;
+    }
+    return lo < heaps_used ? heaps[lo] : 0;
 }
 
 static VALUE
 os_obj_of(of)
     VALUE of;
 {
-    int i;
+    struct heaps_slot *h;
+    RVALUE *last = 0;
     int n = 0;
 
-    for (i = 0; i < heaps_used; i++) {
+    while ((h = next_heap_slot(last)) != 0) {
 	RVALUE *p, *pend;
 
-	p = heaps[i].slot; pend = p + heaps[i].limit;
-	for (;p < pend; p++) {
+	last = p = h->slot; pend = SLOT_END(h);
+	for (;p < pend; p = SLOT_NEXT(h, p)) {
 	    if (p->as.basic.flags) {
+		if (unswept_garbage_p(p)) continue;
 		switch (BUILTIN_TYPE(p)) {
 		  case T_NONE:
 		  case T_ICLASS:
@@ -1696,6 +3146,104 @@ os_each_obj(argc, argv)
     return os_obj_of(of);
 }
 
+/*
+ * Heap dump.  Every live slot is written as one line, using only
+ * stdio, so that a process short of memory can still be inspected.
+ * References are those gc_mark_children would mark: while
+ * heap_dump_file is set, gc_mark reports its argument instead of
+ * marking it.
+ */
+static ID id_classpath;
+static long heap_dump_nrefs;
+
+static void
+heap_dump_ref(ptr)
+    VALUE ptr;
+{
+    fprintf(heap_dump_file, heap_dump_nrefs++ ? " 0x%lx" : "0x%lx",
+	    (unsigned long)ptr);
+}
+
+static void
+heap_dump_obj(f, p)
+    FILE *f;
+    RVALUE *p;
+{
+    int type = BUILTIN_TYPE(p);
+    VALUE klass = type == T_NODE ? 0 : p->as.basic.klass;
+    VALUE path;
+    const char *name = "";
+
+    if ((type == T_CLASS || type == T_MODULE) && p->as.klass.iv_tbl &&
+	st_lookup(p->as.klass.iv_tbl, id_classpath, &path) &&
+	TYPE(path) == T_STRING) {
+	name = RSTRING(path)->ptr;
+    }
+    fprintf(f, "0x%lx\t%s\t0x%lx\t%ld\t%s\t", (unsigned long)p,
+	    builtin_type_name(type), (unsigned long)klass,
+	    obj_memsize(p), name);
+    heap_dump_nrefs = 0;
+    gc_mark_children((VALUE)p, 0);
+    putc('\n', f);
+}
+
+/*
+ *  call-seq:
+ *     ObjectSpace.dump_heap(path)    => integer
+ *
+ *  Writes every live object, including interpreter internals such as
+ *  syntax tree nodes, to the file <i>path</i> and returns the number of
+ *  objects written.  No Ruby objects are allocated while the heap is
+ *  written.  After a header line naming the columns there is one line
+ *  per object with these tab separated fields:
+ *
+ *  address::  the object's address, in hex
+ *  type::     its internal type, such as <code>T_STRING</code>
+ *  class::    the address of its class, <code>0x0</code> for nodes
+ *  size::     approximate bytes used, including malloc'ed contents
+ *  name::     the name of a named class or module, otherwise empty
+ *  refs::     space separated addresses of the objects it references,
+ *             as the garbage collector sees them
+ *
+ *     ObjectSpace.dump_heap("/tmp/heap.txt")    #=> 46012
+ */
+
+static VALUE
+dump_heap(self, path)
+    VALUE self, path;
+{
+    struct heaps_slot *h;
+    RVALUE *last = 0;
+    long n = 0;
+    int err;
+    FILE *f;
+
+    SafeStringValue(path);
+    f = fopen(RSTRING(path)->ptr, "w");
+    if (!f) rb_sys_fail(RSTRING(path)->ptr);
+    fprintf(f, "address\ttype\tclass\tsize\tname\trefs\n");
+
+    during_gc++;
+    heap_dump_file = f;
+    while ((h = next_heap_slot(last)) != 0) {
+	RVALUE *p, *pend;
+
+	last = p = h->slot; pend = SLOT_END(h);
+	for (; p < pend; p = SLOT_NEXT(h, p)) {
+	    if (!p->as.basic.flags || BUILTIN_TYPE(p) == T_NONE) continue;
+	    if (unswept_garbage_p(p)) continue;
+	    heap_dump_obj(f, p);
+	    n++;
+	}
+    }
+    heap_dump_file = 0;
+    during_gc--;
+
+    err = ferror(f);
+    if (fclose(f) != 0 || err) rb_sys_fail(RSTRING(path)->ptr);
+    return LONG2NUM(n);
+}
+
 static VALUE finalizers;
 
 /* deprecated
@@ -1879,26 +3427,28 @@ rb_gc_call_finalizer_at_exit()
     RVALUE *p, *pend;
     int i;
 
+    gc_lazy_sweep(0);
+
     /* run finalizers */
     if (need_call_final) {
 	p = deferred_final_list;
 	deferred_final_list = 0;
 	finalize_list(p);
 	for (i = 0; i < heaps_used; i++) {
-	    p = heaps[i].slot; pend = p + heaps[i].limit;
+	    p = heaps[i]->slot; pend = SLOT_END(heaps[i]);
 	    while (p < pend) {
 		if (FL_TEST(p, FL_FINALIZE)) {
 		    FL_UNSET(p, FL_FINALIZE);
 		    p->as.basic.klass = 0;
 		    run_final((VALUE)p);
 		}
-		p++;
+		p = SLOT_NEXT(heaps[i], p);
 	    }
 	}
     }
     /* run data object's finalizers */
     for (i = 0; i < heaps_used; i++) {
-	p = heaps[i].slot; pend = p + heaps[i].limit;
+	p = heaps[i]->slot; pend = SLOT_END(heaps[i]);
 	while (p < pend) {
 	    if (BUILTIN_TYPE(p) == T_DATA &&
 		DATA_PTR(p) && RANY(p)->as.data.dfree) {
@@ -1914,7 +3464,7 @@ rb_gc_call_finalizer_at_exit()
 		p->as.free.flags = 0;
 		rb_io_fptr_finalize(RANY(p)->as.file.fptr);
 	    }
-	    p++;
+	    p = SLOT_NEXT(heaps[i], p);
 	}
     }
 }
@@ -1932,6 +3482,15 @@ rb_gc_call_finalizer_at_exit()
  *
  */
 
+/* object ids of Symbols are never those of objects, see rb_obj_id() */
+#ifdef USE_SMALL_HEAP
+#define SYMBOL_ID_UNIT sizeof(VALUE)
+#define SYMBOL_ID_TAG (sizeof(VALUE) / 2)
+#else
+#define SYMBOL_ID_UNIT sizeof(RVALUE)
+#define SYMBOL_ID_TAG (4 << 2)
+#endif
+
 static VALUE
 id2ref(obj, objid)
     VALUE obj, objid;
@@ -1947,8 +3506,8 @@ id2ref(obj, objid)
     if (FIXNUM_P(ptr)) return (VALUE)ptr;
     ptr = objid ^ FIXNUM_FLAG;	/* unset FIXNUM_FLAG */
 
-    if ((ptr % sizeof(RVALUE)) == (4 << 2)) {
-        ID symid = ptr / sizeof(RVALUE);
+    if ((ptr % SYMBOL_ID_UNIT) == SYMBOL_ID_TAG) {
+        ID symid = ptr / SYMBOL_ID_UNIT;
         if (rb_id2name(symid) == 0)
             rb_raise(rb_eRangeError, "%p is not symbol id value", p0);
         return ID2SYM(symid);
@@ -1958,7 +3517,8 @@ id2ref(obj, objid)
 	(type = BUILTIN_TYPE(ptr)) >= T_BLKTAG || type == T_ICLASS) {
 	rb_raise(rb_eRangeError, "0x%lx is not id value", p0);
     }
-    if (BUILTIN_TYPE(ptr) == 0 || RBASIC(ptr)->klass == 0) {
+    if (BUILTIN_TYPE(ptr) == 0 || RBASIC(ptr)->klass == 0 ||
+	unswept_garbage_p(RANY(ptr))) {
 	rb_raise(rb_eRangeError, "0x%lx is recycled object", p0);
     }
     return (VALUE)ptr;
@@ -2021,9 +3581,12 @@ rb_obj_id(VALUE obj)
      *  20 if 32-bit, double is 4-byte aligned
      *  24 if 32-bit, double is 8-byte aligned
      *  40 if 64-bit
+     *
+     *  With USE_SMALL_HEAP objects are only known to be 8-byte aligned,
+     *  and A = 4, S...S % A = 2 (S...S = s...s * A + 2) instead.
      */
     if (TYPE(obj) == T_SYMBOL) {
-        return (SYM2ID(obj) * sizeof(RVALUE) + (4 << 2)) | FIXNUM_FLAG;
+        return (SYM2ID(obj) * SYMBOL_ID_UNIT + SYMBOL_ID_TAG) | FIXNUM_FLAG;
     }
     if (SPECIAL_CONST_P(obj)) {
         return LONG2NUM((long)obj);
@@ -2046,6 +3609,16 @@ Init_GC()
     rb_define_singleton_method(rb_mGC, "start", rb_gc_start, 0);
     rb_define_singleton_method(rb_mGC, "enable", rb_gc_enable, 0);
     rb_define_singleton_method(rb_mGC, "disable", rb_gc_disable, 0);
+    rb_define_singleton_method(rb_mGC, "copy_on_write_friendly?", gc_cow_friendly_get, 0);
+    rb_define_singleton_method(rb_mGC, "copy_on_write_friendly=", gc_cow_friendly_set, 1);
+    rb_define_singleton_method(rb_mGC, "lazy_sweep?", gc_lazy_sweep_get, 0);
+    rb_define_singleton_method(rb_mGC, "lazy_sweep=", gc_lazy_sweep_set, 1);
+    rb_define_singleton_method(rb_mGC, "count", gc_count_get, 0);
+    rb_define_singleton_method(rb_mGC, "time", gc_time_get, 0);
+    rb_define_singleton_method(rb_mGC, "stat", gc_stat, 0);
+    rb_define_singleton_method(rb_mGC, "clear_stats", gc_clear_stats, 0);
+    rb_define_singleton_method(rb_mGC, "fragmentation", gc_fragmentation, 0);
+    rb_define_singleton_method(rb_mGC, "trim", gc_trim, 0);
     rb_define_method(rb_mGC, "garbage_collect", rb_gc_start, 0);
 
     rb_mObSpace = rb_define_module("ObjectSpace");
@@ -2061,6 +3634,14 @@ Init_GC()
 
     rb_define_module_function(rb_mObSpace, "_id2ref", id2ref, 1);
 
+    rb_define_module_function(rb_mObSpace, "trace_allocations", trace_allocations, -1);
+    rb_define_module_function(rb_mObSpace, "untrace_allocations", untrace_allocations, 0);
+    rb_define_module_function(rb_mObSpace, "allocation_sites", allocation_sites, 0);
+    rb_define_module_function(rb_mObSpace, "dump_allocation_sites", dump_allocation_sites, 1);
+    rb_define_module_function(rb_mObSpace, "clear_allocation_sites", clear_allocation_sites, 0);
+    rb_define_module_function(rb_mObSpace, "dump_heap", dump_heap, 1);
+    id_classpath = rb_intern("__classpath__");
+
     rb_gc_register_address(&rb_mObSpace);
     rb_global_variable(&finalizers);
     rb_gc_unregister_address(&rb_mObSpace);
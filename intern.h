@@ -156,6 +156,7 @@ void rb_define_alloc_func _((VALUE, VALUE (*)(VALUE)));
 void rb_undef_alloc_func _((VALUE));
 void rb_clear_cache _((void));
 void rb_clear_cache_by_class _((VALUE));
+void rb_check_redefined_ops _((VALUE, VALUE));
 void rb_alias _((VALUE, ID, ID));
 void rb_attr _((VALUE,ID,int,int,int));
 int rb_method_boundp _((VALUE, ID, int));
@@ -223,6 +224,7 @@ VALUE rb_thread_main _((void));
 VALUE rb_thread_local_aref _((VALUE, ID));
 VALUE rb_thread_local_aset _((VALUE, ID, VALUE));
 void rb_thread_atfork _((void));
+void rb_thread_reset_fd_watch _((void));
 VALUE rb_funcall_rescue __((VALUE, ID, int, ...));
 /* file.c */
 VALUE rb_file_s_expand_path _((int, VALUE *));
@@ -240,6 +242,8 @@ NORETURN(void rb_memerror __((void)));
 int ruby_stack_check _((void));
 int ruby_stack_length _((VALUE**));
 int rb_during_gc _((void));
+int rb_gc_marked_p _((VALUE));
+VALUE rb_newobj_small _((void));
 char *rb_source_filename _((const char*));
 void rb_gc_mark_locations _((VALUE*, VALUE*));
 void rb_mark_tbl _((struct st_table*));
@@ -474,6 +478,10 @@ void rb_copy_generic_ivar _((VALUE,VALUE));
 void rb_mark_generic_ivar _((VALUE));
 void rb_mark_generic_ivar_tbl _((void));
 void rb_free_generic_ivar _((VALUE));
+void rb_copy_object_ivar _((VALUE,VALUE));
+long rb_ivar_slot _((VALUE, ID));
+void rb_ivar_foreach _((VALUE, int (*)(ANYARGS), unsigned long));
+long rb_ivar_count _((VALUE));
 VALUE rb_ivar_get _((VALUE, ID));
 VALUE rb_ivar_set _((VALUE, ID, VALUE));
 VALUE rb_ivar_defined _((VALUE, ID));
@@ -493,6 +501,7 @@ int rb_const_defined_from _((VALUE, ID));
 VALUE rb_const_get _((VALUE, ID));
 VALUE rb_const_get_at _((VALUE, ID));
 VALUE rb_const_get_from _((VALUE, ID));
+VALUE rb_const_lookup _((VALUE, ID, int));
 void rb_const_set _((VALUE, ID, VALUE));
 VALUE rb_mod_constants _((VALUE));
 VALUE rb_mod_const_missing _((VALUE,VALUE));
@@ -14,7 +14,8 @@
 #
 # A way of performing a potentially long-running operation in a thread, and
 # terminating it's execution if it hasn't finished within fixed amount of
-# time.
+# time.  The time is kept by the thread scheduler (see Thread.deadline);
+# no thread is started for it.
 #
 # Previous versions of timeout didn't use a module for namespace. This version
 # provides both Timeout.timeout, and a backwards-compatible #timeout.
@@ -54,15 +55,9 @@ module Timeout
     raise ThreadError, "timeout within critical session" if Thread.critical
     exception = klass || Class.new(ExitException)
     begin
-      x = Thread.current
-      y = Thread.start {
-        sleep sec
-        x.raise exception, "execution expired" if x.alive?
-      }
-      yield sec
-      #    return true
+      Thread.deadline(sec, exception) { yield sec }
     rescue exception => e
-      rej = /\A#{Regexp.quote(__FILE__)}:#{__LINE__-4}\z/o
+      rej = /\A#{Regexp.quote(__FILE__)}:#{__LINE__-2}(?::in `\w+')?\z/o
       (bt = e.backtrace).reject! {|m| rej =~ m}
       level = -caller(CALLER_OFFSET).size
       while THIS_FILE =~ bt[level]
@@ -72,8 +67,6 @@ module Timeout
       raise if klass            # if exception class is specified, it
                                 # would be expected outside.
       raise Error, e.message, e.backtrace
-    ensure
-      y.kill if y and y.alive?
     end
   end
 
@@ -454,6 +454,15 @@ w_ivar(tbl, arg)
     }
 }
 
+static void
+w_objivar(obj, arg)
+    VALUE obj;
+    struct dump_call_arg *arg;
+{
+    w_long(rb_ivar_count(obj), arg->arg);
+    rb_ivar_foreach(obj, w_obj_each, (st_data_t)arg);
+}
+
 static void
 w_object(obj, arg, limit)
     VALUE obj;
@@ -657,7 +666,7 @@ w_object(obj, arg, limit)
 
 	  case T_OBJECT:
 	    w_class(TYPE_OBJECT, obj, arg, Qtrue);
-	    w_ivar(ROBJECT(obj)->iv_tbl, &c_arg);
+	    w_objivar(obj, &c_arg);
 	    break;
 
 	  case T_DATA:
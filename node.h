@@ -122,9 +122,14 @@ enum node_type {
     NODE_IFUNC,
     NODE_DSYM,
     NODE_ATTRASGN,
+    NODE_IVINDEX,
     NODE_LAST
 };
 
+struct call_cache;
+struct const_cache;
+struct ivar_cache;
+
 typedef struct RNode {
     unsigned long flags;
     char *nd_file;
@@ -134,6 +139,7 @@ typedef struct RNode {
 	VALUE value;
 	VALUE (*cfunc)(ANYARGS);
 	ID *tbl;
+	struct call_cache *cache;
     } u1;
     union {
 	struct RNode *node;
@@ -148,9 +154,70 @@ typedef struct RNode {
 	struct global_entry *entry;
 	long cnt;
 	VALUE value;
+	struct const_cache *ccache;
+	struct ivar_cache *icache;
+	struct st_table *slots;
     } u3;
 } NODE;
 
+/*
+ * Every call site (NODE_CALL, NODE_FCALL, NODE_VCALL, NODE_ATTRASGN)
+ * remembers the method it last dispatched to, so that a call on a
+ * receiver of the same class needs no method cache lookup.  The entry
+ * is valid while neither the global method serial nor the serial of
+ * the class has changed.
+ */
+struct call_cache {
+    NODE *recv;			/* receiver, for NODE_CALL and NODE_ATTRASGN */
+    VALUE klass;		/* receiver's class */
+    unsigned long serial;	/* method serial when filled */
+    unsigned long class_serial;	/* serial of klass when filled */
+    VALUE origin;		/* where method defined */
+    ID mid0;			/* method's original id */
+    NODE *method;		/* 0 if the method is missing */
+    int noex;
+    int bop;			/* basic operation called, 0 if unknown */
+};
+
+/*
+ * Every constant reference (NODE_CONST, NODE_COLON2, NODE_COLON3)
+ * remembers the value it last found.  The entry is valid while
+ * ruby_const_serial, bumped whenever a constant is set or removed or a
+ * module is included, is unchanged and the lookup starts from the same
+ * place: the cref for NODE_CONST, the class or module for NODE_COLON2.
+ */
+struct const_cache {
+    VALUE key;			/* cref or class looked up in */
+    VALUE value;
+    unsigned long serial;	/* ruby_const_serial when filled */
+};
+
+extern unsigned long ruby_const_serial;
+
+/*
+ * Every instance variable reference (NODE_IVAR, NODE_IASGN, and the
+ * NODE_ATTRSET of attr_writer) remembers the slot the variable had in
+ * the last object it was used on.  The slot is good for any T_OBJECT
+ * whose iv_index is the same, i.e. any other instance of that class.
+ */
+struct ivar_cache {
+    VALUE index;		/* iv_index of the object */
+    long slot;
+};
+
+/*
+ * The serial of a class lives in the flag bits above FL_UMASK; 0 means
+ * none has been given out yet.  CLASS_SEARCHED marks a class that a
+ * method lookup for another class went through.  Copies of a class
+ * must not inherit either.
+ */
+#define CLASS_SEARCHED FL_USER1
+#define CLASS_SERIAL_SHIFT (FL_USHIFT+8)
+#define CLASS_SERIAL_MAX (~0UL >> CLASS_SERIAL_SHIFT)
+#define CLASS_SERIAL(k) (RBASIC(k)->flags >> CLASS_SERIAL_SHIFT)
+#define CLASS_SERIAL_RESET(k) \
+    (RBASIC(k)->flags &= ~(CLASS_SEARCHED|(CLASS_SERIAL_MAX << CLASS_SERIAL_SHIFT)))
+
 extern NODE *ruby_cref;
 extern NODE *ruby_top_cref;
 
@@ -205,7 +272,16 @@ extern NODE *ruby_top_cref;
 #define nd_rest  u2.node
 #define nd_opt   u1.node
 
-#define nd_recv  u1.node
+/* the receiver of NODE_CALL and NODE_ATTRASGN is nd_cache->recv;
+   make call nodes with rb_node_newcall(), not NEW_NODE() */
+#define nd_obj   u1.node
+#define nd_cache u1.cache
+#define nd_ccache u3.ccache
+#define nd_icache u3.icache
+
+#define nd_ivids  u1.tbl
+#define nd_ivcapa u2.argc
+#define nd_ivslots u3.slots
 #define nd_mid   u2.id
 #define nd_args  u3.node
 
@@ -241,6 +317,7 @@ extern NODE *ruby_top_cref;
 #define NEW_IFUNC(f,c) NEW_NODE(NODE_IFUNC,f,c,0)
 #define NEW_RFUNC(b1,b2) NEW_SCOPE(block_append(b1,b2))
 #define NEW_SCOPE(b) NEW_NODE(NODE_SCOPE,local_tbl(),0,(b))
+#define NEW_IVINDEX(t) NEW_NODE(NODE_IVINDEX,0,0,t)
 #define NEW_BLOCK(a) NEW_NODE(NODE_BLOCK,a,0,0)
 #define NEW_IF(c,t,e) NEW_NODE(NODE_IF,c,t,e)
 #define NEW_UNLESS(c,t,e) NEW_IF(c,e,t)
@@ -271,7 +348,7 @@ extern NODE *ruby_top_cref;
 #define NEW_LASGN(v,val) NEW_NODE(NODE_LASGN,v,val,local_cnt(v))
 #define NEW_DASGN(v,val) NEW_NODE(NODE_DASGN,v,val,0)
 #define NEW_DASGN_CURR(v,val) NEW_NODE(NODE_DASGN_CURR,v,val,0)
-#define NEW_IASGN(v,val) NEW_NODE(NODE_IASGN,v,val,0)
+#define NEW_IASGN(v,val) rb_node_newivar(NODE_IASGN,v,val)
 #define NEW_CDECL(v,val,path) NEW_NODE(NODE_CDECL,v,val,path)
 #define NEW_CVASGN(v,val) NEW_NODE(NODE_CVASGN,v,val,0)
 #define NEW_CVDECL(v,val) NEW_NODE(NODE_CVDECL,v,val,0)
@@ -283,8 +360,8 @@ extern NODE *ruby_top_cref;
 #define NEW_GVAR(v) NEW_NODE(NODE_GVAR,v,0,rb_global_entry(v))
 #define NEW_LVAR(v) NEW_NODE(NODE_LVAR,v,0,local_cnt(v))
 #define NEW_DVAR(v) NEW_NODE(NODE_DVAR,v,0,0)
-#define NEW_IVAR(v) NEW_NODE(NODE_IVAR,v,0,0)
-#define NEW_CONST(v) NEW_NODE(NODE_CONST,v,0,0)
+#define NEW_IVAR(v) rb_node_newivar(NODE_IVAR,v,0)
+#define NEW_CONST(v) rb_node_newconst(NODE_CONST,0,v)
 #define NEW_CVAR(v) NEW_NODE(NODE_CVAR,v,0,0)
 #define NEW_NTH_REF(n)  NEW_NODE(NODE_NTH_REF,0,n,local_cnt('~'))
 #define NEW_BACK_REF(n) NEW_NODE(NODE_BACK_REF,0,n,local_cnt('~'))
@@ -298,9 +375,9 @@ extern NODE *ruby_top_cref;
 #define NEW_DXSTR(s) NEW_NODE(NODE_DXSTR,s,0,0)
 #define NEW_DSYM(s) NEW_NODE(NODE_DSYM,s,0,0)
 #define NEW_EVSTR(n) NEW_NODE(NODE_EVSTR,0,(n),0)
-#define NEW_CALL(r,m,a) NEW_NODE(NODE_CALL,r,m,a)
-#define NEW_FCALL(m,a) NEW_NODE(NODE_FCALL,0,m,a)
-#define NEW_VCALL(m) NEW_NODE(NODE_VCALL,0,m,0)
+#define NEW_CALL(r,m,a) rb_node_newcall(NODE_CALL,r,m,a)
+#define NEW_FCALL(m,a) rb_node_newcall(NODE_FCALL,0,m,a)
+#define NEW_VCALL(m) rb_node_newcall(NODE_VCALL,0,m,0)
 #define NEW_SUPER(a) NEW_NODE(NODE_SUPER,0,0,a)
 #define NEW_ZSUPER() NEW_NODE(NODE_ZSUPER,0,0,0)
 #define NEW_ARGS(f,o,r) NEW_NODE(NODE_ARGS,o,r,f)
@@ -317,12 +394,12 @@ extern NODE *ruby_top_cref;
 #define NEW_CLASS(n,b,s) NEW_NODE(NODE_CLASS,n,NEW_SCOPE(b),(s))
 #define NEW_SCLASS(r,b) NEW_NODE(NODE_SCLASS,r,NEW_SCOPE(b),0)
 #define NEW_MODULE(n,b) NEW_NODE(NODE_MODULE,n,NEW_SCOPE(b),0)
-#define NEW_COLON2(c,i) NEW_NODE(NODE_COLON2,c,i,0)
-#define NEW_COLON3(i) NEW_NODE(NODE_COLON3,0,i,0)
+#define NEW_COLON2(c,i) rb_node_newconst(NODE_COLON2,c,i)
+#define NEW_COLON3(i) rb_node_newconst(NODE_COLON3,0,i)
 #define NEW_CREF(c) (NEW_NODE(NODE_CREF,0,0,c))
 #define NEW_DOT2(b,e) NEW_NODE(NODE_DOT2,b,e,0)
 #define NEW_DOT3(b,e) NEW_NODE(NODE_DOT3,b,e,0)
-#define NEW_ATTRSET(a) NEW_NODE(NODE_ATTRSET,a,0,0)
+#define NEW_ATTRSET(a) rb_node_newivar(NODE_ATTRSET,a,0)
 #define NEW_SELF() NEW_NODE(NODE_SELF,0,0,0)
 #define NEW_NIL() NEW_NODE(NODE_NIL,0,0,0)
 #define NEW_TRUE() NEW_NODE(NODE_TRUE,0,0,0)
@@ -333,7 +410,7 @@ extern NODE *ruby_top_cref;
 #define NEW_POSTEXE() NEW_NODE(NODE_POSTEXE,0,0,0)
 #define NEW_DMETHOD(b) NEW_NODE(NODE_DMETHOD,0,0,b)
 #define NEW_BMETHOD(b) NEW_NODE(NODE_BMETHOD,0,0,b)
-#define NEW_ATTRASGN(r,m,a) NEW_NODE(NODE_ATTRASGN,r,m,a)
+#define NEW_ATTRASGN(r,m,a) rb_node_newcall(NODE_ATTRASGN,r,m,a)
 
 #define NOEX_PUBLIC    0
 #define NOEX_NOSUPER   1
@@ -349,6 +426,9 @@ NODE *rb_compile_file _((const char*, VALUE, int));
 
 void rb_add_method _((VALUE, ID, NODE *, int));
 NODE *rb_node_newnode _((enum node_type,VALUE,VALUE,VALUE));
+NODE *rb_node_newcall _((enum node_type,NODE*,ID,NODE*));
+NODE *rb_node_newconst _((enum node_type,NODE*,ID));
+NODE *rb_node_newivar _((enum node_type,ID,NODE*));
 
 NODE* rb_method_node _((VALUE klass, ID id));
 
@@ -372,6 +452,7 @@ typedef unsigned int rb_event_t;
 
 typedef void (*rb_event_hook_func_t) _((rb_event_t,NODE*,VALUE,ID,VALUE));
 NODE *rb_copy_node_scope _((NODE *, NODE *));
+void rb_tcode_free _((NODE *));
 void rb_add_event_hook _((rb_event_hook_func_t,rb_event_t));
 int rb_remove_event_hook _((rb_event_hook_func_t));
 
@@ -413,6 +494,10 @@ struct rb_thread {
     long   stk_max;
     VALUE *stk_ptr;
     VALUE *stk_pos;
+    VALUE *stk_start;		/* rb_gc_stack_start while it runs */
+    unsigned int stk_level_max;	/* ditto rb_gc_stack_level_max */
+    void  *stk_base;		/* native stack of its own, if any */
+    size_t stk_size;
 #ifdef __ia64
     long   bstr_len;
     long   bstr_max;
@@ -449,7 +534,12 @@ struct rb_thread {
     fd_set writefds;
     fd_set exceptfds;
     int select_value;
+    struct fd_waiter *fd_waiters;	/* in the epoll set, while it waits */
+    int fd_nwaiters;
+    int fd_maxwaiters;
     double delay;
+    int timer_pos;		/* in the timer heap, or -1 */
+    struct thread_deadline *deadlines;	/* of Thread.deadline, innermost first */
     rb_thread_t join;
 
     int abort;
@@ -492,7 +492,7 @@ VALUE
 rb_float_new(d)
     double d;
 {
-    NEWOBJ(flt, struct RFloat);
+    struct RFloat *flt = (struct RFloat*)rb_newobj_small();
     OBJSETUP(flt, rb_cFloat, T_FLOAT);
 
     flt->value = d;
@@ -2078,12 +2078,19 @@ fix_mul(x, y)
 	if (a == 0) return x;
 
 	b = FIX2LONG(y);
+#ifdef HAVE_BUILTIN_MUL_OVERFLOW
+	if (__builtin_mul_overflow(a, b, &c) || !FIXABLE(c)) {
+	    return rb_big_mul(rb_int2big(a), rb_int2big(b));
+	}
+#else
+	/* a signed overflow is undefined, so it must not happen */
+	if (b != 0 &&
+	    (a < 0 ? -a : a) > FIXNUM_MAX / (b < 0 ? -b : b)) {
+	    return rb_big_mul(rb_int2big(a), rb_int2big(b));
+	}
 	c = a * b;
+#endif
 	r = LONG2FIX(c);
-
-	if (FIX2LONG(r) != c || c/a != b) {
-	    r = rb_big_mul(rb_int2big(a), rb_int2big(b));
-	}
 	return r;
     }
     if (TYPE(y) == T_FLOAT) {
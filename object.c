@@ -175,15 +175,23 @@ init_copy(dest, obj)
     rb_gc_copy_finalizer(dest, obj);
     switch (TYPE(obj)) {
       case T_OBJECT:
+	rb_copy_object_ivar(dest, obj);
+	break;
       case T_CLASS:
       case T_MODULE:
-	if (ROBJECT(dest)->iv_tbl) {
-	    st_free_table(ROBJECT(dest)->iv_tbl);
-	    ROBJECT(dest)->iv_tbl = 0;
+	if (RCLASS(dest)->iv_tbl) {
+	    st_free_table(RCLASS(dest)->iv_tbl);
+	    RCLASS(dest)->iv_tbl = 0;
 	}
-	if (ROBJECT(obj)->iv_tbl) {
-	    ROBJECT(dest)->iv_tbl = st_copy(ROBJECT(obj)->iv_tbl);
+	if (RCLASS(obj)->iv_tbl) {
+	    RCLASS(dest)->iv_tbl = st_copy(RCLASS(obj)->iv_tbl);
 	}
+	break;
+      case T_STRING:
+      case T_ARRAY:
+	/* clone copied the flags but not the embedded contents */
+	FL_UNSET(dest, ELTS_EMBED);
+	break;
     }
     rb_funcall(dest, id_init_copy, 1, obj);
 }
@@ -367,7 +375,7 @@ static VALUE
 inspect_obj(obj, str)
     VALUE obj, str;
 {
-    st_foreach_safe(ROBJECT(obj)->iv_tbl, inspect_i, str);
+    rb_ivar_foreach(obj, inspect_i, str);
     rb_str_cat2(str, ">");
     RSTRING(str)->ptr[0] = '#';
     OBJ_INFECT(str, obj);
@@ -392,9 +400,7 @@ static VALUE
 rb_obj_inspect(obj)
     VALUE obj;
 {
-    if (TYPE(obj) == T_OBJECT
-	&& ROBJECT(obj)->iv_tbl
-	&& ROBJECT(obj)->iv_tbl->num_entries > 0) {
+    if (TYPE(obj) == T_OBJECT && rb_ivar_count(obj) > 0) {
 	VALUE str;
 	size_t len;
 	char *c;
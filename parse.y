@@ -892,7 +892,7 @@ cpath		: tCOLON3 cname
 		    }
 		| cname
 		    {
-			$$ = NEW_COLON2(0, $$);
+			$$ = NEW_COLON2(0, $1);
 		    }
 		| primary_value tCOLON2 cname
 		    {
@@ -3046,7 +3046,9 @@ static void
 dispose_string(str)
     VALUE str;
 {
-    xfree(RSTRING(str)->ptr);
+    if (!FL_TEST(str, ELTS_EMBED)) {
+	xfree(RSTRING(str)->ptr);
+    }
     rb_gc_force_recycle(str);
 }
 
@@ -4531,6 +4533,60 @@ rb_node_newnode(type, a0, a1, a2)
     return n;
 }
 
+NODE*
+rb_node_newcall(type, recv, mid, args)
+    enum node_type type;
+    NODE *recv;
+    ID mid;
+    NODE *args;
+{
+    NODE *n = rb_node_newnode(type, 0, mid, (VALUE)args);
+    struct call_cache *cc = ALLOC(struct call_cache);
+
+    MEMZERO(cc, struct call_cache, 1);
+    cc->recv = recv;
+    n->nd_cache = cc;
+
+    return n;
+}
+
+NODE*
+rb_node_newconst(type, head, id)
+    enum node_type type;
+    NODE *head;
+    ID id;
+{
+    NODE *n;
+    struct const_cache *cc = ALLOC(struct const_cache);
+
+    MEMZERO(cc, struct const_cache, 1);
+    if (type == NODE_CONST) {
+	n = rb_node_newnode(type, id, 0, 0);
+    }
+    else {
+	n = rb_node_newnode(type, (VALUE)head, id, 0);
+    }
+    n->nd_ccache = cc;
+
+    return n;
+}
+
+NODE*
+rb_node_newivar(type, id, value)
+    enum node_type type;
+    ID id;
+    NODE *value;
+{
+    NODE *n;
+    struct ivar_cache *ic = ALLOC(struct ivar_cache);
+
+    MEMZERO(ic, struct ivar_cache, 1);
+    n = rb_node_newnode(type, id, (VALUE)value, 0);
+    n->nd_icache = ic;
+
+    return n;
+}
+
 static enum node_type
 nodetype(node)			/* for debug */
     NODE *node;
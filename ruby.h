@@ -318,9 +318,13 @@ struct RBasic {
     VALUE klass;
 };
 
+/* there is no iv_tbl any more; extensions use rb_ivar_get(),
+   rb_ivar_set() and rb_ivar_foreach() */
 struct RObject {
     struct RBasic basic;
-    struct st_table *iv_tbl;
+    VALUE iv_index;		/* slots of its ivars, mostly its class's; or 0 */
+    long iv_len;
+    VALUE *iv_ptr;		/* Qundef in slots not set */
 };
 
 struct RClass {
@@ -336,6 +340,7 @@ struct RFloat {
 };
 
 #define ELTS_SHARED FL_USER2
+#define ELTS_EMBED  FL_USER4	/* ptr points into the object's own aux */
 
 struct RString {
     struct RBasic basic;
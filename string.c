@@ -31,12 +31,32 @@ VALUE rb_cString;
 #define STR_ASSOC   FL_USER3
 #define STR_NOCAPA  (ELTS_SHARED|STR_ASSOC)
 
+/*
+ * Strings of up to STR_EMBED_LEN_MAX bytes keep their contents (and the
+ * terminating NUL) in the aux union of the object slot instead of a
+ * malloc'ed buffer.  An embedded string is never shared nor associated,
+ * since both of those need aux for themselves.
+ */
+#define STR_EMBED   ELTS_EMBED
+#define STR_EMBED_P(str) FL_TEST(str, STR_EMBED)
+#define STR_EMBED_PTR(str) ((char *)&RSTRING(str)->aux)
+#define STR_EMBED_LEN_MAX ((long)sizeof(((struct RString *)0)->aux) - 1)
+#define STR_CAPA(str) (STR_EMBED_P(str) ? STR_EMBED_LEN_MAX : RSTRING(str)->aux.capa)
+
 #define RESIZE_CAPA(str,capacity) do {\
-    REALLOC_N(RSTRING(str)->ptr, char, (capacity)+1);\
-    if (!FL_TEST(str, STR_NOCAPA))\
-        RSTRING(str)->aux.capa = (capacity);\
+    if (STR_EMBED_P(str)) {\
+	if ((capacity) > STR_EMBED_LEN_MAX)\
+	    str_unembed(str, capacity);\
+    }\
+    else {\
+	REALLOC_N(RSTRING(str)->ptr, char, (capacity)+1);\
+	if (!FL_TEST(str, STR_NOCAPA))\
+	    RSTRING(str)->aux.capa = (capacity);\
+    }\
 } while (0)
 
+static void str_unembed _((VALUE, long));
+
 VALUE rb_fs;
 
 static inline void
@@ -88,8 +108,14 @@ str_new(klass, ptr, len)
 
     str = str_alloc(klass);
     RSTRING(str)->len = len;
-    RSTRING(str)->aux.capa = len;
-    RSTRING(str)->ptr = ALLOC_N(char,len+1);
+    if (len <= STR_EMBED_LEN_MAX) {
+	FL_SET(str, STR_EMBED);
+	RSTRING(str)->ptr = STR_EMBED_PTR(str);
+    }
+    else {
+	RSTRING(str)->aux.capa = len;
+	RSTRING(str)->ptr = ALLOC_N(char,len+1);
+    }
     if (ptr) {
 	memcpy(RSTRING(str)->ptr, ptr, len);
     }
@@ -140,8 +166,13 @@ static VALUE
 str_new3(klass, str)
     VALUE klass, str;
 {
-    VALUE str2 = str_alloc(klass);
+    VALUE str2;
 
+    if (STR_EMBED_P(str)) {
+	/* copying is cheaper than sharing */
+	return str_new(klass, RSTRING(str)->ptr, RSTRING(str)->len);
+    }
+    str2 = str_alloc(klass);
     RSTRING(str2)->len = RSTRING(str)->len;
     RSTRING(str2)->ptr = RSTRING(str)->ptr;
     RSTRING(str2)->aux.shared = str;
@@ -164,8 +195,12 @@ static VALUE
 str_new4(klass, str)
     VALUE klass, str;
 {
-    VALUE str2 = str_alloc(klass);
+    VALUE str2;
 
+    if (STR_EMBED_P(str)) {
+	return str_new(klass, RSTRING(str)->ptr, RSTRING(str)->len);
+    }
+    str2 = str_alloc(klass);
     RSTRING(str2)->len = RSTRING(str)->len;
     RSTRING(str2)->ptr = RSTRING(str)->ptr;
     if (FL_TEST(str, ELTS_SHARED)) {
@@ -263,28 +298,34 @@ rb_str_shared_replace(str, str2)
 {
     if (str == str2) return;
     rb_str_modify(str);
-    if (!FL_TEST(str, ELTS_SHARED)) free(RSTRING(str)->ptr);
+    if (!FL_TEST(str, ELTS_SHARED|STR_EMBED)) free(RSTRING(str)->ptr);
+    FL_UNSET(str, STR_NOCAPA|STR_EMBED);
     if (NIL_P(str2)) {
 	RSTRING(str)->ptr = 0;
 	RSTRING(str)->len = 0;
 	RSTRING(str)->aux.capa = 0;
-	FL_UNSET(str, STR_NOCAPA);
 	return;
     }
-    RSTRING(str)->ptr = RSTRING(str2)->ptr;
     RSTRING(str)->len = RSTRING(str2)->len;
-    FL_UNSET(str, STR_NOCAPA);
-    if (FL_TEST(str2, STR_NOCAPA)) {
-	FL_SET(str, RBASIC(str2)->flags & STR_NOCAPA);
-	RSTRING(str)->aux.shared = RSTRING(str2)->aux.shared;
+    if (STR_EMBED_P(str2)) {
+	FL_SET(str, STR_EMBED);
+	RSTRING(str)->ptr = STR_EMBED_PTR(str);
+	memcpy(RSTRING(str)->ptr, RSTRING(str2)->ptr, RSTRING(str2)->len+1);
     }
     else {
-	RSTRING(str)->aux.capa = RSTRING(str2)->aux.capa;
+	RSTRING(str)->ptr = RSTRING(str2)->ptr;
+	if (FL_TEST(str2, STR_NOCAPA)) {
+	    FL_SET(str, RBASIC(str2)->flags & STR_NOCAPA);
+	    RSTRING(str)->aux.shared = RSTRING(str2)->aux.shared;
+	}
+	else {
+	    RSTRING(str)->aux.capa = RSTRING(str2)->aux.capa;
+	}
     }
     RSTRING(str2)->ptr = 0;	/* abandon str2 */
     RSTRING(str2)->len = 0;
     RSTRING(str2)->aux.capa = 0;
-    FL_UNSET(str2, STR_NOCAPA);
+    FL_UNSET(str2, STR_NOCAPA|STR_EMBED);
     if (OBJ_TAINTED(str2)) OBJ_TAINT(str);
 }
 
@@ -493,6 +534,21 @@ str_make_independent(str)
     FL_UNSET(str, STR_NOCAPA);
 }
 
+static void
+str_unembed(str, capa)
+    VALUE str;
+    long capa;
+{
+    char *ptr;
+
+    ptr = ALLOC_N(char, capa+1);
+    memcpy(ptr, RSTRING(str)->ptr, RSTRING(str)->len);
+    ptr[RSTRING(str)->len] = '\0';
+    FL_UNSET(str, STR_EMBED);
+    RSTRING(str)->ptr = ptr;
+    RSTRING(str)->aux.capa = capa;
+}
+
 void
 rb_str_modify(str)
     VALUE str;
@@ -513,6 +569,9 @@ rb_str_associate(str, add)
 	if (FL_TEST(str, ELTS_SHARED)) {
 	    str_make_independent(str);
 	}
+	else if (STR_EMBED_P(str)) {
+	    str_unembed(str, RSTRING(str)->len);
+	}
 	else if (RSTRING(str)->aux.capa != RSTRING(str)->len) {
 	    RESIZE_CAPA(str, RSTRING(str)->len);
 	}
@@ -676,10 +735,7 @@ rb_str_resize(str, len)
     rb_str_modify(str);
     if (len != RSTRING(str)->len) {
 	if (RSTRING(str)->len < len || RSTRING(str)->len - len > 1024) {
-	    REALLOC_N(RSTRING(str)->ptr, char, len+1);
-	    if (!FL_TEST(str, STR_NOCAPA)) {
-		RSTRING(str)->aux.capa = len;
-	    }
+	    RESIZE_CAPA(str, len);
 	}
 	RSTRING(str)->len = len;
 	RSTRING(str)->ptr[len] = '\0';	/* sentinel */
@@ -705,7 +761,7 @@ str_buf_cat(str, ptr, len)
 	capa = RSTRING(str)->aux.capa = RSTRING(str)->len;
     }
     else {
-	capa = RSTRING(str)->aux.capa;
+	capa = STR_CAPA(str);
     }
     if (RSTRING(str)->len >= LONG_MAX - len) {
 	rb_raise(rb_eArgError, "string sizes too big");
@@ -2146,10 +2202,10 @@ str_gsub(argc, argv, str, bang)
     *bp = '\0';
     rb_str_unlocktmp(dest);
     if (bang) {
-	if (str_independent(str)) {
+	if (str_independent(str) && !STR_EMBED_P(str)) {
 	    free(RSTRING(str)->ptr);
 	}
-	FL_UNSET(str, STR_NOCAPA);
+	FL_UNSET(str, STR_NOCAPA|STR_EMBED);
 	RSTRING(str)->ptr = buf;
 	RSTRING(str)->aux.capa = blen;
 	RSTRING(dest)->ptr = 0;
@@ -2246,20 +2302,29 @@ rb_str_replace(str, str2)
 
     StringValue(str2);
     if (FL_TEST(str2, ELTS_SHARED)) {
-	if (str_independent(str)) {
+	if (str_independent(str) && !STR_EMBED_P(str)) {
 	    free(RSTRING(str)->ptr);
 	}
 	RSTRING(str)->len = RSTRING(str2)->len;
 	RSTRING(str)->ptr = RSTRING(str2)->ptr;
 	FL_SET(str, ELTS_SHARED);
-	FL_UNSET(str, STR_ASSOC);
+	FL_UNSET(str, STR_ASSOC|STR_EMBED);
 	RSTRING(str)->aux.shared = RSTRING(str2)->aux.shared;
     }
     else {
 	rb_str_modify(str);
+	if (!RSTRING(str)->ptr && !FL_TEST(str, STR_NOCAPA) &&
+	    RSTRING(str2)->len <= STR_EMBED_LEN_MAX) {
+	    /* fresh from str_alloc (dup, clone) */
+	    FL_SET(str, STR_EMBED);
+	    RSTRING(str)->ptr = STR_EMBED_PTR(str);
+	}
 	rb_str_resize(str, RSTRING(str2)->len);
 	memcpy(RSTRING(str)->ptr, RSTRING(str2)->ptr, RSTRING(str2)->len);
 	if (FL_TEST(str2, STR_ASSOC)) {
+	    if (STR_EMBED_P(str)) {
+		str_unembed(str, RSTRING(str)->len);
+	    }
 	    FL_SET(str, STR_ASSOC);
 	    RSTRING(str)->aux.shared = RSTRING(str2)->aux.shared;
 	}
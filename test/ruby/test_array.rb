@@ -142,4 +142,31 @@ class TestArray < Test::Unit::TestCase
     assert_equal([0, 1, 12, 13, 14, 5], [0, 1, 2, 3, 4, 5].fill(2..-2){|i| i+10})
     assert_equal([0, 1, 12, 13, 4, 5], [0, 1, 2, 3, 4, 5].fill(2...-2){|i| i+10})
   end
+
+  def test_small_array_growth
+    a = [1]
+    a << 2 << 3
+    assert_equal([1, 2, 3], a)
+    b = []
+    b.unshift(:x)
+    b.unshift(:y)
+    assert_equal([:y, :x], b)
+    c = [[1, 2], [3]].flatten
+    assert_equal([1, 2, 3], c)
+    d = [:a].clone
+    d.concat([:b, :c])
+    assert_equal([:a, :b, :c], d)
+    e = [0]
+    e[5] = 5
+    assert_equal([0, nil, nil, nil, nil, 5], e)
+    f = [1, 2, 3]
+    g = f[1, 1]
+    f[1] = :changed
+    assert_equal([2], g)
+    g.replace([4, 5, 6])
+    assert_equal([4, 5, 6], g)
+    g.replace([7])
+    assert_equal([7], g.dup)
+    assert_equal([nil], [nil, 1].compact!.fill(nil))
+  end
 end
@@ -1,5 +1,8 @@
 require 'test/unit'
 
+$:.replace([File.dirname(File.expand_path(__FILE__))] | $:)
+require 'envutil'
+
 class TestCall < Test::Unit::TestCase
   def aaa(a, b=100, *rest)
     res = [a, b]
@@ -16,4 +19,158 @@ class TestCall < Test::Unit::TestCase
     assert_equal([1, 2, 3, 4], aaa(1, 2, 3, 4))
     assert_equal([1, 2, 3, 4], aaa(1, *[2, 3, 4]))
   end
+
+  def test_call_site_cache
+    c = Class.new { def foo; :c; end }
+    d = Class.new(c)
+    m = Module.new { def foo; :m; end }
+    call = lambda {|o| o.foo }
+    o = d.new
+
+    assert_equal(:c, call[o])
+    d.class_eval { def foo; :d; end }
+    assert_equal(:d, call[o])
+    d.class_eval { remove_method :foo }
+    assert_equal(:c, call[o])
+    d.class_eval { include m }
+    assert_equal(:m, call[o])
+    def o.foo; :o; end
+    assert_equal(:o, call[o])
+    assert_equal(:m, call[d.new])
+    c.class_eval { alias_method :bar, :foo; private :foo }
+    assert_raises(NoMethodError) { call[c.new] }
+    assert_equal(:c, c.new.bar)
+    assert_equal([:c, :m, :o], [c.new.bar, d.new.foo, o.foo])
+
+    e = Class.new { def method_missing(*a) :missing end }
+    x = e.new
+    2.times { assert_equal(:missing, call[x]) }
+    e.class_eval { def foo; :e; end }
+    assert_equal(:e, call[x])
+  end
+
+  def test_call_site_cache_invalidation
+    c = Class.new { def foo; :c; end }
+    d = Class.new(c) { def foo; [:d, super]; end }
+    m = Module.new
+    n = Module.new
+    call = lambda {|o| o.foo }
+    o = d.new
+
+    assert_equal([:d, :c], call[o])
+    d.class_eval { include m }
+    assert_equal([:d, :c], call[o])
+    m.module_eval { def foo; :m; end }
+    assert_equal([:d, :m], call[o])
+    c.class_eval { include n }
+    m.module_eval { remove_method :foo }
+    assert_equal([:d, :c], call[o])
+    c.class_eval { remove_method :foo }
+    n.module_eval { def foo; :n; end }
+    assert_equal([:d, :n], call[o])
+
+    e = Class.new(c)
+    assert_equal(:n, call[e.new])
+    c.class_eval { def foo; :c2; end }
+    assert_equal(:c2, call[e.new])
+    assert_equal([:d, :c2], call[o])
+
+    s = e.new
+    assert_equal(:c2, call[s])
+    def s.bar; end
+    s.extend(Module.new { def foo; :x; end })
+    assert_equal(:x, call[s])
+    assert_equal(:c2, call[e.new])
+    e.class_eval { private :foo }
+    assert_raises(NoMethodError) { call[e.new] }
+    assert_equal([:d, :c2], call[o])
+  end
+
+  def test_basic_operators
+    max = 2 ** (1.size * 8 - 2) - 1
+    nan = 0.0 / 0.0
+    assert_equal([max + 1, -max - 2, max * 2, 0, 2.5, -0.5, 3.0],
+                 [max + 1, -max - 1 - 1, max * 2, max * 0, 1 + 1.5, 1 - 1.5, 2 * 1.5])
+    assert_equal([true, true, false, false, true], [1 < 2, 2 <= 2, 1 > 2, 1 >= 2, 3 == 3])
+    assert_equal([true, true, false, true, false], [1.5 < 2, 2.0 <= 2, 1.5 > 2.5, 2.5 >= 2, 2.0 == 3])
+    assert_equal([false, false, false, false, false], [nan < 1, nan <= 1.0, nan > 1, nan >= nan, nan == nan])
+    assert_equal(true, 1 == 1.0)
+    assert_equal(false, 1 == :a)
+    a = [1, 2, 3]
+    assert_equal([1, 3, nil, [2, 3]], [a[0], a[-1], a[5], a[1..2]])
+    h = Hash.new { |hash, k| k * 2 }
+    h[1] = :one
+    assert_equal([:one, 4], [h[1], h[2]])
+    sub = Class.new(Array) { def [](i) :sub end }.new
+    assert_equal(:sub, sub[0])
+    o = Object.new
+    def o.+(x) [:plus, x] end
+    assert_equal([:plus, 1], o + 1)
+  end
+
+  def mul(a, b)
+    a * b
+  end
+
+  def test_fixnum_multiplication_overflow
+    max = 2 ** (1.size * 8 - 2) - 1
+    10.times do
+      assert_equal(1267650600228229401496703205376, mul(2 ** 40, 2 ** 60))
+      assert_equal(2 ** 70, mul(2 ** 40, 2 ** 30))
+      assert_equal(-(2 ** 70), mul(-(2 ** 40), 2 ** 30))
+      assert_equal(max * max, mul(max, max))
+      assert_equal(max * -max, mul(max, -max))
+      assert_equal(-max - 1, mul(-(max / 2 + 1), 2))
+      assert_equal(815915283247897734345611269596115894272000000000,
+                   (1..40).inject(1) { |f, i| mul(f, i) })
+    end
+  end
+
+  def deep_yield(n)
+    [1].each { deep_yield(n + 1) }
+  end
+
+  def test_stack_overflow_with_basic_operators
+    3.times { assert_raise(SystemStackError) { deep_yield(0) } }
+  end
+
+  def test_redefined_basic_operators
+    script = <<-'EOS'
+      def ops(x, y) [x + y, x - y, x * y, x < y, x <= y, x > y, x >= y, x == y] end
+      def aref(a, i) a[i] end
+      r = [ops(1, 2), ops(1.5, 2), aref([1], 0), aref({0 => 1}, 0)]
+      class Fixnum; def *(o) :mult end end
+      class Float; def <=(o) :le end end
+      module Ref; def [](i) :ref end end
+      class Array; include Ref end
+      class Array; def [](i) :aref end end
+      class Hash; alias [] fetch end
+      r << ops(1, 2) << ops(1.5, 2) << aref([1], 0) << aref({}, 0) rescue r << $!.class
+      p r
+    EOS
+    out = IO.popen(EnvUtil.rubybin, "r+") { |io| io.write(script); io.close_write; io.read }
+    assert_equal([[3, -1, 2, true, true, false, false, false],
+                  [3.5, -0.5, 3.0, true, true, false, false, false], 1, 1,
+                  [3, -1, :mult, true, true, false, false, false],
+                  [3.5, -0.5, 3.0, true, :le, false, false, false], :aref,
+                  IndexError].inspect + "\n", out)
+  end
+
+  def test_private_basic_operator
+    script = <<-'EOS'
+      def plus(x, y) x + y end
+      def three() 1 + 2 end
+      3.times { plus(1, 2); three }
+      class Fixnum; private :+ end
+      p [(plus(1, 2) rescue $!.class), (three rescue $!.class), (1 + 2 rescue $!.class)]
+    EOS
+    saved = ENV["RUBY_COMPILE_THRESHOLD"]
+    ["0", "1"].each do |threshold|
+      ENV["RUBY_COMPILE_THRESHOLD"] = threshold
+      out = IO.popen(EnvUtil.rubybin, "r+") { |io| io.write(script); io.close_write; io.read }
+      assert_equal("[NoMethodError, NoMethodError, NoMethodError]\n", out, "threshold #{threshold}")
+    end
+  ensure
+    ENV["RUBY_COMPILE_THRESHOLD"] = saved
+  end
 end
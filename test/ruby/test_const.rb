@@ -30,4 +30,51 @@ class TestConst < Test::Unit::TestCase
     assert_equal(1, (Object <=> String))
     assert_equal(nil, (Array <=> String))
   end
+
+  module Cached
+    A = :a
+    def self.get; A end
+    def self.get_from(mod) mod::A end
+    def self.top; ::CachedTop end
+  end
+
+  module CachedA
+    A = :included
+  end
+
+  class CachedB
+    A = :b
+  end
+
+  def test_cache_invalidation
+    Object.const_set(:CachedTop, 1)
+    3.times do
+      assert_equal(:a, Cached.get)
+      assert_equal(:b, Cached.get_from(CachedB))
+      assert_equal(:a, Cached.get_from(Cached))
+      assert_equal(1, Cached.top)
+    end
+
+    Cached.module_eval { remove_const(:A) }
+    assert_raise(NameError) { Cached.get }
+    Cached.module_eval { include CachedA }
+    assert_equal(:included, Cached.get)
+    assert_equal(:included, Cached.get_from(Cached))
+    Cached.const_set(:A, :again)
+    assert_equal(:again, Cached.get)
+    assert_equal(:again, Cached.get_from(Cached))
+
+    Object.module_eval { remove_const(:CachedTop) }
+    Object.const_set(:CachedTop, 2)
+    assert_equal(2, Cached.top)
+
+    def Cached.const_missing(id) [:missing, id] end
+    Cached.module_eval { remove_const(:A) }
+    assert_equal(:included, Cached.get)
+    CachedA.module_eval { remove_const(:A) }
+    assert_equal([:missing, :A], Cached.get)
+    assert_equal([:missing, :A], Cached.get_from(Cached))
+  ensure
+    Object.module_eval { remove_const(:CachedTop) } if defined?(::CachedTop)
+  end
 end
@@ -1,4 +1,6 @@
 require 'test/unit'
+$:.replace([File.dirname(File.expand_path(__FILE__))] | $:)
+require 'envutil'
 
 class TestGc < Test::Unit::TestCase
   class S
@@ -27,4 +29,162 @@ class TestGc < Test::Unit::TestCase
     GC.start
     assert true   # reach here or dumps core
   end
+
+  def test_copy_on_write_friendly
+    old = GC.copy_on_write_friendly?
+    GC.copy_on_write_friendly = true
+    assert_equal(true, GC.copy_on_write_friendly?)
+    l = nil
+    100000.times {|i| l = S.new([l, i.to_s]) }
+    GC.start
+    n = 0
+    while l
+      l = l.instance_variable_get(:@a)[0]
+      n += 1
+    end
+    assert_equal(100000, n)
+    GC.copy_on_write_friendly = false
+    assert_equal(false, GC.copy_on_write_friendly?)
+    GC.start
+  ensure
+    GC.copy_on_write_friendly = old
+  end
+
+  def with_env(env)
+    saved = {}
+    env.each {|k, v| saved[k] = ENV[k]; ENV[k] = v }
+    yield
+  ensure
+    saved.each {|k, v| ENV[k] = v }
+  end
+
+  def test_heap_parameters_from_env
+    ruby = EnvUtil.rubybin
+    script = %q{a = (1..50000).map {|i| i.to_s }; print a.size, GC.count}
+    with_env("RUBY_HEAP_MIN_SLOTS" => "200000",
+             "RUBY_HEAP_SLOTS_INCREMENT" => "50000",
+             "RUBY_HEAP_SLOTS_GROWTH_FACTOR" => "1.2",
+             "RUBY_GC_MALLOC_LIMIT" => "20000000",
+             "RUBY_HEAP_FREE_MIN" => "10000",
+             "RUBY_HEAP_FREE_RATIO" => "0.3") do
+      assert_equal("500000", `#{ruby} -e '#{script}'`)
+    end
+    with_env("RUBY_HEAP_MIN_SLOTS" => "-1",
+             "RUBY_HEAP_SLOTS_GROWTH_FACTOR" => "x",
+             "RUBY_HEAP_FREE_RATIO" => "2") do
+      assert_match(/\A50000[1-9]/, `#{ruby} -e '#{script}'`)
+    end
+  end
+
+  def test_stat
+    GC.start
+    stat = GC.stat
+    assert_kind_of(Hash, stat)
+    assert_equal(GC.count, stat[:count])
+    assert_equal(GC.time, stat[:time])
+    assert_equal(stat[:time], stat[:mark_time] + stat[:sweep_time])
+    assert_operator(stat[:heap_used], :>, 0)
+    assert_operator(stat[:heap_live_num] + stat[:heap_free_num], :<=, stat[:heap_length])
+    count = GC.count
+    objs = stat[:total_allocated_object]
+    1000.times { Object.new }
+    GC.start
+    assert_equal(count + 1, GC.count)
+    assert_operator(GC.stat[:total_allocated_object], :>=, objs + 1000)
+    assert_operator(GC.stat[:total_freed_object], :>=, 1000)
+  end
+
+  def test_clear_stats
+    GC.start
+    GC.clear_stats
+    assert_equal(0, GC.count)
+    assert_equal(0, GC.time)
+    GC.start
+    assert_equal(1, GC.count)
+  end
+
+  def test_many_heaps
+    ruby = EnvUtil.rubybin
+    script = %q{
+      a = (1..40000).map {|i| i.to_s }
+      print GC.stat[:heap_used] > 50, a.all? {|s| ObjectSpace._id2ref(s.object_id).equal?(s) }
+    }
+    with_env("RUBY_HEAP_MIN_SLOTS" => "500",
+             "RUBY_HEAP_SLOTS_INCREMENT" => "500",
+             "RUBY_HEAP_SLOTS_GROWTH_FACTOR" => "1") do
+      assert_equal("truetrue", `#{ruby} -e '#{script}'`)
+    end
+  end
+
+  class L < S; end
+
+  def test_lazy_sweep
+    old = GC.lazy_sweep?
+    GC.lazy_sweep = true
+    assert_equal(true, GC.lazy_sweep?)
+    l = nil
+    100000.times {|i| l = L.new([l, i.to_s]) }
+    count = GC.count
+    200000.times { S.new(nil) } until GC.count > count
+    n = 0
+    ObjectSpace.each_object(L) { n += 1 }
+    assert_equal(100000, n)
+    assert_same(l, ObjectSpace._id2ref(l.object_id))
+    n = 0
+    while l
+      l = l.instance_variable_get(:@a)[0]
+      n += 1
+    end
+    assert_equal(100000, n)
+    GC.lazy_sweep = false
+    assert_equal(false, GC.lazy_sweep?)
+    GC.start
+  ensure
+    GC.lazy_sweep = old
+  end
+
+  def test_lazy_sweep_from_env
+    ruby = EnvUtil.rubybin
+    with_env("RUBY_GC_LAZY_SWEEP" => "1") do
+      assert_equal("true", `#{ruby} -e 'print GC.lazy_sweep?'`)
+    end
+  end
+
+  def test_fragmentation
+    f = GC.fragmentation
+    assert_equal(f[:pages], GC.stat[:heap_used])
+    assert_equal(f[:pages], f[:occupancy].inject(0) {|n, c| n + c })
+    assert_equal(11, f[:occupancy].size)
+    assert_equal(f[:empty_pages], f[:occupancy][0])
+    assert_operator(f[:full_pages], :<=, f[:occupancy][10])
+    assert_operator(f[:live] + f[:free], :<=, f[:pages] * f[:page_slots])
+    assert_operator(f[:fragmentation], :>=, 0.0)
+    assert_operator(f[:fragmentation], :<, 1.0)
+  end
+
+  def test_trim
+    a = (1..200000).map {|i| i.to_s }
+    pages = GC.stat[:heap_used]
+    a = nil
+    assert_operator(GC.trim, :>, 0)
+    assert_operator(GC.stat[:heap_used], :<, pages)
+    assert_equal(0, GC.fragmentation[:empty_pages])
+    assert_nothing_raised { (1..200000).map {|i| i.to_s } }
+  end
+
+  def test_small_heap
+    return unless GC.stat.has_key?(:heap_small_used)
+    a = (1..100000).map {|i| i + 0.5 }
+    GC.start
+    pages = GC.stat[:heap_small_used]
+    assert_operator(pages, :>, 1)
+    assert_equal(5000100000.0, a.inject(0) {|s, x| s + x })
+    f = a[49999]
+    assert_same(f, ObjectSpace._id2ref(f.object_id))
+    assert_equal(:small_heap, ObjectSpace._id2ref(:small_heap.object_id))
+    a = f = nil
+    GC.trim
+    assert_operator(GC.stat[:heap_small_used], :<, pages)
+    assert_equal(1.5, [1.0].map {|x| x + 0.5 }.first)
+  end
 end
@@ -474,4 +474,23 @@ class TestIterator < Test::Unit::TestCase
   def test_block_given_within_iterator
     assert_equal(["b"], ["a", "b", "c"].grep(IterString.new("b")) {|s| s})
   end
+
+  def test_block_vars_per_yield
+    procs = []
+    seen = []
+    [1, 2, 3].each do |x|
+      seen << (defined?(y) && y)
+      y = x * 10
+      procs << lambda { [x, y] } if x != 2
+    end
+    assert_equal([nil, nil, nil], seen)
+    assert_equal([[1, 10], [3, 30]], procs.map { |pr| pr.call })
+    vars = [1, 2].map { |x| before = local_variables; z = x; [before, local_variables] }
+    assert_equal(vars[0], vars[1])
+    assert_equal(["before", "z"], (vars[0][1] - vars[0][0]).sort)
+    b = [1, 2, 3].map { |x| binding }
+    assert_equal([1, 2, 3], b.map { |bi| eval("x", bi) })
+    assert_equal([[1], [2, 2], nil], [[1], [2, 2], nil].map { |x| x })
+    assert_equal([1, 2], [[1, 2]].map { |x, y| [x, y] }.first)
+  end
 end
@@ -1,4 +1,6 @@
 require 'test/unit'
+$:.replace([File.dirname(File.expand_path(__FILE__))] | $:)
+require 'envutil'
 
 class TestObjectSpace < Test::Unit::TestCase
   def self.deftest_id2ref(obj)
@@ -33,4 +35,118 @@ End
   deftest_id2ref(true)
   deftest_id2ref(false)
   deftest_id2ref(nil)
+
+  class Traced; end
+
+  def test_trace_allocations
+    ObjectSpace.clear_allocation_sites
+    line = __LINE__ + 1
+    r = ObjectSpace.trace_allocations { 1000.times { Traced.new }; :done }
+    assert_equal(:done, r)
+    site = ObjectSpace.allocation_sites.find {|s| s[2] == Traced }
+    assert_equal([__FILE__, line, Traced, 1000], site[0, 4])
+    assert_operator(site[4], :>=, 1000)
+    10.times { Traced.new }
+    assert_equal(1000, ObjectSpace.allocation_sites.find {|s| s[2] == Traced }[3])
+    ObjectSpace.clear_allocation_sites
+    assert_equal([], ObjectSpace.allocation_sites)
+  end
+
+  def test_trace_allocations_sampled
+    ObjectSpace.clear_allocation_sites
+    ObjectSpace.trace_allocations(10)
+    begin
+      10000.times { Traced.new }
+    ensure
+      ObjectSpace.untrace_allocations
+    end
+    site = ObjectSpace.allocation_sites.find {|s| s[2] == Traced }
+    assert_operator(site[3], :>, 5000)
+    assert_operator(site[3], :<, 15000)
+    assert_raise(ArgumentError) { ObjectSpace.trace_allocations(0) }
+  ensure
+    ObjectSpace.clear_allocation_sites
+  end
+
+  def test_dump_allocation_sites
+    ObjectSpace.clear_allocation_sites
+    ObjectSpace.trace_allocations { 100.times { Traced.new } }
+    path = "dump_allocation_sites.#{$$}.tsv"
+    n = ObjectSpace.dump_allocation_sites(path)
+    lines = File.readlines(path)
+    assert_equal(n + 1, lines.size)
+    assert_equal("count\tbytes\tfile\tline\tclass\n", lines[0])
+    assert(lines.any? {|l| /\A100\t\d+\t#{Regexp.quote(__FILE__)}\t\d+\t#{self.class}::Traced$/ =~ l })
+  ensure
+    File.unlink(path) if path && File.exist?(path)
+    ObjectSpace.clear_allocation_sites
+  end
+
+  def test_dump_heap
+    obj = Traced.new
+    str = "referenced"
+    obj.instance_variable_set(:@str, str)
+    path = "dump_heap.#{$$}.txt"
+    n = ObjectSpace.dump_heap(path)
+    lines = File.readlines(path)
+    assert_equal(n + 1, lines.size)
+    assert_equal("address\ttype\tclass\tsize\tname\trefs\n", lines[0])
+    addr = lambda {|o| "0x%x" % (o.object_id * 2) }
+    records = {}
+    lines[1..-1].each {|l| f = l.chomp.split("\t", -1); records[f[0]] = f }
+    klass = records[addr[Traced]]
+    assert_equal(["T_CLASS", "#{self.class}::Traced"], klass.values_at(1, 4))
+    rec = records[addr[obj]]
+    assert_equal(["T_OBJECT", addr[Traced]], rec.values_at(1, 2))
+    assert(rec[3].to_i > 0)
+    nodes, refs = rec[5].split(" ").partition {|r| records[r][1] == "T_NODE" }
+    assert_equal([addr[Traced], addr[str]].sort, refs.sort)
+    assert_equal(1, nodes.size) # the slots of Traced's instance variables
+    assert_equal("T_STRING", records[addr[str]][1])
+  ensure
+    File.unlink(path) if path && File.exist?(path)
+  end
+
+  def test_method_cache_stat
+    ObjectSpace.clear_method_cache_stats
+    o = Traced.new
+    100.times { o.frozen? }
+    stat = ObjectSpace.method_cache_stat
+    assert_operator(stat[:inline_hits], :>=, 99)
+    assert_operator(stat[:hits] + stat[:misses], :>, 0)
+    assert_equal(0, stat[:size] % stat[:ways])
+    Traced.class_eval { def cached; end; remove_method :cached }
+    assert_operator(ObjectSpace.method_cache_stat[:invalidations], :>=, 2)
+    ObjectSpace.clear_method_cache_stats
+    assert_equal(0, ObjectSpace.method_cache_stat[:invalidations])
+  end
+
+  def test_method_cache_invalidation_is_local
+    o = Object.new
+    def o.a; :a; end
+    o.a
+    ObjectSpace.clear_method_cache_stats
+    def o.b; end
+    o.a
+    def o.c; end
+    stat = ObjectSpace.method_cache_stat
+    assert_operator(stat[:invalidations], :>=, 2)
+    assert_equal(0, stat[:global_invalidations])
+    Traced.class_eval { def cached; end; remove_method :cached }
+    Traced.new.frozen?
+    Object.class_eval { def cached_in_object; end; remove_method :cached_in_object }
+    assert_operator(ObjectSpace.method_cache_stat[:global_invalidations], :>, 0)
+  end
+
+  def test_method_cache_size_from_env
+    ruby = EnvUtil.rubybin
+    saved = ENV["RUBY_METHOD_CACHE_SIZE"]
+    script = "'p ObjectSpace.method_cache_stat[:size]'"
+    ENV["RUBY_METHOD_CACHE_SIZE"] = "20000"
+    assert_equal("32768", `#{ruby} -e #{script}`.chomp)
+    ENV["RUBY_METHOD_CACHE_SIZE"] = "junk"
+    assert_equal("8192", `#{ruby} -e #{script}`.chomp)
+  ensure
+    ENV["RUBY_METHOD_CACHE_SIZE"] = saved
+  end
 end
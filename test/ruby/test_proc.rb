@@ -86,4 +86,48 @@ class TestProc < Test::Unit::TestCase
     b = lambda {}
     assert_not_equal(a, b)
   end
+
+  def take_block(&b)
+    b
+  end
+
+  def shared_locals
+    x = 1
+    [1].each { x += 1 }
+    pr = lambda { x }
+    [1].each { x += 10 }
+    x += 100
+    eval("x += 1000", binding)
+    eval("y = 5")
+    t = Thread.new { x += 10000 }
+    t.join
+    inc = take_block { x += 100000 }
+    inc.call
+    [pr.call, x, eval("y")]
+  end
+
+  def thread_locals
+    x = 0
+    t = Thread.new { Thread.pass until x == 1; x = 2 }
+    x = 1
+    t.join
+    x
+  end
+
+  def continuation_locals
+    x = 0
+    c = nil
+    callcc { |k| c = k }
+    x += 1
+    c.call if x < 3
+    x
+  end
+
+  def test_locals_outlive_call
+    5.times do
+      assert_equal([111112, 111112, 5], shared_locals)
+      assert_equal(2, thread_locals)
+      assert_equal(3, continuation_locals)
+    end
+  end
 end
@@ -16,4 +16,28 @@ class TestString < Test::Unit::TestCase
       check_sum("xyz", bits)
     }
   end
+  def test_short_string_growth
+    s = "abc"
+    s << "defgh" << "ijklmnopqrstuvwxyz"
+    assert_equal("abcdefghijklmnopqrstuvwxyz", s)
+    t = "x" * 7
+    t[7, 0] = "y"
+    assert_equal("xxxxxxxy", t)
+    assert_equal("aaaaaaaa", "zzzzzzz".succ)
+    u = "short"
+    u.replace("a much longer replacement")
+    assert_equal("a much longer replacement", u)
+    u.replace("tiny")
+    assert_equal("tiny", u)
+    assert_equal("TINY", u.sub!(/tiny/) { "TINY" })
+    assert_equal("T-I-N-Y", u.gsub!(/\B/, "-"))
+    v = "hi".clone
+    v << " there, this is long"
+    assert_equal("hi there, this is long", v)
+    w = "abc".freeze
+    x = w.dup
+    x << "def"
+    assert_equal(["abc", "abcdef"], [w, x])
+    assert_equal(["ab"], ["ab"].pack("p").unpack("p"))
+  end
 end
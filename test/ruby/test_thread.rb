@@ -0,0 +1,218 @@
+require 'test/unit'
+
+$:.replace([File.dirname(File.expand_path(__FILE__))] | $:)
+require 'envutil'
+
+class TestThread < Test::Unit::TestCase
+  def deep(n, &block)
+    n == 0 ? yield : deep(n - 1, &block)
+  end
+
+  def recurse(n)
+    begin
+      recurse(n + 1)
+    rescue SystemStackError
+      n
+    end
+  end
+
+  def test_switch_between_deep_stacks
+    threads = (1..10).map do |i|
+      Thread.new { deep(50 * i) { a = []; 20.times { |k| a << k; Thread.pass }; [i, a.size] } }
+    end
+    GC.start
+    assert_equal((1..10).map { |i| [i, 20] }, threads.map { |t| t.value })
+  end
+
+  def test_stack_overflow_in_thread
+    assert_operator(Thread.new { recurse(0) }.value, :>, 50)
+    assert_operator(Thread.new { deep(20) { recurse(0) } }.value, :>, 50)
+  end
+
+  def test_callcc_in_thread
+    v = Thread.new do
+      c = nil
+      x = callcc { |cc| c = cc; 0 }
+      c.call(x + 1) if x < 3
+      x
+    end.value
+    assert_equal(3, v)
+  end
+
+  def test_backtrace_reaches_creator
+    line = __LINE__ + 1
+    e = Thread.new { deep(3) { raise "in thread" } rescue $! }.value
+    assert_equal("in thread", e.message)
+    assert_match(/:#{line}:in `test_backtrace_reaches_creator'/, e.backtrace.join("\n"))
+  end
+
+  def test_wake_only_threads_with_ready_pipes
+    pipes = (1..60).map { IO.pipe }
+    got = []
+    threads = pipes.map { |r, w| Thread.new { got << r.read(1) } }
+    pipes.each_with_index { |(r, w), i| w.write("x") if i % 3 == 0 }
+    20.times { Thread.pass }
+    sleep 0.1
+    assert_equal(20, got.size)
+    pipes.each_with_index { |(r, w), i| w.write("y") unless i % 3 == 0 }
+    threads.each { |t| t.join }
+    assert_equal(60, got.size)
+  ensure
+    pipes.flatten.each { |io| io.close }
+  end
+
+  def test_select_in_thread
+    r, w = IO.pipe
+    assert_nil(Thread.new { IO.select([r], nil, nil, 0.05) }.value)
+    t = Thread.new { IO.select([r], nil, nil, 10) }
+    Thread.pass
+    w.write "x"
+    assert_equal([[r], [], []], t.value)
+    assert_equal([[r], [w], []], Thread.new { IO.select([r], [w]) }.value)
+  ensure
+    r.close
+    w.close
+  end
+
+  def test_close_while_waiting
+    r, w = IO.pipe
+    t = Thread.new { begin; r.read(1); rescue IOError; :closed; end }
+    Thread.pass until t.stop?
+    r.close
+    assert_equal(:closed, t.value)
+  ensure
+    w.close
+  end
+
+  def test_wait_for_descriptor_above_fd_setsize
+    return unless Process.respond_to?(:getrlimit)
+    soft, hard = Process.getrlimit(Process::RLIMIT_NOFILE)
+    if soft < 1200
+      return if hard != Process::RLIM_INFINITY && hard < 1200
+      Process.setrlimit(Process::RLIMIT_NOFILE, 1200, hard)
+    end
+    pipes = []
+    pipes << IO.pipe while pipes.empty? || pipes.last[0].fileno < 1100
+    r, w = pipes.last
+    t = Thread.new { r.read(1) }
+    Thread.pass until t.stop?
+    w.write "x"
+    w.flush
+    assert_equal("x", t.value)
+  ensure
+    pipes.flatten.each { |io| io.close } if pipes
+  end
+
+  def test_sleepers_wake_in_order
+    order = []
+    delays = [0.14, 0.04, 0.1, 0.02, 0.06, 0.12, 0.08]
+    threads = delays.map { |d| Thread.new { sleep d; order << d } }
+    early = Thread.new { sleep 10; order << :early }
+    Thread.pass until early.stop?
+    early.run
+    threads.each { |t| t.join }
+    early.join
+    assert_equal([:early] + delays.sort, order)
+  end
+
+  def test_join_and_select_time_out
+    t = Thread.new { sleep 0.2 }
+    assert_nil(t.join(0.01))
+    r, w = IO.pipe
+    assert_equal([nil] * 5,
+                 (1..5).map { |i| Thread.new { IO.select([r], nil, nil, i / 100.0) } }.map { |x| x.value })
+    assert_equal(t, t.join)
+  ensure
+    r.close
+    w.close
+  end
+
+  def test_deadline
+    assert_equal(42, Thread.deadline(1, RuntimeError) { 42 })
+    assert_raise(ThreadError) { Thread.deadline(0.05) { sleep } }
+    assert_raise(RuntimeError) { Thread.deadline(0.05, RuntimeError) { loop {} } }
+    assert_raise(RuntimeError) { Thread.deadline(0.05, RuntimeError) { sleep } }
+    r, w = IO.pipe
+    assert_raise(RuntimeError) { Thread.deadline(0.05, RuntimeError) { r.read(1) } }
+    e = assert_raise(IndexError) do
+      Thread.deadline(0.05, IndexError) { Thread.deadline(5, RuntimeError) { sleep } }
+    end
+    assert_equal("execution expired", e.message)
+    assert_raise(RuntimeError) do
+      Thread.deadline(5, IndexError) { Thread.deadline(0.05, RuntimeError) { sleep } }
+    end
+    sleep 0.1
+  ensure
+    r.close
+    w.close
+  end
+
+  def test_deadlines_of_threads
+    threads = [0.08, 0.02, 0.05].map do |d|
+      Thread.new { Thread.deadline(d, RuntimeError) { sleep } rescue d }
+    end
+    assert_equal([0.08, 0.02, 0.05], threads.map { |t| t.value })
+  end
+
+  def test_timeout_starts_no_thread
+    require 'timeout'
+    n = Thread.list.size
+    assert_equal(n, Timeout.timeout(1) { Thread.list.size })
+    assert_raise(Timeout::Error) { Timeout.timeout(0.05) { sleep } }
+  end
+
+  def test_timeout_stopping_only_thread
+    require 'timeout'
+    require 'thread'
+    return unless Thread.list.size == 1
+    assert_raise(ThreadError) { Thread.stop }
+    assert_raise(Timeout::Error) { Timeout.timeout(0.05) { Thread.stop } }
+    assert_raise(Timeout::Error) { Timeout.timeout(0.05) { Queue.new.pop } }
+    m = Mutex.new
+    cv = ConditionVariable.new
+    assert_raise(Timeout::Error) do
+      m.synchronize { Timeout.timeout(0.05) { cv.wait(m) } }
+    end
+  end
+
+  def test_pool_reuse
+    stat = Thread.pool_stat
+    return if stat[:limit] == 0
+    reused = stat[:threads_reused] + stat[:buffers_reused] + stat[:stacks_reused]
+    2.times do
+      20.times { Thread.new { callcc { |c| c } }.join }
+      GC.start
+    end
+    stat = Thread.pool_stat
+    assert_operator(stat[:threads], :<=, stat[:limit])
+    assert_operator(stat[:buffers], :<=, stat[:limit])
+    assert_operator(stat[:stacks], :<=, stat[:limit])
+    assert_operator(stat[:threads_reused] + stat[:buffers_reused] + stat[:stacks_reused], :>, reused)
+  end
+
+  def test_pool_size_from_env
+    saved = ENV["RUBY_THREAD_POOL_SIZE"]
+    ENV["RUBY_THREAD_POOL_SIZE"] = "3"
+    assert_equal("3", `#{EnvUtil.rubybin} -e 'p Thread.pool_stat[:limit]'`.chomp)
+  ensure
+    ENV["RUBY_THREAD_POOL_SIZE"] = saved
+  end
+
+  # only there does a thread get a stack of its own
+  if /i\d86|x86_64/ =~ RUBY_PLATFORM && /cygwin|mingw|mswin|bccwin/ !~ RUBY_PLATFORM
+    def test_thread_stack_size_from_env
+      ruby = EnvUtil.rubybin
+      saved = ENV["RUBY_THREAD_STACK_SIZE"]
+      script = "'def r(n) begin; r(n + 1); rescue SystemStackError; n; end end;" +
+        " p Thread.new { r(0) }.value'"
+      ENV["RUBY_THREAD_STACK_SIZE"] = "524288"
+      small = `#{ruby} -e #{script}`.to_i
+      ENV["RUBY_THREAD_STACK_SIZE"] = "4194304"
+      large = `#{ruby} -e #{script}`.to_i
+      assert_operator(small, :>, 0)
+      assert_operator(large, :>, small)
+    ensure
+      ENV["RUBY_THREAD_STACK_SIZE"] = saved
+    end
+  end
+end
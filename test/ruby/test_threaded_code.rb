@@ -0,0 +1,325 @@
+require 'test/unit'
+
+$:.replace([File.dirname(File.expand_path(__FILE__))] | $:)
+require 'envutil'
+
+class TestThreadedCode < Test::Unit::TestCase
+  CALLS = 20 # well past the calls it takes to compile a method
+
+  # every call must give the same answer, compiled or not
+  def assert_same_result(expected, name, *args)
+    CALLS.times do |i|
+      assert_equal(expected, send(name, *args), "call #{i} of #{name}")
+    end
+  end
+
+  def loops(n)
+    a = []
+    i = 0
+    while i < n
+      i += 1
+      next if i == 2
+      a << i
+    end
+    until i == 0
+      i -= 1
+      break if i < n - 2
+    end
+    begin
+      a << :once
+    end while false
+    a << i
+  end
+
+  def loop_values(n)
+    i = 0
+    v = while true
+      i += 1
+      break i * 10 if i == n
+    end
+    w = while false; end
+    [v, w]
+  end
+
+  def nested_loops
+    a = []
+    i = 0
+    while i < 3
+      i += 1
+      j = 0
+      while true
+        j += 1
+        next if j == 1
+        break if j > 3
+        a << [i, j]
+      end
+      redo_done = a.size > 100
+      break if i == 2 and !redo_done
+    end
+    a
+  end
+
+  def redo_loop
+    a = []
+    i = 0
+    tries = 0
+    while i < 3
+      i += 1
+      tries += 1
+      if tries == 2
+        redo
+      end
+      a << [i, tries]
+    end
+    a
+  end
+
+  # break, next and redo left to rb_eval go through the loop's tag
+  def jumps_through_tag
+    a = []
+    i = 0
+    while i < 5
+      i += 1
+      case i
+      when 2 then next
+      when 4 then begin; break; rescue; end
+      end
+      a << i
+    end
+    j = 0
+    [1, 2].each { |x| j += x; next }
+    a << j
+  end
+
+  def return_in_loop(n)
+    i = 0
+    while true
+      i += 1
+      return i if i == n
+    end
+  end
+
+  def return_through_tag(n)
+    while true
+      [1].each { return n }
+    end
+  end
+
+  attr_accessor :attr
+
+  def calls
+    self.attr = 1
+    v = (self.attr = 5)
+    h = {}
+    w = (h[:a] = 3)
+    [v, w, attr, h, private_one, private_one(2), :sym.to_s]
+  end
+
+  def private_one(x = 1)
+    x
+  end
+  private :private_one
+
+  def literals(x)
+    s = "a#{x}b#{x * 2}c"
+    [s, [1, [x]], {x => s}, (x..x+2), (x...x), [], !x, x && s, nil || x,
+     @ivar = x, @ivar, $tcode_gvar = x, $tcode_gvar, Comparable, "lit"]
+  end
+
+  def interpolate(x)
+    "<#{x}>"
+  end
+
+  def yields(x)
+    [block_given?, yield, yield(x), yield(x, x)]
+  end
+
+  def test_loops
+    assert_same_result([1, 3, 4, :once, 1], :loops, 4)
+    assert_same_result([30, nil], :loop_values, 3)
+    assert_same_result([[1, 2], [1, 3], [2, 2], [2, 3]], :nested_loops)
+    assert_same_result([[1, 1], [3, 3]], :redo_loop)
+    assert_same_result([1, 3, 3], :jumps_through_tag)
+    assert_same_result(7, :return_in_loop, 7)
+    assert_same_result(:ok, :return_through_tag, :ok)
+  end
+
+  def test_calls
+    assert_same_result([5, 3, 5, {:a => 3}, 1, 2, "sym"], :calls)
+  end
+
+  def test_literals
+    CALLS.times do
+      r = literals(1)
+      assert_equal(["a1b2c", [1, [1]], {1 => "a1b2c"}, (1..3), (1...1), [],
+                    false, "a1b2c", 1, 1, 1, 1, 1, Comparable, "lit"], r)
+      assert_not_same(r[0], literals(1)[0])
+      assert_not_same(r.last, literals(1).last)
+    end
+    CALLS.times { assert(interpolate("x".taint).tainted?) }
+  end
+
+  def test_yield
+    CALLS.times do
+      assert_equal([true, [], [1], [1, 1]], yields(1) { |*a| a })
+    end
+  end
+
+  def undefined_name
+    no_such_name
+  end
+
+  RAISE_LINE = __LINE__ + 2
+  def raise_here
+    raise "here"
+  end
+
+  def test_errors
+    CALLS.times do
+      e = assert_raise(NameError) { undefined_name }
+      assert_match(/undefined local variable or method `no_such_name'/, e.message)
+      e = assert_raise(RuntimeError) { raise_here }
+      assert_match(/:#{RAISE_LINE}:in `raise_here'/, e.backtrace.first)
+    end
+  end
+
+  def traced(x)
+    if x
+      x += 1
+    end
+    x
+  end
+
+  def test_line_events
+    lines = []
+    CALLS.times do
+      set_trace_func(proc { |event, file, line, id, binding, klass|
+        lines << line if event == "line" && file == __FILE__
+      })
+      traced(1)
+      set_trace_func(nil)
+    end
+    first = lines[0, lines.size / CALLS]
+    assert_equal(first * CALLS, lines)
+  end
+
+  def spin
+    i = 0
+    i += 1 until @stop
+    i
+  end
+
+  def constants
+    [1 + 2, 5 - 7, 1 < 2, 3 == 4, 1 + 2 - 3 < 1, !nil, !(1 == 1), nil.nil?,
+     1.nil?, 2 ** 3, 1 + 2.5]
+  end
+
+  def arith(x, y)
+    [x + y, x - y, x < y, x == y, x + 1 == y]
+  end
+
+  def test_constants_and_arith
+    assert_same_result([3, -2, true, false, true, true, false, true,
+                        false, 8, 3.5], :constants)
+    assert_same_result([3, -1, true, false, true], :arith, 1, 2)
+    assert_same_result([3.5, -0.5, true, false, false], :arith, 1.5, 2)
+    max = 2 ** (1.size * 8 - 2) - 1
+    assert_same_result([max * 2, 0, false, true, false], :arith, max, max)
+    min = -max - 1
+    assert_same_result([min * 2, 0, false, true, false], :arith, min, min)
+    assert_same_result([min - 1, min + 1, true, false, false], :arith, min, -1)
+  end
+
+  def test_redefined_operators
+    ruby = EnvUtil.rubybin
+    saved = ENV["RUBY_COMPILE_THRESHOLD"]
+    ENV["RUBY_COMPILE_THRESHOLD"] = "1"
+    script = <<-'EOS'
+      def f; [1 + 2, 5 - 7, 1 < 2, 3 == 3, nil.nil?, 1.nil?] end
+      def g(x) [x + 1, x - 1, x < 2, x == 1] end
+      3.times { f; g(1) }
+      class Fixnum; def +(o) :plus end end
+      class Integer; def -(o) :minus end end
+      module LT; def <(o) :lt end end
+      class Fixnum; include LT end
+      class NilClass; def nil?; :nil end end
+      p f, g(1)
+      module NilP; def nil?; :nil_p end end
+      class Object; include NilP end
+      class Fixnum; alias == < end
+      p f, g(1)
+    EOS
+    out = IO.popen("#{ruby}", "r+") { |io| io.write(script); io.close_write; io.read }
+    assert_equal("[:plus, -2, true, true, :nil, false]\n" +
+                 "[:plus, 0, true, true]\n" +
+                 "[:plus, -2, true, false, :nil, :nil_p]\n" +
+                 "[:plus, 0, true, false]\n", out)
+  ensure
+    ENV["RUBY_COMPILE_THRESHOLD"] = saved
+  end
+
+  def add_one(x)
+    x + 1
+  end
+
+  UNTRACED_LINE = __LINE__ + 1
+  def untraced(x)
+    if x
+      nil
+      x = add_one(x)
+    end
+    x
+  end
+
+  def test_events_after_optimizing
+    CALLS.times { untraced(1) }
+    lines = []
+    calls = []
+    set_trace_func(proc { |event, file, line, id, binding, klass|
+      lines << line - UNTRACED_LINE if event == "line" && id == :untraced
+      calls << id if event == "c-call" && id == :+
+    })
+    untraced(1)
+    set_trace_func(nil)
+    assert_equal([1, 1, 2, 3, 5], lines)
+    assert_equal([:+], calls)
+  end
+
+  def test_thread_switch
+    @stop = true
+    CALLS.times { spin }
+    @stop = false
+    t = Thread.new { spin }
+    sleep 0.1
+    @stop = true
+    assert_operator(t.value, :>, 0)
+  end
+
+  def test_threshold_from_env
+    ruby = EnvUtil.rubybin
+    saved = ENV["RUBY_COMPILE_THRESHOLD"]
+    script = "def f(n) s = 0; i = 0; while i < n; i += 1; next if i == 3;" +
+      " s += i; end; s end; p((1..3).map { f(10) })"
+    ENV["RUBY_COMPILE_THRESHOLD"] = "0"
+    off = `#{ruby} -e '#{script}'`
+    ENV["RUBY_COMPILE_THRESHOLD"] = "1"
+    on = `#{ruby} -e '#{script}'`
+    assert_equal("[52, 52, 52]\n", off)
+    assert_equal(off, on)
+  ensure
+    ENV["RUBY_COMPILE_THRESHOLD"] = saved
+  end
+
+  def test_all_compiled_at_once
+    return if ENV["RUBY_COMPILE_THRESHOLD"] == "1"
+    ruby = EnvUtil.rubybin
+    lib = $:.find { |dir| File.exist?(File.join(dir, "test/unit.rb")) }
+    saved = ENV["RUBY_COMPILE_THRESHOLD"]
+    ENV["RUBY_COMPILE_THRESHOLD"] = "1"
+    out = `#{ruby} #{lib ? "-I#{lib}" : ""} #{__FILE__}`
+    assert_match(/ 0 failures, 0 errors$/, out)
+    assert_no_match(/\A0 tests/, out[/\d+ tests/])
+  ensure
+    ENV["RUBY_COMPILE_THRESHOLD"] = saved
+  end
+end
@@ -50,4 +50,90 @@ class TestVariable < Test::Unit::TestCase
     assert_equal("Cronus", atlas.ruler0)
     assert_equal("Zeus", atlas.ruler3)
   end
+
+  module Slots
+    attr_accessor :a
+    def set_b(v) @b = v end
+    def b; @b end
+  end
+
+  class SlotsA; include Slots; def initialize; @c = :c end end
+  class SlotsB; include Slots end
+  class SlotsC < SlotsA; end
+
+  def test_instance_variable_slots
+    # the same nodes used on instances of different classes
+    objs = [SlotsA.new, SlotsB.new, SlotsC.new, SlotsA.new]
+    objs.each_with_index {|o, i| o.a = i; o.set_b(-i) }
+    objs.each_with_index do |o, i|
+      assert_equal([i, -i], [o.a, o.b])
+    end
+    assert_equal(["@a", "@b", "@c"], objs[0].instance_variables.sort)
+    assert_equal(["@a", "@b"], objs[1].instance_variables.sort)
+
+    o = objs[3]
+    assert_equal(:c, o.send(:remove_instance_variable, :@c))
+    assert_equal(false, o.instance_variable_defined?(:@c))
+    assert_equal(["@a", "@b"], o.instance_variables.sort)
+    assert_raise(NameError) { o.send(:remove_instance_variable, :@c) }
+    o.set_b(nil)
+    assert_equal(nil, o.b)
+    assert_equal(true, o.instance_variable_defined?(:@b))
+    assert_match(/\A#<#{SlotsA}:0x[0-9a-f]+ (@a=3, @b=nil|@b=nil, @a=3)>\z/, o.inspect)
+
+    # a variable the class has not seen before, after o was made
+    objs[0].instance_variable_set(:@late, 1)
+    assert_equal(nil, o.instance_variable_get(:@late))
+    o.instance_variable_set(:@late, 2)
+    assert_equal([1, 2], [objs[0], o].map {|x| x.instance_variable_get(:@late) })
+
+    c = o.clone
+    d = o.dup
+    o.a = :changed
+    [c, d].each do |x|
+      assert_equal([3, nil, 2], [x.a, x.b, x.instance_variable_get(:@late)])
+      assert_equal(false, x.instance_variable_defined?(:@c))
+    end
+    m = Marshal.load(Marshal.dump(d))
+    assert_equal(d.instance_variables.sort, m.instance_variables.sort)
+    assert_equal([3, nil, 2], [m.a, m.b, m.instance_variable_get(:@late)])
+
+    s = SlotsB.new
+    def s.x; @x end
+    s.a = :singleton
+    s.instance_variable_set(:@x, 1)
+    assert_equal([:singleton, 1], [s.a, s.x])
+
+    o.freeze
+    assert_raise(TypeError) { o.a = 1 }
+    assert_raise(TypeError) { o.set_b(1) }
+    assert_equal(:changed, o.a)
+  end
+
+  class Sparse; attr_accessor :a end
+
+  def test_instance_variables_taken_by_another_instance
+    big = Sparse.new
+    1000.times {|i| big.instance_variable_set("@v#{i}", i) }
+    small = (1..20).map {|i| o = Sparse.new; o.a = i; o }
+    assert_equal((1..20).to_a, small.map {|o| o.a })
+    assert_equal([["@a"]] * 20, small.map {|o| o.instance_variables })
+    small[0].instance_variable_set(:@v999, :x)
+    assert_equal([1, :x, nil], [small[0].a, small[0].instance_variable_get(:@v999),
+                                small[1].instance_variable_get(:@v999)])
+    assert_equal(999, big.instance_variable_get(:@v999))
+    big.a = :big
+    assert_equal([:big, 1001], [big.a, big.instance_variables.size])
+    c = small[0].clone
+    assert_equal([1, :x], [c.a, c.instance_variable_get(:@v999)])
+
+    # the small ones must not get a slot for every variable of big
+    path = "sparse.#{$$}.txt"
+    ObjectSpace.dump_heap(path)
+    addr = "0x%x" % (small[1].object_id * 2)
+    rec = File.readlines(path).map {|l| l.split("\t") }.assoc(addr)
+    assert_operator(rec[3].to_i, :<, 1000)
+  ensure
+    File.unlink(path) if path && File.exist?(path)
+  end
 end
@@ -20,7 +20,8 @@
 
 st_table *rb_global_tbl;
 st_table *rb_class_tbl;
-static ID autoload, classpath, tmp_classpath;
+static ID autoload, classpath, tmp_classpath, ivindex;
+unsigned long ruby_const_serial = 1;
 
 void
 Init_var_tables()
@@ -30,6 +31,7 @@ Init_var_tables()
     autoload = rb_intern("__autoload__");
     classpath = rb_intern("__classpath__");
     tmp_classpath = rb_intern("__tmp_classpath__");
+    ivindex = rb_intern("__ivindex__");
 }
 
 struct fc_result {
@@ -50,8 +52,8 @@ fc_path(fc, name)
     path = rb_str_new2(rb_id2name(name));
     while (fc) {
 	if (fc->track == rb_cObject) break;
-	if (ROBJECT(fc->track)->iv_tbl &&
-	    st_lookup(ROBJECT(fc->track)->iv_tbl, classpath, &tmp)) {
+	if (RCLASS(fc->track)->iv_tbl &&
+	    st_lookup(RCLASS(fc->track)->iv_tbl, classpath, &tmp)) {
 	    tmp = rb_str_dup(tmp);
 	    rb_str_cat2(tmp, "::");
 	    rb_str_append(tmp, path);
@@ -130,10 +132,10 @@ find_class_path(klass)
 	st_foreach(rb_class_tbl, fc_i, (st_data_t)&arg);
     }
     if (arg.path) {
-	if (!ROBJECT(klass)->iv_tbl) {
-	    ROBJECT(klass)->iv_tbl = st_init_numtable();
+	if (!RCLASS(klass)->iv_tbl) {
+	    RCLASS(klass)->iv_tbl = st_init_numtable();
 	}
-	st_insert(ROBJECT(klass)->iv_tbl, classpath, arg.path);
+	st_insert(RCLASS(klass)->iv_tbl, classpath, arg.path);
 	st_delete(RCLASS(klass)->iv_tbl, &tmp_classpath, 0);
 	return arg.path;
     }
@@ -147,15 +149,15 @@ classname(klass)
     VALUE path = Qnil;
 
     if (!klass) klass = rb_cObject;
-    if (ROBJECT(klass)->iv_tbl) {
-	if (!st_lookup(ROBJECT(klass)->iv_tbl, classpath, &path)) {
+    if (RCLASS(klass)->iv_tbl) {
+	if (!st_lookup(RCLASS(klass)->iv_tbl, classpath, &path)) {
 	    ID classid = rb_intern("__classid__");
 
-	    if (!st_lookup(ROBJECT(klass)->iv_tbl, classid, &path)) {
+	    if (!st_lookup(RCLASS(klass)->iv_tbl, classid, &path)) {
 		return find_class_path(klass);
 	    }
 	    path = rb_str_new2(rb_id2name(SYM2ID(path)));
-	    st_insert(ROBJECT(klass)->iv_tbl, classpath, path);
+	    st_insert(RCLASS(klass)->iv_tbl, classpath, path);
 	    st_delete(RCLASS(klass)->iv_tbl, (st_data_t*)&classid, 0);
 	}
 	if (TYPE(path) != T_STRING) {
@@ -1003,6 +1005,184 @@ rb_copy_generic_ivar(clone, obj)
     }
 }
 
+/*
+ * A T_OBJECT keeps its instance variables in an array, at slots handed
+ * out by its class: the first time an instance sets a variable the
+ * class has not seen, the name gets the next slot, and it has that
+ * slot in every instance.  Slots are never given back; an unset or
+ * removed variable is Qundef.  The index is a NODE_IVINDEX kept in the
+ * class's iv_tbl under a name no instance variable can have.  An
+ * instance that would need many more slots than it has variables, as
+ * other instances took the slots before, gets an index of its own.
+ */
+#define IV_INDEX(obj) RNODE(ROBJECT(obj)->iv_index)
+
+static VALUE
+iv_index_of(klass)
+    VALUE klass;
+{
+    VALUE index;
+
+    if (!RCLASS(klass)->iv_tbl) {
+	RCLASS(klass)->iv_tbl = st_init_numtable();
+    }
+    else if (st_lookup(RCLASS(klass)->iv_tbl, ivindex, &index)) {
+	return index;
+    }
+    index = (VALUE)NEW_IVINDEX(0);
+    RNODE(index)->nd_ivslots = st_init_numtable();
+    st_add_direct(RCLASS(klass)->iv_tbl, ivindex, index);
+    return index;
+}
+
+/* the slot +id+ has in +obj+, or -1 */
+long
+rb_ivar_slot(obj, id)
+    VALUE obj;
+    ID id;
+{
+    st_data_t slot;
+
+    if (ROBJECT(obj)->iv_index &&
+	st_lookup(IV_INDEX(obj)->nd_ivslots, id, &slot)) {
+	return (long)slot;
+    }
+    return -1;
+}
+
+static int
+obj_ivar_get(obj, id, valp)
+    VALUE obj;
+    ID id;
+    VALUE *valp;
+{
+    long slot = rb_ivar_slot(obj, id);
+
+    if (slot < 0 || slot >= ROBJECT(obj)->iv_len) return 0;
+    if (ROBJECT(obj)->iv_ptr[slot] == Qundef) return 0;
+    if (valp) *valp = ROBJECT(obj)->iv_ptr[slot];
+    return 1;
+}
+
+/* gives +id+ the next slot of +index+ */
+static st_data_t
+ivindex_add(index, id)
+    NODE *index;
+    ID id;
+{
+    st_data_t slot = index->nd_ivslots->num_entries;
+
+    if ((long)slot == index->nd_ivcapa) {
+	long capa = index->nd_ivcapa ? index->nd_ivcapa * 2 : 4;
+
+	REALLOC_N(index->nd_ivids, ID, capa);
+	index->nd_ivcapa = capa;
+    }
+    index->nd_ivids[slot] = id;
+    st_add_direct(index->nd_ivslots, id, slot);
+    return slot;
+}
+
+/* moves the variables +obj+ has set to an index of its own, where they
+   take the first slots */
+static NODE *
+obj_ivar_unshare(obj)
+    VALUE obj;
+{
+    NODE *shared = IV_INDEX(obj), *index;
+    VALUE *ptr = ROBJECT(obj)->iv_ptr;
+    long i, n = 0;
+
+    index = NEW_IVINDEX(0);
+    index->nd_ivslots = st_init_numtable();
+    for (i = 0; i < ROBJECT(obj)->iv_len; i++) {
+	if (ptr[i] == Qundef) continue;
+	ivindex_add(index, shared->nd_ivids[i]);
+	ptr[n++] = ptr[i];
+    }
+    while (n < i) ptr[n++] = Qundef;
+    ROBJECT(obj)->iv_index = (VALUE)index;
+    return index;
+}
+
+static void
+obj_ivar_set(obj, id, val)
+    VALUE obj;
+    ID id;
+    VALUE val;
+{
+    NODE *index;
+    st_data_t slot;
+
+    if (!ROBJECT(obj)->iv_index) {
+	ROBJECT(obj)->iv_index = iv_index_of(rb_obj_class(obj));
+    }
+    index = IV_INDEX(obj);
+    if (st_lookup(index->nd_ivslots, id, &slot)) {
+	if ((long)slot < ROBJECT(obj)->iv_len) {
+	    ROBJECT(obj)->iv_ptr[slot] = val;
+	    return;
+	}
+    }
+    else {
+	slot = index->nd_ivslots->num_entries;
+    }
+    if ((long)slot >= 2 * ROBJECT(obj)->iv_len + 8) {
+	/* other instances have taken the slots up to here: rather than
+	   growing this one for them, give it its own */
+	long i, n = 0;
+
+	for (i = 0; i < ROBJECT(obj)->iv_len; i++) {
+	    if (ROBJECT(obj)->iv_ptr[i] != Qundef) n++;
+	}
+	if ((long)slot >= 2 * n + 8) {
+	    index = obj_ivar_unshare(obj);
+	    if (!st_lookup(index->nd_ivslots, id, &slot)) {
+		slot = index->nd_ivslots->num_entries;
+	    }
+	}
+    }
+    if ((long)slot == index->nd_ivslots->num_entries) {
+	ivindex_add(index, id);
+    }
+    if ((long)slot >= ROBJECT(obj)->iv_len) {
+	/* grow by its own size, not to the slots of all the variables
+	   its index has seen */
+	long len = ROBJECT(obj)->iv_len;
+	long newlen = len ? len * 2 : 4;
+	VALUE *ptr = ROBJECT(obj)->iv_ptr;
+
+	if (newlen > index->nd_ivslots->num_entries)
+	    newlen = index->nd_ivslots->num_entries;
+	if (newlen <= (long)slot) newlen = slot + 1;
+	REALLOC_N(ptr, VALUE, newlen);
+	while (len < newlen) ptr[len++] = Qundef;
+	ROBJECT(obj)->iv_ptr = ptr;
+	ROBJECT(obj)->iv_len = newlen;
+    }
+    ROBJECT(obj)->iv_ptr[slot] = val;
+}
+
+void
+rb_copy_object_ivar(clone, obj)
+    VALUE clone, obj;
+{
+    VALUE *ptr = ROBJECT(clone)->iv_ptr;
+    long len = ROBJECT(obj)->iv_len;
+
+    ROBJECT(clone)->iv_index = 0;
+    ROBJECT(clone)->iv_len = 0;
+    ROBJECT(clone)->iv_ptr = 0;
+    if (ptr) free(ptr);
+    if (len > 0) {
+	ptr = ALLOC_N(VALUE, len);
+	MEMCPY(ptr, ROBJECT(obj)->iv_ptr, VALUE, len);
+	ROBJECT(clone)->iv_ptr = ptr;
+	ROBJECT(clone)->iv_len = len;
+	ROBJECT(clone)->iv_index = ROBJECT(obj)->iv_index;
+    }
+}
+
 static VALUE
 ivar_get(obj, id, warn)
     VALUE obj;
@@ -1013,9 +1193,12 @@ ivar_get(obj, id, warn)
 
     switch (TYPE(obj)) {
       case T_OBJECT:
+	if (obj_ivar_get(obj, id, &val))
+	    return val;
+	break;
       case T_CLASS:
       case T_MODULE:
-	if (ROBJECT(obj)->iv_tbl && st_lookup(ROBJECT(obj)->iv_tbl, id, &val))
+	if (RCLASS(obj)->iv_tbl && st_lookup(RCLASS(obj)->iv_tbl, id, &val))
 	    return val;
 	break;
       default:
@@ -1056,10 +1239,12 @@ rb_ivar_set(obj, id, val)
     if (OBJ_FROZEN(obj)) rb_error_frozen("object");
     switch (TYPE(obj)) {
       case T_OBJECT:
+	obj_ivar_set(obj, id, val);
+	break;
       case T_CLASS:
       case T_MODULE:
-	if (!ROBJECT(obj)->iv_tbl) ROBJECT(obj)->iv_tbl = st_init_numtable();
-	st_insert(ROBJECT(obj)->iv_tbl, id, val);
+	if (!RCLASS(obj)->iv_tbl) RCLASS(obj)->iv_tbl = st_init_numtable();
+	st_insert(RCLASS(obj)->iv_tbl, id, val);
 	break;
       default:
 	generic_ivar_set(obj, id, val);
@@ -1075,9 +1260,12 @@ rb_ivar_defined(obj, id)
 {
     switch (TYPE(obj)) {
       case T_OBJECT:
+	if (obj_ivar_get(obj, id, 0))
+	    return Qtrue;
+	break;
       case T_CLASS:
       case T_MODULE:
-	if (ROBJECT(obj)->iv_tbl && st_lookup(ROBJECT(obj)->iv_tbl, id, 0))
+	if (RCLASS(obj)->iv_tbl && st_lookup(RCLASS(obj)->iv_tbl, id, 0))
 	    return Qtrue;
 	break;
       default:
@@ -1088,6 +1276,70 @@ rb_ivar_defined(obj, id)
     return Qfalse;
 }
 
+/*
+ * Calls +func+ with the id and value of each instance variable of
+ * +obj+; for a class or module, with each entry of its iv_tbl.
+ */
+void
+rb_ivar_foreach(obj, func, arg)
+    VALUE obj;
+    int (*func)(ANYARGS);
+    st_data_t arg;
+{
+    st_table *tbl = 0;
+    long i;
+
+    switch (TYPE(obj)) {
+      case T_OBJECT:
+	for (i = 0; i < ROBJECT(obj)->iv_len; i++) {
+	    VALUE val = ROBJECT(obj)->iv_ptr[i];
+
+	    if (val == Qundef) continue;
+	    if ((*func)(IV_INDEX(obj)->nd_ivids[i], val, arg) == ST_STOP) break;
+	}
+	return;
+      case T_CLASS:
+      case T_MODULE:
+	tbl = RCLASS(obj)->iv_tbl;
+	break;
+      default:
+	if (generic_iv_tbl &&
+	    (FL_TEST(obj, FL_EXIVAR) || rb_special_const_p(obj))) {
+	    st_lookup(generic_iv_tbl, obj, (st_data_t *)&tbl);
+	}
+	break;
+    }
+    if (tbl) st_foreach_safe(tbl, func, arg);
+}
+
+/* the number of times rb_ivar_foreach() would call back */
+long
+rb_ivar_count(obj)
+    VALUE obj;
+{
+    st_table *tbl = 0;
+    long i, n = 0;
+
+    switch (TYPE(obj)) {
+      case T_OBJECT:
+	for (i = 0; i < ROBJECT(obj)->iv_len; i++) {
+	    if (ROBJECT(obj)->iv_ptr[i] != Qundef) n++;
+	}
+	return n;
+      case T_CLASS:
+      case T_MODULE:
+	tbl = RCLASS(obj)->iv_tbl;
+	break;
+      default:
+	if (generic_iv_tbl &&
+	    (FL_TEST(obj, FL_EXIVAR) || rb_special_const_p(obj))) {
+	    st_lookup(generic_iv_tbl, obj, (st_data_t *)&tbl);
+	}
+	break;
+    }
+    return tbl ? tbl->num_entries : 0;
+}
+
 static int
 ivar_i(key, entry, ary)
     ID key;
@@ -1124,25 +1376,7 @@ rb_obj_instance_variables(obj)
     VALUE ary;
 
     ary = rb_ary_new();
-    switch (TYPE(obj)) {
-      case T_OBJECT:
-      case T_CLASS:
-      case T_MODULE:
-	if (ROBJECT(obj)->iv_tbl) {
-	    st_foreach_safe(ROBJECT(obj)->iv_tbl, ivar_i, ary);
-	}
-	break;
-      default:
-	if (!generic_iv_tbl) break;
-	if (FL_TEST(obj, FL_EXIVAR) || rb_special_const_p(obj)) {
-	    st_table *tbl;
-
-	    if (st_lookup(generic_iv_tbl, obj, (st_data_t *)&tbl)) {
-		st_foreach_safe(tbl, ivar_i, ary);
-	    }
-	}
-	break;
-    }
+    rb_ivar_foreach(obj, ivar_i, ary);
     return ary;
 }
 
@@ -1184,9 +1418,14 @@ rb_obj_remove_instance_variable(obj, name)
 
     switch (TYPE(obj)) {
       case T_OBJECT:
+	if (obj_ivar_get(obj, id, &val)) {
+	    ROBJECT(obj)->iv_ptr[rb_ivar_slot(obj, id)] = Qundef;
+	    return val;
+	}
+	break;
       case T_CLASS:
       case T_MODULE:
-	if (ROBJECT(obj)->iv_tbl && st_delete(ROBJECT(obj)->iv_tbl, (st_data_t*)&id, &val)) {
+	if (RCLASS(obj)->iv_tbl && st_delete(RCLASS(obj)->iv_tbl, (st_data_t*)&id, &val)) {
 	    return val;
 	}
 	break;
@@ -1318,6 +1557,7 @@ autoload_delete(mod, id)
     VALUE val;
     st_data_t load = 0;
 
+    ruby_const_serial++;
     st_delete(RCLASS(mod)->iv_tbl, (st_data_t*)&id, 0);
     if (st_lookup(RCLASS(mod)->iv_tbl, autoload, &val)) {
 	struct st_table *tbl = check_autoload_table(val);
@@ -1435,6 +1675,38 @@ rb_const_get_0(klass, id, exclude, recurse)
     return const_missing(klass, id);
 }
 
+/*
+ * Like rb_const_get_0() with recurse, but returns Qundef instead of
+ * autoloading, warning or calling const_missing, so that the value
+ * found can be cached.
+ */
+VALUE
+rb_const_lookup(klass, id, exclude)
+    VALUE klass;
+    ID id;
+    int exclude;
+{
+    VALUE value, tmp;
+    int mod_retry = 0;
+
+    tmp = klass;
+  retry:
+    while (tmp) {
+	if (RCLASS(tmp)->iv_tbl && st_lookup(RCLASS(tmp)->iv_tbl,id,&value)) {
+	    if (value == Qundef) return Qundef;
+	    if (exclude && tmp == rb_cObject && klass != rb_cObject) return Qundef;
+	    return value;
+	}
+	tmp = RCLASS(tmp)->super;
+    }
+    if (!exclude && !mod_retry && BUILTIN_TYPE(klass) == T_MODULE) {
+	mod_retry = 1;
+	tmp = rb_cObject;
+	goto retry;
+    }
+    return Qundef;
+}
+
 VALUE
 rb_const_get_from(klass, id)
     VALUE klass;
@@ -1482,7 +1754,8 @@ rb_mod_remove_const(mod, name)
 	rb_raise(rb_eSecurityError, "Insecure: can't remove constant");
     if (OBJ_FROZEN(mod)) rb_error_frozen("class/module");
 
-    if (RCLASS(mod)->iv_tbl && st_delete(ROBJECT(mod)->iv_tbl, (st_data_t*)&id, &val)) {
+    if (RCLASS(mod)->iv_tbl && st_delete(RCLASS(mod)->iv_tbl, (st_data_t*)&id, &val)) {
+	ruby_const_serial++;
 	if (val == Qundef) {
 	    autoload_delete(mod, id);
 	    val = Qnil;
@@ -1667,6 +1940,7 @@ mod_av_set(klass, id, val, isconst)
 	}
     }
 
+    if (isconst) ruby_const_serial++;
     st_insert(RCLASS(klass)->iv_tbl, id, val);
 }
 
@@ -1932,7 +2206,7 @@ rb_mod_remove_cvar(mod, name)
 	rb_raise(rb_eSecurityError, "Insecure: can't remove class variable");
     if (OBJ_FROZEN(mod)) rb_error_frozen("class/module");
 
-    if (RCLASS(mod)->iv_tbl && st_delete(ROBJECT(mod)->iv_tbl, (st_data_t*)&id, &val)) {
+    if (RCLASS(mod)->iv_tbl && st_delete(RCLASS(mod)->iv_tbl, (st_data_t*)&id, &val)) {
 	return val;
     }
     if (rb_cvar_defined(mod, id)) {